@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h> /* int64_t */
+#include <pthread.h>
 
 /* libarchive */
 #include <archive.h>
@@ -43,6 +44,9 @@
 #include "backup.h"
 #include "package.h"
 #include "db.h"
+#include "deps.h"
+#include "diskwriter.h"
+#include "readahead.h"
 #include "remove.h"
 #include "handle.h"
 
@@ -103,26 +107,24 @@ int SYMEXPORT alpm_add_pkg(alpm_handle_t *handle, alpm_pkg_t *pkg)
 	return 0;
 }
 
-static int perform_extraction(alpm_handle_t *handle, struct archive *archive,
-		struct archive_entry *entry, const char *filename, const char *origname)
+static int perform_extraction(alpm_handle_t *handle, alpm_readahead_t *ra,
+		alpm_diskwriter_t *disk, struct archive_entry *entry, const char *filename,
+		const char *origname)
 {
 	int ret;
-	const int archive_flags = ARCHIVE_EXTRACT_OWNER |
-	                          ARCHIVE_EXTRACT_PERM |
-	                          ARCHIVE_EXTRACT_TIME;
 
 	archive_entry_set_pathname(entry, filename);
 
-	ret = archive_read_extract(archive, entry, archive_flags);
-	if(ret == ARCHIVE_WARN && archive_errno(archive) != ENOSPC) {
+	ret = _alpm_readahead_extract(ra, entry, disk);
+	if(ret == ARCHIVE_WARN && _alpm_readahead_errno(ra) != ENOSPC) {
 		/* operation succeeded but a "non-critical" error was encountered */
 		_alpm_log(handle, ALPM_LOG_WARNING, _("warning given when extracting %s (%s)\n"),
-				origname, archive_error_string(archive));
+				origname, _alpm_readahead_error_string(ra));
 	} else if(ret != ARCHIVE_OK) {
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not extract %s (%s)\n"),
-				origname, archive_error_string(archive));
+				origname, _alpm_readahead_error_string(ra));
 		alpm_logaction(handle, "error: could not extract %s (%s)\n",
-				origname, archive_error_string(archive));
+				origname, _alpm_readahead_error_string(ra));
 		return 1;
 	}
 	return 0;
@@ -140,13 +142,76 @@ static int try_rename(alpm_handle_t *handle, const char *src, const char *dest)
 	return 0;
 }
 
-static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
-		struct archive_entry *entry, alpm_pkg_t *newpkg, alpm_pkg_t *oldpkg)
+/* the md5sum of the file just extracted, as computed by the disk writer;
+ * the path itself may still hold the old contents until the deferred
+ * replacements are renamed into place, so it is never read back */
+static char *extracted_md5sum(alpm_diskwriter_t *disk)
+{
+	const char *md5sum = _alpm_diskwriter_md5sum(disk);
+
+	return md5sum ? strdup(md5sum) : NULL;
+}
+
+/* remember what was installed for a file of newpkg, NULL if unknown */
+static void set_file_sha256sum(alpm_pkg_t *newpkg, const char *entryname,
+		const char *sha256sum)
+{
+	alpm_file_t *file = alpm_filelist_contains(alpm_pkg_get_files(newpkg), entryname);
+
+	if(file == NULL) {
+		return;
+	}
+	FREE(file->sha256sum);
+	if(sha256sum) {
+		file->sha256sum = strdup(sha256sum);
+	}
+}
+
+/* Check whether a regular file can stay as it is on upgrade: oldpkg recorded
+ * the same contents the new package has, and the file on disk still has
+ * them. Size, modification time and the recorded sums rule out most files
+ * cheaply; the rest are hashed, which only reads them, so that a reinstall
+ * still repairs files that were damaged or edited behind our back. */
+static int is_unchanged(alpm_pkg_t *newpkg, alpm_pkg_t *oldpkg,
+		struct archive_entry *entry, const char *filename,
+		const struct stat *lsbuf)
+{
+	const char *entryname = archive_entry_pathname(entry);
+	alpm_file_t *newfile, *oldfile;
+	char *sha256sum;
+	int ret;
+
+	if(oldpkg == NULL || archive_entry_hardlink(entry) != NULL
+			|| !S_ISREG(lsbuf->st_mode)
+			|| lsbuf->st_size != archive_entry_size(entry)
+			|| lsbuf->st_mtime > alpm_pkg_get_installdate(oldpkg)) {
+		return 0;
+	}
+	newfile = alpm_filelist_contains(alpm_pkg_get_files(newpkg), entryname);
+	oldfile = alpm_filelist_contains(alpm_pkg_get_files(oldpkg), entryname);
+	if(!newfile || !oldfile || !newfile->sha256sum || !oldfile->sha256sum
+			|| strcmp(newfile->sha256sum, oldfile->sha256sum) != 0) {
+		return 0;
+	}
+
+	if((sha256sum = alpm_compute_sha256sum(filename)) == NULL) {
+		return 0;
+	}
+	ret = strcmp(sha256sum, newfile->sha256sum) == 0;
+	free(sha256sum);
+	return ret;
+}
+
+/* errors are counted in the return value, their code is stored in *err
+ * rather than handle->pm_errno as this may run on a worker thread */
+static int extract_single_file(alpm_handle_t *handle, alpm_readahead_t *ra,
+		alpm_diskwriter_t *disk, struct archive_entry *entry, alpm_pkg_t *newpkg,
+		alpm_pkg_t *oldpkg, alpm_errno_t *err)
 {
 	const char *entryname;
 	mode_t entrymode;
 	char filename[PATH_MAX]; /* the actual file we're extracting */
-	int needbackup = 0, notouch = 0;
+	int needbackup = 0, notouch = 0, unchanged = 0;
 	const char *hash_orig = NULL;
 	char *entryname_orig = NULL;
 	int errors = 0;
@@ -168,7 +233,7 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 		/* for now, ignore all files starting with '.' that haven't
 		 * already been handled (for future possibilities) */
 		_alpm_log(handle, ALPM_LOG_DEBUG, "skipping extraction of '%s'\n", entryname);
-		archive_read_data_skip(archive);
+		_alpm_readahead_data_skip(ra);
 		return 0;
 	} else {
 		/* build the new entryname relative to handle->root */
@@ -176,12 +241,13 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 	}
 
 	/* if a file is in NoExtract then we never extract it */
-	if(alpm_list_find(handle->noextract, entryname, _alpm_fnmatch)) {
+	if(_alpm_globset_match(handle->trans->noextract, entryname)) {
 		_alpm_log(handle, ALPM_LOG_DEBUG, "%s is in NoExtract, skipping extraction\n",
 				entryname);
 		alpm_logaction(handle, "note: %s is in NoExtract, skipping extraction\n",
 				entryname);
-		archive_read_data_skip(archive);
+		set_file_sha256sum(newpkg, entryname, NULL);
+		_alpm_readahead_data_skip(ra);
 		return 0;
 	}
 
@@ -225,13 +291,14 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 				}
 				_alpm_log(handle, ALPM_LOG_DEBUG, "extract: skipping dir extraction of %s\n",
 						entryname);
-				archive_read_data_skip(archive);
+				_alpm_readahead_data_skip(ra);
 				return 0;
 			} else {
 				/* case 10/11: trying to overwrite dir with file/symlink, don't allow it */
 				_alpm_log(handle, ALPM_LOG_ERROR, _("extract: not overwriting dir with file %s\n"),
 						entryname);
-				archive_read_data_skip(archive);
+				set_file_sha256sum(newpkg, entryname, NULL);
+				_alpm_readahead_data_skip(ra);
 				return 1;
 			}
 		} else if(S_ISLNK(lsbuf.st_mode) && S_ISDIR(entrymode)) {
@@ -240,13 +307,13 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 				/* the symlink on FS is to a directory, so we'll use it */
 				_alpm_log(handle, ALPM_LOG_DEBUG, "extract: skipping symlink overwrite of %s\n",
 						entryname);
-				archive_read_data_skip(archive);
+				_alpm_readahead_data_skip(ra);
 				return 0;
 			} else {
 				/* this is BAD. symlink was not to a directory */
 				_alpm_log(handle, ALPM_LOG_ERROR, _("extract: symlink %s does not point to dir\n"),
 						entryname);
-				archive_read_data_skip(archive);
+				_alpm_readahead_data_skip(ra);
 				return 1;
 			}
 		} else if(S_ISREG(lsbuf.st_mode) && S_ISDIR(entrymode)) {
@@ -256,7 +323,7 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 		} else if(S_ISREG(entrymode)) {
 			/* case 4,7: */
 			/* if file is in NoUpgrade, don't touch it */
-			if(alpm_list_find(handle->noupgrade, entryname, _alpm_fnmatch)) {
+			if(_alpm_globset_match(handle->trans->noupgrade, entryname)) {
 				notouch = 1;
 			} else {
 				alpm_backup_t *backup;
@@ -277,6 +344,10 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 						needbackup = 1;
 					}
 				}
+
+				if(!needbackup && !(handle->trans->flags & ALPM_TRANS_FLAG_FORCE)) {
+					unchanged = is_unchanged(newpkg, oldpkg, entry, filename, &lsbuf);
+				}
 			}
 		}
 		/* else if(S_ISLNK(entrymode)) */
@@ -285,7 +356,7 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 
 	/* we need access to the original entryname later after calls to
 	 * archive_entry_set_pathname(), so we need to dupe it and free() later */
-	STRDUP(entryname_orig, entryname, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	STRDUP(entryname_orig, entryname, *err = ALPM_ERR_MEMORY; return 1);
 
 	if(needbackup) {
 		char *checkfile;
@@ -294,16 +365,20 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 
 		len = strlen(filename) + 10;
 		MALLOC(checkfile, len,
-				errors++; handle->pm_errno = ALPM_ERR_MEMORY; goto needbackup_cleanup);
+				errors++; *err = ALPM_ERR_MEMORY; goto needbackup_cleanup);
 		snprintf(checkfile, len, "%s.paccheck", filename);
+		/* a leftover would be replaced by a deferred write, too late for
+		 * the comparison below */
+		unlink(checkfile);
 
-		if(perform_extraction(handle, archive, entry, checkfile, entryname_orig)) {
+		_alpm_diskwriter_want_md5(disk);
+		if(perform_extraction(handle, ra, disk, entry, checkfile, entryname_orig)) {
 			errors++;
 			goto needbackup_cleanup;
 		}
 
 		hash_local = alpm_compute_md5sum(filename);
-		hash_pkg = alpm_compute_md5sum(checkfile);
+		hash_pkg = extracted_md5sum(disk);
 
 		/* update the md5 hash in newpkg's backup (it will be the new orginal) */
 		alpm_list_t *i;
@@ -313,7 +388,7 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 			if(!backup->name || strcmp(backup->name, entryname_orig) != 0) {
 				continue;
 			}
-			STRDUP(newhash, hash_pkg, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+			STRDUP(newhash, hash_pkg, *err = ALPM_ERR_MEMORY; return 1);
 			FREE(backup->hash);
 			backup->hash = newhash;
 		}
@@ -330,7 +405,7 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 				char *newpath;
 				size_t newlen = strlen(filename) + 9;
 				MALLOC(newpath, newlen,
-						errors++; handle->pm_errno = ALPM_ERR_MEMORY; goto needbackup_cleanup);
+						errors++; *err = ALPM_ERR_MEMORY; goto needbackup_cleanup);
 				snprintf(newpath, newlen, "%s.pacorig", filename);
 
 				/* move the existing file to the "pacorig" */
@@ -387,7 +462,7 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 				_alpm_log(handle, ALPM_LOG_DEBUG, "action: keeping current file and installing"
 						" new one with .pacnew ending\n");
 				MALLOC(newpath, newlen,
-						errors++; handle->pm_errno = ALPM_ERR_MEMORY; goto needbackup_cleanup);
+						errors++; *err = ALPM_ERR_MEMORY; goto needbackup_cleanup);
 				snprintf(newpath, newlen, "%s.pacnew", filename);
 				if(try_rename(handle, checkfile, newpath)) {
 					errors++;
@@ -402,9 +477,21 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 		}
 
 needbackup_cleanup:
+		/* backup files are tracked by their md5sum */
+		set_file_sha256sum(newpkg, entryname_orig, NULL);
 		free(checkfile);
 		free(hash_local);
 		free(hash_pkg);
+	} else if(unchanged) {
+		/* same contents as installed, spare the disk from rewriting them */
+		_alpm_log(handle, ALPM_LOG_DEBUG, "%s is unchanged, updating metadata only\n",
+				filename);
+		_alpm_readahead_data_skip(ra);
+		archive_entry_set_pathname(entry, filename);
+		if(_alpm_diskwriter_metadata(disk, entry) != ARCHIVE_OK) {
+			_alpm_log(handle, ALPM_LOG_WARNING, _("warning given when extracting %s (%s)\n"),
+					entryname_orig, _alpm_diskwriter_error_string(disk));
+		}
 	} else {
 		/* we didn't need a backup */
 		if(notouch) {
@@ -424,37 +511,73 @@ needbackup_cleanup:
 			unlink(filename);
 		}
 
-		if(perform_extraction(handle, archive, entry, filename, entryname_orig)) {
+		alpm_backup_t *backup = _alpm_needbackup(entryname_orig, newpkg);
+		if(backup) {
+			_alpm_diskwriter_want_md5(disk);
+		}
+		if(perform_extraction(handle, ra, disk, entry, filename, entryname_orig)) {
 			/* error */
+			set_file_sha256sum(newpkg, entryname_orig, NULL);
 			free(entryname_orig);
 			errors++;
 			return errors;
 		}
+		/* a .pacnew does not tell what is installed */
+		set_file_sha256sum(newpkg, entryname_orig,
+				notouch ? NULL : _alpm_diskwriter_sha256sum(disk));
 
-		/* calculate an hash if this is in newpkg's backup */
-		alpm_list_t *i;
-		for(i = alpm_pkg_get_backup(newpkg); i; i = i->next) {
-			alpm_backup_t *backup = i->data;
-			char *newhash;
-			if(!backup->name || strcmp(backup->name, entryname_orig) != 0) {
-				continue;
-			}
+		/* record the hash if this is in newpkg's backup */
+		if(backup) {
 			_alpm_log(handle, ALPM_LOG_DEBUG, "appending backup entry for %s\n", entryname_orig);
-			newhash = alpm_compute_md5sum(filename);
 			FREE(backup->hash);
-			backup->hash = newhash;
+			backup->hash = extracted_md5sum(disk);
 		}
 	}
 	free(entryname_orig);
 	return errors;
 }
 
-static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
-		size_t pkg_current, size_t pkg_count)
-{
-	int i, ret = 0, errors = 0;
+/* a package being committed; the work is split in phases so independent
+ * packages can be extracted concurrently, see upgrade_packages_parallel() */
+struct commit_state {
+	alpm_pkg_t *newpkg;
+	alpm_pkg_t *oldpkg;
 	int is_upgrade;
-	alpm_pkg_t *oldpkg = NULL;
+	size_t pkg_current;
+	size_t pkg_count;
+	char *pkgpath;
+	/* writes below handle->root, one per package so workers share nothing */
+	alpm_diskwriter_t *disk;
+	int errors;
+	alpm_errno_t err;    /* set while extracting, handed on by the main thread */
+	int ret;
+	/* progress of a worker extracting it, under extract_workers.lock */
+	int percent;
+	int extracted;
+};
+
+struct extract_workers;
+static void extract_progress(struct extract_workers *workers,
+		struct commit_state *cs, int percent);
+
+static void commit_cleanup(struct commit_state *cs)
+{
+	if(cs->disk) {
+		_alpm_diskwriter_free(cs->disk);
+		cs->disk = NULL;
+	}
+	FREE(cs->pkgpath);
+	_alpm_pkg_free(cs->oldpkg);
+	cs->oldpkg = NULL;
+}
+
+/** Everything that happens before the files of a package are extracted:
+ * the pre_install scriptlet, removal of the old version and creation of
+ * the database entry.
+ */
+static int commit_prepare(alpm_handle_t *handle, struct commit_state *cs)
+{
+	alpm_pkg_t *newpkg = cs->newpkg;
 	alpm_db_t *db = handle->db_local;
 	alpm_trans_t *trans = handle->trans;
 	const char *pkgfile;
@@ -464,12 +587,11 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 	/* see if this is an upgrade. if so, remove the old package first */
 	alpm_pkg_t *local = _alpm_db_get_pkgfromcache(db, newpkg->name);
 	if(local) {
-		is_upgrade = 1;
+		cs->is_upgrade = 1;
 
 		/* we'll need to save some record for backup checks later */
-		if(_alpm_pkg_dup(local, &oldpkg) == -1) {
-			ret = -1;
-			goto cleanup;
+		if(_alpm_pkg_dup(local, &cs->oldpkg) == -1) {
+			return -1;
 		}
 
 		/* copy over the install reason */
@@ -477,21 +599,21 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 
 		EVENT(handle, ALPM_EVENT_UPGRADE_START, newpkg, local);
 	} else {
-		is_upgrade = 0;
+		cs->is_upgrade = 0;
 		EVENT(handle, ALPM_EVENT_ADD_START, newpkg, NULL);
 	}
 
 	pkgfile = newpkg->origin_data.file;
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "%s package %s-%s\n",
-			is_upgrade ? "upgrading" : "adding", newpkg->name, newpkg->version);
+			cs->is_upgrade ? "upgrading" : "adding", newpkg->name, newpkg->version);
 		/* pre_install/pre_upgrade scriptlet */
 	if(alpm_pkg_has_scriptlet(newpkg) &&
 			!(trans->flags & ALPM_TRANS_FLAG_NOSCRIPTLET)) {
-		const char *scriptlet_name = is_upgrade ? "pre_upgrade" : "pre_install";
+		const char *scriptlet_name = cs->is_upgrade ? "pre_upgrade" : "pre_install";
 
 		_alpm_runscriptlet(handle, pkgfile, scriptlet_name,
-				newpkg->version, oldpkg ? oldpkg->version : NULL, 1);
+				newpkg->version, cs->oldpkg ? cs->oldpkg->version : NULL, 1);
 	}
 
 	/* we override any pre-set reason if we have alldeps or allexplicit set */
@@ -501,12 +623,11 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 		newpkg->reason = ALPM_PKG_REASON_EXPLICIT;
 	}
 
-	if(oldpkg) {
+	if(cs->oldpkg) {
 		/* set up fake remove transaction */
-		if(_alpm_remove_single_package(handle, oldpkg, newpkg, 0, 0) == -1) {
+		if(_alpm_remove_single_package(handle, cs->oldpkg, newpkg, 0, 0) == -1) {
 			handle->pm_errno = ALPM_ERR_TRANS_ABORT;
-			ret = -1;
-			goto cleanup;
+			return -1;
 		}
 	}
 
@@ -516,103 +637,159 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 		alpm_logaction(handle, "error: could not create database entry %s-%s\n",
 				newpkg->name, newpkg->version);
 		handle->pm_errno = ALPM_ERR_DB_WRITE;
-		ret = -1;
-		goto cleanup;
+		return -1;
 	}
 
 	if(!(trans->flags & ALPM_TRANS_FLAG_DBONLY)) {
-		struct archive *archive;
-		struct archive_entry *entry;
-		struct stat buf;
-		int fd, cwdfd;
+		int flags = DISKWRITER_OWNER | DISKWRITER_PERM | DISKWRITER_TIME
+			| DISKWRITER_SHA256;
 
-		_alpm_log(handle, ALPM_LOG_DEBUG, "extracting files\n");
+		STRDUP(cs->pkgpath, pkgfile, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
 
-		fd = _alpm_open_archive(db->handle, pkgfile, &buf,
-				&archive, ALPM_ERR_PKG_OPEN);
-		if(fd < 0) {
-			ret = -1;
-			goto cleanup;
+		/* replaced files are swapped in once they are on disk, so a crash
+		 * never leaves a half written file in their place: after each
+		 * package, or together with those of the other packages */
+		if(handle->syncpolicy != ALPM_SYNCPOLICY_NONE) {
+			flags |= DISKWRITER_DEFER;
 		}
-
-		/* save the cwd so we can restore it later */
-		OPEN(cwdfd, ".", O_RDONLY);
-		if(cwdfd < 0) {
-			_alpm_log(handle, ALPM_LOG_ERROR, _("could not get current working directory\n"));
+		if(_alpm_trans_holds_renames(handle)) {
+			flags |= DISKWRITER_HOLD;
 		}
-
-		/* libarchive requires this for extracting hard links */
-		if(chdir(handle->root) != 0) {
-			_alpm_log(handle, ALPM_LOG_ERROR, _("could not change directory to %s (%s)\n"),
+		cs->disk = _alpm_diskwriter_new(handle->root, flags);
+		if(cs->disk == NULL) {
+			_alpm_log(handle, ALPM_LOG_ERROR, _("could not open directory %s: %s\n"),
 					handle->root, strerror(errno));
-			archive_read_finish(archive);
-			CLOSE(fd);
-			ret = -1;
-			goto cleanup;
-		}
-
-		/* call PROGRESS once with 0 percent, as we sort-of skip that here */
-		if(is_upgrade) {
-			PROGRESS(handle, ALPM_PROGRESS_UPGRADE_START,
-					newpkg->name, 0, pkg_count, pkg_current);
-		} else {
-			PROGRESS(handle, ALPM_PROGRESS_ADD_START,
-					newpkg->name, 0, pkg_count, pkg_current);
+			return -1;
 		}
+	}
 
-		for(i = 0; archive_read_next_header(archive, &entry) == ARCHIVE_OK; i++) {
-			int percent;
-
-			if(newpkg->size != 0) {
-				/* Using compressed size for calculations here, as newpkg->isize is not
-				 * exact when it comes to comparing to the ACTUAL uncompressed size
-				 * (missing metadata sizes) */
-				int64_t pos = archive_position_compressed(archive);
-				percent = (pos * 100) / newpkg->size;
-				if(percent >= 100) {
-					percent = 100;
-				}
-			} else {
-				percent = 0;
-			}
+	return 0;
+}
 
-			if(is_upgrade) {
-				PROGRESS(handle, ALPM_PROGRESS_UPGRADE_START,
-						newpkg->name, percent, pkg_count, pkg_current);
-			} else {
-				PROGRESS(handle, ALPM_PROGRESS_ADD_START,
-						newpkg->name, percent, pkg_count, pkg_current);
-			}
+/** Extract the files of a package below the root.
+ * @param handle the context handle
+ * @param cs the package to extract
+ * @param workers the workers this runs on, NULL on the main thread; only
+ * the main thread reports progress, workers leave it in cs
+ * @return 0 if the package could be read, -1 otherwise; errors while
+ * extracting single files are counted in cs->errors. Error codes go to
+ * cs->err, not handle->pm_errno, as this may run on a worker thread.
+ */
+static int commit_extract(alpm_handle_t *handle, struct commit_state *cs,
+		struct extract_workers *workers)
+{
+	struct archive *archive;
+	struct archive_entry *entry;
+	struct stat buf;
+	alpm_readahead_t *ra;
+	alpm_pkg_t *newpkg = cs->newpkg;
+	alpm_progress_t progress = cs->is_upgrade ?
+		ALPM_PROGRESS_UPGRADE_START : ALPM_PROGRESS_ADD_START;
+	int i, fd, ret, plain, last = 0;
+
+	_alpm_log(handle, ALPM_LOG_DEBUG, "extracting files of %s\n", newpkg->name);
+
+	fd = _alpm_open_archive_r(handle, cs->pkgpath, &buf,
+			&archive, ALPM_ERR_PKG_OPEN, 1, &cs->err);
+	if(fd < 0) {
+		return -1;
+	}
+	/* a tar read as is, or decoded by several threads before libarchive
+	 * sees it, only tells the uncompressed position */
+	plain = archive_compression(archive) == ARCHIVE_COMPRESSION_NONE;
 
-			/* extract the next file from the archive */
-			errors += extract_single_file(handle, archive, entry, newpkg, oldpkg);
-		}
+	/* decompress in a separate thread while we are writing files */
+	ra = _alpm_readahead_new(archive);
+	if(ra == NULL) {
 		archive_read_finish(archive);
 		CLOSE(fd);
+		cs->err = ALPM_ERR_MEMORY;
+		return -1;
+	}
+
+	/* call PROGRESS once with 0 percent, as we sort-of skip that here */
+	if(!workers) {
+		PROGRESS(handle, progress, newpkg->name, 0, cs->pkg_count, cs->pkg_current);
+	}
 
-		/* restore the old cwd if we have it */
-		if(cwdfd >= 0) {
-			if(fchdir(cwdfd) != 0) {
-				_alpm_log(handle, ALPM_LOG_ERROR,
-						_("could not restore working directory (%s)\n"), strerror(errno));
+	for(i = 0; _alpm_readahead_next_header(ra, &entry) == ARCHIVE_OK; i++) {
+		int percent;
+
+		/* Using compressed size for calculations here, as newpkg->isize is not
+		 * exact when it comes to comparing to the ACTUAL uncompressed size
+		 * (missing metadata sizes) */
+		off_t total = plain ? newpkg->isize : newpkg->size;
+		if(total != 0) {
+			int64_t pos = _alpm_readahead_position(ra);
+			percent = (pos * 100) / total;
+			if(percent >= 100) {
+				percent = 100;
 			}
-			CLOSE(cwdfd);
+		} else {
+			percent = 0;
 		}
 
-		if(errors) {
-			ret = -1;
-			if(is_upgrade) {
-				_alpm_log(handle, ALPM_LOG_ERROR, _("problem occurred while upgrading %s\n"),
-						newpkg->name);
-				alpm_logaction(handle, "error: problem occurred while upgrading %s\n",
-						newpkg->name);
-			} else {
-				_alpm_log(handle, ALPM_LOG_ERROR, _("problem occurred while installing %s\n"),
-						newpkg->name);
-				alpm_logaction(handle, "error: problem occurred while installing %s\n",
-						newpkg->name);
-			}
+		if(!workers) {
+			PROGRESS(handle, progress, newpkg->name, percent,
+					cs->pkg_count, cs->pkg_current);
+		} else if(percent != last) {
+			extract_progress(workers, cs, percent);
+			last = percent;
 		}
+
+		/* extract the next file from the archive */
+		cs->errors += extract_single_file(handle, ra, cs->disk, entry,
+				newpkg, cs->oldpkg, &cs->err);
+	}
+	_alpm_readahead_free(ra);
+
+	/* deferred files are moved into place, directory permissions and times
+	 * are only set once all their contents have been written */
+	ret = _alpm_diskwriter_close(cs->disk);
+	if(ret == ARCHIVE_WARN) {
+		_alpm_log(handle, ALPM_LOG_WARNING, _("warning given when extracting %s (%s)\n"),
+				newpkg->name, _alpm_diskwriter_error_string(cs->disk));
+	} else if(ret != ARCHIVE_OK) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not extract %s (%s)\n"),
+				newpkg->name, _alpm_diskwriter_error_string(cs->disk));
+		alpm_logaction(handle, "error: could not extract %s (%s)\n",
+				newpkg->name, _alpm_diskwriter_error_string(cs->disk));
+		cs->errors++;
+	}
+	archive_read_finish(archive);
+	CLOSE(fd);
+
+	return 0;
+}
+
+/** Everything that happens after the files of a package are extracted:
+ * writing the database entry and the post_install scriptlet.
+ */
+static int commit_finish(alpm_handle_t *handle, struct commit_state *cs)
+{
+	alpm_pkg_t *newpkg = cs->newpkg;
+	alpm_db_t *db = handle->db_local;
+	alpm_trans_t *trans = handle->trans;
+
+	if(cs->errors) {
+		cs->ret = -1;
+		if(cs->is_upgrade) {
+			_alpm_log(handle, ALPM_LOG_ERROR, _("problem occurred while upgrading %s\n"),
+					newpkg->name);
+			alpm_logaction(handle, "error: problem occurred while upgrading %s\n",
+					newpkg->name);
+		} else {
+			_alpm_log(handle, ALPM_LOG_ERROR, _("problem occurred while installing %s\n"),
+					newpkg->name);
+			alpm_logaction(handle, "error: problem occurred while installing %s\n",
+					newpkg->name);
+		}
+	}
+
+	/* the replaced files go in before the database entry that lists them */
+	if(cs->disk && _alpm_trans_holds_renames(handle)) {
+		trans->renames = alpm_list_join(trans->renames,
+				_alpm_diskwriter_take_pending(cs->disk));
 	}
 
 	/* make an install date (in UTC) */
@@ -627,8 +804,12 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 		alpm_logaction(handle, "error: could not update database entry %s-%s\n",
 				newpkg->name, newpkg->version);
 		handle->pm_errno = ALPM_ERR_DB_WRITE;
-		ret = -1;
-		goto cleanup;
+		return -1;
+	}
+
+	if(handle->syncpolicy == ALPM_SYNCPOLICY_PACKAGE) {
+		/* the renamed files and the database entry */
+		_alpm_syncfs(handle);
 	}
 
 	if(_alpm_db_add_pkgincache(db, newpkg) == -1) {
@@ -636,33 +817,357 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 				newpkg->name);
 	}
 
-	if(is_upgrade) {
+	if(cs->is_upgrade) {
 		PROGRESS(handle, ALPM_PROGRESS_UPGRADE_START,
-				newpkg->name, 100, pkg_count, pkg_current);
+				newpkg->name, 100, cs->pkg_count, cs->pkg_current);
 	} else {
 		PROGRESS(handle, ALPM_PROGRESS_ADD_START,
-				newpkg->name, 100, pkg_count, pkg_current);
+				newpkg->name, 100, cs->pkg_count, cs->pkg_current);
 	}
 
 	/* run the post-install script if it exists  */
 	if(alpm_pkg_has_scriptlet(newpkg)
 			&& !(trans->flags & ALPM_TRANS_FLAG_NOSCRIPTLET)) {
 		char *scriptlet = _alpm_local_db_pkgpath(db, newpkg, "install");
-		const char *scriptlet_name = is_upgrade ? "post_upgrade" : "post_install";
+		const char *scriptlet_name = cs->is_upgrade ? "post_upgrade" : "post_install";
 
 		_alpm_runscriptlet(handle, scriptlet, scriptlet_name,
-				newpkg->version, oldpkg ? oldpkg->version : NULL, 0);
+				newpkg->version, cs->oldpkg ? cs->oldpkg->version : NULL, 0);
 		free(scriptlet);
 	}
 
-	if(is_upgrade) {
-		EVENT(handle, ALPM_EVENT_UPGRADE_DONE, newpkg, oldpkg);
+	if(cs->is_upgrade) {
+		EVENT(handle, ALPM_EVENT_UPGRADE_DONE, newpkg, cs->oldpkg);
 	} else {
-		EVENT(handle, ALPM_EVENT_ADD_DONE, newpkg, oldpkg);
+		EVENT(handle, ALPM_EVENT_ADD_DONE, newpkg, cs->oldpkg);
 	}
 
+	return cs->ret;
+}
+
+static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
+		size_t pkg_current, size_t pkg_count)
+{
+	struct commit_state cs;
+	int ret = -1;
+
+	memset(&cs, 0, sizeof(cs));
+	cs.newpkg = newpkg;
+	cs.pkg_current = pkg_current;
+	cs.pkg_count = pkg_count;
+
+	if(commit_prepare(handle, &cs) != 0) {
+		goto cleanup;
+	}
+
+	if(!(handle->trans->flags & ALPM_TRANS_FLAG_DBONLY)) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "extracting files\n");
+
+		if(commit_extract(handle, &cs, NULL) != 0) {
+			handle->pm_errno = cs.err;
+			goto cleanup;
+		}
+	}
+
+	ret = commit_finish(handle, &cs);
+
 cleanup:
-	_alpm_pkg_free(oldpkg);
+	commit_cleanup(&cs);
+	return ret;
+}
+
+/* Packages queued for extraction. The main thread prepares, queues and
+ * finishes them in order, and reports the progress the workers leave. */
+struct extract_workers {
+	struct commit_state **queue;
+	size_t queued;
+	size_t next;
+	int closing;
+	alpm_handle_t *handle;
+	pthread_t *threads;
+	size_t nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;      /* a package was queued, or we are closing */
+	pthread_cond_t progress;  /* a worker got further */
+};
+
+static void extract_progress(struct extract_workers *workers,
+		struct commit_state *cs, int percent)
+{
+	pthread_mutex_lock(&workers->lock);
+	cs->percent = percent;
+	pthread_cond_broadcast(&workers->progress);
+	pthread_mutex_unlock(&workers->lock);
+}
+
+static void *extract_worker(void *arg)
+{
+	struct extract_workers *workers = arg;
+
+	while(1) {
+		struct commit_state *cs;
+		int ret;
+
+		pthread_mutex_lock(&workers->lock);
+		while(workers->next == workers->queued && !workers->closing) {
+			pthread_cond_wait(&workers->wake, &workers->lock);
+		}
+		if(workers->next == workers->queued) {
+			pthread_mutex_unlock(&workers->lock);
+			break;
+		}
+		cs = workers->queue[workers->next++];
+		pthread_mutex_unlock(&workers->lock);
+
+		ret = commit_extract(workers->handle, cs, workers);
+
+		pthread_mutex_lock(&workers->lock);
+		if(ret != 0) {
+			cs->ret = -1;
+		}
+		cs->extracted = 1;
+		pthread_cond_broadcast(&workers->progress);
+		pthread_mutex_unlock(&workers->lock);
+	}
+	return NULL;
+}
+
+/** Start one extraction worker per CPU.
+ * @return 0 on success, -1 if out of memory; no threads at all is fine,
+ * the main thread then extracts the packages itself
+ */
+static int extract_workers_start(alpm_handle_t *handle,
+		struct extract_workers *workers, size_t count)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads, i;
+
+	memset(workers, 0, sizeof(struct extract_workers));
+	workers->handle = handle;
+	CALLOC(workers->queue, count, sizeof(struct commit_state *), return -1);
+	pthread_mutex_init(&workers->lock, NULL);
+	pthread_cond_init(&workers->wake, NULL);
+	pthread_cond_init(&workers->progress, NULL);
+
+	nthreads = ncpu > 1 ? (size_t)ncpu : 1;
+	if(nthreads > count) {
+		nthreads = count;
+	}
+	CALLOC(workers->threads, nthreads, sizeof(pthread_t), nthreads = 0);
+	for(i = 0; i < nthreads; i++) {
+		if(pthread_create(&workers->threads[workers->nthreads], NULL,
+					extract_worker, workers) != 0) {
+			break;
+		}
+		workers->nthreads++;
+	}
+	return 0;
+}
+
+static void extract_workers_stop(struct extract_workers *workers)
+{
+	size_t i;
+
+	pthread_mutex_lock(&workers->lock);
+	workers->closing = 1;
+	pthread_cond_broadcast(&workers->wake);
+	pthread_mutex_unlock(&workers->lock);
+	for(i = 0; i < workers->nthreads; i++) {
+		pthread_join(workers->threads[i], NULL);
+	}
+	free(workers->threads);
+	free(workers->queue);
+	pthread_cond_destroy(&workers->progress);
+	pthread_cond_destroy(&workers->wake);
+	pthread_mutex_destroy(&workers->lock);
+}
+
+static void extract_queue(struct extract_workers *workers,
+		struct commit_state *cs)
+{
+	pthread_mutex_lock(&workers->lock);
+	workers->queue[workers->queued++] = cs;
+	pthread_cond_signal(&workers->wake);
+	pthread_mutex_unlock(&workers->lock);
+}
+
+/** Wait for a queued package to be extracted, reporting its progress.
+ * Packages are waited for in the order they were queued.
+ */
+static void extract_wait(alpm_handle_t *handle, struct extract_workers *workers,
+		struct commit_state *cs)
+{
+	alpm_progress_t progress = cs->is_upgrade ?
+		ALPM_PROGRESS_UPGRADE_START : ALPM_PROGRESS_ADD_START;
+	int reported = -1;
+
+	if(workers->nthreads == 0) {
+		/* no workers to be had, it is next in the queue */
+		workers->next++;
+		if(commit_extract(handle, cs, NULL) != 0) {
+			cs->ret = -1;
+		}
+		cs->extracted = 1;
+		return;
+	}
+
+	pthread_mutex_lock(&workers->lock);
+	while(1) {
+		int percent = cs->percent, done = cs->extracted;
+
+		pthread_mutex_unlock(&workers->lock);
+		if(percent != reported) {
+			PROGRESS(handle, progress, cs->newpkg->name, percent,
+					cs->pkg_count, cs->pkg_current);
+			reported = percent;
+		}
+		if(done) {
+			return;
+		}
+		pthread_mutex_lock(&workers->lock);
+		while(!cs->extracted && cs->percent == reported) {
+			pthread_cond_wait(&workers->progress, &workers->lock);
+		}
+	}
+}
+
+/* wait for a package queued for extraction and write it to the database */
+static int extract_finish(alpm_handle_t *handle, struct extract_workers *workers,
+		struct commit_state *cs)
+{
+	int ret;
+
+	extract_wait(handle, workers, cs);
+	if(cs->ret != 0) {
+		/* the workers leave the error code to us */
+		handle->pm_errno = cs->err;
+		ret = -1;
+	} else {
+		ret = commit_finish(handle, cs);
+	}
+	commit_cleanup(cs);
+	return ret;
+}
+
+/* One past the last package of states[first..end) that newpkg depends on,
+ * or first if it depends on none of them. */
+static size_t depends_on_queued(alpm_pkg_t *newpkg, struct commit_state *states,
+		size_t first, size_t end)
+{
+	alpm_list_t *i;
+	size_t j, need = first;
+
+	for(i = alpm_pkg_get_depends(newpkg); i; i = i->next) {
+		for(j = end; j > need; j--) {
+			if(_alpm_depcmp(states[j - 1].newpkg, i->data)) {
+				need = j;
+				break;
+			}
+		}
+	}
+	return need;
+}
+
+/** Commit packages while the files of several are extracted concurrently.
+ * trans->add is in _alpm_sortbydeps() order and is walked as is: each
+ * package is prepared on the main thread and queued for the workers, and
+ * the queued packages are finished in order. A package waits for the
+ * queued ones it depends on to be finished first. Packages with scriptlets
+ * wait for all of them and are committed on their own, so every package
+ * still goes from pre_install through its files to post_install before
+ * a scriptlet runs. The file conflict checks have made sure no two
+ * targets own the same file; with ALPM_TRANS_FLAG_FORCE they may, so
+ * this is not used then.
+ */
+static int upgrade_packages_parallel(alpm_handle_t *handle, int *skip_ldconfig)
+{
+	alpm_trans_t *trans = handle->trans;
+	struct commit_state *states = NULL;
+	struct extract_workers workers;
+	size_t pkg_count, window, i, finished = 0, end = 0;
+	alpm_list_t *targ;
+	int ret = 0;
+
+	pkg_count = alpm_list_count(trans->add);
+	CALLOC(states, pkg_count, sizeof(struct commit_state),
+			RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	if(extract_workers_start(handle, &workers, pkg_count) != 0) {
+		free(states);
+		RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+	}
+	/* keep the workers busy without removing old versions far ahead */
+	window = workers.nthreads > 0 ? 2 * workers.nthreads : 1;
+	_alpm_log(handle, ALPM_LOG_DEBUG, "extracting with %zd workers\n",
+			workers.nthreads);
+
+	for(targ = trans->add, i = 0; targ; targ = targ->next, i++) {
+		alpm_pkg_t *newpkg = targ->data;
+		struct commit_state *cs = states + i;
+		int scriptlet = alpm_pkg_has_scriptlet(newpkg)
+			&& !(trans->flags & ALPM_TRANS_FLAG_NOSCRIPTLET);
+		size_t need;
+
+		if(trans->state == STATE_INTERRUPTED) {
+			break;
+		}
+
+		if(scriptlet) {
+			need = end;
+		} else {
+			need = depends_on_queued(newpkg, states, finished, end);
+			if(end - finished >= window && need == finished) {
+				need = finished + 1;
+			}
+		}
+		while(finished < need) {
+			if(extract_finish(handle, &workers, states + finished++) != 0) {
+				ret = -1;
+			}
+		}
+		if(ret != 0) {
+			break;
+		}
+
+		if(scriptlet) {
+			if(commit_single_pkg(handle, newpkg, i + 1, pkg_count) != 0) {
+				ret = -1;
+			}
+			finished = end = i + 1;
+			if(ret != 0) {
+				break;
+			}
+			continue;
+		}
+
+		cs->newpkg = newpkg;
+		cs->pkg_current = i + 1;
+		cs->pkg_count = pkg_count;
+		if(commit_prepare(handle, cs) != 0) {
+			commit_cleanup(cs);
+			ret = -1;
+			break;
+		}
+		extract_queue(&workers, cs);
+		end = i + 1;
+	}
+
+	/* whatever is still queued gets finished, even after an error */
+	while(finished < end) {
+		if(extract_finish(handle, &workers, states + finished++) != 0) {
+			ret = -1;
+		}
+	}
+	extract_workers_stop(&workers);
+
+	if(ret != 0) {
+		/* something screwed up on the commit, abort the trans */
+		trans->state = STATE_INTERRUPTED;
+		handle->pm_errno = ALPM_ERR_TRANS_ABORT;
+		/* running ldconfig at this point could possibly screw system */
+		*skip_ldconfig = 1;
+	}
+
+	free(states);
 	return ret;
 }
 
@@ -680,6 +1185,18 @@ int _alpm_upgrade_packages(alpm_handle_t *handle)
 	pkg_count = alpm_list_count(trans->add);
 	pkg_current = 1;
 
+	/* forced transactions may have conflicting files among the targets,
+	 * which would be written by several workers at once */
+	if(handle->parallelextract && pkg_count > 1
+			&& !(trans->flags & (ALPM_TRANS_FLAG_DBONLY | ALPM_TRANS_FLAG_FORCE))) {
+		ret = upgrade_packages_parallel(handle, &skip_ldconfig);
+		if(!skip_ldconfig) {
+			/* run ldconfig if it exists */
+			_alpm_ldconfig(handle);
+		}
+		return ret;
+	}
+
 	/* loop through our package list adding/upgrading one at a time */
 	for(targ = trans->add; targ; targ = targ->next) {
 		alpm_pkg_t *newpkg = targ->data;
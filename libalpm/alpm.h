@@ -114,6 +114,18 @@ typedef enum _alpm_siglevel_t {
 	ALPM_SIG_USE_DEFAULT = (1 << 31)
 } alpm_siglevel_t;
 
+/** When the files written by a transaction are flushed to disk */
+typedef enum _alpm_syncpolicy_t {
+	/** Leave it to the system */
+	ALPM_SYNCPOLICY_NONE = 0,
+	/** After each package, before its database entry is written */
+	ALPM_SYNCPOLICY_PACKAGE,
+	/** Replaced files and database entries are renamed into place all at
+	 * once behind a single sync, at the end of the transaction or before a
+	 * scriptlet or ldconfig runs */
+	ALPM_SYNCPOLICY_TRANSACTION
+} alpm_syncpolicy_t;
+
 /** PGP signature verification status return codes */
 typedef enum _alpm_sigstatus_t {
 	ALPM_SIGSTATUS_VALID,
@@ -204,6 +216,8 @@ typedef struct _alpm_file_t {
 	char *name;
 	off_t size;
 	mode_t mode;
+	/** sha256sum of the contents of a regular file, if known */
+	char *sha256sum;
 } alpm_file_t;
 
 /** Package filelist container */
@@ -476,6 +490,14 @@ int alpm_option_add_cachedir(alpm_handle_t *handle, const char *cachedir);
 int alpm_option_remove_cachedir(alpm_handle_t *handle, const char *cachedir);
 /** @} */
 
+/** Returns the shared package cache directory, NULL if there is none.
+ * Packages in it are stored by sha256sum and hard linked or copied into
+ * the cache of every handle using it, so a host stores each package once.
+ */
+const char *alpm_option_get_sharedcachedir(alpm_handle_t *handle);
+/** Sets the shared package cache directory, NULL for none. */
+int alpm_option_set_sharedcachedir(alpm_handle_t *handle, const char *sharedcachedir);
+
 /** Returns the logfile name. */
 const char *alpm_option_get_logfile(alpm_handle_t *handle);
 /** Sets the logfile name. */
@@ -547,6 +569,16 @@ int alpm_option_set_deltaratio(alpm_handle_t *handle, double ratio);
 int alpm_option_get_checkspace(alpm_handle_t *handle);
 int alpm_option_set_checkspace(alpm_handle_t *handle, int checkspace);
 
+/** Returns whether independent packages are extracted concurrently. */
+int alpm_option_get_parallelextract(alpm_handle_t *handle);
+/** Sets whether independent packages are extracted concurrently. */
+int alpm_option_set_parallelextract(alpm_handle_t *handle, int parallelextract);
+
+/** Returns when written files are flushed to disk. */
+alpm_syncpolicy_t alpm_option_get_syncpolicy(alpm_handle_t *handle);
+/** Sets when written files are flushed to disk. */
+int alpm_option_set_syncpolicy(alpm_handle_t *handle, alpm_syncpolicy_t policy);
+
 alpm_siglevel_t alpm_option_get_default_siglevel(alpm_handle_t *handle);
 int alpm_option_set_default_siglevel(alpm_handle_t *handle, alpm_siglevel_t level);
 
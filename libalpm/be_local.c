@@ -38,6 +38,7 @@
 #include "package.h"
 #include "deps.h"
 #include "filelist.h"
+#include "trans.h"
 
 static int local_db_read(alpm_pkg_t *info, alpm_dbinfrq_t inforeq);
 
@@ -169,6 +170,12 @@ static alpm_list_t *_cache_get_backup(alpm_pkg_t *pkg)
 	return pkg->backup;
 }
 
+static alpm_list_t *_cache_get_dirsizes(alpm_pkg_t *pkg)
+{
+	LAZY_LOAD(INFRQ_DESC, NULL);
+	return pkg->dirsizes;
+}
+
 /**
  * Open a package changelog for reading. Similar to fopen in functionality,
  * except that the returned 'file stream' is from the database.
@@ -241,6 +248,7 @@ static struct pkg_operations local_pkg_ops = {
 	.get_replaces    = _cache_get_replaces,
 	.get_files       = _cache_get_files,
 	.get_backup      = _cache_get_backup,
+	.get_dirsizes    = _cache_get_dirsizes,
 
 	.changelog_open  = _cache_changelog_open,
 	.changelog_read  = _cache_changelog_read,
@@ -625,6 +633,14 @@ static int local_db_read(alpm_pkg_t *info, alpm_dbinfrq_t inforeq)
 			} else if(strcmp(line, "%SIZE%") == 0) {
 				READ_NEXT();
 				info->isize = _alpm_strtoofft(line);
+			} else if(strcmp(line, "%DIRSIZES%") == 0) {
+				/* "<directory>\t<usage>" summaries of the files */
+				while(fgets(line, sizeof(line), fp) && _alpm_strip_newline(line, 0)) {
+					alpm_dirsize_t *dirsize = _alpm_dirsize_parse(line);
+					if(dirsize) {
+						info->dirsizes = alpm_list_add(info->dirsizes, dirsize);
+					}
+				}
 			} else if(strcmp(line, "%REPLACES%") == 0) {
 				READ_AND_SPLITDEP(info->replaces);
 			} else if(strcmp(line, "%DEPENDS%") == 0) {
@@ -693,6 +709,48 @@ static int local_db_read(alpm_pkg_t *info, alpm_dbinfrq_t inforeq)
 				qsort(files, files_count, sizeof(alpm_file_t), _alpm_files_cmp);
 				info->files.count = files_count;
 				info->files.files = files;
+			} else if(strcmp(line, "%SHA256SUMS%") == 0) {
+				/* "<file>\t<sha256sum>" of the installed contents, follows %FILES% */
+				while(fgets(line, sizeof(line), fp) && _alpm_strip_newline(line, 0)) {
+					alpm_file_t *file;
+					char *sep = strrchr(line, '\t');
+					if(sep == NULL) {
+						continue;
+					}
+					*sep = '\0';
+					file = alpm_filelist_contains(&info->files, line);
+					if(file && file->sha256sum == NULL) {
+						STRDUP(file->sha256sum, sep + 1, goto error);
+					}
+				}
+			} else if(strcmp(line, "%FILESTAT%") == 0) {
+				/* "<file>\t<mode>\t<size>", written in the order of %FILES% */
+				size_t next = 0;
+				while(fgets(line, sizeof(line), fp) && _alpm_strip_newline(line, 0)) {
+					alpm_file_t *file;
+					char *size = strrchr(line, '\t'), *mode;
+					if(size == NULL) {
+						continue;
+					}
+					*size++ = '\0';
+					mode = strrchr(line, '\t');
+					if(mode == NULL) {
+						continue;
+					}
+					*mode++ = '\0';
+					if(next < info->files.count
+							&& strcmp(info->files.files[next].name, line) == 0) {
+						file = info->files.files + next;
+					} else {
+						file = alpm_filelist_contains(&info->files, line);
+					}
+					if(file && (file->size = _alpm_strtoofft(size)) >= 0) {
+						file->mode = (mode_t)strtoul(mode, NULL, 8);
+						next = file - info->files.files + 1;
+					} else if(file) {
+						file->size = 0;
+					}
+				}
 			} else if(strcmp(line, "%BACKUP%") == 0) {
 				while(fgets(line, sizeof(line), fp) && _alpm_strip_newline(line, 0)) {
 					alpm_backup_t *backup;
@@ -770,6 +828,70 @@ static void write_deps(FILE *fp, const char *header, alpm_list_t *deplist)
 	fputc('\n', fp);
 }
 
+/* Open a file of a database entry for writing. Unless the sync policy is
+ * none, the contents go to a temporary file which close_entry_file()
+ * renames over the old one once it is on disk, so a crash never leaves a
+ * truncated entry. */
+static FILE *open_entry_file(alpm_db_t *db, alpm_pkg_t *info,
+		const char *filename, char **path, char **tmppath)
+{
+	FILE *fp;
+
+	*tmppath = NULL;
+	*path = _alpm_local_db_pkgpath(db, info, filename);
+	if(*path == NULL) {
+		return NULL;
+	}
+	if(db->handle->syncpolicy != ALPM_SYNCPOLICY_NONE) {
+		size_t len = strlen(*path) + 5;
+		MALLOC(*tmppath, len, FREE(*path); return NULL);
+		snprintf(*tmppath, len, "%s.tmp", *path);
+	}
+
+	fp = fopen(*tmppath ? *tmppath : *path, "w");
+	if(fp == NULL) {
+		_alpm_log(db->handle, ALPM_LOG_ERROR, _("could not open file %s: %s\n"),
+				*tmppath ? *tmppath : *path, strerror(errno));
+		FREE(*path);
+		FREE(*tmppath);
+	}
+	return fp;
+}
+
+static int close_entry_file(alpm_db_t *db, FILE *fp, char *path, char *tmppath)
+{
+	alpm_handle_t *handle = db->handle;
+	int ret = 0, hold = tmppath && _alpm_trans_holds_renames(handle);
+
+	/* a held file is synced with the others before it is renamed */
+	if(tmppath && !hold && (fflush(fp) != 0 || fdatasync(fileno(fp)) != 0)) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not write to file %s: %s\n"),
+				tmppath, strerror(errno));
+		ret = -1;
+	}
+	if(fclose(fp) != 0 && ret == 0) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not write to file %s: %s\n"),
+				tmppath ? tmppath : path, strerror(errno));
+		ret = -1;
+	}
+	if(hold && ret == 0 && _alpm_trans_hold_rename(handle, tmppath, path) == 0) {
+		return 0;
+	}
+	if(tmppath) {
+		if(ret == 0 && rename(tmppath, path) != 0) {
+			_alpm_log(db->handle, ALPM_LOG_ERROR, _("could not rename %s to %s (%s)\n"),
+					tmppath, path, strerror(errno));
+			ret = -1;
+		}
+		if(ret != 0) {
+			unlink(tmppath);
+		}
+	}
+	free(path);
+	free(tmppath);
+	return ret;
+}
+
 int _alpm_local_db_write(alpm_db_t *db, alpm_pkg_t *info, alpm_dbinfrq_t inforeq)
 {
 	FILE *fp = NULL;
@@ -786,19 +908,15 @@ int _alpm_local_db_write(alpm_db_t *db, alpm_pkg_t *info, alpm_dbinfrq_t inforeq
 
 	/* DESC */
 	if(inforeq & INFRQ_DESC) {
-		char *path;
+		char *path, *tmppath;
 		_alpm_log(db->handle, ALPM_LOG_DEBUG,
 				"writing %s-%s DESC information back to db\n",
 				info->name, info->version);
-		path = _alpm_local_db_pkgpath(db, info, "desc");
-		if(!path || (fp = fopen(path, "w")) == NULL) {
-			_alpm_log(db->handle, ALPM_LOG_ERROR, _("could not open file %s: %s\n"),
-					path, strerror(errno));
+		fp = open_entry_file(db, info, "desc", &path, &tmppath);
+		if(fp == NULL) {
 			retval = -1;
-			free(path);
 			goto cleanup;
 		}
-		free(path);
 		fprintf(fp, "%%NAME%%\n%s\n\n"
 						"%%VERSION%%\n%s\n\n", info->name, info->version);
 		if(info->desc) {
@@ -830,6 +948,24 @@ int _alpm_local_db_write(alpm_db_t *db, alpm_pkg_t *info, alpm_dbinfrq_t inforeq
 			fprintf(fp, "%%SIZE%%\n"
 							"%jd\n\n", (intmax_t)info->isize);
 		}
+		if(info->infolevel & INFRQ_FILES) {
+			/* summarize what was installed; keep what came with the package if
+			 * the file list lacks sizes */
+			alpm_list_t *dirsizes = _alpm_dirsizes_from_files(&info->files);
+			if(dirsizes) {
+				alpm_list_free_inner(info->dirsizes, (alpm_list_fn_free)_alpm_dirsize_free);
+				alpm_list_free(info->dirsizes);
+				info->dirsizes = dirsizes;
+			}
+		}
+		if(info->dirsizes) {
+			fputs("%DIRSIZES%\n", fp);
+			for(lp = info->dirsizes; lp; lp = lp->next) {
+				const alpm_dirsize_t *dirsize = lp->data;
+				fprintf(fp, "%s\t%jd\n", dirsize->name, (intmax_t)dirsize->usage);
+			}
+			fputc('\n', fp);
+		}
 		if(info->reason) {
 			fprintf(fp, "%%REASON%%\n"
 							"%u\n\n", info->reason);
@@ -873,25 +1009,23 @@ int _alpm_local_db_write(alpm_db_t *db, alpm_pkg_t *info, alpm_dbinfrq_t inforeq
 		write_deps(fp, "%CONFLICTS%", info->conflicts);
 		write_deps(fp, "%PROVIDES%", info->provides);
 
-		fclose(fp);
+		if(close_entry_file(db, fp, path, tmppath) != 0) {
+			retval = -1;
+		}
 		fp = NULL;
 	}
 
 	/* FILES */
 	if(inforeq & INFRQ_FILES) {
-		char *path;
+		char *path, *tmppath;
 		_alpm_log(db->handle, ALPM_LOG_DEBUG,
 				"writing %s-%s FILES information back to db\n",
 				info->name, info->version);
-		path = _alpm_local_db_pkgpath(db, info, "files");
-		if(!path || (fp = fopen(path, "w")) == NULL) {
-			_alpm_log(db->handle, ALPM_LOG_ERROR, _("could not open file %s: %s\n"),
-					path, strerror(errno));
+		fp = open_entry_file(db, info, "files", &path, &tmppath);
+		if(fp == NULL) {
 			retval = -1;
-			free(path);
 			goto cleanup;
 		}
-		free(path);
 		if(info->files.count) {
 			size_t i;
 			fputs("%FILES%\n", fp);
@@ -901,6 +1035,42 @@ int _alpm_local_db_write(alpm_db_t *db, alpm_pkg_t *info, alpm_dbinfrq_t inforeq
 				fputc('\n', fp);
 			}
 			fputc('\n', fp);
+
+			for(i = 0; i < info->files.count; i++) {
+				const alpm_file_t *file = info->files.files + i;
+				if(file->mode) {
+					break;
+				}
+			}
+			if(i < info->files.count) {
+				/* sizes and types, so disk space checks need not stat the files */
+				fputs("%FILESTAT%\n", fp);
+				for(; i < info->files.count; i++) {
+					const alpm_file_t *file = info->files.files + i;
+					if(file->mode) {
+						fprintf(fp, "%s\t%o\t%jd\n", file->name,
+								(unsigned int)file->mode, (intmax_t)file->size);
+					}
+				}
+				fputc('\n', fp);
+			}
+
+			for(i = 0; i < info->files.count; i++) {
+				const alpm_file_t *file = info->files.files + i;
+				if(file->sha256sum) {
+					break;
+				}
+			}
+			if(i < info->files.count) {
+				fputs("%SHA256SUMS%\n", fp);
+				for(; i < info->files.count; i++) {
+					const alpm_file_t *file = info->files.files + i;
+					if(file->sha256sum) {
+						fprintf(fp, "%s\t%s\n", file->name, file->sha256sum);
+					}
+				}
+				fputc('\n', fp);
+			}
 		}
 		if(info->backup) {
 			fputs("%BACKUP%\n", fp);
@@ -910,7 +1080,9 @@ int _alpm_local_db_write(alpm_db_t *db, alpm_pkg_t *info, alpm_dbinfrq_t inforeq
 			}
 			fputc('\n', fp);
 		}
-		fclose(fp);
+		if(close_entry_file(db, fp, path, tmppath) != 0) {
+			retval = -1;
+		}
 		fp = NULL;
 	}
 
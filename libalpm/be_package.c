@@ -62,7 +62,7 @@ static void *_package_changelog_open(alpm_pkg_t *pkg)
 	int fd;
 
 	fd = _alpm_open_archive(pkg->handle, pkgfile, &buf,
-			&archive, ALPM_ERR_PKG_OPEN);
+			&archive, ALPM_ERR_PKG_OPEN, 0);
 	if(fd < 0) {
 		return NULL;
 	}
@@ -231,6 +231,11 @@ static int parse_descfile(alpm_handle_t *handle, struct archive *a, alpm_pkg_t *
 				CALLOC(backup, 1, sizeof(alpm_backup_t), return -1);
 				STRDUP(backup->name, ptr, return -1);
 				newpkg->backup = alpm_list_add(newpkg->backup, backup);
+			} else if(strcmp(key, "dirsize") == 0) {
+				alpm_dirsize_t *dirsize = _alpm_dirsize_parse(ptr);
+				if(dirsize) {
+					newpkg->dirsizes = alpm_list_add(newpkg->dirsizes, dirsize);
+				}
 			} else if(strcmp(key, "force") == 0) {
 				/* deprecated, skip it */
 			} else if(strcmp(key, "makepkgopt") == 0) {
@@ -249,6 +254,77 @@ static int parse_descfile(alpm_handle_t *handle, struct archive *a, alpm_pkg_t *
 	return 0;
 }
 
+/* decode the \ooo escapes mtree uses for special characters, in place */
+static void mtree_unescape(char *str)
+{
+	char *out = str;
+
+	while(*str) {
+		if(str[0] == '\\' && str[1] >= '0' && str[1] <= '3'
+				&& str[2] >= '0' && str[2] <= '7' && str[3] >= '0' && str[3] <= '7') {
+			*out++ = (char)((str[1] - '0') * 64 + (str[2] - '0') * 8 + (str[3] - '0'));
+			str += 4;
+		} else {
+			*out++ = *str++;
+		}
+	}
+	*out = '\0';
+}
+
+/**
+ * Read the file digests from the .MTREE of a package.
+ * @param handle the context handle
+ * @param a the archive positioned at the .MTREE entry
+ * @param digests list of alpm_backup_t with the sha256sum as hash
+ * @return 0 on success, -1 on error
+ */
+static int parse_mtree(alpm_handle_t *handle, struct archive *a,
+		alpm_list_t **digests)
+{
+	int ret, linenum = 0;
+	struct archive_read_buffer buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.max_line_size = 512 * 1024;
+
+	while((ret = _alpm_archive_fgets(a, &buf)) == ARCHIVE_OK) {
+		size_t len = _alpm_strip_newline(buf.line, buf.real_line_size);
+		char *path, *key, *ptr = buf.line;
+
+		linenum++;
+		if(linenum == 1 && strcmp(buf.line, "#mtree") != 0) {
+			/* compressed or otherwise unknown, not worth an error */
+			_alpm_log(handle, ALPM_LOG_DEBUG, "ignoring unknown .MTREE format\n");
+			return 0;
+		}
+		if(len == 0 || buf.line[0] == '#' || buf.line[0] == '/') {
+			continue;
+		}
+
+		path = strsep(&ptr, " ");
+		if(path[0] == '.' && path[1] == '/') {
+			path += 2;
+		}
+		while((key = strsep(&ptr, " ")) != NULL) {
+			if(strncmp(key, "sha256digest=", 13) == 0) {
+				alpm_backup_t *digest;
+				CALLOC(digest, 1, sizeof(alpm_backup_t), return -1);
+				STRDUP(digest->name, path, free(digest); return -1);
+				STRDUP(digest->hash, key + 13, _alpm_backup_free(digest); return -1);
+				mtree_unescape(digest->name);
+				*digests = alpm_list_add(*digests, digest);
+				break;
+			}
+		}
+	}
+	if(ret != ARCHIVE_EOF) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "error parsing package .MTREE\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
  * Validate a package.
  * @param handle the context handle
@@ -357,14 +433,17 @@ alpm_pkg_t *_alpm_pkg_load_internal(alpm_handle_t *handle,
 	struct archive *archive;
 	struct archive_entry *entry;
 	alpm_pkg_t *newpkg;
+	alpm_list_t *i;
 	struct stat st;
 	size_t files_size = 0;
+	alpm_list_t *digests = NULL;
 
 	if(pkgfile == NULL || strlen(pkgfile) == 0) {
 		RET_ERR(handle, ALPM_ERR_WRONG_ARGS, NULL);
 	}
 
-	fd = _alpm_open_archive(handle, pkgfile, &st, &archive, ALPM_ERR_PKG_OPEN);
+	fd = _alpm_open_archive(handle, pkgfile, &st, &archive, ALPM_ERR_PKG_OPEN,
+			full);
 	if(fd < 0) {
 		if(errno == ENOENT) {
 			handle->pm_errno = ALPM_ERR_PKG_NOT_FOUND;
@@ -412,6 +491,14 @@ alpm_pkg_t *_alpm_pkg_load_internal(alpm_handle_t *handle,
 			continue;
 		} else if(strcmp(entry_name,  ".INSTALL") == 0) {
 			newpkg->scriptlet = 1;
+		} else if(full && strcmp(entry_name, ".MTREE") == 0) {
+			/* contents of the files, for skipping unchanged ones on upgrade */
+			if(parse_mtree(handle, archive, &digests) != 0) {
+				_alpm_log(handle, ALPM_LOG_ERROR, _("could not parse package mtree file in %s\n"),
+						pkgfile);
+				goto pkg_invalid;
+			}
+			continue;
 		} else if(*entry_name == '.') {
 			/* for now, ignore all files starting with '.' that haven't
 			 * already been handled (for future possibilities) */
@@ -494,14 +581,27 @@ alpm_pkg_t *_alpm_pkg_load_internal(alpm_handle_t *handle,
 			qsort(newpkg->files.files, newpkg->files.count,
 					sizeof(alpm_file_t), _alpm_files_cmp);
 		}
+		for(i = digests; i; i = i->next) {
+			alpm_backup_t *digest = i->data;
+			alpm_file_t *file = alpm_filelist_contains(&newpkg->files, digest->name);
+			if(file && file->sha256sum == NULL && S_ISREG(file->mode)) {
+				/* hand over the string */
+				file->sha256sum = digest->hash;
+				digest->hash = NULL;
+			}
+		}
 		newpkg->infolevel |= INFRQ_FILES;
 	}
+	alpm_list_free_inner(digests, (alpm_list_fn_free)_alpm_backup_free);
+	alpm_list_free(digests);
 
 	return newpkg;
 
 pkg_invalid:
 	handle->pm_errno = ALPM_ERR_PKG_INVALID;
 error:
+	alpm_list_free_inner(digests, (alpm_list_fn_free)_alpm_backup_free);
+	alpm_list_free(digests);
 	_alpm_pkg_free(newpkg);
 	archive_read_finish(archive);
 	if(fd >= 0) {
@@ -19,6 +19,8 @@
  */
 
 #include <errno.h>
+#include <stdint.h> /* intmax_t */
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -38,6 +40,7 @@
 #include "delta.h"
 #include "deps.h"
 #include "dload.h"
+#include "vcdiff.h"
 
 static char *get_sync_dir(alpm_handle_t *handle)
 {
@@ -131,6 +134,205 @@ valid:
 	return 0;
 }
 
+/* Servers may publish deltas between consecutive versions of a database.
+ * <repo>.db.delta is a small text file next to the database: its first line
+ * holds the sha256sum and size of the current database, every further line
+ * the sha256sum of an older database and the name of the VCDIFF (xdelta3)
+ * file turning that one into the current one. A patched database has to
+ * match the published sha256sum byte for byte; its signature, if required,
+ * is downloaded and checked as for a full download. */
+#define DBDELTA_INDEX_MAX (64 * 1024)
+
+/* download a file next to the database on a server into the sync dir */
+static int sync_db_fetch(alpm_db_t *db, const char *server, const char *name,
+		const char *syncpath, off_t max_size, int force)
+{
+	struct dload_payload payload;
+	size_t len;
+	int ret;
+
+	memset(&payload, 0, sizeof(struct dload_payload));
+	len = strlen(server) + strlen(name) + 2;
+	MALLOC(payload.fileurl, len, RET_ERR(db->handle, ALPM_ERR_MEMORY, -1));
+	snprintf(payload.fileurl, len, "%s/%s", server, name);
+	payload.handle = db->handle;
+	payload.force = force;
+	payload.errors_ok = 1;
+	payload.unlink_on_fail = 1;
+	payload.max_size = max_size;
+
+	ret = _alpm_download(&payload, syncpath, NULL);
+	_alpm_dload_payload_reset(&payload);
+	return ret;
+}
+
+/* apply a delta to the database, leaving the result in newpath */
+static int sync_db_apply_delta(const char *dbpath, const char *deltapath,
+		const char *syncpath, const char *newpath)
+{
+	alpm_vcdiff_t *vcd;
+	unsigned char *src;
+	size_t srclen, len;
+	char *tmppath;
+	int fd, ret = -1;
+
+	if(_alpm_vcdiff_open(deltapath, &vcd) != 0) {
+		return -1;
+	}
+	if(vcd->target_comp != VCDIFF_COMP_NONE && vcd->target_comp != VCDIFF_COMP_GZIP) {
+		_alpm_vcdiff_close(vcd);
+		return -1;
+	}
+	if(_alpm_vcdiff_map_source(dbpath, vcd->source_comp != VCDIFF_COMP_NONE,
+				syncpath, &src, &srclen) != 0) {
+		_alpm_vcdiff_close(vcd);
+		return -1;
+	}
+
+	len = strlen(syncpath) + 22;
+	MALLOC(tmppath, len, goto cleanup);
+	snprintf(tmppath, len, "%s.alpm_dbdelta_XXXXXX", syncpath);
+	if((fd = mkstemp(tmppath)) < 0) {
+		FREE(tmppath);
+		goto cleanup;
+	}
+	ret = _alpm_vcdiff_decode(vcd, src, srclen, fd);
+	if(fchmod(fd, 0644) != 0) {
+		ret = -1;
+	}
+	CLOSE(fd);
+
+	if(ret == 0) {
+		if(vcd->target_comp == VCDIFF_COMP_GZIP) {
+			ret = _alpm_gzip_file(tmppath, newpath);
+		} else {
+			ret = rename(tmppath, newpath);
+		}
+	}
+	unlink(tmppath);
+	free(tmppath);
+
+cleanup:
+	_alpm_vcdiff_unmap_source(src, srclen);
+	_alpm_vcdiff_close(vcd);
+	return ret;
+}
+
+/** Bring a database up to date with a delta published by a server.
+ * @param db the database
+ * @param server the server to ask
+ * @param syncpath the directory of the sync databases
+ * @return 0 if the database was patched, 1 if it is already up to date, -1
+ * if it has to be downloaded in full
+ *
+ * The index is kept in the sync dir and only downloaded again when the
+ * server has a newer one, so a refresh of an unchanged repository, or one
+ * from a server that publishes no index, costs a single request and no
+ * hashing of the database.
+ */
+static int sync_db_patch(alpm_db_t *db, const char *server, const char *syncpath)
+{
+	alpm_handle_t *handle = db->handle;
+	const char *dbpath = _alpm_db_path(db);
+	char *localsum = NULL, *indexname = NULL, *indexpath = NULL;
+	char *deltapath = NULL, *newpath = NULL;
+	char line[PATH_MAX + 80], newsum[65], from[65], deltaname[PATH_MAX];
+	intmax_t newsize;
+	struct stat st;
+	size_t len;
+	FILE *fp = NULL;
+	int found = 0, ret = -1;
+
+	if(dbpath == NULL) {
+		return -1;
+	}
+
+	len = strlen(db->treename) + 10;
+	MALLOC(indexname, len, goto cleanup);
+	snprintf(indexname, len, "%s.db.delta", db->treename);
+	len = strlen(syncpath) + strlen(indexname) + 1;
+	MALLOC(indexpath, len, goto cleanup);
+	snprintf(indexpath, len, "%s%s", syncpath, indexname);
+
+	/* an index that is not newer than the last one says nothing new, the
+	 * database request with its own time condition settles it */
+	if(sync_db_fetch(db, server, indexname, syncpath, DBDELTA_INDEX_MAX, 0) != 0) {
+		goto cleanup;
+	}
+	if((fp = fopen(indexpath, "r")) == NULL ||
+			fgets(line, sizeof(line), fp) == NULL ||
+			sscanf(line, "%64s %jd", newsum, &newsize) != 2) {
+		unlink(indexpath);
+		goto cleanup;
+	}
+	if((localsum = alpm_compute_sha256sum(dbpath)) == NULL) {
+		goto cleanup;
+	}
+
+	if(strcmp(newsum, localsum) == 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "database %s matches %s\n",
+				db->treename, indexname);
+		ret = 1;
+		goto cleanup;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		if(sscanf(line, "%64s %4095s", from, deltaname) == 2 &&
+				strcmp(from, localsum) == 0) {
+			found = 1;
+			break;
+		}
+	}
+	/* the delta has to land in the sync dir */
+	if(!found || strchr(deltaname, '/') || deltaname[0] == '.') {
+		goto cleanup;
+	}
+
+	_alpm_log(handle, ALPM_LOG_DEBUG, "updating database %s with delta %s\n",
+			db->treename, deltaname);
+	len = strlen(syncpath) + strlen(deltaname) + 1;
+	MALLOC(deltapath, len, goto cleanup);
+	snprintf(deltapath, len, "%s%s", syncpath, deltaname);
+	len = strlen(dbpath) + 6;
+	MALLOC(newpath, len, goto cleanup);
+	snprintf(newpath, len, "%s.part", dbpath);
+
+	if(sync_db_fetch(db, server, deltaname, syncpath, (off_t)newsize, 1) != 0 ||
+			sync_db_apply_delta(dbpath, deltapath, syncpath, newpath) != 0) {
+		goto cleanup;
+	}
+	if(stat(newpath, &st) != 0 || st.st_size != (off_t)newsize ||
+			_alpm_test_checksum(newpath, newsum, ALPM_PKG_VALIDATION_SHA256SUM) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG,
+				"patched database %s does not match, downloading it in full\n",
+				db->treename);
+		goto cleanup;
+	}
+	if(rename(newpath, dbpath) == 0) {
+		ret = 0;
+	}
+
+cleanup:
+	if(fp) {
+		fclose(fp);
+	}
+	if(deltapath) {
+		unlink(deltapath);
+	}
+	if(newpath && ret != 0) {
+		unlink(newpath);
+	}
+	free(localsum);
+	free(indexname);
+	free(indexpath);
+	free(deltapath);
+	free(newpath);
+	if(ret == -1) {
+		/* falling back is not an error */
+		handle->pm_errno = 0;
+	}
+	return ret;
+}
+
 /** Update a package database
  *
  * An update of the package database \a db will be attempted. Unless
@@ -169,9 +371,11 @@ valid:
 int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 {
 	char *syncpath;
-	alpm_list_t *i;
+	alpm_list_t *i, *servers;
 	int ret = -1;
 	mode_t oldmask;
+	off_t dbsize = 0;
+	struct stat buf;
 	alpm_handle_t *handle;
 	alpm_siglevel_t level;
 
@@ -199,7 +403,13 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 		RET_ERR(handle, ALPM_ERR_HANDLE_LOCK, -1);
 	}
 
-	for(i = db->servers; i; i = i->next) {
+	/* the current database is the best guess at the size of the new one */
+	if(stat(_alpm_db_path(db), &buf) == 0) {
+		dbsize = buf.st_size;
+	}
+	servers = _alpm_dload_rank_servers(handle, db->servers, dbsize);
+
+	for(i = servers; i; i = i->next) {
 		const char *server = i->data;
 		struct dload_payload payload;
 		size_t len;
@@ -207,20 +417,28 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 
 		memset(&payload, 0, sizeof(struct dload_payload));
 
-		/* set hard upper limit of 25MiB */
-		payload.max_size = 25 * 1024 * 1024;
+		/* a delta against the database we have saves downloading all of it */
+		ret = -1;
+		if(!force && access(_alpm_db_path(db), R_OK) == 0) {
+			ret = sync_db_patch(db, server, syncpath);
+		}
 
-		/* print server + filename into a buffer */
-		len = strlen(server) + strlen(db->treename) + 5;
-		/* TODO fix leak syncpath and umask unset */
-		MALLOC(payload.fileurl, len, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
-		snprintf(payload.fileurl, len, "%s/%s.db", server, db->treename);
-		payload.handle = handle;
-		payload.force = force;
-		payload.unlink_on_fail = 1;
+		if(ret == -1) {
+			/* set hard upper limit of 25MiB */
+			payload.max_size = 25 * 1024 * 1024;
 
-		ret = _alpm_download(&payload, syncpath, NULL);
-		_alpm_dload_payload_reset(&payload);
+			/* print server + filename into a buffer */
+			len = strlen(server) + strlen(db->treename) + 5;
+			/* TODO fix leak syncpath and umask unset */
+			MALLOC(payload.fileurl, len, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+			snprintf(payload.fileurl, len, "%s/%s.db", server, db->treename);
+			payload.handle = handle;
+			payload.force = force;
+			payload.unlink_on_fail = 1;
+
+			ret = _alpm_download(&payload, syncpath, NULL);
+			_alpm_dload_payload_reset(&payload);
+		}
 
 		if(ret == 0 && (level & ALPM_SIG_DATABASE)) {
 			/* an existing sig file is no good at this point */
@@ -255,6 +473,8 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 			break;
 		}
 	}
+	alpm_list_free(servers);
+	_alpm_dload_save_mirrorstats(handle);
 
 	if(ret == 1) {
 		/* files match, do nothing */
@@ -399,6 +619,11 @@ static size_t estimate_package_count(struct stat *st, struct archive *archive)
 		case ARCHIVE_COMPRESSION_XZ:
 			per_package = 400;
 			break;
+#ifdef ARCHIVE_FILTER_ZSTD
+		case ARCHIVE_FILTER_ZSTD:
+			per_package = 410;
+			break;
+#endif
 #ifdef ARCHIVE_COMPRESSION_UU
 		case ARCHIVE_COMPRESSION_UU:
 			per_package = 3015 * 4 / 3;
@@ -434,7 +659,7 @@ static int sync_db_populate(alpm_db_t *db)
 	}
 
 	fd = _alpm_open_archive(db->handle, dbpath, &buf,
-			&archive, ALPM_ERR_DB_OPEN);
+			&archive, ALPM_ERR_DB_OPEN, 1);
 	if(fd < 0) {
 		return -1;
 	}
@@ -579,6 +804,19 @@ static int sync_db_read(alpm_db_t *db, struct archive *archive,
 			} else if(strcmp(line, "%ISIZE%") == 0) {
 				READ_NEXT();
 				pkg->isize = _alpm_strtoofft(line);
+			} else if(strcmp(line, "%DIRSIZES%") == 0) {
+				/* "<directory>\t<usage>" summaries of the files */
+				while(1) {
+					alpm_dirsize_t *dirsize;
+					READ_NEXT();
+					if(*line == '\0') {
+						break;
+					}
+					dirsize = _alpm_dirsize_parse(line);
+					if(dirsize) {
+						pkg->dirsizes = alpm_list_add(pkg->dirsizes, dirsize);
+					}
+				}
 			} else if(strcmp(line, "%MD5SUM%") == 0) {
 				READ_AND_STORE(pkg->md5sum);
 			} else if(strcmp(line, "%SHA256SUM%") == 0) {
@@ -475,8 +475,13 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 					/* skip removal of file, but not add. this will prevent a second
 					 * package from removing the file when it was already installed
 					 * by its new owner (whether the file is in backup array or not */
-					handle->trans->skip_remove =
-						alpm_list_add(handle->trans->skip_remove, strdup(filestr));
+					if(_alpm_globset_add_literal(handle->trans->skip_remove, filestr) != 0) {
+						FREELIST(conflicts);
+						if(dbpkg) {
+							free(tmpfiles.files);
+						}
+						RET_ERR(handle, ALPM_ERR_MEMORY, NULL);
+					}
 					_alpm_log(handle, ALPM_LOG_DEBUG,
 							"file changed packages, adding to remove skiplist\n");
 					resolved_conflict = 1;
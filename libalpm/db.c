@@ -36,6 +36,7 @@
 #include "alpm.h"
 #include "package.h"
 #include "group.h"
+#include "deps.h"
 
 /** \addtogroup alpm_databases Database Functions
  * @brief Functions to query and manipulate the database of libalpm
@@ -471,6 +472,20 @@ static void free_groupcache(alpm_db_t *db)
 	db->status &= ~DB_STATUS_GRPCACHE;
 }
 
+static void free_replcache(alpm_db_t *db)
+{
+	if(db == NULL || !(db->status & DB_STATUS_REPLCACHE)) {
+		return;
+	}
+
+	_alpm_log(db->handle, ALPM_LOG_DEBUG,
+			"freeing replaces cache for repository '%s'\n", db->treename);
+
+	FREE(db->replcache);
+	db->replcache_count = 0;
+	db->status &= ~DB_STATUS_REPLCACHE;
+}
+
 void _alpm_db_free_pkgcache(alpm_db_t *db)
 {
 	if(db == NULL || !(db->status & DB_STATUS_PKGCACHE)) {
@@ -488,6 +503,7 @@ void _alpm_db_free_pkgcache(alpm_db_t *db)
 	db->status &= ~DB_STATUS_PKGCACHE;
 
 	free_groupcache(db);
+	free_replcache(db);
 }
 
 alpm_pkghash_t *_alpm_db_get_pkgcache_hash(alpm_db_t *db)
@@ -536,6 +552,7 @@ int _alpm_db_add_pkgincache(alpm_db_t *db, alpm_pkg_t *pkg)
 	db->pkgcache = _alpm_pkghash_add_sorted(db->pkgcache, newpkg);
 
 	free_groupcache(db);
+	free_replcache(db);
 
 	return 0;
 }
@@ -562,6 +579,7 @@ int _alpm_db_remove_pkgfromcache(alpm_db_t *db, alpm_pkg_t *pkg)
 	_alpm_pkg_free(data);
 
 	free_groupcache(db);
+	free_replcache(db);
 
 	return 0;
 }
@@ -668,4 +686,116 @@ alpm_group_t *_alpm_db_get_groupfromcache(alpm_db_t *db, const char *target)
 	return NULL;
 }
 
+struct db_replacer {
+	alpm_depend_t *replace;
+	alpm_pkg_t *pkg;
+	/* position of pkg in the package cache */
+	size_t idx;
+};
+
+static int replacer_cmp(const void *p1, const void *p2)
+{
+	const struct db_replacer *r1 = p1;
+	const struct db_replacer *r2 = p2;
+	int ret = strcmp(r1->replace->name, r2->replace->name);
+	if(ret == 0) {
+		ret = r1->idx < r2->idx ? -1 : (r1->idx > r2->idx);
+	}
+	return ret;
+}
+
+/* Builds an index of the replaces entries of every package in db, so
+ * replacers of a package can be looked up without parsing the replaces
+ * of the whole repository.
+ */
+static int load_replcache(alpm_db_t *db)
+{
+	alpm_list_t *lp, *i;
+	size_t count = 0, idx;
+
+	if(db == NULL) {
+		return -1;
+	}
+
+	_alpm_log(db->handle, ALPM_LOG_DEBUG, "loading replaces cache for repository '%s'\n",
+			db->treename);
+
+	for(lp = _alpm_db_get_pkgcache(db); lp; lp = lp->next) {
+		count += alpm_list_count(alpm_pkg_get_replaces(lp->data));
+	}
+	if(count > 0) {
+		CALLOC(db->replcache, count, sizeof(struct db_replacer),
+				RET_ERR(db->handle, ALPM_ERR_MEMORY, -1));
+	}
+
+	count = 0;
+	for(lp = _alpm_db_get_pkgcache(db), idx = 0; lp; lp = lp->next, idx++) {
+		alpm_pkg_t *pkg = lp->data;
+		for(i = alpm_pkg_get_replaces(pkg); i; i = i->next) {
+			struct db_replacer *r = db->replcache + count++;
+			r->replace = i->data;
+			r->pkg = pkg;
+			r->idx = idx;
+		}
+	}
+	qsort(db->replcache, count, sizeof(struct db_replacer), replacer_cmp);
+	db->replcache_count = count;
+
+	db->status |= DB_STATUS_REPLCACHE;
+	return 0;
+}
+
+/** Find the packages of a database replacing a package.
+ * Only literal matches of the replaces entries are considered.
+ * @param db the database to search
+ * @param pkg the package to be replaced
+ * @return a list of alpm_pkg_t * in package cache order, to be freed by
+ * the caller with alpm_list_free()
+ */
+alpm_list_t *_alpm_db_find_replacers(alpm_db_t *db, alpm_pkg_t *pkg)
+{
+	alpm_list_t *replacers = NULL;
+	alpm_pkg_t *last = NULL;
+	size_t lo = 0, hi;
+
+	if(db == NULL || pkg == NULL) {
+		return NULL;
+	}
+
+	if(!(db->status & DB_STATUS_VALID)) {
+		RET_ERR(db->handle, ALPM_ERR_DB_INVALID, NULL);
+	}
+
+	if(!(db->status & DB_STATUS_REPLCACHE)) {
+		if(load_replcache(db) != 0) {
+			return NULL;
+		}
+	}
+
+	/* find the first entry replacing this name */
+	hi = db->replcache_count;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(strcmp(db->replcache[mid].replace->name, pkg->name) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for(; lo < db->replcache_count; lo++) {
+		struct db_replacer *r = db->replcache + lo;
+		if(strcmp(r->replace->name, pkg->name) != 0) {
+			break;
+		}
+		/* a package may list several versions of the same name */
+		if(r->pkg != last && _alpm_depcmp_literal(pkg, r->replace)) {
+			replacers = alpm_list_add(replacers, r->pkg);
+			last = r->pkg;
+		}
+	}
+
+	return replacers;
+}
+
 /* vim: set ts=2 sw=2 noet: */
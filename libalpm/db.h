@@ -51,7 +51,8 @@ enum _alpm_dbstatus_t {
 
 	DB_STATUS_LOCAL = (1 << 10),
 	DB_STATUS_PKGCACHE = (1 << 11),
-	DB_STATUS_GRPCACHE = (1 << 12)
+	DB_STATUS_GRPCACHE = (1 << 12),
+	DB_STATUS_REPLCACHE = (1 << 13)
 };
 
 struct db_operations {
@@ -60,6 +61,9 @@ struct db_operations {
 	void (*unregister) (alpm_db_t *);
 };
 
+/* an entry of the replaces index, see _alpm_db_find_replacers() */
+struct db_replacer;
+
 /* Database */
 struct __alpm_db_t {
 	alpm_handle_t *handle;
@@ -68,6 +72,9 @@ struct __alpm_db_t {
 	char *_path;
 	alpm_pkghash_t *pkgcache;
 	alpm_list_t *grpcache;
+	/* replaces entries of all packages, sorted by replaced name */
+	struct db_replacer *replcache;
+	size_t replcache_count;
 	alpm_list_t *servers;
 	struct db_operations *ops;
 	/* flags determining validity, local, loaded caches, etc. */
@@ -104,6 +111,8 @@ alpm_pkg_t *_alpm_db_get_pkgfromcache(alpm_db_t *db, const char *target);
 /* groups */
 alpm_list_t *_alpm_db_get_groupcache(alpm_db_t *db);
 alpm_group_t *_alpm_db_get_groupfromcache(alpm_db_t *db, const char *target);
+/* replacers */
+alpm_list_t *_alpm_db_find_replacers(alpm_db_t *db, alpm_pkg_t *pkg);
 
 #endif /* _ALPM_DB_H */
 
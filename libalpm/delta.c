@@ -30,60 +30,136 @@
 #include "alpm_list.h"
 #include "util.h"
 #include "log.h"
-#include "graph.h"
 
-static alpm_list_t *graph_init(alpm_list_t *deltas, int reverse)
+/* Deltas form a graph: there is an edge from delta A to delta B if B starts
+ * from the file A produces (or the other way around for a reverse graph).
+ * Vertices live in an array and refer to each other by index, so edges can
+ * be found with a sorted index instead of comparing every pair of deltas,
+ * and the shortest paths are computed with a binary heap. */
+#define NO_VERTEX SIZE_MAX
+
+struct delta_vertex {
+	alpm_delta_t *delta;
+	off_t weight;
+	size_t parent;      /* where did we come from? */
+	size_t *children;
+	size_t nchildren;
+	size_t heappos;     /* position in the heap, NO_VERTEX once visited */
+};
+
+struct delta_graph {
+	struct delta_vertex *vertices;
+	size_t count;
+	size_t *heap;
+	size_t heapsize;
+};
+
+struct delta_key {
+	const char *name;
+	size_t idx;
+};
+
+static int delta_key_cmp(const void *p1, const void *p2)
+{
+	const struct delta_key *k1 = p1;
+	const struct delta_key *k2 = p2;
+	int ret = strcmp(k1->name, k2->name);
+	if(ret == 0) {
+		ret = k1->idx < k2->idx ? -1 : (k1->idx > k2->idx);
+	}
+	return ret;
+}
+
+static void graph_free(struct delta_graph *graph)
 {
-	alpm_list_t *i, *j;
-	alpm_list_t *vertices = NULL;
+	size_t i;
+
+	if(graph == NULL) {
+		return;
+	}
+	for(i = 0; i < graph->count; i++) {
+		free(graph->vertices[i].children);
+	}
+	free(graph->vertices);
+	free(graph->heap);
+	free(graph);
+}
+
+static struct delta_graph *graph_init(alpm_list_t *deltas, int reverse)
+{
+	struct delta_graph *graph;
+	struct delta_key *keys;
+	alpm_list_t *i;
+	size_t idx;
+
+	CALLOC(graph, 1, sizeof(struct delta_graph), return NULL);
+	graph->count = alpm_list_count(deltas);
+	CALLOC(graph->vertices, graph->count ? graph->count : 1,
+			sizeof(struct delta_vertex), graph_free(graph); return NULL);
+	CALLOC(keys, graph->count ? graph->count : 1, sizeof(struct delta_key),
+			graph_free(graph); return NULL);
+
 	/* create the vertices */
-	for(i = deltas; i; i = i->next) {
-		alpm_graph_t *v = _alpm_graph_new();
-		if(!v) {
-			alpm_list_free(vertices);
-			return NULL;
-		}
+	for(i = deltas, idx = 0; i; i = i->next, idx++) {
+		struct delta_vertex *v = graph->vertices + idx;
 		alpm_delta_t *vdelta = i->data;
 		vdelta->download_size = vdelta->delta_size;
 		v->weight = LONG_MAX;
-		v->data = vdelta;
-		vertices = alpm_list_add(vertices, v);
+		v->delta = vdelta;
+		v->parent = NO_VERTEX;
+		keys[idx].name = reverse ? vdelta->to : vdelta->from;
+		keys[idx].idx = idx;
 	}
+	qsort(keys, graph->count, sizeof(struct delta_key), delta_key_cmp);
 
 	/* compute the edges */
-	for(i = vertices; i; i = i->next) {
-		alpm_graph_t *v_i = i->data;
-		alpm_delta_t *d_i = v_i->data;
-		/* loop a second time so we make all possible comparisons */
-		for(j = vertices; j; j = j->next) {
-			alpm_graph_t *v_j = j->data;
-			alpm_delta_t *d_j = v_j->data;
-			/* We want to create a delta tree like the following:
-			 *          1_to_2
-			 *            |
-			 * 1_to_3   2_to_3
-			 *   \        /
-			 *     3_to_4
-			 * If J 'from' is equal to I 'to', then J is a child of I.
-			 * */
-			if((!reverse && strcmp(d_j->from, d_i->to) == 0) ||
-					(reverse && strcmp(d_j->to, d_i->from) == 0)) {
-				v_i->children = alpm_list_add(v_i->children, v_j);
+	for(idx = 0; idx < graph->count; idx++) {
+		struct delta_vertex *v = graph->vertices + idx;
+		/* We want to create a delta tree like the following:
+		 *          1_to_2
+		 *            |
+		 * 1_to_3   2_to_3
+		 *   \        /
+		 *     3_to_4
+		 * If J 'from' is equal to I 'to', then J is a child of I.
+		 * */
+		const char *name = reverse ? v->delta->from : v->delta->to;
+		size_t lo = 0, hi = graph->count, j;
+
+		/* find the first key with this name; keys with equal names are in
+		 * vertex order, so children end up in the order of the delta list */
+		while(lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if(strcmp(keys[mid].name, name) < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
 			}
 		}
-		v_i->childptr = v_i->children;
+		for(j = lo; j < graph->count && strcmp(keys[j].name, name) == 0; j++) {
+			v->nchildren++;
+		}
+		if(v->nchildren == 0) {
+			continue;
+		}
+		MALLOC(v->children, v->nchildren * sizeof(size_t),
+				free(keys); graph_free(graph); return NULL);
+		for(j = 0; j < v->nchildren; j++) {
+			v->children[j] = keys[lo + j].idx;
+		}
 	}
-	return vertices;
+	free(keys);
+	return graph;
 }
 
-static void graph_init_size(alpm_handle_t *handle, alpm_list_t *vertices)
+static void graph_init_size(alpm_handle_t *handle, struct delta_graph *graph)
 {
-	alpm_list_t *i;
+	size_t i;
 
-	for(i = vertices; i; i = i->next) {
+	for(i = 0; i < graph->count; i++) {
 		char *fpath, *md5sum;
-		alpm_graph_t *v = i->data;
-		alpm_delta_t *vdelta = v->data;
+		struct delta_vertex *v = graph->vertices + i;
+		alpm_delta_t *vdelta = v->delta;
 
 		/* determine whether the delta file already exists */
 		fpath = _alpm_filecache_find(handle, vdelta->delta);
@@ -119,69 +195,117 @@ static void graph_init_size(alpm_handle_t *handle, alpm_list_t *vertices)
 	}
 }
 
+/* heap order: smallest weight first, ties broken by position in the delta
+ * list so the chosen path does not depend on the heap layout */
+static int heap_less(struct delta_graph *graph, size_t a, size_t b)
+{
+	const struct delta_vertex *va = graph->vertices + a;
+	const struct delta_vertex *vb = graph->vertices + b;
+	return va->weight < vb->weight || (va->weight == vb->weight && a < b);
+}
 
-static void dijkstra(alpm_list_t *vertices)
+static void heap_swap(struct delta_graph *graph, size_t i, size_t j)
 {
-	alpm_list_t *i;
-	alpm_graph_t *v;
-	while(1) {
-		v = NULL;
-		/* find the smallest vertice not visited yet */
-		for(i = vertices; i; i = i->next) {
-			alpm_graph_t *v_i = i->data;
+	size_t tmp = graph->heap[i];
+	graph->heap[i] = graph->heap[j];
+	graph->heap[j] = tmp;
+	graph->vertices[graph->heap[i]].heappos = i;
+	graph->vertices[graph->heap[j]].heappos = j;
+}
 
-			if(v_i->state == -1) {
-				continue;
-			}
+static void heap_up(struct delta_graph *graph, size_t pos)
+{
+	while(pos > 0) {
+		size_t parent = (pos - 1) / 2;
+		if(!heap_less(graph, graph->heap[pos], graph->heap[parent])) {
+			break;
+		}
+		heap_swap(graph, pos, parent);
+		pos = parent;
+	}
+}
 
-			if(v == NULL || v_i->weight < v->weight) {
-				v = v_i;
-			}
+static void heap_down(struct delta_graph *graph, size_t pos)
+{
+	while(1) {
+		size_t left = 2 * pos + 1, right = left + 1, smallest = pos;
+		if(left < graph->heapsize
+				&& heap_less(graph, graph->heap[left], graph->heap[smallest])) {
+			smallest = left;
 		}
-		if(v == NULL || v->weight == LONG_MAX) {
+		if(right < graph->heapsize
+				&& heap_less(graph, graph->heap[right], graph->heap[smallest])) {
+			smallest = right;
+		}
+		if(smallest == pos) {
 			break;
 		}
+		heap_swap(graph, pos, smallest);
+		pos = smallest;
+	}
+}
 
-		v->state = -1;
-
-		v->childptr = v->children;
-		while(v->childptr) {
-			alpm_graph_t *v_c = v->childptr->data;
-			alpm_delta_t *d_c = v_c->data;
-			if(v_c->weight > v->weight + d_c->download_size) {
-				v_c->weight = v->weight + d_c->download_size;
-				v_c->parent = v;
-			}
+static int dijkstra(struct delta_graph *graph)
+{
+	size_t i;
+
+	MALLOC(graph->heap, (graph->count ? graph->count : 1) * sizeof(size_t),
+			return -1);
+	graph->heapsize = 0;
+	for(i = 0; i < graph->count; i++) {
+		graph->heap[graph->heapsize] = i;
+		graph->vertices[i].heappos = graph->heapsize++;
+		heap_up(graph, graph->heapsize - 1);
+	}
 
-			v->childptr = (v->childptr)->next;
+	while(graph->heapsize > 0) {
+		/* take the smallest vertex not visited yet */
+		size_t idx = graph->heap[0];
+		struct delta_vertex *v = graph->vertices + idx;
 
+		if(v->weight == LONG_MAX) {
+			break;
+		}
+		heap_swap(graph, 0, --graph->heapsize);
+		heap_down(graph, 0);
+		v->heappos = NO_VERTEX;
+
+		for(i = 0; i < v->nchildren; i++) {
+			struct delta_vertex *v_c = graph->vertices + v->children[i];
+			if(v_c->weight > v->weight + v_c->delta->download_size) {
+				v_c->weight = v->weight + v_c->delta->download_size;
+				v_c->parent = idx;
+				if(v_c->heappos != NO_VERTEX) {
+					heap_up(graph, v_c->heappos);
+				}
+			}
 		}
 	}
+	return 0;
 }
 
-static off_t shortest_path(alpm_list_t *vertices, const char *to, alpm_list_t **path)
+static off_t shortest_path(struct delta_graph *graph, const char *to,
+		alpm_list_t **path)
 {
-	alpm_list_t *i;
-	alpm_graph_t *v = NULL;
+	size_t i, best = NO_VERTEX;
 	off_t bestsize = 0;
 	alpm_list_t *rpath = NULL;
 
-	for(i = vertices; i; i = i->next) {
-		alpm_graph_t *v_i = i->data;
-		alpm_delta_t *d_i = v_i->data;
+	for(i = 0; i < graph->count; i++) {
+		struct delta_vertex *v_i = graph->vertices + i;
 
-		if(strcmp(d_i->to, to) == 0) {
-			if(v == NULL || v_i->weight < v->weight) {
-				v = v_i;
-				bestsize = v->weight;
+		if(strcmp(v_i->delta->to, to) == 0) {
+			if(best == NO_VERTEX || v_i->weight < graph->vertices[best].weight) {
+				best = i;
+				bestsize = v_i->weight;
 			}
 		}
 	}
 
-	while(v != NULL) {
-		alpm_delta_t *vdelta = v->data;
-		rpath = alpm_list_add(rpath, vdelta);
-		v = v->parent;
+	while(best != NO_VERTEX) {
+		struct delta_vertex *v = graph->vertices + best;
+		rpath = alpm_list_add(rpath, v->delta);
+		best = v->parent;
 	}
 	*path = alpm_list_reverse(rpath);
 	alpm_list_free(rpath);
@@ -204,7 +328,7 @@ off_t _alpm_shortest_delta_path(alpm_handle_t *handle, alpm_list_t *deltas,
 		const char *to, alpm_list_t **path)
 {
 	alpm_list_t *bestpath = NULL;
-	alpm_list_t *vertices;
+	struct delta_graph *graph;
 	off_t bestsize = LONG_MAX;
 
 	if(deltas == NULL) {
@@ -214,15 +338,22 @@ off_t _alpm_shortest_delta_path(alpm_handle_t *handle, alpm_list_t *deltas,
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "started delta shortest-path search for '%s'\n", to);
 
-	vertices = graph_init(deltas, 0);
-	graph_init_size(handle, vertices);
-	dijkstra(vertices);
-	bestsize = shortest_path(vertices, to, &bestpath);
+	graph = graph_init(deltas, 0);
+	if(graph == NULL) {
+		*path = NULL;
+		return bestsize;
+	}
+	graph_init_size(handle, graph);
+	if(dijkstra(graph) != 0) {
+		graph_free(graph);
+		*path = NULL;
+		return bestsize;
+	}
+	bestsize = shortest_path(graph, to, &bestpath);
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "delta shortest-path search complete : '%jd'\n", (intmax_t)bestsize);
 
-	alpm_list_free_inner(vertices, _alpm_graph_free);
-	alpm_list_free(vertices);
+	graph_free(graph);
 
 	*path = bestpath;
 	return bestsize;
@@ -231,28 +362,32 @@ off_t _alpm_shortest_delta_path(alpm_handle_t *handle, alpm_list_t *deltas,
 static alpm_list_t *find_unused(alpm_list_t *deltas, const char *to, off_t quota)
 {
 	alpm_list_t *unused = NULL;
-	alpm_list_t *vertices;
-	alpm_list_t *i;
-	vertices = graph_init(deltas, 1);
+	struct delta_graph *graph;
+	size_t i;
+
+	graph = graph_init(deltas, 1);
+	if(graph == NULL) {
+		return NULL;
+	}
 
-	for(i = vertices; i; i = i->next) {
-		alpm_graph_t *v = i->data;
-		alpm_delta_t *vdelta = v->data;
-		if(strcmp(vdelta->to, to) == 0)
+	for(i = 0; i < graph->count; i++) {
+		struct delta_vertex *v = graph->vertices + i;
+		if(strcmp(v->delta->to, to) == 0)
 		{
-			v->weight = vdelta->download_size;
+			v->weight = v->delta->download_size;
 		}
 	}
-	dijkstra(vertices);
-	for(i = vertices; i; i = i->next) {
-		alpm_graph_t *v = i->data;
-		alpm_delta_t *vdelta = v->data;
+	if(dijkstra(graph) != 0) {
+		graph_free(graph);
+		return NULL;
+	}
+	for(i = 0; i < graph->count; i++) {
+		struct delta_vertex *v = graph->vertices + i;
 		if(v->weight > quota) {
-			unused = alpm_list_add(unused, vdelta->delta);
+			unused = alpm_list_add(unused, v->delta->delta);
 		}
 	}
-	alpm_list_free_inner(vertices, _alpm_graph_free);
-	alpm_list_free(vertices);
+	graph_free(graph);
 	return unused;
 }
 
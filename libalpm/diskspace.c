@@ -49,6 +49,9 @@
 #include "log.h"
 #include "trans.h"
 #include "handle.h"
+#include "package.h"
+#include "backup.h"
+#include "globset.h"
 
 static int mount_point_cmp(const void *p1, const void *p2)
 {
@@ -184,63 +187,440 @@ static alpm_list_t *mount_point_list(alpm_handle_t *handle)
 	return mount_points;
 }
 
-static alpm_mountpoint_t *match_mount_point(const alpm_list_t *mount_points,
+/* Mount points are kept in a tree of path components, so finding the one
+ * holding a path takes one step per component of the path instead of a
+ * comparison with every mount point. */
+struct mount_node {
+	char *name;                    /* path component */
+	size_t len;
+	alpm_mountpoint_t *mp;         /* mounted exactly here, if anything */
+	struct mount_node *children;   /* sorted by name */
+	size_t count;
+};
+
+/* where the directory of the last file looked up led to */
+struct mount_dir_cache {
+	const char *dir;               /* a file list entry starting with it */
+	size_t len;
+	const struct mount_node *node; /* NULL once the walk left the tree */
+	alpm_mountpoint_t *mp;
+};
+
+static int mount_node_cmp(const struct mount_node *node, const char *name,
+		size_t len)
+{
+	int cmp = memcmp(node->name, name, node->len < len ? node->len : len);
+	if(cmp == 0) {
+		cmp = (node->len > len) - (node->len < len);
+	}
+	return cmp;
+}
+
+/* index of the child called name, or of where it would go if missing */
+static size_t mount_node_find(const struct mount_node *node, const char *name,
+		size_t len, int *found)
+{
+	size_t lo = 0, hi = node->count;
+
+	*found = 0;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = mount_node_cmp(node->children + mid, name, len);
+		if(cmp == 0) {
+			*found = 1;
+			return mid;
+		} else if(cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static const struct mount_node *mount_node_child(const struct mount_node *node,
+		const char *name, size_t len)
+{
+	int found;
+	size_t idx = mount_node_find(node, name, len, &found);
+	return found ? node->children + idx : NULL;
+}
+
+static void mount_node_free(struct mount_node *node)
+{
+	size_t i;
+
+	for(i = 0; i < node->count; i++) {
+		mount_node_free(node->children + i);
+	}
+	free(node->children);
+	free(node->name);
+}
+
+static int mount_node_add(struct mount_node *node, alpm_mountpoint_t *mp)
+{
+	const char *path = mp->mount_dir;
+
+	while(*path) {
+		size_t len = strcspn(path, "/"), idx;
+		int found;
+
+		if(len == 0) {
+			path++;
+			continue;
+		}
+		idx = mount_node_find(node, path, len, &found);
+		if(!found) {
+			struct mount_node *children, *child;
+			children = realloc(node->children,
+					(node->count + 1) * sizeof(struct mount_node));
+			if(children == NULL) {
+				_alpm_alloc_fail((node->count + 1) * sizeof(struct mount_node));
+				return -1;
+			}
+			node->children = children;
+			memmove(children + idx + 1, children + idx,
+					(node->count - idx) * sizeof(struct mount_node));
+			node->count++;
+			child = children + idx;
+			memset(child, 0, sizeof(struct mount_node));
+			STRNDUP(child->name, path, len, return -1);
+			child->len = len;
+		}
+		node = node->children + idx;
+		path += len;
+	}
+
+	/* when a directory is mounted over, the first entry wins as it always did */
+	if(node->mp == NULL) {
+		node->mp = mp;
+	}
+	return 0;
+}
+
+/** Build the tree of a list of mount points.
+ * @param tree the root node to fill in
+ * @param mount_points list of alpm_mountpoint_t
+ * @return 0 on success, -1 on allocation failure
+ */
+static int mount_point_tree(struct mount_node *tree,
+		const alpm_list_t *mount_points)
+{
+	const alpm_list_t *i;
+
+	memset(tree, 0, sizeof(struct mount_node));
+	for(i = mount_points; i; i = i->next) {
+		alpm_mountpoint_t *mp = i->data;
+		/* swap and the like are listed without a directory */
+		if(mp->mount_dir == NULL || mp->mount_dir[0] != '/') {
+			continue;
+		}
+		if(mount_node_add(tree, mp) != 0) {
+			mount_node_free(tree);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* follow len bytes of path down from node, remembering the deepest mount
+ * point passed in *mp; returns NULL when the path leaves the tree */
+static const struct mount_node *mount_walk(const struct mount_node *node,
+		const char *path, size_t len, alpm_mountpoint_t **mp)
+{
+	const char *end = path + len;
+
+	while(node && path < end) {
+		size_t clen = 0;
+
+		while(path + clen < end && path[clen] != '/') {
+			clen++;
+		}
+		if(clen > 0) {
+			node = mount_node_child(node, path, clen);
+			if(node && node->mp) {
+				*mp = node->mp;
+			}
+		}
+		path += clen + (path + clen < end);
+	}
+	return node;
+}
+
+static alpm_mountpoint_t *match_mount_point(const struct mount_node *tree,
 		const char *real_path)
 {
-	const alpm_list_t *mp;
-
-	for(mp = mount_points; mp != NULL; mp = mp->next) {
-		alpm_mountpoint_t *data = mp->data;
-
-		/* first, check if the prefix matches */
-		if(strncmp(data->mount_dir, real_path, data->mount_dir_len) == 0) {
-			/* now, the hard work- a file like '/etc/myconfig' shouldn't map to a
-			 * mountpoint '/e', but only '/etc'. If the mountpoint ends in a trailing
-			 * slash, we know we didn't have a mismatch, otherwise we have to do some
-			 * more sanity checks. */
-			if(data->mount_dir[data->mount_dir_len - 1] == '/') {
-				return data;
-			} else if(strlen(real_path) >= data->mount_dir_len) {
-				const char next = real_path[data->mount_dir_len];
-				if(next == '/' || next == '\0') {
-					return data;
-				}
+	alpm_mountpoint_t *mp = tree->mp;
+	mount_walk(tree, real_path, strlen(real_path), &mp);
+	return mp;
+}
+
+/** Find the mount point holding a file of a package. Files of the same
+ * directory usually follow each other in a file list, so the walk down to
+ * their directory is only done when the directory changes.
+ * @param handle the context handle
+ * @param tree mount point tree
+ * @param cache directory of the previous file, zeroed before the first one
+ * @param filename file list entry
+ * @return the mount point, NULL if none was found
+ */
+static alpm_mountpoint_t *file_mount_point(alpm_handle_t *handle,
+		const struct mount_node *tree, struct mount_dir_cache *cache,
+		const char *filename)
+{
+	const char *base = strrchr(filename, '/');
+	size_t len = base ? (size_t)(base - filename) + 1 : 0;
+	const struct mount_node *child;
+
+	if(cache->dir == NULL || cache->len != len
+			|| strncmp(cache->dir, filename, len) != 0) {
+		cache->mp = tree->mp;
+		cache->node = mount_walk(tree, handle->root, strlen(handle->root),
+				&cache->mp);
+		cache->node = mount_walk(cache->node, filename, len, &cache->mp);
+		cache->dir = filename;
+		cache->len = len;
+	}
+
+	/* a file can be mounted over as well */
+	if(cache->node && filename[len]) {
+		child = mount_node_child(cache->node, filename + len, strlen(filename + len));
+		if(child && child->mp) {
+			return child->mp;
+		}
+	}
+	return cache->mp;
+}
+
+/* lazy load filesystem info, 0 if the mount can be checked */
+static int mount_point_ready(alpm_handle_t *handle, alpm_mountpoint_t *mp)
+{
+	/* don't check a mount that we know we can't stat */
+	if(mp->fsinfo_loaded == MOUNT_FSINFO_FAIL) {
+		return -1;
+	}
+	if(mp->fsinfo_loaded == MOUNT_FSINFO_UNLOADED) {
+		return mount_point_load_fsinfo(handle, mp) < 0 ? -1 : 0;
+	}
+	return 0;
+}
+
+/* Whether the size recorded for an installed file may not be what it takes
+ * on disk: backup files get edited and NoExtract ones were never written. */
+static int removed_size_unknown(alpm_handle_t *handle, alpm_pkg_t *pkg,
+		const char *filename)
+{
+	return _alpm_needbackup(filename, pkg) != NULL
+		|| _alpm_globset_match(handle->trans->noextract, filename);
+}
+
+/* replace the recorded size of a file counted in a removal summary with
+ * the one it has on disk */
+static void correct_removed_file(alpm_handle_t *handle,
+		const struct mount_node *mount_tree, struct mount_dir_cache *cache,
+		const alpm_file_t *file)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	alpm_mountpoint_t *mp;
+	off_t recorded, actual = 0;
+
+	if(S_ISDIR(file->mode) || S_ISLNK(file->mode) || file->name[0] == '.') {
+		return;
+	}
+	mp = file_mount_point(handle, mount_tree, cache, file->name);
+	if(mp == NULL || mount_point_ready(handle, mp) != 0) {
+		return;
+	}
+
+	snprintf(path, PATH_MAX, "%s%s", handle->root, file->name);
+	if(_alpm_lstat(path, &st) == 0 && !S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode)) {
+		actual = (st.st_size + DIRSIZE_BLOCK - 1) / DIRSIZE_BLOCK * DIRSIZE_BLOCK;
+	}
+	recorded = (file->size + DIRSIZE_BLOCK - 1) / DIRSIZE_BLOCK * DIRSIZE_BLOCK;
+	mp->blocks_needed += (recorded - actual) / (off_t)mp->fsp.f_bsize;
+}
+
+/* the summaries of an installed package count every file at its packaged
+ * size; look at those whose size on disk may differ */
+static void correct_removed_dirsizes(alpm_handle_t *handle,
+		const struct mount_node *mount_tree, alpm_pkg_t *pkg)
+{
+	alpm_filelist_t *filelist = alpm_pkg_get_files(pkg);
+	struct mount_dir_cache cache;
+	alpm_list_t *i;
+	size_t f;
+
+	memset(&cache, 0, sizeof(cache));
+	for(i = alpm_pkg_get_backup(pkg); i; i = i->next) {
+		const alpm_backup_t *backup = i->data;
+		const alpm_file_t *file = alpm_filelist_contains(filelist, backup->name);
+		if(file) {
+			correct_removed_file(handle, mount_tree, &cache, file);
+		}
+	}
+	if(handle->noextract == NULL) {
+		return;
+	}
+	for(f = 0; f < filelist->count; f++) {
+		const alpm_file_t *file = filelist->files + f;
+		if(_alpm_globset_match(handle->trans->noextract, file->name)
+				&& !_alpm_needbackup(file->name, pkg)) {
+			correct_removed_file(handle, mount_tree, &cache, file);
+		}
+	}
+}
+
+/* approximate space requirements for db entries, as for single files */
+static void calculate_dbentry_size(alpm_handle_t *handle,
+		const struct mount_node *mount_tree, alpm_pkg_t *pkg)
+{
+	alpm_filelist_t *filelist = alpm_pkg_get_files(pkg);
+	alpm_mountpoint_t *mp = NULL;
+	size_t f;
+
+	for(f = 0; f < filelist->count; f++) {
+		const alpm_file_t *file = filelist->files + f;
+
+		if(file->name[0] != '.' || S_ISDIR(file->mode) || S_ISLNK(file->mode)) {
+			continue;
+		}
+		if(mp == NULL) {
+			char path[PATH_MAX];
+			snprintf(path, PATH_MAX, "%s%s", handle->root, handle->dbpath);
+			mp = match_mount_point(mount_tree, path);
+			if(mp == NULL) {
+				_alpm_log(handle, ALPM_LOG_WARNING,
+						_("could not determine mount point for file %s\n"), handle->dbpath);
+				return;
+			}
+			if(mount_point_ready(handle, mp) != 0) {
+				return;
 			}
 		}
+		mp->blocks_needed += (file->size + mp->fsp.f_bsize - 1) / mp->fsp.f_bsize;
+		mp->used |= USED_INSTALL;
+	}
+}
+
+/** Account for the files of a package through its disk usage summaries.
+ * @param handle the context handle
+ * @param mount_tree mount point tree
+ * @param pkg the package
+ * @param install whether the package is installed or removed
+ * @return 0 on success, 1 if the package lacks summaries, has some that
+ * span several mount points or on a mount with blocks of another size than
+ * the summaries are rounded to, so its files have to be looked at one by one
+ */
+static int calculate_size_from_dirsizes(alpm_handle_t *handle,
+		const struct mount_node *mount_tree, alpm_pkg_t *pkg, int install)
+{
+	alpm_list_t *dirsizes = _alpm_pkg_get_dirsizes(pkg), *i;
+	alpm_mountpoint_t *root_mp = mount_tree->mp;
+	const struct mount_node *root;
+
+	if(dirsizes == NULL) {
+		return 1;
+	}
+	root = mount_walk(mount_tree, handle->root, strlen(handle->root), &root_mp);
+	for(i = dirsizes; i; i = i->next) {
+		const alpm_dirsize_t *dirsize = i->data;
+		alpm_mountpoint_t *mp = root_mp;
+		const struct mount_node *node = mount_walk(root, dirsize->name,
+				strlen(dirsize->name), &mp);
+		/* something is mounted below the directory */
+		if(node && node->count) {
+			return 1;
+		}
+		/* rounding each file up to DIRSIZE_BLOCK says nothing about how many
+		 * blocks of another size it takes */
+		if(mp && mount_point_ready(handle, mp) == 0
+				&& mp->fsp.f_bsize != DIRSIZE_BLOCK) {
+			return 1;
+		}
+	}
+
+	for(i = dirsizes; i; i = i->next) {
+		const alpm_dirsize_t *dirsize = i->data;
+		alpm_mountpoint_t *mp = root_mp;
+		blkcnt_t blocks;
+
+		mount_walk(root, dirsize->name, strlen(dirsize->name), &mp);
+		if(mp == NULL) {
+			_alpm_log(handle, ALPM_LOG_WARNING,
+					_("could not determine mount point for file %s\n"), dirsize->name);
+			continue;
+		}
+
+		if(mount_point_ready(handle, mp) != 0) {
+			continue;
+		}
+
+		blocks = dirsize->usage / mp->fsp.f_bsize;
+		if(install) {
+			mp->blocks_needed += blocks;
+			mp->used |= USED_INSTALL;
+		} else {
+			mp->blocks_needed -= blocks;
+			mp->used |= USED_REMOVE;
+		}
 	}
 
-	/* should not get here... */
-	return NULL;
+	if(install) {
+		calculate_dbentry_size(handle, mount_tree, pkg);
+	} else {
+		correct_removed_dirsizes(handle, mount_tree, pkg);
+	}
+
+	return 0;
 }
 
 static int calculate_removed_size(alpm_handle_t *handle,
-		const alpm_list_t *mount_points, alpm_pkg_t *pkg)
+		const struct mount_node *mount_tree, alpm_pkg_t *pkg)
 {
 	size_t i;
-	alpm_filelist_t *filelist = alpm_pkg_get_files(pkg);
+	alpm_filelist_t *filelist;
+	struct mount_dir_cache cache;
 
+	if(calculate_size_from_dirsizes(handle, mount_tree, pkg, 0) == 0) {
+		return 0;
+	}
+
+	filelist = alpm_pkg_get_files(pkg);
 	if(!filelist->count) {
 		return 0;
 	}
 
+	memset(&cache, 0, sizeof(cache));
 	for(i = 0; i < filelist->count; i++) {
 		const alpm_file_t *file = filelist->files + i;
 		alpm_mountpoint_t *mp;
-		struct stat st;
-		char path[PATH_MAX];
 		blkcnt_t remove_size;
+		off_t size = file->size;
+		mode_t mode = file->mode;
 		const char *filename = file->name;
 
-		snprintf(path, PATH_MAX, "%s%s", handle->root, filename);
-		_alpm_lstat(path, &st);
+		/* the local database knows sizes and types of files installed since
+		 * it started recording them; look at the others, and at those that
+		 * may not have their packaged size on disk */
+		if(mode == 0 || removed_size_unknown(handle, pkg, filename)) {
+			char path[PATH_MAX];
+			struct stat st;
+			snprintf(path, PATH_MAX, "%s%s", handle->root, filename);
+			if(_alpm_lstat(path, &st) != 0) {
+				continue;
+			}
+			size = st.st_size;
+			mode = st.st_mode;
+		}
 
 		/* skip directories and symlinks to be consistent with libarchive that
 		 * reports them to be zero size */
-		if(S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode)) {
+		if(S_ISDIR(mode) || S_ISLNK(mode)) {
 			continue;
 		}
 
-		mp = match_mount_point(mount_points, path);
+		mp = file_mount_point(handle, mount_tree, &cache, filename);
 		if(mp == NULL) {
 			_alpm_log(handle, ALPM_LOG_WARNING,
 					_("could not determine mount point for file %s\n"), filename);
@@ -260,7 +640,7 @@ static int calculate_removed_size(alpm_handle_t *handle,
 		}
 
 		/* the addition of (divisor - 1) performs ceil() with integer division */
-		remove_size = (st.st_size + mp->fsp.f_bsize - 1) / mp->fsp.f_bsize;
+		remove_size = (size + mp->fsp.f_bsize - 1) / mp->fsp.f_bsize;
 		mp->blocks_needed -= remove_size;
 		mp->used |= USED_REMOVE;
 	}
@@ -269,19 +649,25 @@ static int calculate_removed_size(alpm_handle_t *handle,
 }
 
 static int calculate_installed_size(alpm_handle_t *handle,
-		const alpm_list_t *mount_points, alpm_pkg_t *pkg)
+		const struct mount_node *mount_tree, alpm_pkg_t *pkg)
 {
 	size_t i;
-	alpm_filelist_t *filelist = alpm_pkg_get_files(pkg);
+	alpm_filelist_t *filelist;
+	struct mount_dir_cache cache;
+
+	if(calculate_size_from_dirsizes(handle, mount_tree, pkg, 1) == 0) {
+		return 0;
+	}
 
+	filelist = alpm_pkg_get_files(pkg);
 	if(!filelist->count) {
 		return 0;
 	}
 
+	memset(&cache, 0, sizeof(cache));
 	for(i = 0; i < filelist->count; i++) {
 		const alpm_file_t *file = filelist->files + i;
 		alpm_mountpoint_t *mp;
-		char path[PATH_MAX];
 		blkcnt_t install_size;
 		const char *filename = file->name;
 
@@ -294,12 +680,13 @@ static int calculate_installed_size(alpm_handle_t *handle,
 
 		/* approximate space requirements for db entries */
 		if(filename[0] == '.') {
+			char path[PATH_MAX];
 			filename = handle->dbpath;
+			snprintf(path, PATH_MAX, "%s%s", handle->root, filename);
+			mp = match_mount_point(mount_tree, path);
+		} else {
+			mp = file_mount_point(handle, mount_tree, &cache, filename);
 		}
-
-		snprintf(path, PATH_MAX, "%s%s", handle->root, filename);
-
-		mp = match_mount_point(mount_points, path);
 		if(mp == NULL) {
 			_alpm_log(handle, ALPM_LOG_WARNING,
 					_("could not determine mount point for file %s\n"), filename);
@@ -352,6 +739,7 @@ int _alpm_check_downloadspace(alpm_handle_t *handle, const char *cachedir,
 		size_t num_files, off_t *file_sizes)
 {
 	alpm_list_t *mount_points;
+	struct mount_node mount_tree;
 	alpm_mountpoint_t *cachedir_mp;
 	char resolved_cachedir[PATH_MAX];
 	size_t j;
@@ -369,8 +757,12 @@ int _alpm_check_downloadspace(alpm_handle_t *handle, const char *cachedir,
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not determine filesystem mount points\n"));
 		return -1;
 	}
+	if(mount_point_tree(&mount_tree, mount_points) != 0) {
+		mount_point_list_free(mount_points);
+		RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+	}
 
-	cachedir_mp = match_mount_point(mount_points, cachedir);
+	cachedir_mp = match_mount_point(&mount_tree, cachedir);
 	if(cachedir_mp == NULL) {
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not determine cachedir mount point %s\n"),
 				cachedir);
@@ -399,6 +791,7 @@ int _alpm_check_downloadspace(alpm_handle_t *handle, const char *cachedir,
 	}
 
 finish:
+	mount_node_free(&mount_tree);
 	mount_point_list_free(mount_points);
 
 	if(error) {
@@ -411,6 +804,7 @@ finish:
 int _alpm_check_diskspace(alpm_handle_t *handle)
 {
 	alpm_list_t *mount_points, *i;
+	struct mount_node mount_tree;
 	alpm_mountpoint_t *root_mp;
 	size_t replaces = 0, current = 0, numtargs;
 	int error = 0;
@@ -423,7 +817,11 @@ int _alpm_check_diskspace(alpm_handle_t *handle)
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not determine filesystem mount points\n"));
 		return -1;
 	}
-	root_mp = match_mount_point(mount_points, handle->root);
+	if(mount_point_tree(&mount_tree, mount_points) != 0) {
+		mount_point_list_free(mount_points);
+		RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+	}
+	root_mp = match_mount_point(&mount_tree, handle->root);
 	if(root_mp == NULL) {
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not determine root mount point %s\n"),
 				handle->root);
@@ -441,7 +839,7 @@ int _alpm_check_diskspace(alpm_handle_t *handle)
 					numtargs, current);
 
 			local_pkg = targ->data;
-			calculate_removed_size(handle, mount_points, local_pkg);
+			calculate_removed_size(handle, &mount_tree, local_pkg);
 		}
 	}
 
@@ -455,9 +853,9 @@ int _alpm_check_diskspace(alpm_handle_t *handle)
 		/* is this package already installed? */
 		local_pkg = _alpm_db_get_pkgfromcache(handle->db_local, pkg->name);
 		if(local_pkg) {
-			calculate_removed_size(handle, mount_points, local_pkg);
+			calculate_removed_size(handle, &mount_tree, local_pkg);
 		}
-		calculate_installed_size(handle, mount_points, pkg);
+		calculate_installed_size(handle, &mount_tree, pkg);
 
 		for(i = mount_points; i; i = i->next) {
 			alpm_mountpoint_t *data = i->data;
@@ -482,6 +880,7 @@ int _alpm_check_diskspace(alpm_handle_t *handle)
 	}
 
 finish:
+	mount_node_free(&mount_tree);
 	mount_point_list_free(mount_points);
 
 	if(error) {
@@ -0,0 +1,1071 @@
+/*
+ *  diskwriter.c
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A replacement for libarchive's disk writer working with directory file
+ * descriptors. libarchive resolves every path from the working directory,
+ * which forced extraction to chdir() into the root and made it a process
+ * wide affair. Here every entry is created with the *at() system calls
+ * relative to a cached descriptor of its parent directory. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* libarchive */
+#include <archive.h>
+#include <archive_entry.h>
+
+/* libalpm */
+#include "diskwriter.h"
+#include "alpm_list.h"
+#include "util.h"
+
+/* number of directory descriptors kept open */
+#define DW_CACHE_SIZE 32
+
+/* tells the temporary names of writers apart, held files of one writer
+ * may still be around while the next one writes */
+static pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int serial_next;
+
+struct dw_dirfd {
+	char *key;    /* relative path, prefixed by '/' if outside of the base */
+	int fd;
+};
+
+/* what is restored besides the contents */
+struct dw_meta {
+	mode_t type;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec times[2];
+};
+
+/* a file written under a temporary name, waiting to replace name */
+struct dw_pending {
+	int outside;
+	char *parent;
+	char *tmpname;
+	char *name;
+};
+
+/* directories get their final permissions and times once all their
+ * contents are written, like libarchive does */
+struct dw_fixup {
+	int outside;
+	char *path;
+	struct dw_meta meta;
+};
+
+struct __alpm_diskwriter_t {
+	char *base;          /* with a trailing slash */
+	size_t baselen;
+	int basefd;
+	int slashfd;         /* "/", for absolute paths outside of the base */
+	int flags;
+	uid_t euid;
+	struct dw_dirfd cache[DW_CACHE_SIZE];
+	alpm_list_t *fixups; /* in creation order */
+	alpm_list_t *pending; /* in creation order */
+	unsigned int serial;
+	unsigned int tmpcount;
+
+	/* the entry being written */
+	struct archive_entry *entry;
+	int fd;
+	int64_t end;
+
+	/* digests of the contents written so far: sha256 if DISKWRITER_SHA256
+	 * is set, md5 if requested for the entry with _alpm_diskwriter_want_md5();
+	 * hashed is -1 when the data did not arrive in order */
+	alpm_digest_t *digest;
+	alpm_digest_t *md5;
+	int want_md5;
+	int64_t hashed;
+	char *sha256sum;
+	char *md5sum;
+
+	int errnum;
+	char errstr[PATH_MAX + 128];
+};
+
+static int dw_error(alpm_diskwriter_t *dw, int errnum, int ret,
+		const char *fmt, ...)
+{
+	va_list args;
+	size_t len;
+
+	va_start(args, fmt);
+	vsnprintf(dw->errstr, sizeof(dw->errstr), fmt, args);
+	va_end(args);
+	len = strlen(dw->errstr);
+	if(errnum != 0) {
+		snprintf(dw->errstr + len, sizeof(dw->errstr) - len, ": %s", strerror(errnum));
+	}
+	dw->errnum = errnum;
+	return ret;
+}
+
+/** Create a writer for a base directory.
+ * @param base the base directory, which has to exist
+ * @param flags DISKWRITER_* flags telling which metadata to restore
+ * @return the writer, NULL on error with errno set
+ */
+alpm_diskwriter_t *_alpm_diskwriter_new(const char *base, int flags)
+{
+	alpm_diskwriter_t *dw;
+	size_t len = strlen(base);
+
+	CALLOC(dw, 1, sizeof(alpm_diskwriter_t), return NULL);
+	MALLOC(dw->base, len + 2, free(dw); return NULL);
+	strcpy(dw->base, base);
+	if(len == 0 || base[len - 1] != '/') {
+		dw->base[len++] = '/';
+		dw->base[len] = '\0';
+	}
+	dw->baselen = len;
+	dw->basefd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dw->basefd < 0) {
+		free(dw->base);
+		free(dw);
+		return NULL;
+	}
+	dw->slashfd = -1;
+	dw->flags = flags;
+	dw->euid = geteuid();
+	dw->fd = -1;
+	pthread_mutex_lock(&serial_lock);
+	dw->serial = ++serial_next;
+	pthread_mutex_unlock(&serial_lock);
+	if(flags & DISKWRITER_SHA256) {
+		dw->digest = _alpm_digest_new(ALPM_PKG_VALIDATION_SHA256SUM);
+		if(dw->digest == NULL) {
+			close(dw->basefd);
+			free(dw->base);
+			free(dw);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	return dw;
+}
+
+static int anchor_fd(alpm_diskwriter_t *dw, int outside)
+{
+	if(!outside) {
+		return dw->basefd;
+	}
+	if(dw->slashfd < 0) {
+		dw->slashfd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	return dw->slashfd;
+}
+
+static void flush_cache(alpm_diskwriter_t *dw)
+{
+	int i;
+
+	for(i = 0; i < DW_CACHE_SIZE; i++) {
+		if(dw->cache[i].key) {
+			close(dw->cache[i].fd);
+			FREE(dw->cache[i].key);
+		}
+	}
+}
+
+/* Copy the part of path relative to its anchor into buf: paths below the
+ * base are relative to the base, other absolute paths to "/" */
+static int relative_path(alpm_diskwriter_t *dw, const char *path, char *buf,
+		int *outside)
+{
+	const char *rel;
+	size_t len;
+
+	if(strncmp(path, dw->base, dw->baselen) == 0) {
+		rel = path + dw->baselen;
+		*outside = 0;
+	} else if(path[0] == '/') {
+		rel = path + 1;
+		*outside = 1;
+	} else {
+		rel = path;
+		*outside = 0;
+	}
+	while(rel[0] == '.' && rel[1] == '/') {
+		rel += 2;
+	}
+	while(*rel == '/') {
+		rel++;
+	}
+
+	len = strlen(rel);
+	if(len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(buf, rel, len + 1);
+	while(len > 0 && buf[len - 1] == '/') {
+		buf[--len] = '\0';
+	}
+	return 0;
+}
+
+/* get a descriptor of a directory relative to an anchor, creating it and
+ * its parents if missing; dir is modified during the call */
+static int get_dirfd(alpm_diskwriter_t *dw, int outside, char *dir)
+{
+	char key[PATH_MAX + 1];
+	struct dw_dirfd *slot;
+	char *slash, *name;
+	int parentfd, fd;
+
+	if(*dir == '\0') {
+		return anchor_fd(dw, outside);
+	}
+
+	snprintf(key, sizeof(key), "%s%s", outside ? "/" : "", dir);
+	slot = dw->cache + _alpm_hash_sdbm(key) % DW_CACHE_SIZE;
+	if(slot->key && strcmp(slot->key, key) == 0) {
+		return slot->fd;
+	}
+
+	slash = strrchr(dir, '/');
+	if(slash) {
+		*slash = '\0';
+		parentfd = get_dirfd(dw, outside, dir);
+		*slash = '/';
+		name = slash + 1;
+	} else {
+		parentfd = anchor_fd(dw, outside);
+		name = dir;
+	}
+	if(parentfd < 0) {
+		return -1;
+	}
+
+	fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0 && errno == ENOENT) {
+		/* missing parents are created with default permissions */
+		if(mkdirat(parentfd, name, 0755) != 0 && errno != EEXIST) {
+			return -1;
+		}
+		fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if(fd < 0) {
+		return -1;
+	}
+
+	/* the slot may hold the parent, which is no longer needed */
+	if(slot->key) {
+		close(slot->fd);
+		free(slot->key);
+	}
+	slot->key = strdup(key);
+	if(slot->key == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	slot->fd = fd;
+	return fd;
+}
+
+/* resolve path to a descriptor of its parent directory and the name of
+ * the entry in there; buf holds the relative path with the last slash
+ * replaced by a nul byte */
+static int open_parent(alpm_diskwriter_t *dw, const char *path, char *buf,
+		char **name, int *outside)
+{
+	char *slash;
+	int fd;
+
+	if(relative_path(dw, path, buf, outside) != 0) {
+		return -1;
+	}
+	slash = strrchr(buf, '/');
+	if(slash == NULL) {
+		*name = buf;
+		return anchor_fd(dw, *outside);
+	}
+	*slash = '\0';
+	fd = get_dirfd(dw, *outside, buf);
+	*name = slash + 1;
+	return fd;
+}
+
+/* forget the descriptors of a removed directory and its subdirectories */
+static void invalidate(alpm_diskwriter_t *dw, int outside, const char *parent,
+		const char *name)
+{
+	char key[PATH_MAX + 2];
+	size_t len;
+	int i;
+
+	snprintf(key, sizeof(key), "%s%s%s%s", outside ? "/" : "", parent,
+			*parent ? "/" : "", name);
+	len = strlen(key);
+	for(i = 0; i < DW_CACHE_SIZE; i++) {
+		const char *k = dw->cache[i].key;
+		if(k && strncmp(k, key, len) == 0 && (k[len] == '\0' || k[len] == '/')) {
+			close(dw->cache[i].fd);
+			FREE(dw->cache[i].key);
+		}
+	}
+}
+
+/* remove what is in the way of a new entry; parent is the path of the
+ * directory dirfd refers to, for keeping the cache right */
+static int remove_existing(alpm_diskwriter_t *dw, int dirfd, const char *name,
+		int outside, const char *parent)
+{
+	if(unlinkat(dirfd, name, 0) == 0 || errno == ENOENT) {
+		return 0;
+	}
+	if(errno == EISDIR && unlinkat(dirfd, name, AT_REMOVEDIR) == 0) {
+		invalidate(dw, outside, parent, name);
+		return 0;
+	}
+	return -1;
+}
+
+static int is_dir(int dirfd, const char *name)
+{
+	struct stat st;
+	return fstatat(dirfd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void entry_meta(struct archive_entry *entry, struct dw_meta *meta)
+{
+	meta->type = archive_entry_filetype(entry);
+	meta->mode = archive_entry_perm(entry);
+	meta->uid = archive_entry_uid(entry);
+	meta->gid = archive_entry_gid(entry);
+	if(archive_entry_atime_is_set(entry)) {
+		meta->times[0].tv_sec = archive_entry_atime(entry);
+		meta->times[0].tv_nsec = archive_entry_atime_nsec(entry);
+	} else {
+		meta->times[0].tv_sec = 0;
+		meta->times[0].tv_nsec = UTIME_NOW;
+	}
+	if(archive_entry_mtime_is_set(entry)) {
+		meta->times[1].tv_sec = archive_entry_mtime(entry);
+		meta->times[1].tv_nsec = archive_entry_mtime_nsec(entry);
+	} else {
+		meta->times[1].tv_sec = 0;
+		meta->times[1].tv_nsec = UTIME_NOW;
+	}
+}
+
+/* restore ownership, permissions and times, either through fd or through
+ * dirfd and name */
+static int set_metadata(alpm_diskwriter_t *dw, int dirfd, const char *name,
+		int fd, const struct dw_meta *meta, const char *path)
+{
+	int ret = ARCHIVE_OK, owned = 0;
+
+	if(dw->flags & DISKWRITER_OWNER) {
+		/* only root may give files away */
+		if(dw->euid == 0 || dw->euid == meta->uid) {
+			int r = fd >= 0 ? fchown(fd, meta->uid, meta->gid)
+				: fchownat(dirfd, name, meta->uid, meta->gid, AT_SYMLINK_NOFOLLOW);
+			if(r == 0) {
+				owned = 1;
+			} else {
+				ret = dw_error(dw, errno, ARCHIVE_WARN, "Can't set user=%d/group=%d for %s",
+						(int)meta->uid, (int)meta->gid, path);
+			}
+		}
+	}
+
+	if((dw->flags & DISKWRITER_PERM) && meta->type != AE_IFLNK) {
+		mode_t mode = meta->mode;
+		int r;
+		if(!owned) {
+			/* do not hand out setuid bits on files of the wrong owner */
+			mode &= ~(S_ISUID | S_ISGID);
+		}
+		r = fd >= 0 ? fchmod(fd, mode) : fchmodat(dirfd, name, mode, 0);
+		if(r != 0) {
+			ret = dw_error(dw, errno, ARCHIVE_WARN, "Can't set permissions for %s", path);
+		}
+	}
+
+	if(dw->flags & DISKWRITER_TIME) {
+		int r = fd >= 0 ? futimens(fd, meta->times)
+			: utimensat(dirfd, name, meta->times, AT_SYMLINK_NOFOLLOW);
+		if(r != 0) {
+			ret = dw_error(dw, errno, ARCHIVE_WARN, "Can't restore time for %s", path);
+		}
+	}
+
+	return ret;
+}
+
+static int add_fixup(alpm_diskwriter_t *dw, int outside, const char *path,
+		const struct dw_meta *meta)
+{
+	struct dw_fixup *fixup;
+
+	CALLOC(fixup, 1, sizeof(struct dw_fixup),
+			return dw_error(dw, ENOMEM, ARCHIVE_FATAL, "Can't allocate memory"));
+	STRDUP(fixup->path, path, free(fixup);
+			return dw_error(dw, ENOMEM, ARCHIVE_FATAL, "Can't allocate memory"));
+	fixup->outside = outside;
+	fixup->meta = *meta;
+	dw->fixups = alpm_list_add(dw->fixups, fixup);
+	return ARCHIVE_OK;
+}
+
+/* regular files are read back if their md5 could not be computed while
+ * they were written, see rehash_md5() */
+static int file_flags(alpm_diskwriter_t *dw)
+{
+	return dw->want_md5 ? O_RDWR : O_WRONLY;
+}
+
+/* write a regular file replacing an existing one under a temporary name,
+ * see DISKWRITER_DEFER; returns the open descriptor */
+static int create_deferred(alpm_diskwriter_t *dw, int dirfd, const char *name,
+		int outside, const char *parent, mode_t mode)
+{
+	struct dw_pending *pending;
+	char tmpname[64];
+	int fd, tries;
+
+	for(tries = 0; tries < 100; tries++) {
+		snprintf(tmpname, sizeof(tmpname), ".alpm%ld.%u.%u", (long)getpid(),
+				dw->serial, ++dw->tmpcount);
+		fd = openat(dirfd, tmpname, file_flags(dw) | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+		if(fd >= 0 || errno != EEXIST) {
+			break;
+		}
+	}
+	if(fd < 0) {
+		return -1;
+	}
+
+	CALLOC(pending, 1, sizeof(struct dw_pending), goto oom);
+	pending->outside = outside;
+	STRDUP(pending->parent, parent, goto oom);
+	STRDUP(pending->tmpname, tmpname, goto oom);
+	STRDUP(pending->name, name, goto oom);
+	dw->pending = alpm_list_add(dw->pending, pending);
+	return fd;
+
+oom:
+	if(pending) {
+		free(pending->parent);
+		free(pending->tmpname);
+		free(pending);
+	}
+	close(fd);
+	unlinkat(dirfd, tmpname, 0);
+	errno = ENOMEM;
+	return -1;
+}
+
+/* the temporary name of a deferred file, NULL if there is none */
+static const char *deferred_name(alpm_diskwriter_t *dw, int outside,
+		const char *parent, const char *name)
+{
+	alpm_list_t *i;
+	const char *tmpname = NULL;
+
+	/* the most recent one wins, like it will when renaming */
+	for(i = dw->pending; i; i = i->next) {
+		struct dw_pending *pending = i->data;
+		if(pending->outside == outside && strcmp(pending->name, name) == 0
+				&& strcmp(pending->parent, parent) == 0) {
+			tmpname = pending->tmpname;
+		}
+	}
+	return tmpname;
+}
+
+/* create the filesystem object of an entry, replacing whatever is in the
+ * way; returns the open descriptor for regular files, 0 otherwise */
+static int create_entry(alpm_diskwriter_t *dw, int dirfd, const char *name,
+		int outside, const char *parent, struct archive_entry *entry,
+		const struct dw_meta *meta)
+{
+	int tries, ret = -1;
+	int restore = dw->flags & DISKWRITER_PERM;
+
+	if(meta->type == AE_IFREG && (dw->flags & DISKWRITER_DEFER)) {
+		struct stat st;
+		if(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(st.st_mode)) {
+			return create_deferred(dw, dirfd, name, outside, parent,
+					restore ? 0600 : meta->mode);
+		}
+	}
+
+	for(tries = 0; tries < 2; tries++) {
+		switch(meta->type) {
+			case AE_IFREG:
+				ret = openat(dirfd, name, file_flags(dw) | O_CREAT | O_EXCL | O_CLOEXEC,
+						restore ? 0600 : meta->mode);
+				break;
+			case AE_IFLNK:
+				ret = symlinkat(archive_entry_symlink(entry), dirfd, name);
+				break;
+			case AE_IFDIR:
+				ret = mkdirat(dirfd, name, restore ? 0700 : (meta->mode | 0700));
+				if(ret != 0 && errno == EEXIST && is_dir(dirfd, name)) {
+					return 0;
+				}
+				break;
+			default:
+				ret = mknodat(dirfd, name, meta->type | (restore ? 0600 : meta->mode),
+						archive_entry_rdev(entry));
+				break;
+		}
+		if(ret >= 0 || errno != EEXIST) {
+			break;
+		}
+		if(remove_existing(dw, dirfd, name, outside, parent) != 0) {
+			return -1;
+		}
+	}
+	return ret;
+}
+
+/** Create the filesystem object of an entry. The contents of regular files
+ * follow with _alpm_diskwriter_data(), the entry has to be completed with
+ * _alpm_diskwriter_finish_entry().
+ */
+int _alpm_diskwriter_header(alpm_diskwriter_t *dw, struct archive_entry *entry)
+{
+	char buf[PATH_MAX];
+	const char *path = archive_entry_pathname(entry);
+	const char *hardlink = archive_entry_hardlink(entry);
+	const char *parent;
+	struct dw_meta meta;
+	char *name;
+	int dirfd, outside, ret;
+
+	dw->entry = entry;
+	dw->fd = -1;
+	dw->end = 0;
+	dw->hashed = 0;
+	FREE(dw->sha256sum);
+	FREE(dw->md5sum);
+	if(dw->digest) {
+		_alpm_digest_reset(dw->digest);
+	}
+	if(dw->want_md5) {
+		if(dw->md5 == NULL) {
+			dw->md5 = _alpm_digest_new(ALPM_PKG_VALIDATION_MD5SUM);
+		} else {
+			_alpm_digest_reset(dw->md5);
+		}
+		if(dw->md5 == NULL) {
+			dw->want_md5 = 0;
+			return dw_error(dw, ENOMEM, ARCHIVE_FATAL, "Can't hash '%s'", path);
+		}
+	}
+
+	dirfd = open_parent(dw, path, buf, &name, &outside);
+	if(dirfd < 0) {
+		return dw_error(dw, errno, ARCHIVE_FAILED, "Can't create '%s'", path);
+	}
+	if(*name == '\0') {
+		/* the base directory itself */
+		return ARCHIVE_OK;
+	}
+	parent = name == buf ? "" : buf;
+
+	if(hardlink) {
+		char tbuf[PATH_MAX];
+		char *tname;
+		const char *tmpname;
+		int tdirfd, toutside, tries;
+
+		tdirfd = open_parent(dw, hardlink, tbuf, &tname, &toutside);
+		if(tdirfd < 0) {
+			return dw_error(dw, errno, ARCHIVE_FAILED, "Can't create '%s'", path);
+		}
+		/* a deferred target only has its new contents under the temporary name */
+		tmpname = deferred_name(dw, toutside, tname == tbuf ? "" : tbuf, tname);
+		if(tmpname) {
+			tname = (char *)tmpname;
+		}
+		for(tries = 0; tries < 2; tries++) {
+			ret = linkat(tdirfd, tname, dirfd, name, 0);
+			if(ret == 0 || errno != EEXIST
+					|| remove_existing(dw, dirfd, name, outside, parent) != 0) {
+				break;
+			}
+		}
+		if(ret != 0) {
+			return dw_error(dw, errno, ARCHIVE_FAILED, "Can't create '%s'", path);
+		}
+		if(archive_entry_size(entry) > 0) {
+			dw->fd = openat(dirfd, name, file_flags(dw) | O_TRUNC | O_CLOEXEC);
+			if(dw->fd < 0) {
+				return dw_error(dw, errno, ARCHIVE_FAILED, "Can't open '%s'", path);
+			}
+		}
+		return ARCHIVE_OK;
+	}
+
+	entry_meta(entry, &meta);
+	ret = create_entry(dw, dirfd, name, outside, parent, entry, &meta);
+	if(ret < 0) {
+		return dw_error(dw, errno, ARCHIVE_FAILED, "Can't create '%s'", path);
+	}
+
+	switch(meta.type) {
+		case AE_IFREG:
+			/* metadata is restored once the contents are written */
+			dw->fd = ret;
+			return ARCHIVE_OK;
+		case AE_IFDIR:
+			if(!(dw->flags & (DISKWRITER_OWNER | DISKWRITER_PERM | DISKWRITER_TIME))) {
+				return ARCHIVE_OK;
+			}
+			if(name != buf) {
+				/* put the full relative path back together */
+				name[-1] = '/';
+			}
+			return add_fixup(dw, outside, buf, &meta);
+		default:
+			return set_metadata(dw, dirfd, name, -1, &meta, path);
+	}
+}
+
+static int hashing(alpm_diskwriter_t *dw)
+{
+	return (dw->digest || dw->want_md5) && dw->hashed >= 0;
+}
+
+static void hash_update(alpm_diskwriter_t *dw, const void *buf, size_t size)
+{
+	if(dw->digest) {
+		_alpm_digest_update(dw->digest, buf, size);
+	}
+	if(dw->want_md5) {
+		_alpm_digest_update(dw->md5, buf, size);
+	}
+	dw->hashed += size;
+}
+
+/* digest the hole between what was hashed so far and offset */
+static void hash_zeros(alpm_diskwriter_t *dw, int64_t offset)
+{
+	static const char zeros[4096];
+
+	while(dw->hashed < offset) {
+		size_t n = sizeof(zeros);
+		if(offset - dw->hashed < (int64_t)n) {
+			n = offset - dw->hashed;
+		}
+		hash_update(dw, zeros, n);
+	}
+}
+
+/* compute the md5 of the current file from what was written, for when the
+ * data did not arrive in order */
+static int rehash_md5(alpm_diskwriter_t *dw)
+{
+	char buf[64 * 1024];
+	off_t offset = 0;
+	ssize_t n;
+
+	_alpm_digest_reset(dw->md5);
+	while((n = pread(dw->fd, buf, sizeof(buf), offset)) != 0) {
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		_alpm_digest_update(dw->md5, buf, (size_t)n);
+		offset += n;
+	}
+	dw->md5sum = _alpm_digest_finish(dw->md5);
+	return 0;
+}
+
+/** Write a block of the contents of the current entry. */
+int _alpm_diskwriter_data(alpm_diskwriter_t *dw, const void *buf, size_t size,
+		int64_t offset)
+{
+	const char *p = buf;
+
+	if(dw->fd < 0) {
+		/* nothing to write to */
+		return ARCHIVE_OK;
+	}
+
+	if(hashing(dw)) {
+		if(offset < dw->hashed) {
+			dw->hashed = -1;
+		} else {
+			hash_zeros(dw, offset);
+			hash_update(dw, buf, size);
+		}
+	}
+
+	while(size > 0) {
+		ssize_t n = pwrite(dw->fd, p, size, offset);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return dw_error(dw, errno, ARCHIVE_FATAL, "Write failed for '%s'",
+					archive_entry_pathname(dw->entry));
+		}
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	if(offset > dw->end) {
+		dw->end = offset;
+	}
+	return ARCHIVE_OK;
+}
+
+/** Complete the current entry. */
+int _alpm_diskwriter_finish_entry(alpm_diskwriter_t *dw)
+{
+	int ret = ARCHIVE_OK;
+
+	if(dw->fd >= 0) {
+		struct archive_entry *entry = dw->entry;
+		const char *path = archive_entry_pathname(entry);
+		int64_t size = archive_entry_size(entry);
+
+		/* a sparse file may end in a hole */
+		if(dw->end < size && ftruncate(dw->fd, size) != 0) {
+			ret = dw_error(dw, errno, ARCHIVE_WARN, "Can't truncate '%s'", path);
+		}
+		if(hashing(dw)) {
+			hash_zeros(dw, size);
+			if(dw->digest) {
+				dw->sha256sum = _alpm_digest_finish(dw->digest);
+			}
+			if(dw->want_md5) {
+				dw->md5sum = _alpm_digest_finish(dw->md5);
+			}
+		} else if(dw->want_md5 && rehash_md5(dw) != 0) {
+			ret = dw_error(dw, errno, ARCHIVE_WARN, "Can't hash '%s'", path);
+		}
+		if(archive_entry_hardlink(entry) == NULL) {
+			struct dw_meta meta;
+			int r;
+			entry_meta(entry, &meta);
+			r = set_metadata(dw, -1, NULL, dw->fd, &meta, path);
+			if(r < ret) {
+				ret = r;
+			}
+		}
+		if(close(dw->fd) != 0 && ret == ARCHIVE_OK) {
+			ret = dw_error(dw, errno, ARCHIVE_WARN, "Can't close '%s'", path);
+		}
+		dw->fd = -1;
+	}
+	dw->entry = NULL;
+	dw->want_md5 = 0;
+	return ret;
+}
+
+/** Write an entry with its contents read from an archive, reporting errors
+ * like archive_read_extract2() does.
+ */
+int _alpm_diskwriter_extract(alpm_diskwriter_t *dw, struct archive *archive,
+		struct archive_entry *entry)
+{
+	int ret, ret2;
+
+	ret = _alpm_diskwriter_header(dw, entry);
+	if(ret < ARCHIVE_WARN) {
+		ret = ARCHIVE_WARN;
+	}
+	if(ret == ARCHIVE_OK
+			&& (!archive_entry_size_is_set(entry) || archive_entry_size(entry) > 0)) {
+		while(1) {
+			const void *buf;
+			size_t size;
+			int64_t offset;
+
+			ret = archive_read_data_block(archive, &buf, &size, &offset);
+			if(ret == ARCHIVE_EOF) {
+				ret = ARCHIVE_OK;
+				break;
+			} else if(ret != ARCHIVE_OK) {
+				dw_error(dw, archive_errno(archive), ret, "%s",
+						archive_error_string(archive));
+				break;
+			}
+			ret = _alpm_diskwriter_data(dw, buf, size, offset);
+			if(ret < ARCHIVE_WARN) {
+				ret = ARCHIVE_WARN;
+			}
+			if(ret < ARCHIVE_OK) {
+				break;
+			}
+		}
+	}
+
+	ret2 = _alpm_diskwriter_finish_entry(dw);
+	if(ret2 < ARCHIVE_WARN) {
+		ret2 = ARCHIVE_WARN;
+	}
+	if(ret2 < ret) {
+		ret = ret2;
+	}
+	return ret;
+}
+
+/** Restore ownership, permissions and times of an entry which is already
+ * on disk, without touching its contents.
+ */
+int _alpm_diskwriter_metadata(alpm_diskwriter_t *dw, struct archive_entry *entry)
+{
+	char buf[PATH_MAX];
+	const char *path = archive_entry_pathname(entry);
+	struct dw_meta meta;
+	char *name;
+	int dirfd, outside;
+
+	dirfd = open_parent(dw, path, buf, &name, &outside);
+	if(dirfd < 0) {
+		return dw_error(dw, errno, ARCHIVE_FAILED, "Can't access '%s'", path);
+	}
+	entry_meta(entry, &meta);
+	return set_metadata(dw, dirfd, *name ? name : ".", -1, &meta, path);
+}
+
+/** The sha256 digest of the regular file written last.
+ * @return the checksum if DISKWRITER_SHA256 is set and the contents were
+ * written completely, NULL otherwise; valid until the next entry
+ */
+const char *_alpm_diskwriter_sha256sum(alpm_diskwriter_t *dw)
+{
+	return dw->sha256sum;
+}
+
+/** Also compute the md5 digest of the next entry written, which saves
+ * reading the file back when its checksum is needed.
+ */
+void _alpm_diskwriter_want_md5(alpm_diskwriter_t *dw)
+{
+	dw->want_md5 = 1;
+}
+
+/** The md5 digest of the regular file written last.
+ * @return the checksum if it was requested with _alpm_diskwriter_want_md5()
+ * and the contents were written completely, NULL otherwise; valid until the
+ * next entry
+ */
+const char *_alpm_diskwriter_md5sum(alpm_diskwriter_t *dw)
+{
+	return dw->md5sum;
+}
+
+static void free_pending(alpm_diskwriter_t UNUSED *dw, struct dw_pending *pending,
+		int dirfd)
+{
+	if(dirfd >= 0) {
+		unlinkat(dirfd, pending->tmpname, 0);
+	}
+	free(pending->parent);
+	free(pending->tmpname);
+	free(pending->name);
+	free(pending);
+}
+
+/* move the deferred files into place */
+static int rename_pending(alpm_diskwriter_t *dw)
+{
+	alpm_list_t *i;
+	int ret = ARCHIVE_OK;
+
+	if(dw->pending == NULL) {
+		return ARCHIVE_OK;
+	}
+
+	/* the new contents have to be on disk before they replace the old ones,
+	 * one call for all the files instead of one fsync() each */
+	for(i = dw->pending; i; i = i->next) {
+		struct dw_pending *pending = i->data;
+		if(pending->outside) {
+			break;
+		}
+	}
+	if(syncfs(dw->basefd) != 0 || (i && syncfs(anchor_fd(dw, 1)) != 0)) {
+		ret = dw_error(dw, errno, ARCHIVE_WARN, "Can't sync '%s'", dw->base);
+	}
+
+	for(i = dw->pending; i; i = i->next) {
+		struct dw_pending *pending = i->data;
+		char dir[PATH_MAX];
+		int dirfd;
+
+		snprintf(dir, sizeof(dir), "%s", pending->parent);
+		dirfd = get_dirfd(dw, pending->outside, dir);
+		if(dirfd >= 0 && renameat(dirfd, pending->tmpname, dirfd, pending->name) == 0) {
+			free_pending(dw, pending, -1);
+			continue;
+		}
+		ret = dw_error(dw, errno, ARCHIVE_FAILED, "Can't replace '%s%s%s%s'",
+				pending->outside ? "/" : dw->base, pending->parent,
+				*pending->parent ? "/" : "", pending->name);
+		free_pending(dw, pending, dirfd);
+	}
+	alpm_list_free(dw->pending);
+	dw->pending = NULL;
+	return ret;
+}
+
+/** Move deferred files into place and give the directories written their
+ * final permissions and times. This has to be called once all entries are
+ * written. With DISKWRITER_HOLD the deferred files are left for
+ * _alpm_diskwriter_take_pending().
+ */
+int _alpm_diskwriter_close(alpm_diskwriter_t *dw)
+{
+	alpm_list_t *i;
+	int r, ret = ARCHIVE_OK;
+
+	if(dw->fd >= 0) {
+		ret = _alpm_diskwriter_finish_entry(dw);
+	}
+
+	if(!(dw->flags & DISKWRITER_HOLD)) {
+		r = rename_pending(dw);
+		if(r < ret) {
+			ret = r;
+		}
+	}
+
+	/* most recent first, so subdirectories come before their parents */
+	for(i = alpm_list_last(dw->fixups); i; i = alpm_list_previous(i)) {
+		struct dw_fixup *fixup = i->data;
+		int dirfd = anchor_fd(dw, fixup->outside);
+		r = set_metadata(dw, dirfd, fixup->path, -1, &fixup->meta, fixup->path);
+		if(r < ret) {
+			ret = r;
+		}
+		free(fixup->path);
+		free(fixup);
+	}
+	alpm_list_free(dw->fixups);
+	dw->fixups = NULL;
+	return ret;
+}
+
+/** Hand the deferred files left by _alpm_diskwriter_close() over to the
+ * caller, who renames them once their contents are on disk.
+ * @return a list of alpm_heldrename_t with absolute paths, in the order the
+ * files were written; the writer no longer removes them
+ */
+alpm_list_t *_alpm_diskwriter_take_pending(alpm_diskwriter_t *dw)
+{
+	alpm_list_t *i, *held = NULL;
+
+	for(i = dw->pending; i; i = i->next) {
+		struct dw_pending *pending = i->data;
+		const char *prefix = pending->outside ? "/" : dw->base;
+		const char *sep = *pending->parent ? "/" : "";
+		alpm_heldrename_t *file;
+		size_t len = strlen(prefix) + strlen(pending->parent) + 2;
+
+		CALLOC(file, 1, sizeof(alpm_heldrename_t), break);
+		MALLOC(file->tmppath, len + strlen(pending->tmpname),
+				_alpm_heldrename_free(file); break);
+		MALLOC(file->path, len + strlen(pending->name),
+				_alpm_heldrename_free(file); break);
+		sprintf(file->tmppath, "%s%s%s%s", prefix, pending->parent, sep,
+				pending->tmpname);
+		sprintf(file->path, "%s%s%s%s", prefix, pending->parent, sep,
+				pending->name);
+		held = alpm_list_add(held, file);
+		free_pending(dw, pending, -1);
+		i->data = NULL;
+	}
+	/* whatever could not be handed over is removed as usual */
+	for(; i; i = i->next) {
+		struct dw_pending *pending = i->data;
+		char dir[PATH_MAX];
+		snprintf(dir, sizeof(dir), "%s", pending->parent);
+		free_pending(dw, pending, get_dirfd(dw, pending->outside, dir));
+	}
+	alpm_list_free(dw->pending);
+	dw->pending = NULL;
+	return held;
+}
+
+int _alpm_diskwriter_errno(alpm_diskwriter_t *dw)
+{
+	return dw->errnum;
+}
+
+const char *_alpm_diskwriter_error_string(alpm_diskwriter_t *dw)
+{
+	return dw->errstr;
+}
+
+void _alpm_diskwriter_free(alpm_diskwriter_t *dw)
+{
+	alpm_list_t *i;
+
+	if(dw == NULL) {
+		return;
+	}
+	if(dw->fd >= 0) {
+		close(dw->fd);
+	}
+	for(i = dw->fixups; i; i = i->next) {
+		struct dw_fixup *fixup = i->data;
+		free(fixup->path);
+		free(fixup);
+	}
+	alpm_list_free(dw->fixups);
+	/* not closed, the old files stay */
+	for(i = dw->pending; i; i = i->next) {
+		struct dw_pending *pending = i->data;
+		char dir[PATH_MAX];
+		snprintf(dir, sizeof(dir), "%s", pending->parent);
+		free_pending(dw, pending, get_dirfd(dw, pending->outside, dir));
+	}
+	alpm_list_free(dw->pending);
+	flush_cache(dw);
+	_alpm_digest_free(dw->digest);
+	_alpm_digest_free(dw->md5);
+	free(dw->sha256sum);
+	free(dw->md5sum);
+	if(dw->slashfd >= 0) {
+		close(dw->slashfd);
+	}
+	close(dw->basefd);
+	free(dw->base);
+	free(dw);
+}
+
+/* vim: set ts=2 sw=2 noet: */
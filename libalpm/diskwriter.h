@@ -0,0 +1,70 @@
+/*
+ *  diskwriter.h
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALPM_DISKWRITER_H
+#define _ALPM_DISKWRITER_H
+
+#include <sys/types.h> /* size_t */
+#include <stdint.h> /* int64_t */
+
+#include "alpm_list.h"
+
+/* libarchive */
+#include <archive.h>
+#include <archive_entry.h>
+
+/* what to restore besides the file contents, like ARCHIVE_EXTRACT_* */
+#define DISKWRITER_OWNER 0x1
+#define DISKWRITER_PERM  0x2
+#define DISKWRITER_TIME  0x4
+/* compute the sha256 digest of regular files, see _alpm_diskwriter_sha256sum() */
+#define DISKWRITER_SHA256 0x8
+/* replace existing regular files atomically: their contents go to a
+ * temporary name, and _alpm_diskwriter_close() renames them into place
+ * after one syncfs() */
+#define DISKWRITER_DEFER  0x10
+/* leave the deferred files to the caller, see _alpm_diskwriter_take_pending() */
+#define DISKWRITER_HOLD   0x20
+
+/* Writes archive entries below a base directory without changing the
+ * working directory. Paths are resolved through a cache of open directory
+ * descriptors; relative paths and hard link targets are taken relative to
+ * the base directory. A writer must only be used by one thread at a time.
+ * The functions return libarchive status codes. */
+typedef struct __alpm_diskwriter_t alpm_diskwriter_t;
+
+alpm_diskwriter_t *_alpm_diskwriter_new(const char *base, int flags);
+int _alpm_diskwriter_header(alpm_diskwriter_t *dw, struct archive_entry *entry);
+int _alpm_diskwriter_data(alpm_diskwriter_t *dw, const void *buf, size_t size,
+		int64_t offset);
+int _alpm_diskwriter_finish_entry(alpm_diskwriter_t *dw);
+int _alpm_diskwriter_extract(alpm_diskwriter_t *dw, struct archive *archive,
+		struct archive_entry *entry);
+int _alpm_diskwriter_metadata(alpm_diskwriter_t *dw, struct archive_entry *entry);
+const char *_alpm_diskwriter_sha256sum(alpm_diskwriter_t *dw);
+void _alpm_diskwriter_want_md5(alpm_diskwriter_t *dw);
+const char *_alpm_diskwriter_md5sum(alpm_diskwriter_t *dw);
+int _alpm_diskwriter_close(alpm_diskwriter_t *dw);
+alpm_list_t *_alpm_diskwriter_take_pending(alpm_diskwriter_t *dw);
+int _alpm_diskwriter_errno(alpm_diskwriter_t *dw);
+const char *_alpm_diskwriter_error_string(alpm_diskwriter_t *dw);
+void _alpm_diskwriter_free(alpm_diskwriter_t *dw);
+
+#endif /* _ALPM_DISKWRITER_H */
+
+/* vim: set ts=2 sw=2 noet: */
@@ -22,12 +22,16 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/socket.h> /* setsockopt, SO_KEEPALIVE */
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ctype.h>
 
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h> /* IPPROTO_TCP */
@@ -48,7 +52,6 @@
 #include "util.h"
 #include "handle.h"
 
-#ifdef HAVE_LIBCURL
 static const char *get_filename(const char *url)
 {
 	char *filename = strrchr(url, '/');
@@ -70,6 +73,173 @@ static char *get_fullpath(const char *path, const char *filename,
 	return filepath;
 }
 
+/* Files on a file:// server, or on a server given as a plain absolute path,
+ * are not read through libcurl: the cache entry is made a hard link to the
+ * source, or failing that a reflink (FICLONE) or a copy_file_range() copy,
+ * which lets the filesystem (or an NFS server) share or copy the blocks
+ * without passing them through userspace. Package checksums are still
+ * verified on the cached file afterwards, so a hard link is only made to a
+ * source nobody but root can change; anything else gets an inode of its
+ * own. */
+enum {
+	LOCAL_UNHANDLED = -2
+};
+
+/* the decoded path of a local URL, NULL if the URL is not local */
+static char *local_url_path(const char *url)
+{
+	const char *p;
+	char *path, *q;
+
+	if(url[0] == '/') {
+		p = url;
+	} else if(strncmp(url, "file://", 7) == 0) {
+		p = url + 7;
+		if(strncmp(p, "localhost/", 10) == 0) {
+			p += 9;
+		}
+		if(*p != '/') {
+			return NULL;
+		}
+	} else {
+		return NULL;
+	}
+
+	MALLOC(path, strlen(p) + 1, return NULL);
+	for(q = path; *p; p++) {
+		unsigned int c;
+		if(*p == '%' && sscanf(p + 1, "%2x", &c) == 1 && isxdigit((unsigned char)p[2])) {
+			*q++ = (char)c;
+			p += 2;
+		} else {
+			*q++ = *p;
+		}
+	}
+	*q = '\0';
+	return path;
+}
+
+static int local_download(struct dload_payload *payload, const char *localpath,
+		char **final_file)
+{
+	alpm_handle_t *handle = payload->handle;
+	const char *filename, *name;
+	char *srcpath, *destpath = NULL, *partpath = NULL;
+	struct stat st, destst;
+	int srcfd = -1, destfd = -1, ret = -1;
+
+	if((srcpath = local_url_path(payload->fileurl)) == NULL) {
+		return LOCAL_UNHANDLED;
+	}
+	/* let libcurl report anything unusual the way it always has */
+	if(stat(srcpath, &st) != 0 || !S_ISREG(st.st_mode)) {
+		free(srcpath);
+		return LOCAL_UNHANDLED;
+	}
+
+	filename = strrchr(srcpath, '/') + 1;
+	name = payload->remote_name ? payload->remote_name : filename;
+	if(*filename == '\0' || strcmp(name, ".sig") == 0) {
+		free(srcpath);
+		return LOCAL_UNHANDLED;
+	}
+
+	if(payload->max_size && st.st_size > payload->max_size) {
+		handle->pm_errno = ALPM_ERR_RETRIEVE;
+		_alpm_log(handle, ALPM_LOG_ERROR,
+				_("failed retrieving file '%s' from %s : %s\n"),
+				filename, _("disk"), strerror(EFBIG));
+		goto cleanup;
+	}
+
+	destpath = get_fullpath(localpath, filename, "");
+	partpath = get_fullpath(localpath, filename, ".part");
+	if(!destpath || !partpath) {
+		handle->pm_errno = ALPM_ERR_MEMORY;
+		goto cleanup;
+	}
+
+	if(stat(destpath, &destst) == 0 && destst.st_ino == st.st_ino &&
+			destst.st_dev == st.st_dev) {
+		if(_alpm_root_only_writable(&st)) {
+			/* already linked on an earlier run */
+			ret = payload->force ? 0 : 1;
+			goto done;
+		}
+		/* linked to a source others may change now, replaced by a copy below */
+	} else if(!payload->force && !payload->allow_resume && stat(destpath, &destst) == 0 &&
+			destst.st_mtime >= st.st_mtime) {
+		/* same time condition as for remote files */
+		_alpm_log(handle, ALPM_LOG_DEBUG, "file met time condition\n");
+		ret = 1;
+		goto cleanup;
+	}
+
+	_alpm_log(handle, ALPM_LOG_DEBUG, "local file: %s\n", srcpath);
+	if(handle->dlcb) {
+		handle->dlcb(filename, 0, st.st_size);
+	}
+
+	unlink(partpath);
+	if(_alpm_link_trusted(srcpath, partpath, &st) == 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "linked %s into the cache\n", filename);
+	} else {
+		struct timespec times[2];
+
+		OPEN(srcfd, srcpath, O_RDONLY | O_CLOEXEC);
+		if(srcfd < 0 || (destfd = open(partpath,
+						O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) < 0 ||
+				_alpm_copyfd(srcfd, destfd, st.st_size) != 0) {
+			handle->pm_errno = ALPM_ERR_RETRIEVE;
+			_alpm_log(handle, ALPM_LOG_ERROR,
+					_("failed retrieving file '%s' from %s : %s\n"),
+					filename, _("disk"), strerror(errno));
+			unlink(partpath);
+			goto cleanup;
+		}
+		/* keep the source time so the time condition works next run */
+		times[0] = st.st_atim;
+		times[1] = st.st_mtim;
+		futimens(destfd, times);
+		if(close(destfd) != 0) {
+			destfd = -1;
+			handle->pm_errno = ALPM_ERR_RETRIEVE;
+			unlink(partpath);
+			goto cleanup;
+		}
+		destfd = -1;
+	}
+
+	if(rename(partpath, destpath)) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not rename %s to %s (%s)\n"),
+				partpath, destpath, strerror(errno));
+		unlink(partpath);
+		goto cleanup;
+	}
+	if(handle->dlcb) {
+		handle->dlcb(filename, st.st_size, st.st_size);
+	}
+	ret = 0;
+
+done:
+	if(final_file) {
+		STRDUP(*final_file, filename, ret = -1; handle->pm_errno = ALPM_ERR_MEMORY);
+	}
+
+cleanup:
+	if(srcfd >= 0) {
+		close(srcfd);
+	}
+	if(destfd >= 0) {
+		close(destfd);
+	}
+	free(srcpath);
+	free(destpath);
+	free(partpath);
+	return ret;
+}
+
+#ifdef HAVE_LIBCURL
 static CURL *get_libcurl_handle(alpm_handle_t *handle)
 {
 	if(!handle->curl) {
@@ -79,6 +249,27 @@ static CURL *get_libcurl_handle(alpm_handle_t *handle)
 	return handle->curl;
 }
 
+/* Every transfer of a handle goes through one share object, so the database,
+ * signature and package downloads of a run, and the range requests of a
+ * segmented download, draw on one pool of open connections, one DNS cache
+ * and one set of TLS sessions. All transfers run on the calling thread, so
+ * the share needs no lock callbacks. */
+static CURLSH *get_libcurl_share(alpm_handle_t *handle)
+{
+	if(!handle->curlsh) {
+		get_libcurl_handle(handle);
+		if((handle->curlsh = curl_share_init()) == NULL) {
+			return NULL;
+		}
+		curl_share_setopt(handle->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(handle->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900 /* 7.57.0 */
+		curl_share_setopt(handle->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+	}
+	return handle->curlsh;
+}
+
 enum {
 	ABORT_SIGINT = 1,
 	ABORT_OVER_MAXFILESIZE
@@ -173,6 +364,319 @@ static int curl_gethost(const char *url, char *buffer, size_t buf_len)
 	return 0;
 }
 
+/* RFC1123 states applications should support this length */
+#define HOSTNAME_SIZE 256
+
+/* Transfer statistics are kept per mirror host in a small file in the dbpath
+ * so servers can be tried fastest first. Each line holds the host, the time
+ * to the first byte and the transfer rate (both moving averages), a failure
+ * score that grows by one with every failed or stalled transfer and halves
+ * with every good one, and when the host was last used. */
+#define MIRRORSTATS_FILE "mirrorstats"
+/* weight of a new sample in the moving averages */
+#define MIRROR_WEIGHT 0.3
+/* smaller transfers say more about latency than about the transfer rate */
+#define MIRROR_RATE_MIN_BYTES (64 * 1024)
+/* seconds a failure is assumed to cost, about the connect timeout */
+#define MIRROR_FAILURE_COST 10.0
+/* forget hosts not used for 90 days */
+#define MIRROR_MAX_AGE (90 * 24 * 60 * 60)
+
+struct mirror_stat {
+	char *host;
+	double latency;     /* seconds to the first byte, 0 if unknown */
+	double rate;        /* bytes per second, 0 if unknown */
+	double failures;
+	time_t updated;
+};
+
+static void mirror_stat_free(struct mirror_stat *stat)
+{
+	free(stat->host);
+	free(stat);
+}
+
+static void mirrorstats_load(alpm_handle_t *handle)
+{
+	char line[HOSTNAME_SIZE + 128], path[PATH_MAX];
+	time_t now = time(NULL);
+	FILE *fp;
+
+	if(handle->mirrorstats_loaded) {
+		return;
+	}
+	handle->mirrorstats_loaded = 1;
+
+	snprintf(path, PATH_MAX, "%s%s", handle->dbpath, MIRRORSTATS_FILE);
+	if((fp = fopen(path, "r")) == NULL) {
+		return;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		struct mirror_stat stat, *copy;
+		char host[HOSTNAME_SIZE];
+		intmax_t updated;
+
+		if(sscanf(line, "%255s %lf %lf %lf %jd", host, &stat.latency,
+					&stat.rate, &stat.failures, &updated) != 5) {
+			continue;
+		}
+		stat.updated = (time_t)updated;
+		if(now - stat.updated > MIRROR_MAX_AGE) {
+			continue;
+		}
+		MALLOC(copy, sizeof(struct mirror_stat), break);
+		*copy = stat;
+		STRDUP(copy->host, host, free(copy); break);
+		handle->mirrorstats = alpm_list_add(handle->mirrorstats, copy);
+	}
+	fclose(fp);
+	_alpm_log(handle, ALPM_LOG_DEBUG, "loaded statistics for %zd mirrors\n",
+			alpm_list_count(handle->mirrorstats));
+}
+
+static struct mirror_stat *mirror_stat_find(alpm_handle_t *handle,
+		const char *host)
+{
+	alpm_list_t *i;
+
+	mirrorstats_load(handle);
+	for(i = handle->mirrorstats; i; i = i->next) {
+		struct mirror_stat *stat = i->data;
+		if(strcmp(stat->host, host) == 0) {
+			return stat;
+		}
+	}
+	return NULL;
+}
+
+/* fold a new sample into a moving average, 0 meaning no sample yet */
+static double mirror_average(double average, double sample)
+{
+	if(DOUBLE_EQ(average, 0.0)) {
+		return sample;
+	}
+	return average + MIRROR_WEIGHT * (sample - average);
+}
+
+/* update the statistics of a host with the outcome of a transfer */
+static void mirror_record(alpm_handle_t *handle, CURL *curl, CURLcode curlerr,
+		const char *url)
+{
+	char hostname[HOSTNAME_SIZE];
+	struct mirror_stat *stat;
+	double start = 0, total = 0, bytes = 0;
+
+	/* interrupts, size limits and local files tell nothing about a mirror */
+	if(strncmp(url, "file://", 7) == 0 || curlerr == CURLE_ABORTED_BY_CALLBACK ||
+			curlerr == CURLE_FILESIZE_EXCEEDED ||
+			curl_gethost(url, hostname, sizeof(hostname)) != 0) {
+		return;
+	}
+
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &start);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &bytes);
+
+	stat = mirror_stat_find(handle, hostname);
+	if(stat == NULL) {
+		CALLOC(stat, 1, sizeof(struct mirror_stat), return);
+		STRDUP(stat->host, hostname, free(stat); return);
+		handle->mirrorstats = alpm_list_add(handle->mirrorstats, stat);
+	}
+
+	if(curlerr == CURLE_OK) {
+		if(start > 0) {
+			stat->latency = mirror_average(stat->latency, start);
+		}
+		if(bytes >= MIRROR_RATE_MIN_BYTES && total > start) {
+			stat->rate = mirror_average(stat->rate, bytes / (total - start));
+		}
+		stat->failures /= 2;
+	} else {
+		stat->failures += 1;
+		if(bytes > 0 && total > start) {
+			/* stalled or dropped mid-transfer: the rate actually achieved until
+			 * giving up pushes the mirror down the list */
+			stat->rate = mirror_average(stat->rate, bytes / total);
+		}
+		_alpm_log(handle, ALPM_LOG_DEBUG,
+				"mirror %s failed after %jd bytes, failure score %.2f\n",
+				hostname, (intmax_t)bytes, stat->failures);
+	}
+	stat->updated = time(NULL);
+	handle->mirrorstats_dirty = 1;
+}
+
+struct mirror_rank {
+	void *server;
+	double cost;
+};
+
+static int mirror_rank_cmp(const void *p1, const void *p2)
+{
+	const struct mirror_rank *r1 = p1, *r2 = p2;
+
+	if(r1->cost < r2->cost) {
+		return -1;
+	}
+	return r1->cost > r2->cost;
+}
+#endif
+
+/** Order servers by the expected time to download a file from them.
+ * Servers without statistics are assumed to be as good as the best known
+ * one, so they keep their configured place ahead of worse servers; with no
+ * statistics at all the configured order is kept.
+ * @param handle the context handle
+ * @param servers a list of (char *) server URLs
+ * @param size the expected size of the file, 0 if unknown
+ * @return a new list sharing the server strings, free with alpm_list_free()
+ */
+alpm_list_t *_alpm_dload_rank_servers(alpm_handle_t *handle,
+		alpm_list_t *servers, off_t size)
+{
+#ifdef HAVE_LIBCURL
+	size_t idx, count = alpm_list_count(servers);
+	struct mirror_rank *ranks;
+	struct mirror_stat **stats;
+	double best_latency = 0, best_rate = 0;
+	alpm_list_t *i, *sorted = NULL, *ret = NULL;
+	int known = 0;
+
+	if(count < 2) {
+		return alpm_list_copy(servers);
+	}
+
+	CALLOC(ranks, count, sizeof(struct mirror_rank), return alpm_list_copy(servers));
+	CALLOC(stats, count, sizeof(struct mirror_stat *),
+			free(ranks); return alpm_list_copy(servers));
+
+	for(i = servers, idx = 0; i; i = i->next, idx++) {
+		char hostname[HOSTNAME_SIZE];
+
+		ranks[idx].server = i->data;
+		if(strncmp(i->data, "file://", 7) == 0 ||
+				curl_gethost(i->data, hostname, sizeof(hostname)) != 0 ||
+				(stats[idx] = mirror_stat_find(handle, hostname)) == NULL) {
+			continue;
+		}
+		known = 1;
+		if(stats[idx]->latency > 0 &&
+				(DOUBLE_EQ(best_latency, 0.0) || stats[idx]->latency < best_latency)) {
+			best_latency = stats[idx]->latency;
+		}
+		if(stats[idx]->rate > best_rate) {
+			best_rate = stats[idx]->rate;
+		}
+	}
+
+	if(!known) {
+		free(stats);
+		free(ranks);
+		return alpm_list_copy(servers);
+	}
+
+	for(idx = 0; idx < count; idx++) {
+		struct mirror_stat *stat = stats[idx];
+		double latency = best_latency, rate = best_rate, failures = 0;
+
+		if(stat) {
+			latency = stat->latency > 0 ? stat->latency : best_latency;
+			rate = stat->rate > 0 ? stat->rate : best_rate;
+			failures = stat->failures;
+		}
+		ranks[idx].cost = latency + failures * MIRROR_FAILURE_COST;
+		if(rate > 0) {
+			ranks[idx].cost += (double)size / rate;
+		}
+		sorted = alpm_list_add(sorted, ranks + idx);
+	}
+
+	/* the merge sort is stable, ties keep the configured order */
+	sorted = alpm_list_msort(sorted, count, mirror_rank_cmp);
+	for(i = sorted; i; i = i->next) {
+		struct mirror_rank *rank = i->data;
+		ret = alpm_list_add(ret, rank->server);
+	}
+	alpm_list_free(sorted);
+	free(stats);
+	free(ranks);
+	return ret;
+#else
+	(void)handle;
+	(void)size;
+	return alpm_list_copy(servers);
+#endif
+}
+
+/** Write the mirror statistics back to the dbpath if they changed. Failing
+ * to write them (e.g. running unprivileged) is not an error.
+ * @param handle the context handle
+ */
+void _alpm_dload_save_mirrorstats(alpm_handle_t *handle)
+{
+#ifdef HAVE_LIBCURL
+	char path[PATH_MAX], tmppath[PATH_MAX];
+	alpm_list_t *i;
+	FILE *fp;
+	int fd;
+
+	if(!handle->mirrorstats_dirty) {
+		return;
+	}
+	handle->mirrorstats_dirty = 0;
+
+	/* written aside and renamed, so that a concurrent reader or a crash
+	 * never sees a truncated file */
+	snprintf(path, PATH_MAX, "%s%s", handle->dbpath, MIRRORSTATS_FILE);
+	snprintf(tmppath, PATH_MAX, "%s.XXXXXX", path);
+	if((fd = mkstemp(tmppath)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not write mirror statistics %s: %s\n",
+				path, strerror(errno));
+		if(fd >= 0) {
+			close(fd);
+			unlink(tmppath);
+		}
+		return;
+	}
+	fchmod(fd, 0644);
+	for(i = handle->mirrorstats; i; i = i->next) {
+		struct mirror_stat *stat = i->data;
+		fprintf(fp, "%s %.6f %.0f %.4f %jd\n", stat->host, stat->latency,
+				stat->rate, stat->failures, (intmax_t)stat->updated);
+	}
+	if(fflush(fp) != 0 || fsync(fd) != 0 || fclose(fp) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not write mirror statistics %s: %s\n",
+				path, strerror(errno));
+		unlink(tmppath);
+		return;
+	}
+	if(rename(tmppath, path) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not write mirror statistics %s: %s\n",
+				path, strerror(errno));
+		unlink(tmppath);
+	}
+#else
+	(void)handle;
+#endif
+}
+
+/** Free the in-memory mirror statistics.
+ * @param handle the context handle
+ */
+void _alpm_dload_free_mirrorstats(alpm_handle_t *handle)
+{
+#ifdef HAVE_LIBCURL
+	alpm_list_free_inner(handle->mirrorstats, (alpm_list_fn_free)mirror_stat_free);
+	alpm_list_free(handle->mirrorstats);
+	handle->mirrorstats = NULL;
+#else
+	(void)handle;
+#endif
+}
+
+#ifdef HAVE_LIBCURL
+
 static int utimes_long(const char *path, long seconds)
 {
 	if(seconds != -1) {
@@ -264,32 +768,51 @@ static int dload_sockopt_cb(void *userdata, curl_socket_t curlfd,
 	return 0;
 }
 
-static void curl_set_handle_opts(struct dload_payload *payload,
-		CURL *curl, char *error_buffer)
+/* reset a curl_easy handle to the options every transfer uses */
+static void curl_set_common_opts(alpm_handle_t *handle, CURL *curl,
+		const char *url, char *error_buffer)
 {
-	alpm_handle_t *handle = payload->handle;
 	const char *useragent = getenv("HTTP_USER_AGENT");
-	struct stat st;
+	CURLSH *share = get_libcurl_share(handle);
 
-	/* the curl_easy handle is initialized with the alpm handle, so we only need
-	 * to reset the handle's parameters for each time it's used. */
 	curl_easy_reset(curl);
-	curl_easy_setopt(curl, CURLOPT_URL, payload->fileurl);
+	if(share) {
+		curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	}
+#if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+	/* HTTP/2 where the server offers it over TLS, HTTP/1.1 otherwise */
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+#endif
+	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_buffer);
 	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
-	curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
 	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, dload_progress_cb);
-	curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, (void *)payload);
 	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
 	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 10L);
-	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, dload_parseheader_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEHEADER, (void *)payload);
 	curl_easy_setopt(curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 	curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, dload_sockopt_cb);
 	curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, (void *)handle);
+	if(useragent != NULL) {
+		curl_easy_setopt(curl, CURLOPT_USERAGENT, useragent);
+	}
+}
+
+static void curl_set_handle_opts(struct dload_payload *payload,
+		CURL *curl, char *error_buffer)
+{
+	alpm_handle_t *handle = payload->handle;
+	struct stat st;
+
+	/* the curl_easy handle is initialized with the alpm handle, so we only need
+	 * to reset the handle's parameters for each time it's used. */
+	curl_set_common_opts(handle, curl, payload->fileurl, error_buffer);
+	curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, dload_progress_cb);
+	curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, (void *)payload);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, dload_parseheader_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEHEADER, (void *)payload);
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "url: %s\n", payload->fileurl);
 
@@ -300,10 +823,6 @@ static void curl_set_handle_opts(struct dload_payload *payload,
 				(curl_off_t)payload->max_size);
 	}
 
-	if(useragent != NULL) {
-		curl_easy_setopt(curl, CURLOPT_USERAGENT, useragent);
-	}
-
 	if(!payload->allow_resume && !payload->force && payload->destfile_name &&
 			stat(payload->destfile_name, &st) == 0) {
 		/* start from scratch, but only download if our local is out of date. */
@@ -370,9 +889,6 @@ static FILE *create_tempfile(struct dload_payload *payload, const char *localpat
 	return fp;
 }
 
-/* RFC1123 states applications should support this length */
-#define HOSTNAME_SIZE 256
-
 static int curl_download_internal(struct dload_payload *payload,
 		const char *localpath, char **final_file)
 {
@@ -451,6 +967,10 @@ static int curl_download_internal(struct dload_payload *payload,
 	payload->curlerr = curl_easy_perform(curl);
 	_alpm_log(handle, ALPM_LOG_DEBUG, "curl returned error %d from transfer\n",
 			payload->curlerr);
+	/* neither does a missing optional file */
+	if(payload->curlerr != CURLE_HTTP_RETURNED_ERROR || !payload->errors_ok) {
+		mirror_record(handle, curl, payload->curlerr, payload->fileurl);
+	}
 
 	/* disconnect relationships from the curl handle for things that might go out
 	 * of scope, but could still be touched on connection teardown.  This really
@@ -592,6 +1112,436 @@ cleanup:
 
 	return ret;
 }
+
+/* Files of at least DLOAD_SEGMENT_THRESHOLD bytes are fetched in byte ranges
+ * over up to DLOAD_MAX_CONNECTIONS connections, each to a different server.
+ * The file is cut into a few more segments than there are connections and
+ * every connection takes the next pending segment when it finishes one, so
+ * faster servers end up carrying more of the file. A segment that fails goes
+ * back to the queue, to be resumed where it stopped, and its connection moves
+ * on to a server not yet in use. */
+#define DLOAD_SEGMENT_THRESHOLD (16 * 1024 * 1024)
+#define DLOAD_MAX_CONNECTIONS 4
+#define DLOAD_MIN_SEGMENT (1024 * 1024)
+
+enum {
+	SEGMENT_PENDING = 0,
+	SEGMENT_ACTIVE,
+	SEGMENT_DONE
+};
+
+struct dload_segment {
+	off_t offset;
+	off_t length;
+	off_t received;
+	int state;
+};
+
+struct dload_segmented;
+
+struct dload_conn {
+	struct dload_segmented *dl;
+	CURL *curl;
+	char *url;
+	struct dload_segment *segment;
+	int range_checked;
+	char error_buffer[CURL_ERROR_SIZE];
+};
+
+struct dload_segmented {
+	struct dload_payload *payload;
+	int fd;
+	int created;
+	off_t size;
+	off_t received;
+	struct dload_segment *segments;
+	size_t segment_count;
+	alpm_list_t *spare;     /* servers without a connection yet */
+};
+
+static size_t segment_write_cb(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	struct dload_conn *conn = data;
+	struct dload_segmented *dl = conn->dl;
+	struct dload_segment *segment = conn->segment;
+	alpm_handle_t *handle = dl->payload->handle;
+	size_t realsize = size * nmemb, written = 0;
+
+	if(dload_interrupted) {
+		return 0;
+	}
+
+	/* a server that ignores the range would send the whole file */
+	if(!conn->range_checked) {
+		long respcode = 0;
+		curl_easy_getinfo(conn->curl, CURLINFO_RESPONSE_CODE, &respcode);
+		if(respcode != 206) {
+			snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+					"range request answered with %ld", respcode);
+			return 0;
+		}
+		conn->range_checked = 1;
+	}
+
+	if((off_t)realsize > segment->length - segment->received) {
+		snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+				"server sent more than the requested range");
+		return 0;
+	}
+
+	while(written < realsize) {
+		ssize_t n = pwrite(dl->fd, ptr + written, realsize - written,
+				segment->offset + segment->received + (off_t)written);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+					"%s", strerror(errno));
+			return 0;
+		}
+		written += (size_t)n;
+	}
+
+	segment->received += (off_t)realsize;
+	dl->received += (off_t)realsize;
+	if(handle->dlcb) {
+		handle->dlcb(dl->payload->remote_name, dl->received, dl->size);
+	}
+	return realsize;
+}
+
+static int segment_progress_cb(void UNUSED *data, double UNUSED dltotal,
+		double UNUSED dlnow, double UNUSED ultotal, double UNUSED ulnow)
+{
+	/* SIGINT sent, abort by alerting curl */
+	return dload_interrupted != 0;
+}
+
+static struct dload_segment *segment_next(struct dload_segmented *dl)
+{
+	size_t i;
+
+	for(i = 0; i < dl->segment_count; i++) {
+		if(dl->segments[i].state == SEGMENT_PENDING) {
+			return dl->segments + i;
+		}
+	}
+	return NULL;
+}
+
+/* point a connection at a server, NULL to take the next spare one */
+static int conn_set_server(struct dload_conn *conn, const char *server)
+{
+	struct dload_payload *payload = conn->dl->payload;
+	size_t len;
+
+	if(server == NULL) {
+		if(conn->dl->spare == NULL) {
+			/* out of servers, the connection retires */
+			FREE(conn->url);
+			return -1;
+		}
+		server = conn->dl->spare->data;
+		conn->dl->spare = conn->dl->spare->next;
+	}
+
+	free(conn->url);
+	len = strlen(server) + strlen(payload->remote_name) + 2;
+	MALLOC(conn->url, len, RET_ERR(payload->handle, ALPM_ERR_MEMORY, -1));
+	snprintf(conn->url, len, "%s/%s", server, payload->remote_name);
+	return 0;
+}
+
+/* start the next pending segment on a connection */
+static int conn_start(struct dload_conn *conn, CURLM *multi)
+{
+	struct dload_segment *segment = segment_next(conn->dl);
+	char range[64];
+
+	if(segment == NULL) {
+		return -1;
+	}
+	segment->state = SEGMENT_ACTIVE;
+	conn->segment = segment;
+	conn->range_checked = 0;
+	conn->error_buffer[0] = '\0';
+
+	snprintf(range, sizeof(range), "%jd-%jd",
+			(intmax_t)(segment->offset + segment->received),
+			(intmax_t)(segment->offset + segment->length - 1));
+
+	curl_set_common_opts(conn->dl->payload->handle, conn->curl, conn->url,
+			conn->error_buffer);
+	curl_easy_setopt(conn->curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(conn->curl, CURLOPT_PROGRESSFUNCTION, segment_progress_cb);
+	curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, segment_write_cb);
+	curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, (void *)conn);
+#ifdef CURLPIPE_MULTIPLEX
+	/* rather wait for a connection that can multiplex than open another */
+	curl_easy_setopt(conn->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+
+	_alpm_log(conn->dl->payload->handle, ALPM_LOG_DEBUG,
+			"url: %s, range %s\n", conn->url, range);
+	curl_multi_add_handle(multi, conn->curl);
+	return 0;
+}
+
+/* handle a finished transfer; returns 0 if the connection is still usable */
+static int conn_finish(struct dload_conn *conn, CURLM *multi, CURLcode result)
+{
+	struct dload_segment *segment = conn->segment;
+	alpm_handle_t *handle = conn->dl->payload->handle;
+
+	curl_multi_remove_handle(multi, conn->curl);
+	/* write errors are ours: a refused range or a local I/O error */
+	if(result != CURLE_WRITE_ERROR) {
+		mirror_record(handle, conn->curl, result, conn->url);
+	}
+	conn->segment = NULL;
+
+	if(result == CURLE_OK && segment->received == segment->length) {
+		segment->state = SEGMENT_DONE;
+		return 0;
+	}
+
+	/* give the rest of the segment to whichever connection is free next and
+	 * move this one to a fresh server */
+	segment->state = SEGMENT_PENDING;
+	_alpm_log(handle, ALPM_LOG_DEBUG, "range of %s failed from %s: %s\n",
+			conn->dl->payload->remote_name, conn->url,
+			conn->error_buffer[0] ? conn->error_buffer : curl_easy_strerror(result));
+	return conn_set_server(conn, NULL);
+}
+
+static int segments_complete(struct dload_segmented *dl)
+{
+	size_t i;
+
+	for(i = 0; i < dl->segment_count; i++) {
+		if(dl->segments[i].state != SEGMENT_DONE) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int segmented_checksum_ok(struct dload_payload *payload)
+{
+	char *sum = NULL;
+	int ok;
+
+	if(payload->sha256sum) {
+		sum = alpm_compute_sha256sum(payload->tempfile_name);
+		ok = sum && strcmp(sum, payload->sha256sum) == 0;
+	} else if(payload->md5sum) {
+		sum = alpm_compute_md5sum(payload->tempfile_name);
+		ok = sum && strcmp(sum, payload->md5sum) == 0;
+	} else {
+		/* nothing to compare with here, validation still follows later */
+		ok = 1;
+	}
+	free(sum);
+	return ok;
+}
+
+static int curl_download_segmented(struct dload_payload *payload,
+		alpm_list_t *servers, const char *localpath)
+{
+	alpm_handle_t *handle = payload->handle;
+	struct dload_segmented dl;
+	struct dload_conn conns[DLOAD_MAX_CONNECTIONS];
+	struct sigaction orig_sig_pipe, orig_sig_int;
+	CURLM *multi;
+	alpm_list_t *i;
+	size_t idx, nconns = 0, active = 0;
+	off_t seglen, offset;
+	struct stat st;
+	int ret = -1;
+
+	memset(&dl, 0, sizeof(dl));
+	memset(conns, 0, sizeof(conns));
+	dl.payload = payload;
+	dl.fd = -1;
+	dl.size = payload->max_size;
+
+	/* local mirrors need no help, and a partial file from an earlier attempt
+	 * is cheaper to resume from a single server */
+	for(i = servers; i; i = i->next) {
+		const char *server = i->data;
+		if(server[0] == '/' || strncmp(server, "file://", 7) == 0) {
+			return -1;
+		}
+	}
+
+	FREE(payload->tempfile_name);
+	FREE(payload->destfile_name);
+	payload->destfile_name = get_fullpath(localpath, payload->remote_name, "");
+	payload->tempfile_name = get_fullpath(localpath, payload->remote_name, ".part");
+	if(!payload->destfile_name || !payload->tempfile_name ||
+			stat(payload->tempfile_name, &st) == 0) {
+		return -1;
+	}
+
+	nconns = alpm_list_count(servers);
+	if(nconns > DLOAD_MAX_CONNECTIONS) {
+		nconns = DLOAD_MAX_CONNECTIONS;
+	}
+	seglen = dl.size / (off_t)(nconns * 4);
+	if(seglen < DLOAD_MIN_SEGMENT) {
+		seglen = DLOAD_MIN_SEGMENT;
+	}
+	dl.segment_count = (size_t)(dl.size / seglen);
+	CALLOC(dl.segments, dl.segment_count, sizeof(struct dload_segment),
+			RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	for(idx = 0, offset = 0; idx < dl.segment_count; idx++) {
+		off_t end = dl.size / (off_t)dl.segment_count * (off_t)(idx + 1);
+		if(idx == dl.segment_count - 1) {
+			end = dl.size;
+		}
+		dl.segments[idx].offset = offset;
+		dl.segments[idx].length = end - offset;
+		offset = end;
+	}
+
+	if((multi = curl_multi_init()) == NULL) {
+		free(dl.segments);
+		return -1;
+	}
+#ifdef CURLPIPE_MULTIPLEX
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+
+	dl.fd = open(payload->tempfile_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if(dl.fd < 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not open file %s: %s\n",
+				payload->tempfile_name, strerror(errno));
+		goto cleanup;
+	}
+	dl.created = 1;
+
+	_alpm_log(handle, ALPM_LOG_DEBUG,
+			"downloading %s in %zd segments over %zd connections\n",
+			payload->remote_name, dl.segment_count, nconns);
+
+	mask_signal(SIGPIPE, SIG_IGN, &orig_sig_pipe);
+	mask_signal(SIGINT, &inthandler, &orig_sig_int);
+
+	if(handle->dlcb) {
+		handle->dlcb(payload->remote_name, 0, dl.size);
+	}
+
+	dl.spare = servers;
+	for(idx = 0; idx < nconns; idx++) {
+		conns[idx].dl = &dl;
+		if((conns[idx].curl = curl_easy_init()) == NULL ||
+				conn_set_server(conns + idx, NULL) != 0) {
+			break;
+		}
+		if(conn_start(conns + idx, multi) == 0) {
+			active++;
+		}
+	}
+
+	while(active > 0 && !dload_interrupted) {
+		CURLMsg *msg;
+		int running, left;
+
+		if(curl_multi_perform(multi, &running) != CURLM_OK ||
+				curl_multi_wait(multi, NULL, 0, 1000, NULL) != CURLM_OK) {
+			break;
+		}
+
+		while((msg = curl_multi_info_read(multi, &left)) != NULL) {
+			struct dload_conn *conn = NULL;
+
+			if(msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			for(idx = 0; idx < nconns; idx++) {
+				if(conns[idx].curl == msg->easy_handle) {
+					conn = conns + idx;
+					break;
+				}
+			}
+			if(conn == NULL || conn->segment == NULL) {
+				continue;
+			}
+			active--;
+			if(conn_finish(conn, multi, msg->data.result) == 0 &&
+					conn_start(conn, multi) == 0) {
+				active++;
+			}
+		}
+
+		/* a segment may have gone back to the queue with no connection left
+		 * free to pick it up; wake up an idle one */
+		for(idx = 0; idx < nconns && segment_next(&dl); idx++) {
+			if(conns[idx].curl && conns[idx].url && conns[idx].segment == NULL &&
+					conn_start(conns + idx, multi) == 0) {
+				active++;
+			}
+		}
+	}
+
+	for(idx = 0; idx < nconns; idx++) {
+		if(conns[idx].segment) {
+			curl_multi_remove_handle(multi, conns[idx].curl);
+		}
+	}
+
+	unmask_signal(SIGINT, &orig_sig_int);
+	unmask_signal(SIGPIPE, &orig_sig_pipe);
+
+	if(dload_interrupted || !segments_complete(&dl)) {
+		goto cleanup;
+	}
+
+	if(close(dl.fd) != 0) {
+		dl.fd = -1;
+		goto cleanup;
+	}
+	dl.fd = -1;
+
+	/* ranges from different servers only make up the package if all of them
+	 * served the same file */
+	if(!segmented_checksum_ok(payload)) {
+		_alpm_log(handle, ALPM_LOG_DEBUG,
+				"segments of %s do not match its checksum\n", payload->remote_name);
+		goto cleanup;
+	}
+
+	if(rename(payload->tempfile_name, payload->destfile_name)) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not rename %s to %s (%s)\n"),
+				payload->tempfile_name, payload->destfile_name, strerror(errno));
+		goto cleanup;
+	}
+	ret = 0;
+
+cleanup:
+	if(dl.fd >= 0) {
+		close(dl.fd);
+	}
+	if(ret == -1 && dl.created) {
+		/* the partial file has holes; it can not be resumed */
+		unlink(payload->tempfile_name);
+	}
+	for(idx = 0; idx < nconns; idx++) {
+		if(conns[idx].curl) {
+			curl_easy_cleanup(conns[idx].curl);
+		}
+		free(conns[idx].url);
+	}
+	curl_multi_cleanup(multi);
+	free(dl.segments);
+
+	/* if we were interrupted, trip the old handler */
+	if(dload_interrupted) {
+		raise(SIGINT);
+	}
+	return ret;
+}
 #endif
 
 /** Download a file given by a URL to a local directory.
@@ -607,6 +1557,10 @@ int _alpm_download(struct dload_payload *payload, const char *localpath,
 	alpm_handle_t *handle = payload->handle;
 
 	if(handle->fetchcb == NULL) {
+		int ret = local_download(payload, localpath, final_file);
+		if(ret != LOCAL_UNHANDLED) {
+			return ret;
+		}
 #ifdef HAVE_LIBCURL
 		return curl_download_internal(payload, localpath, final_file);
 #else
@@ -621,6 +1575,32 @@ int _alpm_download(struct dload_payload *payload, const char *localpath,
 	}
 }
 
+/** Download a large file in byte ranges from several servers at once.
+ * Files below the size threshold, downloads through the fetch callback and
+ * files with only one server are left to the single server download, as is
+ * any download this fails on; the partial file is removed in that case.
+ * @param payload the payload context, max_size holding the file size
+ * @param servers the servers to use, best first
+ * @param localpath the directory to save the file in
+ * @return 0 on success, -1 if the file still needs to be downloaded
+ */
+int _alpm_download_segmented(struct dload_payload *payload,
+		alpm_list_t *servers, const char *localpath)
+{
+#ifdef HAVE_LIBCURL
+	if(payload->handle->fetchcb == NULL &&
+			payload->max_size >= DLOAD_SEGMENT_THRESHOLD &&
+			alpm_list_count(servers) > 1) {
+		return curl_download_segmented(payload, servers, localpath);
+	}
+#else
+	(void)payload;
+	(void)servers;
+	(void)localpath;
+#endif
+	return -1;
+}
+
 static char *filecache_find_url(alpm_handle_t *handle, const char *url)
 {
 	const char *filebase = strrchr(url, '/');
@@ -39,6 +39,8 @@ struct dload_payload {
 	int errors_ok;
 	int unlink_on_fail;
 	alpm_list_t *servers;
+	const char *md5sum;     /* expected checksums of the file, if known */
+	const char *sha256sum;
 #ifdef HAVE_LIBCURL
 	CURLcode curlerr;       /* last error produced by curl */
 #endif
@@ -48,6 +50,13 @@ void _alpm_dload_payload_reset(struct dload_payload *payload);
 
 int _alpm_download(struct dload_payload *payload, const char *localpath,
 		char **final_file);
+int _alpm_download_segmented(struct dload_payload *payload,
+		alpm_list_t *servers, const char *localpath);
+
+alpm_list_t *_alpm_dload_rank_servers(alpm_handle_t *handle,
+		alpm_list_t *servers, off_t size);
+void _alpm_dload_save_mirrorstats(alpm_handle_t *handle);
+void _alpm_dload_free_mirrorstats(alpm_handle_t *handle);
 
 #endif /* _ALPM_DLOAD_H */
 
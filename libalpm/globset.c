@@ -0,0 +1,316 @@
+/*
+ *  globset.c
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Globs are kept in two tries: one over the literal text a glob starts
+ * with, and for globs starting with a wildcard, one over the reversed
+ * literal text it ends with. Walking a path down the first trie and its
+ * reverse down the second yields every glob whose fixed parts agree with
+ * the path; fnmatch() only runs on those. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+/* libalpm */
+#include "globset.h"
+#include "alpm_list.h"
+#include "util.h"
+
+/* characters that make a pattern more than a literal path for fnmatch() */
+#define GLOB_SPECIAL "*?[\\"
+
+struct gs_node {
+	char c;
+	struct gs_node *child;
+	struct gs_node *sibling;
+	alpm_list_t *globs;       /* globs whose literal part ends here */
+};
+
+struct __alpm_globset_t {
+	/* literal paths, linear probing in a power of two sized table */
+	char **literals;
+	size_t buckets;
+	size_t count;
+
+	struct gs_node prefixes;
+	struct gs_node suffixes;
+	alpm_list_t *anywhere;    /* globs without a literal prefix or suffix */
+	alpm_list_t *globs;       /* the copies of all globs, for freeing */
+};
+
+/** Create an empty set.
+ * @return the set, NULL on allocation failure
+ */
+alpm_globset_t *_alpm_globset_new(void)
+{
+	alpm_globset_t *set;
+
+	CALLOC(set, 1, sizeof(alpm_globset_t), return NULL);
+	return set;
+}
+
+static int literal_insert(char **table, size_t buckets, char *path)
+{
+	size_t i = _alpm_hash_sdbm(path) & (buckets - 1);
+
+	while(table[i]) {
+		if(strcmp(table[i], path) == 0) {
+			return 0;
+		}
+		i = (i + 1) & (buckets - 1);
+	}
+	table[i] = path;
+	return 1;
+}
+
+static int literal_add(alpm_globset_t *set, const char *pattern)
+{
+	char *path;
+
+	/* keep the load at most one half */
+	if((set->count + 1) * 2 > set->buckets) {
+		size_t i, buckets = set->buckets ? set->buckets * 2 : 64;
+		char **table;
+
+		CALLOC(table, buckets, sizeof(char *), return -1);
+		for(i = 0; i < set->buckets; i++) {
+			if(set->literals[i]) {
+				literal_insert(table, buckets, set->literals[i]);
+			}
+		}
+		free(set->literals);
+		set->literals = table;
+		set->buckets = buckets;
+	}
+
+	STRDUP(path, pattern, return -1);
+	if(literal_insert(set->literals, set->buckets, path)) {
+		set->count++;
+	} else {
+		free(path);
+	}
+	return 0;
+}
+
+static int literal_find(const alpm_globset_t *set, const char *path)
+{
+	size_t i;
+
+	if(set->count == 0) {
+		return 0;
+	}
+	i = _alpm_hash_sdbm(path) & (set->buckets - 1);
+	while(set->literals[i]) {
+		if(strcmp(set->literals[i], path) == 0) {
+			return 1;
+		}
+		i = (i + 1) & (set->buckets - 1);
+	}
+	return 0;
+}
+
+static struct gs_node *node_child(struct gs_node *node, char c, int create)
+{
+	struct gs_node *child;
+
+	for(child = node->child; child; child = child->sibling) {
+		if(child->c == c) {
+			return child;
+		}
+	}
+	if(!create) {
+		return NULL;
+	}
+	CALLOC(child, 1, sizeof(struct gs_node), return NULL);
+	child->c = c;
+	child->sibling = node->child;
+	node->child = child;
+	return child;
+}
+
+/* file a glob under text, read backwards if reverse is set */
+static int node_add(struct gs_node *node, const char *text, size_t len,
+		int reverse, char *glob)
+{
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		node = node_child(node, reverse ? text[len - 1 - i] : text[i], 1);
+		if(node == NULL) {
+			return -1;
+		}
+	}
+	node->globs = alpm_list_add(node->globs, glob);
+	return 0;
+}
+
+static void node_free(struct gs_node *node)
+{
+	struct gs_node *child = node->child;
+
+	while(child) {
+		struct gs_node *next = child->sibling;
+		node_free(child);
+		free(child);
+		child = next;
+	}
+	alpm_list_free(node->globs);
+}
+
+static int try_globs(alpm_list_t *globs, const char *path)
+{
+	alpm_list_t *i;
+
+	for(i = globs; i; i = i->next) {
+		if(fnmatch(i->data, path, 0) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** Add a pattern to a set.
+ * @param set the set
+ * @param pattern a path or shell wildcard pattern
+ * @return 0 on success, -1 on allocation failure
+ */
+int _alpm_globset_add(alpm_globset_t *set, const char *pattern)
+{
+	size_t prefix, suffix, len;
+	char *glob;
+
+	prefix = strcspn(pattern, GLOB_SPECIAL);
+	if(pattern[prefix] == '\0') {
+		return literal_add(set, pattern);
+	}
+
+	STRDUP(glob, pattern, return -1);
+	set->globs = alpm_list_add(set->globs, glob);
+
+	if(prefix > 0) {
+		return node_add(&set->prefixes, pattern, prefix, 0, glob);
+	}
+
+	/* whatever follows the last special character must end the path; a ']'
+	 * there may close a bracket expression */
+	len = strlen(pattern);
+	for(suffix = 0; suffix < len; suffix++) {
+		char c = pattern[len - 1 - suffix];
+		if(c == ']' || strchr(GLOB_SPECIAL, c)) {
+			break;
+		}
+	}
+	if(suffix > 0) {
+		return node_add(&set->suffixes, pattern + len - suffix, suffix, 1, glob);
+	}
+	set->anywhere = alpm_list_add(set->anywhere, glob);
+	return 0;
+}
+
+/** Add a path to a set, which only matches itself even if it contains
+ * wildcard characters.
+ * @param set the set
+ * @param path the path
+ * @return 0 on success, -1 on allocation failure
+ */
+int _alpm_globset_add_literal(alpm_globset_t *set, const char *path)
+{
+	return literal_add(set, path);
+}
+
+/** Add a list of patterns to a set.
+ * @param set the set
+ * @param patterns a list of (char *) paths or shell wildcard patterns
+ * @return 0 on success, -1 on allocation failure
+ */
+int _alpm_globset_add_list(alpm_globset_t *set, alpm_list_t *patterns)
+{
+	alpm_list_t *i;
+
+	for(i = patterns; i; i = i->next) {
+		if(_alpm_globset_add(set, i->data) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** Check whether a path matches any pattern of a set.
+ * @param set the set, NULL for an empty one
+ * @param path the path to check
+ * @return 1 if a pattern matches, 0 otherwise
+ */
+int _alpm_globset_match(const alpm_globset_t *set, const char *path)
+{
+	const struct gs_node *node;
+	size_t i, len;
+
+	if(set == NULL) {
+		return 0;
+	}
+	if(literal_find(set, path)) {
+		return 1;
+	}
+
+	node = &set->prefixes;
+	for(i = 0; path[i] && node->child; i++) {
+		node = node_child((struct gs_node *)node, path[i], 0);
+		if(node == NULL) {
+			break;
+		}
+		if(try_globs(node->globs, path)) {
+			return 1;
+		}
+	}
+
+	len = strlen(path);
+	node = &set->suffixes;
+	for(i = 0; i < len && node->child; i++) {
+		node = node_child((struct gs_node *)node, path[len - 1 - i], 0);
+		if(node == NULL) {
+			break;
+		}
+		if(try_globs(node->globs, path)) {
+			return 1;
+		}
+	}
+
+	return try_globs(set->anywhere, path);
+}
+
+/** Free a set and its patterns. */
+void _alpm_globset_free(alpm_globset_t *set)
+{
+	size_t i;
+
+	if(set == NULL) {
+		return;
+	}
+	for(i = 0; i < set->buckets; i++) {
+		free(set->literals[i]);
+	}
+	free(set->literals);
+	node_free(&set->prefixes);
+	node_free(&set->suffixes);
+	alpm_list_free(set->anywhere);
+	FREELIST(set->globs);
+	free(set);
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,40 @@
+/*
+ *  globset.h
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALPM_GLOBSET_H
+#define _ALPM_GLOBSET_H
+
+#include "alpm_list.h"
+
+/* A set of shell wildcard patterns matched like _alpm_fnmatch() does, but
+ * without trying every pattern: literal paths are looked up in a hash
+ * table, and globs are indexed by the literal text they start or end with,
+ * so only the globs sharing that text with a path are tried on it.
+ * Matching does not modify the set and may be done from several threads. */
+typedef struct __alpm_globset_t alpm_globset_t;
+
+alpm_globset_t *_alpm_globset_new(void);
+int _alpm_globset_add(alpm_globset_t *set, const char *pattern);
+int _alpm_globset_add_literal(alpm_globset_t *set, const char *path);
+int _alpm_globset_add_list(alpm_globset_t *set, alpm_list_t *patterns);
+int _alpm_globset_match(const alpm_globset_t *set, const char *path);
+void _alpm_globset_free(alpm_globset_t *set);
+
+#endif /* _ALPM_GLOBSET_H */
+
+/* vim: set ts=2 sw=2 noet: */
@@ -35,15 +35,27 @@
 #include "util.h"
 #include "log.h"
 #include "delta.h"
+#include "dload.h"
 #include "trans.h"
+#include "signing.h"
 #include "alpm.h"
 
 alpm_handle_t *_alpm_handle_new(void)
 {
 	alpm_handle_t *handle;
+	pthread_mutexattr_t attr;
 
 	CALLOC(handle, 1, sizeof(alpm_handle_t), return NULL);
 	handle->deltaratio = 0.0;
+	/* recursive, a log callback may well call alpm_logaction() */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&handle->log_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&handle->sigcache_lock, NULL);
+#if HAVE_LIBGPGME
+	pthread_mutex_init(&handle->gpgme_lock, NULL);
+#endif
 
 	return handle;
 }
@@ -67,24 +79,34 @@ void _alpm_handle_free(alpm_handle_t *handle)
 #ifdef HAVE_LIBCURL
 	/* release curl handle */
 	curl_easy_cleanup(handle->curl);
+	if(handle->curlsh) {
+		curl_share_cleanup(handle->curlsh);
+	}
 #endif
+	_alpm_dload_free_mirrorstats(handle);
 
 	regfree(&handle->delta_regex);
 
+	_alpm_sigcache_save(handle);
+	_alpm_gpgme_cleanup(handle);
+
 	/* free memory */
 	_alpm_trans_free(handle->trans);
 	FREE(handle->root);
 	FREE(handle->dbpath);
 	FREELIST(handle->cachedirs);
+	FREE(handle->sharedcachedir);
 	FREE(handle->logfile);
 	FREE(handle->lockfile);
 	FREE(handle->arch);
 	FREE(handle->gpgdir);
+	_alpm_sigcache_free(handle);
 	FREELIST(handle->dbs_sync);
 	FREELIST(handle->noupgrade);
 	FREELIST(handle->noextract);
 	FREELIST(handle->ignorepkg);
 	FREELIST(handle->ignoregroup);
+	pthread_mutex_destroy(&handle->log_lock);
 	FREE(handle);
 }
 
@@ -211,6 +233,12 @@ const char SYMEXPORT *alpm_option_get_lockfile(alpm_handle_t *handle)
 	return handle->lockfile;
 }
 
+const char SYMEXPORT *alpm_option_get_sharedcachedir(alpm_handle_t *handle)
+{
+	CHECK_HANDLE(handle, return NULL);
+	return handle->sharedcachedir;
+}
+
 const char SYMEXPORT *alpm_option_get_gpgdir(alpm_handle_t *handle)
 {
 	CHECK_HANDLE(handle, return NULL);
@@ -265,6 +293,18 @@ int SYMEXPORT alpm_option_get_checkspace(alpm_handle_t *handle)
 	return handle->checkspace;
 }
 
+int SYMEXPORT alpm_option_get_parallelextract(alpm_handle_t *handle)
+{
+	CHECK_HANDLE(handle, return -1);
+	return handle->parallelextract;
+}
+
+alpm_syncpolicy_t SYMEXPORT alpm_option_get_syncpolicy(alpm_handle_t *handle)
+{
+	CHECK_HANDLE(handle, return -1);
+	return handle->syncpolicy;
+}
+
 int SYMEXPORT alpm_option_set_logcb(alpm_handle_t *handle, alpm_cb_log cb)
 {
 	CHECK_HANDLE(handle, return -1);
@@ -439,6 +479,24 @@ int SYMEXPORT alpm_option_set_logfile(alpm_handle_t *handle, const char *logfile
 	return 0;
 }
 
+int SYMEXPORT alpm_option_set_sharedcachedir(alpm_handle_t *handle,
+		const char *sharedcachedir)
+{
+	CHECK_HANDLE(handle, return -1);
+	FREE(handle->sharedcachedir);
+	if(!sharedcachedir) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "option 'sharedcachedir' = (none)\n");
+		return 0;
+	}
+	handle->sharedcachedir = canonicalize_path(sharedcachedir);
+	if(!handle->sharedcachedir) {
+		RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+	}
+	_alpm_log(handle, ALPM_LOG_DEBUG, "option 'sharedcachedir' = %s\n",
+			handle->sharedcachedir);
+	return 0;
+}
+
 int SYMEXPORT alpm_option_set_gpgdir(alpm_handle_t *handle, const char *gpgdir)
 {
 	CHECK_HANDLE(handle, return -1);
@@ -600,6 +658,26 @@ int SYMEXPORT alpm_option_set_checkspace(alpm_handle_t *handle, int checkspace)
 	return 0;
 }
 
+int SYMEXPORT alpm_option_set_parallelextract(alpm_handle_t *handle,
+		int parallelextract)
+{
+	CHECK_HANDLE(handle, return -1);
+	handle->parallelextract = parallelextract;
+	return 0;
+}
+
+int SYMEXPORT alpm_option_set_syncpolicy(alpm_handle_t *handle,
+		alpm_syncpolicy_t policy)
+{
+	CHECK_HANDLE(handle, return -1);
+	if(policy != ALPM_SYNCPOLICY_NONE && policy != ALPM_SYNCPOLICY_PACKAGE
+			&& policy != ALPM_SYNCPOLICY_TRANSACTION) {
+		RET_ERR(handle, ALPM_ERR_WRONG_ARGS, -1);
+	}
+	handle->syncpolicy = policy;
+	return 0;
+}
+
 int SYMEXPORT alpm_option_set_default_siglevel(alpm_handle_t *handle,
 		alpm_siglevel_t level)
 {
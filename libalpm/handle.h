@@ -31,6 +31,8 @@
 #include <curl/curl.h>
 #endif
 
+#include <pthread.h>
+
 #define EVENT(h, e, d1, d2) \
 do { \
 	if((h)->eventcb) { \
@@ -61,6 +63,10 @@ struct __alpm_handle_t {
 #ifdef HAVE_LIBCURL
 	/* libcurl handle */
 	CURL *curl;             /* reusable curl_easy handle */
+	CURLSH *curlsh;         /* connections, DNS and TLS sessions of all transfers */
+	alpm_list_t *mirrorstats; /* transfer statistics per host, see dload.c */
+	int mirrorstats_loaded;
+	int mirrorstats_dirty;
 #endif
 
 	/* callback functions */
@@ -79,6 +85,7 @@ struct __alpm_handle_t {
 	char *lockfile;          /* Name of the lock file */
 	char *gpgdir;            /* Directory where GnuPG files are stored */
 	alpm_list_t *cachedirs;  /* Paths to pacman cache directories */
+	char *sharedcachedir;    /* Content addressed cache shared with other roots */
 
 	/* package lists */
 	alpm_list_t *noupgrade;   /* List of packages NOT to be upgraded */
@@ -91,11 +98,29 @@ struct __alpm_handle_t {
 	double deltaratio;       /* Download deltas if possible; a ratio value */
 	int usesyslog;           /* Use syslog instead of logfile? */ /* TODO move to frontend */
 	int checkspace;          /* Check disk space before installing */
+	int parallelextract;     /* Extract independent packages concurrently */
+	alpm_syncpolicy_t syncpolicy; /* When written files are flushed to disk */
 	alpm_siglevel_t siglevel;   /* Default signature verification level */
 
 	/* error code */
 	alpm_errno_t pm_errno;
 
+	/* serializes the log callback and log file for worker threads */
+	pthread_mutex_t log_lock;
+
+#if HAVE_LIBGPGME
+	/* pool of idle gpgme contexts, see signing.c */
+	alpm_list_t *gpgme_ctxs;
+	pthread_mutex_t gpgme_lock;
+#endif
+
+	/* signature verification cache, see signing.c */
+	struct _alpm_sigentry_t *sigcache;  /* known good verifications, by key */
+	size_t sigcache_count;
+	char *sigcache_stamp;    /* keyring state the cached keys belong to */
+	int sigcache_dirty;      /* keys were added since the cache was written */
+	pthread_mutex_t sigcache_lock;
+
 	/* for delta parsing efficiency */
 	int delta_regex_compiled;
 	regex_t delta_regex;
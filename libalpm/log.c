@@ -45,6 +45,8 @@ int SYMEXPORT alpm_logaction(alpm_handle_t *handle, const char *fmt, ...)
 
 	ASSERT(handle != NULL, return -1);
 
+	pthread_mutex_lock(&handle->log_lock);
+
 	/* check if the logstream is open already, opening it if needed */
 	if(handle->logstream == NULL) {
 		handle->logstream = fopen(handle->logfile, "a");
@@ -57,6 +59,7 @@ int SYMEXPORT alpm_logaction(alpm_handle_t *handle, const char *fmt, ...)
 			} else {
 				handle->pm_errno = ALPM_ERR_SYSTEM;
 			}
+			pthread_mutex_unlock(&handle->log_lock);
 			return -1;
 		}
 	}
@@ -65,6 +68,8 @@ int SYMEXPORT alpm_logaction(alpm_handle_t *handle, const char *fmt, ...)
 	ret = _alpm_logaction(handle, fmt, args);
 	va_end(args);
 
+	pthread_mutex_unlock(&handle->log_lock);
+
 	/* TODO	We should add a prefix to log strings depending on who called us.
 	 * If logaction was called by the frontend:
 	 *   USER: <the frontend log>
@@ -89,9 +94,11 @@ void _alpm_log(alpm_handle_t *handle, alpm_loglevel_t flag, const char *fmt, ...
 		return;
 	}
 
+	pthread_mutex_lock(&handle->log_lock);
 	va_start(args, fmt);
 	handle->logcb(flag, fmt, args);
 	va_end(args);
+	pthread_mutex_unlock(&handle->log_lock);
 }
 
 /* vim: set ts=2 sw=2 noet: */
@@ -72,7 +72,7 @@
 /*
  * MD5 context setup
  */
-static void md5_starts( md5_context *ctx )
+void md5_starts( md5_context *ctx )
 {
     ctx->total[0] = 0;
     ctx->total[1] = 0;
@@ -209,7 +209,7 @@ static void md5_process( md5_context *ctx, const unsigned char data[64] )
 /*
  * MD5 process buffer
  */
-static void md5_update( md5_context *ctx, const unsigned char *input, size_t ilen )
+void md5_update( md5_context *ctx, const unsigned char *input, size_t ilen )
 {
     size_t fill;
     uint32_t left;
@@ -261,7 +261,7 @@ static const unsigned char md5_padding[64] =
 /*
  * MD5 final digest
  */
-static void md5_finish( md5_context *ctx, unsigned char output[16] )
+void md5_finish( md5_context *ctx, unsigned char output[16] )
 {
     uint32_t last, padn;
     uint32_t high, low;
@@ -0,0 +1,486 @@
+/*
+ *  mtdecode.c
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The compressed file is mapped into memory and decoded in parallel;
+ * libarchive reads the decoded data through its client callbacks.
+ * xz streams are handed to the multi-threaded decoder of liblzma, which
+ * decodes blocks concurrently when their sizes are stored in the block
+ * headers, as xz -T writes them. zstd frames are independent of each
+ * other, so a pool of workers decodes whole frames ahead of the reader. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/* libarchive */
+#include <archive.h>
+
+/* libalpm */
+#include "mtdecode.h"
+#include "util.h"
+
+/* below this compressed size one thread is fast enough */
+#define MT_MIN_SIZE (4 * 1024 * 1024)
+#define MT_MAX_THREADS 64
+/* memory for decoded data when the amount of RAM is unknown */
+#define MT_DEFAULT_MEMLIMIT (256 * 1024 * 1024)
+/* size of the blocks handed to libarchive from the xz decoder */
+#define MT_XZ_BUFFER_SIZE (256 * 1024)
+
+/* what libarchive reports for corrupt data, it is not in its public header */
+#ifndef ARCHIVE_ERRNO_MISC
+#define ARCHIVE_ERRNO_MISC (-1)
+#endif
+
+#if defined(HAVE_LIBLZMA) && LZMA_VERSION >= 50040002
+#define MT_XZ 1
+#endif
+
+enum mt_state {
+	FRAME_QUEUED,
+	FRAME_BUSY,
+	FRAME_DONE,
+	FRAME_FAILED
+};
+
+struct mt_frame {
+	const unsigned char *in;
+	size_t insize;
+	unsigned char *out;
+	size_t outsize;
+	enum mt_state state;
+};
+
+struct mt_decoder {
+	unsigned char *map;
+	size_t mapsize;
+	int eof;
+	int opened;         /* handed to libarchive, which frees it */
+
+#ifdef MT_XZ
+	lzma_stream lzma;
+	unsigned char *outbuf;
+#endif
+
+	/* zstd frames, decoded by the workers */
+	struct mt_frame *frames;
+	size_t nframes;
+	size_t next_job;    /* first frame not picked up by a worker */
+	size_t next_out;    /* frame handed to libarchive next */
+	size_t window;      /* how many frames may be decoded ahead */
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads;
+};
+
+static int online_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(n < 1) {
+		return 1;
+	}
+	return n > MT_MAX_THREADS ? MT_MAX_THREADS : (int)n;
+}
+
+/* how much memory decoding ahead may take, a quarter of the RAM */
+static uint64_t mt_memlimit(void)
+{
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	uint64_t limit;
+
+	if(pages < 1 || pagesize < 1) {
+		return MT_DEFAULT_MEMLIMIT;
+	}
+	limit = (uint64_t)pages * (uint64_t)pagesize / 4;
+	return limit > SIZE_MAX ? SIZE_MAX : limit;
+}
+
+static void free_decoder(struct mt_decoder *md)
+{
+	size_t i;
+
+	if(md->nthreads > 0) {
+		int t;
+		pthread_mutex_lock(&md->lock);
+		md->stop = 1;
+		pthread_cond_broadcast(&md->cond);
+		pthread_mutex_unlock(&md->lock);
+		for(t = 0; t < md->nthreads; t++) {
+			pthread_join(md->threads[t], NULL);
+		}
+	}
+	for(i = 0; i < md->nframes; i++) {
+		free(md->frames[i].out);
+	}
+	free(md->frames);
+	pthread_mutex_destroy(&md->lock);
+	pthread_cond_destroy(&md->cond);
+	free(md->threads);
+#ifdef MT_XZ
+	lzma_end(&md->lzma);
+	free(md->outbuf);
+#endif
+	munmap(md->map, md->mapsize);
+	free(md);
+}
+
+static int mt_close(struct archive UNUSED *archive, void *data)
+{
+	free_decoder(data);
+	return ARCHIVE_OK;
+}
+
+#ifdef MT_XZ
+static ssize_t xz_read(struct archive *archive, void *data, const void **buf)
+{
+	struct mt_decoder *md = data;
+	lzma_stream *strm = &md->lzma;
+
+	*buf = md->outbuf;
+	if(md->eof) {
+		return 0;
+	}
+	strm->next_out = md->outbuf;
+	strm->avail_out = MT_XZ_BUFFER_SIZE;
+	while(strm->avail_out > 0) {
+		lzma_ret ret = lzma_code(strm, LZMA_FINISH);
+		if(ret == LZMA_STREAM_END) {
+			md->eof = 1;
+			break;
+		} else if(ret != LZMA_OK) {
+			archive_set_error(archive, ARCHIVE_ERRNO_MISC,
+					"xz decompression failed (%d)", (int)ret);
+			return -1;
+		}
+	}
+	return MT_XZ_BUFFER_SIZE - strm->avail_out;
+}
+
+static int xz_open(struct archive *archive, struct mt_decoder *md, int threads)
+{
+	lzma_mt mt;
+
+	memset(&mt, 0, sizeof(mt));
+	mt.flags = LZMA_CONCATENATED;
+	mt.threads = threads;
+	/* past this much memory liblzma drops back to a single thread */
+	mt.memlimit_threading = mt_memlimit();
+	mt.memlimit_stop = UINT64_MAX;
+
+	if(lzma_stream_decoder_mt(&md->lzma, &mt) != LZMA_OK) {
+		return 1;
+	}
+	MALLOC(md->outbuf, MT_XZ_BUFFER_SIZE, return -1);
+	md->lzma.next_in = md->map;
+	md->lzma.avail_in = md->mapsize;
+
+	md->opened = 1;
+	if(archive_read_open(archive, md, NULL, xz_read, mt_close) != ARCHIVE_OK) {
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+/* decode a frame into a buffer of its own, returns 0 on success */
+/* the size of the buffer a frame is decoded into at first; zstd fails a
+ * frame whose data does not match a size given in its header */
+static uint64_t zstd_frame_size(const unsigned char *in, size_t insize)
+{
+	unsigned long long size = ZSTD_getFrameContentSize(in, insize);
+
+	if(size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR) {
+		return size > 0 ? size : 1;
+	}
+	return (uint64_t)insize * 4;
+}
+
+static int zstd_decode_frame(ZSTD_DCtx *dctx, struct mt_frame *frame)
+{
+	ZSTD_inBuffer in = { frame->in, frame->insize, 0 };
+	ZSTD_outBuffer out;
+	size_t ret, cap = (size_t)zstd_frame_size(frame->in, frame->insize);
+
+	MALLOC(frame->out, cap, return -1);
+	out.dst = frame->out;
+	out.size = cap;
+	out.pos = 0;
+
+	ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+	do {
+		if(out.pos == out.size) {
+			unsigned char *newbuf = realloc(frame->out, out.size * 2);
+			if(newbuf == NULL) {
+				return -1;
+			}
+			frame->out = newbuf;
+			out.dst = newbuf;
+			out.size *= 2;
+		}
+		ret = ZSTD_decompressStream(dctx, &out, &in);
+		if(ZSTD_isError(ret)) {
+			return -1;
+		}
+	} while(ret != 0);
+	frame->outsize = out.pos;
+	return 0;
+}
+
+/* the frames a worker may start on; the window opens up gradually, so a
+ * reader that only looks at the first entries does not make the workers
+ * decode the whole archive */
+static size_t zstd_limit(struct mt_decoder *md)
+{
+	size_t ahead = md->next_out + 1;
+
+	if(ahead > md->window) {
+		ahead = md->window;
+	}
+	return md->next_out + ahead;
+}
+
+static void *zstd_worker(void *data)
+{
+	struct mt_decoder *md = data;
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+	pthread_mutex_lock(&md->lock);
+	while(1) {
+		struct mt_frame *frame;
+		int ret;
+
+		while(!md->stop && md->next_job < md->nframes
+				&& md->next_job >= zstd_limit(md)) {
+			pthread_cond_wait(&md->cond, &md->lock);
+		}
+		if(md->stop || md->next_job >= md->nframes) {
+			break;
+		}
+		frame = &md->frames[md->next_job++];
+		frame->state = FRAME_BUSY;
+		pthread_mutex_unlock(&md->lock);
+
+		ret = dctx ? zstd_decode_frame(dctx, frame) : -1;
+
+		pthread_mutex_lock(&md->lock);
+		frame->state = ret == 0 ? FRAME_DONE : FRAME_FAILED;
+		pthread_cond_broadcast(&md->cond);
+	}
+	pthread_mutex_unlock(&md->lock);
+	ZSTD_freeDCtx(dctx);
+	return NULL;
+}
+
+static ssize_t zstd_read(struct archive *archive, void *data, const void **buf)
+{
+	struct mt_decoder *md = data;
+	struct mt_frame *frame;
+
+	pthread_mutex_lock(&md->lock);
+	do {
+		/* libarchive is done with what it got last time */
+		if(md->next_out > 0) {
+			FREE(md->frames[md->next_out - 1].out);
+		}
+		if(md->next_out == md->nframes) {
+			pthread_mutex_unlock(&md->lock);
+			*buf = NULL;
+			return 0;
+		}
+		frame = &md->frames[md->next_out];
+		while(frame->state != FRAME_DONE && frame->state != FRAME_FAILED) {
+			pthread_cond_wait(&md->cond, &md->lock);
+		}
+		if(frame->state == FRAME_FAILED) {
+			pthread_mutex_unlock(&md->lock);
+			archive_set_error(archive, ARCHIVE_ERRNO_MISC,
+					"zstd decompression failed");
+			return -1;
+		}
+		md->next_out++;
+		pthread_cond_broadcast(&md->cond);
+		/* empty frames would read as the end of the archive */
+	} while(frame->outsize == 0);
+	pthread_mutex_unlock(&md->lock);
+
+	*buf = frame->out;
+	return frame->outsize;
+}
+
+static int zstd_is_skippable(const unsigned char *p)
+{
+	return (p[0] & 0xf0) == 0x50 && p[1] == 0x2a && p[2] == 0x4d && p[3] == 0x18;
+}
+
+static int zstd_open(struct archive *archive, struct mt_decoder *md, int threads)
+{
+	const unsigned char *p = md->map;
+	size_t left = md->mapsize, count = 0, alloced = 0;
+	uint64_t memlimit = mt_memlimit(), largest = 1;
+	int t;
+
+	/* find the frames, skippable ones (as pzstd writes) carry no data */
+	while(left > 0) {
+		size_t n = ZSTD_findFrameCompressedSize(p, left);
+		if(ZSTD_isError(n)) {
+			/* leave it to libarchive to complain */
+			return 1;
+		}
+		if(!zstd_is_skippable(p)) {
+			if(count == alloced) {
+				struct mt_frame *frames;
+				alloced = alloced ? alloced * 2 : 16;
+				frames = realloc(md->frames, alloced * sizeof(struct mt_frame));
+				if(frames == NULL) {
+					return -1;
+				}
+				md->frames = frames;
+			}
+			memset(&md->frames[count], 0, sizeof(struct mt_frame));
+			md->frames[count].in = p;
+			md->frames[count].insize = n;
+			md->frames[count].state = FRAME_QUEUED;
+			count++;
+			if(zstd_frame_size(p, n) > largest) {
+				largest = zstd_frame_size(p, n);
+			}
+		}
+		p += n;
+		left -= n;
+	}
+	md->nframes = count;
+	if(count < 2) {
+		/* a single frame can only be decoded by a single thread */
+		return 1;
+	}
+
+	if(largest > memlimit / 2) {
+		/* not even two frames fit, leave it to the streaming decoder */
+		return 1;
+	}
+
+	if((size_t)threads > count) {
+		threads = count;
+	}
+	/* every frame in the window is held in memory at once */
+	md->window = threads * 2;
+	if(md->window > memlimit / largest) {
+		md->window = (size_t)(memlimit / largest);
+	}
+	if((size_t)threads > md->window) {
+		threads = (int)md->window;
+	}
+	CALLOC(md->threads, threads, sizeof(pthread_t), return -1);
+	for(t = 0; t < threads; t++) {
+		if(pthread_create(&md->threads[t], NULL, zstd_worker, md) != 0) {
+			break;
+		}
+		md->nthreads++;
+	}
+	if(md->nthreads == 0) {
+		return 1;
+	}
+
+	md->opened = 1;
+	if(archive_read_open(archive, md, NULL, zstd_read, mt_close) != ARCHIVE_OK) {
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/** Open an archive on a compressed file that is decoded by several threads.
+ * @param archive a new archive
+ * @param fd the file, which does not have to stay open
+ * @param size the size of the file
+ * @return 0 if the archive was opened, 1 if the caller has to open it
+ * itself, -1 on error
+ */
+int _alpm_mtdecode_open(struct archive *archive, int fd, off_t size)
+{
+	struct mt_decoder *md;
+	void *map;
+	int threads = online_cpus();
+	int ret = 1;
+
+	if(threads < 2 || size < MT_MIN_SIZE || (uintmax_t)size > SIZE_MAX) {
+		return 1;
+	}
+
+	map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) {
+		return 1;
+	}
+	madvise(map, (size_t)size, MADV_SEQUENTIAL);
+
+	md = calloc(1, sizeof(struct mt_decoder));
+	if(md == NULL) {
+		munmap(map, (size_t)size);
+		return -1;
+	}
+	md->map = map;
+	md->mapsize = (size_t)size;
+	pthread_mutex_init(&md->lock, NULL);
+	pthread_cond_init(&md->cond, NULL);
+
+#ifdef MT_XZ
+	{
+		static const unsigned char xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+		lzma_stream init = LZMA_STREAM_INIT;
+		md->lzma = init;
+		if(memcmp(map, xz_magic, sizeof(xz_magic)) == 0) {
+			ret = xz_open(archive, md, threads);
+		}
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	{
+		static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+		if(memcmp(map, zstd_magic, sizeof(zstd_magic)) == 0
+				|| zstd_is_skippable(map)) {
+			ret = zstd_open(archive, md, threads);
+		}
+	}
+#endif
+	/* once opened, the decoder goes away with the archive */
+	if(!md->opened) {
+		free_decoder(md);
+	}
+	return ret;
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,36 @@
+/*
+ *  mtdecode.h
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALPM_MTDECODE_H
+#define _ALPM_MTDECODE_H
+
+#include <sys/types.h> /* off_t */
+
+/* libarchive */
+#include <archive.h>
+
+/* Decodes xz streams made of several blocks and zstd streams made of
+ * several frames with one thread per core, and feeds the result to
+ * libarchive, which is then only left with the tar format. Returns 0 if
+ * the archive was opened, 1 if the file is not worth it (the caller opens
+ * it as usual) and -1 on error. */
+int _alpm_mtdecode_open(struct archive *archive, int fd, off_t size);
+
+#endif /* _ALPM_MTDECODE_H */
+
+/* vim: set ts=2 sw=2 noet: */
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 /* libalpm */
 #include "package.h"
@@ -103,6 +104,7 @@ static alpm_list_t *_pkg_get_provides(alpm_pkg_t *pkg)   { return pkg->provides;
 static alpm_list_t *_pkg_get_replaces(alpm_pkg_t *pkg)   { return pkg->replaces; }
 static alpm_filelist_t *_pkg_get_files(alpm_pkg_t *pkg)  { return &(pkg->files); }
 static alpm_list_t *_pkg_get_backup(alpm_pkg_t *pkg)     { return pkg->backup; }
+static alpm_list_t *_pkg_get_dirsizes(alpm_pkg_t *pkg)   { return pkg->dirsizes; }
 
 static void *_pkg_changelog_open(alpm_pkg_t UNUSED *pkg)
 {
@@ -147,6 +149,7 @@ struct pkg_operations default_pkg_ops = {
 	.get_replaces    = _pkg_get_replaces,
 	.get_files       = _pkg_get_files,
 	.get_backup      = _pkg_get_backup,
+	.get_dirsizes    = _pkg_get_dirsizes,
 
 	.changelog_open  = _pkg_changelog_open,
 	.changelog_read  = _pkg_changelog_read,
@@ -446,10 +449,124 @@ alpm_file_t *_alpm_file_copy(alpm_file_t *dest,
 	STRDUP(dest->name, src->name, return NULL);
 	dest->size = src->size;
 	dest->mode = src->mode;
+	dest->sha256sum = NULL;
+	if(src->sha256sum) {
+		STRDUP(dest->sha256sum, src->sha256sum, FREE(dest->name); return NULL);
+	}
 
 	return dest;
 }
 
+/** Find the directory a file is summarized under.
+ * @param name file list entry
+ * @return the length of the leading part of \a name naming the directory
+ */
+size_t _alpm_dirsize_key(const char *name)
+{
+	const char *slash = strchr(name, '/');
+
+	if(slash == NULL) {
+		return 0;
+	}
+	if(slash[1] != '\0') {
+		const char *next = strchr(slash + 1, '/');
+		if(next) {
+			slash = next;
+		}
+	}
+	return (size_t)(slash - name) + 1;
+}
+
+/** Parse a "<directory>\t<usage>" line.
+ * @param line the line
+ * @return the summary, NULL if the line is invalid or memory ran out
+ */
+alpm_dirsize_t *_alpm_dirsize_parse(const char *line)
+{
+	alpm_dirsize_t *dirsize;
+	const char *sep = strrchr(line, '\t');
+	off_t usage;
+
+	if(sep == NULL || (usage = _alpm_strtoofft(sep + 1)) < 0) {
+		return NULL;
+	}
+	CALLOC(dirsize, 1, sizeof(alpm_dirsize_t), return NULL);
+	STRNDUP(dirsize->name, line, sep - line, free(dirsize); return NULL);
+	dirsize->usage = usage;
+	return dirsize;
+}
+
+void _alpm_dirsize_free(alpm_dirsize_t *dirsize)
+{
+	free(dirsize->name);
+	free(dirsize);
+}
+
+/** Get the disk usage summaries of a package.
+ * @param pkg the package
+ * @return a list of alpm_dirsize_t, NULL if the package has none
+ */
+alpm_list_t *_alpm_pkg_get_dirsizes(alpm_pkg_t *pkg)
+{
+	return pkg->ops->get_dirsizes(pkg);
+}
+
+static alpm_dirsize_t *dirsize_dup(const alpm_dirsize_t *dirsize)
+{
+	alpm_dirsize_t *newdirsize;
+
+	CALLOC(newdirsize, 1, sizeof(alpm_dirsize_t), return NULL);
+	STRDUP(newdirsize->name, dirsize->name, free(newdirsize); return NULL);
+	newdirsize->usage = dirsize->usage;
+	return newdirsize;
+}
+
+/** Summarize the disk usage of a file list. Directories and symlinks take
+ * no space, as libarchive reports them with a zero size.
+ * @param filelist a file list with sizes and modes
+ * @return a list of alpm_dirsize_t, NULL if the list lacks modes, is empty
+ * or memory ran out
+ */
+alpm_list_t *_alpm_dirsizes_from_files(alpm_filelist_t *filelist)
+{
+	alpm_list_t *dirsizes = NULL, *i;
+	size_t f;
+
+	for(f = 0; f < filelist->count; f++) {
+		const alpm_file_t *file = filelist->files + f;
+		alpm_dirsize_t *dirsize = NULL;
+		size_t len;
+
+		if(file->mode == 0) {
+			goto error;
+		}
+		if(S_ISDIR(file->mode) || S_ISLNK(file->mode) || file->name[0] == '.') {
+			continue;
+		}
+		len = _alpm_dirsize_key(file->name);
+		for(i = dirsizes; i; i = i->next) {
+			alpm_dirsize_t *d = i->data;
+			if(strncmp(d->name, file->name, len) == 0 && d->name[len] == '\0') {
+				dirsize = d;
+				break;
+			}
+		}
+		if(dirsize == NULL) {
+			CALLOC(dirsize, 1, sizeof(alpm_dirsize_t), goto error);
+			STRNDUP(dirsize->name, file->name, len, free(dirsize); goto error);
+			dirsizes = alpm_list_add(dirsizes, dirsize);
+		}
+		dirsize->usage += (file->size + DIRSIZE_BLOCK - 1)
+			/ DIRSIZE_BLOCK * DIRSIZE_BLOCK;
+	}
+	return dirsizes;
+
+error:
+	alpm_list_free_inner(dirsizes, (alpm_list_fn_free)_alpm_dirsize_free);
+	alpm_list_free(dirsizes);
+	return NULL;
+}
+
 alpm_pkg_t *_alpm_pkg_new(void)
 {
 	alpm_pkg_t *pkg;
@@ -528,6 +645,13 @@ int _alpm_pkg_dup(alpm_pkg_t *pkg, alpm_pkg_t **new_ptr)
 	for(i = pkg->deltas; i; i = i->next) {
 		newpkg->deltas = alpm_list_add(newpkg->deltas, _alpm_delta_dup(i->data));
 	}
+	for(i = pkg->dirsizes; i; i = i->next) {
+		alpm_dirsize_t *dirsize = dirsize_dup(i->data);
+		if(dirsize == NULL) {
+			goto cleanup;
+		}
+		newpkg->dirsizes = alpm_list_add(newpkg->dirsizes, dirsize);
+	}
 
 	if(pkg->files.count) {
 		size_t filenum;
@@ -591,6 +715,7 @@ void _alpm_pkg_free(alpm_pkg_t *pkg)
 		size_t i;
 		for(i = 0; i < pkg->files.count; i++) {
 			free(pkg->files.files[i].name);
+			free(pkg->files.files[i].sha256sum);
 		}
 		free(pkg->files.files);
 	}
@@ -603,6 +728,8 @@ void _alpm_pkg_free(alpm_pkg_t *pkg)
 	alpm_list_free_inner(pkg->deltas, (alpm_list_fn_free)_alpm_delta_free);
 	alpm_list_free(pkg->deltas);
 	alpm_list_free(pkg->delta_path);
+	alpm_list_free_inner(pkg->dirsizes, (alpm_list_fn_free)_alpm_dirsize_free);
+	alpm_list_free(pkg->dirsizes);
 	alpm_list_free(pkg->removes);
 
 	if(pkg->origin == ALPM_PKG_FROM_FILE) {
@@ -59,6 +59,7 @@ struct pkg_operations {
 	alpm_list_t *(*get_replaces) (alpm_pkg_t *);
 	alpm_filelist_t *(*get_files) (alpm_pkg_t *);
 	alpm_list_t *(*get_backup) (alpm_pkg_t *);
+	alpm_list_t *(*get_dirsizes) (alpm_pkg_t *);
 
 	void *(*changelog_open) (alpm_pkg_t *);
 	size_t (*changelog_read) (void *, size_t, const alpm_pkg_t *, void *);
@@ -74,6 +75,15 @@ struct pkg_operations {
  */
 extern struct pkg_operations default_pkg_ops;
 
+/* Packages summarize the disk usage of their files by directory, at most
+ * two levels deep, so disk space checks need not look at each file. */
+#define DIRSIZE_BLOCK 4096
+
+typedef struct _alpm_dirsize_t {
+	char *name;     /* "usr/share/", "etc/", or "" for the root */
+	off_t usage;    /* bytes, each file rounded up to DIRSIZE_BLOCK */
+} alpm_dirsize_t;
+
 struct __alpm_pkg_t {
 	unsigned long name_hash;
 	char *filename;
@@ -119,6 +129,7 @@ struct __alpm_pkg_t {
 	alpm_list_t *deltas;
 	alpm_list_t *delta_path;
 	alpm_list_t *removes; /* in transaction targets only */
+	alpm_list_t *dirsizes;
 
 	struct pkg_operations *ops;
 
@@ -127,6 +138,12 @@ struct __alpm_pkg_t {
 
 alpm_file_t *_alpm_file_copy(alpm_file_t *dest, const alpm_file_t *src);
 
+size_t _alpm_dirsize_key(const char *name);
+alpm_dirsize_t *_alpm_dirsize_parse(const char *line);
+void _alpm_dirsize_free(alpm_dirsize_t *dirsize);
+alpm_list_t *_alpm_dirsizes_from_files(alpm_filelist_t *filelist);
+alpm_list_t *_alpm_pkg_get_dirsizes(alpm_pkg_t *pkg);
+
 alpm_pkg_t *_alpm_pkg_new(void);
 int _alpm_pkg_dup(alpm_pkg_t *pkg, alpm_pkg_t **new_ptr);
 void _alpm_pkg_free(alpm_pkg_t *pkg);
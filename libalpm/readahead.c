@@ -0,0 +1,451 @@
+/*
+ *  readahead.c
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A producer thread reads headers and data blocks from a libarchive reader
+ * into a bounded queue; the consumer writes them out with a disk writer.
+ * Only the producer touches the reader once started, the consumer only
+ * sees copies of the entries and blocks. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* libarchive */
+#include <archive.h>
+#include <archive_entry.h>
+
+/* libalpm */
+#include "readahead.h"
+#include "diskwriter.h"
+#include "util.h"
+
+/* how much decoded data may be waiting for the consumer */
+#define READAHEAD_MAX_BYTES (8 * 1024 * 1024)
+
+enum ra_kind {
+	RA_HEADER,  /* start of an entry */
+	RA_DATA,    /* a block of entry data */
+	RA_END,     /* end of the data of an entry, ret tells how it ended */
+	RA_FINISH   /* no more entries, ret tells why */
+};
+
+struct ra_item {
+	enum ra_kind kind;
+	struct archive_entry *entry;
+	int64_t position;
+	void *data;
+	size_t size;
+	int64_t offset;
+	int ret;
+	int errnum;
+	char *errstr;
+	struct ra_item *next;
+};
+
+struct __alpm_readahead_t {
+	struct archive *archive;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct ra_item *head;
+	struct ra_item *tail;
+	size_t queued;      /* bytes of data in the queue */
+	int stop;           /* consumer is going away */
+	int done;           /* producer pushed RA_FINISH */
+
+	/* consumer side */
+	struct archive_entry *entry;
+	int64_t position;
+	int in_entry;       /* RA_END of the current entry not consumed yet */
+	int finished;       /* RA_FINISH consumed, finish_ret is its status */
+	int finish_ret;
+	int errnum;
+	char errstr[256];
+};
+
+static void free_item(struct ra_item *item)
+{
+	if(item->entry) {
+		archive_entry_free(item->entry);
+	}
+	free(item->data);
+	free(item->errstr);
+	free(item);
+}
+
+/* returns 0 if the item was queued, -1 if the consumer went away */
+static int push_item(alpm_readahead_t *ra, struct ra_item *item)
+{
+	pthread_mutex_lock(&ra->lock);
+	/* always let one block through so huge blocks can not stall us */
+	while(!ra->stop && ra->head && ra->queued + item->size > READAHEAD_MAX_BYTES) {
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	}
+	if(ra->stop) {
+		pthread_mutex_unlock(&ra->lock);
+		free_item(item);
+		return -1;
+	}
+	if(ra->tail) {
+		ra->tail->next = item;
+	} else {
+		ra->head = item;
+	}
+	ra->tail = item;
+	ra->queued += item->size;
+	if(item->kind == RA_FINISH) {
+		ra->done = 1;
+	}
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	return 0;
+}
+
+/* get the next item of the queue, NULL if the producer died of an
+ * allocation failure before finishing */
+static struct ra_item *pop_item(alpm_readahead_t *ra)
+{
+	struct ra_item *item;
+
+	pthread_mutex_lock(&ra->lock);
+	while(ra->head == NULL && !ra->done) {
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	}
+	item = ra->head;
+	if(item == NULL) {
+		pthread_mutex_unlock(&ra->lock);
+		return NULL;
+	}
+	ra->head = item->next;
+	if(ra->head == NULL) {
+		ra->tail = NULL;
+	}
+	ra->queued -= item->size;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	return item;
+}
+
+/* queue an item telling the consumer how an entry or the archive ended;
+ * running out of memory here has to be reported somehow, so the item is
+ * preallocated by the caller */
+static int push_status(alpm_readahead_t *ra, struct ra_item *item,
+		enum ra_kind kind, int ret)
+{
+	item->kind = kind;
+	item->ret = ret;
+	if(ret != ARCHIVE_OK && ret != ARCHIVE_EOF) {
+		const char *errstr = archive_error_string(ra->archive);
+		item->errnum = archive_errno(ra->archive);
+		item->errstr = errstr ? strdup(errstr) : NULL;
+	}
+	return push_item(ra, item);
+}
+
+static void *producer(void *arg)
+{
+	alpm_readahead_t *ra = arg;
+	struct archive_entry *entry;
+	struct ra_item *item, *status;
+
+	while(1) {
+		int ret;
+
+		/* the item closing the entry or archive is allocated up front */
+		CALLOC(status, 1, sizeof(struct ra_item), goto oom);
+
+		ret = archive_read_next_header(ra->archive, &entry);
+		if(ret != ARCHIVE_OK) {
+			push_status(ra, status, RA_FINISH, ret);
+			return NULL;
+		}
+
+		CALLOC(item, 1, sizeof(struct ra_item), goto oom_status);
+		item->kind = RA_HEADER;
+		item->position = archive_position_compressed(ra->archive);
+		item->entry = archive_entry_clone(entry);
+		if(item->entry == NULL) {
+			free(item);
+			goto oom_status;
+		}
+		if(push_item(ra, item) != 0) {
+			free(status);
+			return NULL;
+		}
+
+		while(1) {
+			const void *buf;
+			size_t size;
+			int64_t offset;
+
+			ret = archive_read_data_block(ra->archive, &buf, &size, &offset);
+			if(ret != ARCHIVE_OK) {
+				break;
+			}
+			CALLOC(item, 1, sizeof(struct ra_item), goto oom_status);
+			item->kind = RA_DATA;
+			item->offset = offset;
+			item->size = size;
+			if(size > 0) {
+				MALLOC(item->data, size, free(item); goto oom_status);
+				memcpy(item->data, buf, size);
+			}
+			if(push_item(ra, item) != 0) {
+				free(status);
+				return NULL;
+			}
+		}
+		if(push_status(ra, status, RA_END, ret) != 0) {
+			return NULL;
+		}
+		if(ret != ARCHIVE_EOF) {
+			/* the reader is in an unknown state, do not go on */
+			CALLOC(status, 1, sizeof(struct ra_item), goto oom);
+			push_status(ra, status, RA_FINISH, ret);
+			return NULL;
+		}
+	}
+
+oom_status:
+	free(status);
+oom:
+	/* make sure the consumer does not wait forever */
+	pthread_mutex_lock(&ra->lock);
+	ra->done = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+/** Start decoding an archive in a separate thread. From now on the archive
+ * may only be accessed through the returned object until it is freed.
+ * @param archive an archive opened for reading
+ * @return the read-ahead object, NULL on error
+ */
+alpm_readahead_t *_alpm_readahead_new(struct archive *archive)
+{
+	alpm_readahead_t *ra;
+
+	CALLOC(ra, 1, sizeof(alpm_readahead_t), return NULL);
+	ra->archive = archive;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	if(pthread_create(&ra->thread, NULL, producer, ra) != 0) {
+		pthread_cond_destroy(&ra->cond);
+		pthread_mutex_destroy(&ra->lock);
+		free(ra);
+		return NULL;
+	}
+	return ra;
+}
+
+static void set_error(alpm_readahead_t *ra, int errnum, const char *errstr)
+{
+	ra->errnum = errnum;
+	snprintf(ra->errstr, sizeof(ra->errstr), "%s", errstr ? errstr : "");
+}
+
+/* drop what is left of the data of the current entry */
+static int finish_entry(alpm_readahead_t *ra)
+{
+	int ret = ARCHIVE_OK;
+
+	while(ra->in_entry) {
+		struct ra_item *item = pop_item(ra);
+		if(item == NULL) {
+			set_error(ra, ENOMEM, "out of memory");
+			ra->in_entry = 0;
+			return ARCHIVE_FATAL;
+		}
+		if(item->kind == RA_END) {
+			ra->in_entry = 0;
+			if(item->ret != ARCHIVE_EOF) {
+				set_error(ra, item->errnum, item->errstr);
+				ret = item->ret;
+			}
+		}
+		free_item(item);
+	}
+	return ret;
+}
+
+/** Read the next entry header.
+ * @param ra the read-ahead object
+ * @param entry where to store the entry, valid until the next call
+ * @return ARCHIVE_OK, ARCHIVE_EOF at the end of the archive or an error
+ */
+int _alpm_readahead_next_header(alpm_readahead_t *ra, struct archive_entry **entry)
+{
+	struct ra_item *item;
+	int ret;
+
+	finish_entry(ra);
+	if(ra->entry) {
+		archive_entry_free(ra->entry);
+		ra->entry = NULL;
+	}
+
+	if(ra->finished) {
+		return ra->finish_ret;
+	}
+
+	item = pop_item(ra);
+	if(item == NULL) {
+		set_error(ra, ENOMEM, "out of memory");
+		return ARCHIVE_FATAL;
+	}
+	if(item->kind == RA_HEADER) {
+		ra->entry = item->entry;
+		ra->position = item->position;
+		ra->in_entry = 1;
+		item->entry = NULL;
+		*entry = ra->entry;
+		ret = ARCHIVE_OK;
+	} else {
+		/* RA_FINISH is always the last item */
+		ret = item->ret;
+		if(ret != ARCHIVE_EOF) {
+			set_error(ra, item->errnum, item->errstr);
+		}
+		ra->finished = 1;
+		ra->finish_ret = ret;
+	}
+	free_item(item);
+	return ret;
+}
+
+/** The compressed position of the archive when the current header was read. */
+int64_t _alpm_readahead_position(alpm_readahead_t *ra)
+{
+	return ra->position;
+}
+
+/** Skip the data of the current entry. */
+int _alpm_readahead_data_skip(alpm_readahead_t *ra)
+{
+	return finish_entry(ra);
+}
+
+/** Write the current entry to disk, reporting errors like
+ * archive_read_extract2() does.
+ * @param ra the read-ahead object
+ * @param entry the current entry, possibly modified by the caller
+ * @param disk the disk writer
+ * @return the worst libarchive status of reading and writing; on failure
+ * the error is available from _alpm_readahead_error_string()
+ */
+int _alpm_readahead_extract(alpm_readahead_t *ra, struct archive_entry *entry,
+		alpm_diskwriter_t *disk)
+{
+	int ret, ret2;
+
+	ret = _alpm_diskwriter_header(disk, entry);
+	if(ret < ARCHIVE_WARN) {
+		ret = ARCHIVE_WARN;
+	}
+	if(ret != ARCHIVE_OK) {
+		set_error(ra, _alpm_diskwriter_errno(disk), _alpm_diskwriter_error_string(disk));
+	} else if(!archive_entry_size_is_set(entry) || archive_entry_size(entry) > 0) {
+		/* pour the data into the entry */
+		while(ra->in_entry) {
+			struct ra_item *item = pop_item(ra);
+			if(item == NULL) {
+				set_error(ra, ENOMEM, "out of memory");
+				ra->in_entry = 0;
+				ret = ARCHIVE_FATAL;
+				break;
+			}
+			if(item->kind == RA_END) {
+				ra->in_entry = 0;
+				if(item->ret != ARCHIVE_EOF) {
+					set_error(ra, item->errnum, item->errstr);
+					ret = item->ret;
+				}
+			} else {
+				ret = _alpm_diskwriter_data(disk, item->data, item->size, item->offset);
+				if(ret < ARCHIVE_WARN) {
+					ret = ARCHIVE_WARN;
+				}
+				if(ret < ARCHIVE_OK) {
+					set_error(ra, _alpm_diskwriter_errno(disk), _alpm_diskwriter_error_string(disk));
+					free_item(item);
+					break;
+				}
+			}
+			free_item(item);
+		}
+	}
+
+	ret2 = _alpm_diskwriter_finish_entry(disk);
+	if(ret2 < ARCHIVE_WARN) {
+		ret2 = ARCHIVE_WARN;
+	}
+	/* use the first message */
+	if(ret2 != ARCHIVE_OK && ret == ARCHIVE_OK) {
+		set_error(ra, _alpm_diskwriter_errno(disk), _alpm_diskwriter_error_string(disk));
+	}
+	/* use the worst error return */
+	if(ret2 < ret) {
+		ret = ret2;
+	}
+	return ret;
+}
+
+int _alpm_readahead_errno(alpm_readahead_t *ra)
+{
+	return ra->errnum;
+}
+
+const char *_alpm_readahead_error_string(alpm_readahead_t *ra)
+{
+	return ra->errstr;
+}
+
+/** Stop the producer and free everything queued. The archive is left for
+ * the caller to close. */
+void _alpm_readahead_free(alpm_readahead_t *ra)
+{
+	struct ra_item *item;
+
+	if(ra == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->thread, NULL);
+
+	for(item = ra->head; item; ) {
+		struct ra_item *next = item->next;
+		free_item(item);
+		item = next;
+	}
+	if(ra->entry) {
+		archive_entry_free(ra->entry);
+	}
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,48 @@
+/*
+ *  readahead.h
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALPM_READAHEAD_H
+#define _ALPM_READAHEAD_H
+
+#include <stdint.h> /* int64_t */
+
+/* libarchive */
+#include <archive.h>
+#include <archive_entry.h>
+
+/* libalpm */
+#include "diskwriter.h"
+
+/* An archive being decoded by a separate thread. Entries and their data
+ * are queued up to a fixed amount of memory, so decompression goes on
+ * while the caller is busy writing files. */
+typedef struct __alpm_readahead_t alpm_readahead_t;
+
+alpm_readahead_t *_alpm_readahead_new(struct archive *archive);
+int _alpm_readahead_next_header(alpm_readahead_t *ra, struct archive_entry **entry);
+int64_t _alpm_readahead_position(alpm_readahead_t *ra);
+int _alpm_readahead_data_skip(alpm_readahead_t *ra);
+int _alpm_readahead_extract(alpm_readahead_t *ra, struct archive_entry *entry,
+		alpm_diskwriter_t *disk);
+int _alpm_readahead_errno(alpm_readahead_t *ra);
+const char *_alpm_readahead_error_string(alpm_readahead_t *ra);
+void _alpm_readahead_free(alpm_readahead_t *ra);
+
+#endif /* _ALPM_READAHEAD_H */
+
+/* vim: set ts=2 sw=2 noet: */
@@ -27,6 +27,8 @@
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 /* libalpm */
@@ -235,21 +237,35 @@ int _alpm_remove_prepare(alpm_handle_t *handle, alpm_list_t **data)
 	return 0;
 }
 
+/* Files that changed owner are left alone, see the big comment block in
+ * _alpm_db_find_fileconflicts(). So are NoUpgrade files and the backup
+ * files of the new package on upgrades. */
+static int skip_removal(alpm_handle_t *handle, alpm_pkg_t *newpkg,
+		const alpm_globset_t *newbackup, const char *name)
+{
+	alpm_trans_t *trans = handle->trans;
+
+	return _alpm_globset_match(trans->skip_remove, name)
+		|| (newpkg && (_alpm_globset_match(trans->noupgrade, name)
+					|| _alpm_globset_match(newbackup, name)));
+}
+
 /**
  * @brief Check if alpm can delete a file.
  *
  * @param handle the context handle
+ * @param newpkg the package replacing the owner of \a file (optional)
  * @param file file to be removed
- * @param skip_remove list of files that will not be removed
+ * @param newbackup backup files of \a newpkg
  *
  * @return 1 if the file can be deleted, 0 if it cannot be deleted
  */
-static int can_remove_file(alpm_handle_t *handle, const alpm_file_t *file,
-		alpm_list_t *skip_remove)
+static int can_remove_file(alpm_handle_t *handle, alpm_pkg_t *newpkg,
+		const alpm_file_t *file, const alpm_globset_t *newbackup)
 {
 	char filepath[PATH_MAX];
 
-	if(alpm_list_find(skip_remove, file->name, _alpm_fnmatch)) {
+	if(skip_removal(handle, newpkg, newbackup, file->name)) {
 		/* return success because we will never actually remove this file */
 		return 1;
 	}
@@ -270,140 +286,508 @@ static int can_remove_file(alpm_handle_t *handle, const alpm_file_t *file,
 	return 1;
 }
 
+/* Files are removed in chunks of whole directories, with the chunks spread
+ * over one worker per CPU. Each worker keeps the directories leading to
+ * its current file open and removes files relative to the innermost one.
+ * Directories are left for a final pass that walks the sorted file list
+ * backwards, so they come after everything below them; one is only tried
+ * when nothing under it was kept. */
+
+#define RM_CHUNK 512                /* file list entries per unit of work, at least */
+#define RM_MAXDEPTH (PATH_MAX / 2)  /* components of a path, at most */
+
+/* status of a file list entry */
+enum {
+	RM_PENDING = 0,   /* not handled yet: a directory, left for the last pass */
+	RM_DONE,          /* removed, skipped or not there */
+	RM_KEPT,          /* still on disk, or saved as .pacsave */
+	RM_FAILED,        /* could not be removed */
+	RM_NONEMPTY = 8   /* flag: something below this directory was kept */
+};
+
+struct remove_state {
+	alpm_handle_t *handle;
+	alpm_pkg_t *oldpkg;
+	alpm_pkg_t *newpkg;
+	alpm_filelist_t *filelist;
+	const alpm_globset_t *newbackup;
+	int nosave;
+	int rootfd;
+	size_t targ_count;
+	size_t pkg_count;
+	unsigned char *status;
+
+	/* chunk i covers the entries from bounds[i] to bounds[i + 1] */
+	size_t *bounds;
+	size_t nchunks;
+	size_t next;
+	size_t done;      /* entries of finished chunks, for the progress bar */
+	pthread_mutex_t lock;
+};
+
+/* the directories leading to the file being removed, all kept open */
+struct rm_cursor {
+	char dir[PATH_MAX];   /* relative to the root, with a trailing slash */
+	size_t dirlen;
+	int fds[RM_MAXDEPTH];
+	size_t depth;
+	char name[PATH_MAX];  /* last component of the current entry */
+	char path[PATH_MAX];  /* full path of the current entry, for messages */
+};
+
+/* length of the directory part of a file list entry, including its slash */
+static size_t parent_len(const char *name, size_t len)
+{
+	if(len > 0 && name[len - 1] == '/') {
+		len--;
+	}
+	while(len > 0 && name[len - 1] != '/') {
+		len--;
+	}
+	return len;
+}
+
+static void cursor_close(struct rm_cursor *cur)
+{
+	while(cur->depth > 0) {
+		close(cur->fds[--cur->depth]);
+	}
+	cur->dirlen = 0;
+}
+
 /**
- * @brief Unlink a package file, backing it up if necessary.
+ * @brief Open the directory containing a file list entry.
  *
- * @note Helper function for iterating through a package's file and deleting
- * them.
- * @note Used by _alpm_remove_commit.
+ * The directories shared with the previous entry stay open, the others are
+ * closed and the missing ones opened relative to their parent. Intermediate
+ * symlinks are followed, as a full path would be.
  *
- * @param handle the context handle
- * @param oldpkg the package being removed
- * @param newpkg the package replacing \a oldpkg
+ * @param state removal state
+ * @param cur the cursor of the calling thread
+ * @param entry a file list entry
+ *
+ * @return a descriptor of the directory holding \a entry, whose last
+ * component is left in cur->name, or -1 if the directory cannot be opened
+ */
+static int cursor_open(struct remove_state *state, struct rm_cursor *cur,
+		const char *entry)
+{
+	size_t len = strlen(entry);
+	size_t plen = parent_len(entry, len);
+	size_t common = 0, i;
+
+	snprintf(cur->path, PATH_MAX, "%s%s", state->handle->root, entry);
+	if(len > 0 && entry[len - 1] == '/') {
+		len--;
+	}
+	if(len - plen >= PATH_MAX) {
+		return -1;
+	}
+	memcpy(cur->name, entry + plen, len - plen);
+	cur->name[len - plen] = '\0';
+
+	for(i = 0; i < plen && i < cur->dirlen && entry[i] == cur->dir[i]; i++) {
+		if(entry[i] == '/') {
+			common = i + 1;
+		}
+	}
+	while(cur->dirlen > common) {
+		close(cur->fds[--cur->depth]);
+		cur->dirlen = parent_len(cur->dir, cur->dirlen);
+	}
+
+	while(cur->dirlen < plen) {
+		int parentfd = cur->depth ? cur->fds[cur->depth - 1] : state->rootfd;
+		size_t end = cur->dirlen;
+		int fd;
+
+		while(entry[end] != '/') {
+			end++;
+		}
+		if(cur->depth == RM_MAXDEPTH) {
+			return -1;
+		}
+		memcpy(cur->dir + cur->dirlen, entry + cur->dirlen, end - cur->dirlen);
+		cur->dir[end] = '\0';
+		fd = openat(parentfd, cur->dir + cur->dirlen,
+				O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(fd < 0) {
+			return -1;
+		}
+		cur->dir[end] = '/';
+		cur->fds[cur->depth++] = fd;
+		cur->dirlen = end + 1;
+	}
+
+	return cur->depth ? cur->fds[cur->depth - 1] : state->rootfd;
+}
+
+/**
+ * @brief Unlink a file that is not a directory, backing it up if necessary.
+ *
+ * @param state removal state
+ * @param cur the cursor of the calling thread, opened on the file
+ * @param dirfd the directory holding the file
  * @param fileobj file to remove
- * @param skip_remove list of files that shouldn't be removed
- * @param nosave whether files should be backed up
  *
- * @return 0 on success, -1 if there was an error unlinking the file, 1 if the
- * file was skipped or did not exist
+ * @return the new status of the file, RM_PENDING if it turned out to be a
+ * directory
  */
-static int unlink_file(alpm_handle_t *handle, alpm_pkg_t *oldpkg,
-		alpm_pkg_t *newpkg, const alpm_file_t *fileobj, alpm_list_t *skip_remove,
-		int nosave)
+static int unlink_file(struct remove_state *state, struct rm_cursor *cur,
+		int dirfd, const alpm_file_t *fileobj)
 {
+	alpm_handle_t *handle = state->handle;
+	const char *file = cur->path;
 	struct stat buf;
-	char file[PATH_MAX];
 
-	snprintf(file, PATH_MAX, "%s%s", handle->root, fileobj->name);
+	/* if the file needs backup and has been modified, back it up to .pacsave */
+	alpm_backup_t *backup = _alpm_needbackup(fileobj->name, state->oldpkg);
+	if(backup) {
+		if(fstatat(dirfd, cur->name, &buf, AT_SYMLINK_NOFOLLOW)) {
+			_alpm_log(handle, ALPM_LOG_DEBUG, "file %s does not exist\n", file);
+			return RM_DONE;
+		}
+		if(S_ISDIR(buf.st_mode)) {
+			return RM_PENDING;
+		}
+		if(state->nosave) {
+			_alpm_log(handle, ALPM_LOG_DEBUG, "transaction is set to NOSAVE, not backing up '%s'\n", file);
+		} else {
+			char *filehash = alpm_compute_md5sum(file);
+			int cmp = filehash ? strcmp(filehash, backup->hash) : 0;
+			FREE(filehash);
+			if(cmp != 0) {
+				char newname[PATH_MAX], newpath[PATH_MAX];
+				snprintf(newname, PATH_MAX, "%s.pacsave", cur->name);
+				snprintf(newpath, PATH_MAX, "%s.pacsave", file);
+				if(renameat(dirfd, cur->name, dirfd, newname)) {
+					_alpm_log(handle, ALPM_LOG_ERROR, _("could not rename %s to %s (%s)\n"),
+							file, newpath, strerror(errno));
+					alpm_logaction(handle, "error: could not rename %s to %s (%s)\n",
+							file, newpath, strerror(errno));
+					return RM_FAILED;
+				}
+				_alpm_log(handle, ALPM_LOG_WARNING, _("%s saved as %s\n"), file, newpath);
+				alpm_logaction(handle, "warning: %s saved as %s\n", file, newpath);
+				return RM_KEPT;
+			}
+		}
+	}
+
+	_alpm_log(handle, ALPM_LOG_DEBUG, "unlinking %s\n", file);
+
+	if(unlinkat(dirfd, cur->name, 0) == -1) {
+		int err = errno;
+		if(err == ENOENT) {
+			_alpm_log(handle, ALPM_LOG_DEBUG, "file %s does not exist\n", file);
+			return RM_DONE;
+		}
+		/* EPERM is what POSIX asks for when unlinking a directory */
+		if((err == EISDIR || err == EPERM)
+				&& fstatat(dirfd, cur->name, &buf, AT_SYMLINK_NOFOLLOW) == 0
+				&& S_ISDIR(buf.st_mode)) {
+			return RM_PENDING;
+		}
+		_alpm_log(handle, ALPM_LOG_ERROR, _("cannot remove %s (%s)\n"),
+				file, strerror(err));
+		alpm_logaction(handle, "error: cannot remove %s (%s)\n",
+				file, strerror(err));
+		return RM_FAILED;
+	}
+	return RM_DONE;
+}
+
+/**
+ * @brief Remove a file list entry, leaving directories for later.
+ *
+ * @param state removal state
+ * @param cur the cursor of the calling thread
+ * @param fileobj file to remove
+ *
+ * @return the new status of the file
+ */
+static int remove_file(struct remove_state *state, struct rm_cursor *cur,
+		const alpm_file_t *fileobj)
+{
+	size_t len = strlen(fileobj->name);
+	int dirfd;
+
+	if(len > 0 && fileobj->name[len - 1] == '/') {
+		return RM_PENDING;
+	}
 
 	/* check the remove skip list before removing the file.
 	 * see the big comment block in db_find_fileconflicts() for an
 	 * explanation. */
-	if(alpm_list_find(skip_remove, fileobj->name, _alpm_fnmatch)) {
+	if(skip_removal(state->handle, state->newpkg, state->newbackup,
+				fileobj->name)) {
+		_alpm_log(state->handle, ALPM_LOG_DEBUG,
+				"%s%s is in skip_remove, skipping removal\n",
+				state->handle->root, fileobj->name);
+		return RM_DONE;
+	}
+
+	dirfd = cursor_open(state, cur, fileobj->name);
+	if(dirfd < 0) {
+		_alpm_log(state->handle, ALPM_LOG_DEBUG, "file %s does not exist\n",
+				cur->path);
+		return RM_DONE;
+	}
+	return unlink_file(state, cur, dirfd, fileobj);
+}
+
+/**
+ * @brief Remove a directory of the package if nothing else needs it.
+ *
+ * @param state removal state
+ * @param cur the cursor of the calling thread
+ * @param fileobj the directory
+ * @param nonempty whether an entry below the directory was kept
+ *
+ * @return the new status of the directory
+ */
+static int remove_directory(struct remove_state *state, struct rm_cursor *cur,
+		const alpm_file_t *fileobj, int nonempty)
+{
+	alpm_handle_t *handle = state->handle;
+	const char *file;
+	struct stat buf;
+	alpm_list_t *local;
+	int dirfd;
+
+	if(skip_removal(handle, state->newpkg, state->newbackup, fileobj->name)) {
 		_alpm_log(handle, ALPM_LOG_DEBUG,
-				"%s is in skip_remove, skipping removal\n", file);
-		return 1;
+				"%s%s is in skip_remove, skipping removal\n",
+				handle->root, fileobj->name);
+		return RM_DONE;
 	}
 
-	/* we want to do a lstat here, and not a _alpm_lstat.
-	 * if a directory in the package is actually a directory symlink on the
-	 * filesystem, we want to work with the linked directory instead of the
-	 * actual symlink */
-	if(lstat(file, &buf)) {
+	dirfd = cursor_open(state, cur, fileobj->name);
+	file = cur->path;
+	if(dirfd < 0 || fstatat(dirfd, cur->name, &buf, AT_SYMLINK_NOFOLLOW)) {
 		_alpm_log(handle, ALPM_LOG_DEBUG, "file %s does not exist\n", file);
-		return 1;
+		return RM_DONE;
+	}
+	if(!S_ISDIR(buf.st_mode)) {
+		size_t len = strlen(fileobj->name);
+		if(fileobj->name[len - 1] != '/') {
+			return unlink_file(state, cur, dirfd, fileobj);
+		}
+		/* if a directory in the package is actually a directory symlink on the
+		 * filesystem, we want to work with the linked directory instead of the
+		 * actual symlink, which is never removed */
+		if(!S_ISLNK(buf.st_mode) || fstatat(dirfd, cur->name, &buf, 0)
+				|| !S_ISDIR(buf.st_mode)) {
+			_alpm_log(handle, ALPM_LOG_DEBUG, "file %s does not exist\n", file);
+			return RM_DONE;
+		}
+		_alpm_log(handle, ALPM_LOG_DEBUG,
+				"keeping directory %s (symlink to a directory)\n", file);
+		return RM_KEPT;
 	}
 
-	if(S_ISDIR(buf.st_mode)) {
-		ssize_t files = _alpm_files_in_directory(handle, file, 0);
-		/* if we have files, no need to remove the directory */
-		if(files > 0) {
-			_alpm_log(handle, ALPM_LOG_DEBUG, "keeping directory %s (contains files)\n",
-					file);
-		} else if(files < 0) {
+	/* if we have files, no need to remove the directory */
+	if(nonempty) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "keeping directory %s (contains files)\n",
+				file);
+		return RM_KEPT;
+	}
+	if(state->newpkg && alpm_filelist_contains(alpm_pkg_get_files(state->newpkg),
+				fileobj->name)) {
+		_alpm_log(handle, ALPM_LOG_DEBUG,
+				"keeping directory %s (in new package)\n", file);
+		return RM_KEPT;
+	}
+	/* one last check- does any other package own this file? */
+	for(local = _alpm_db_get_pkgcache(handle->db_local); local;
+			local = local->next) {
+		alpm_pkg_t *local_pkg = local->data;
+
+		/* we duplicated the package when we put it in the removal list, so we
+		 * so we can't use direct pointer comparison here. */
+		if(state->oldpkg->name_hash == local_pkg->name_hash
+				&& strcmp(state->oldpkg->name, local_pkg->name) == 0) {
+			continue;
+		}
+		if(alpm_filelist_contains(alpm_pkg_get_files(local_pkg), fileobj->name)) {
 			_alpm_log(handle, ALPM_LOG_DEBUG,
-					"keeping directory %s (could not count files)\n", file);
-		} else if(newpkg && alpm_filelist_contains(alpm_pkg_get_files(newpkg),
-					fileobj->name)) {
+					"keeping directory %s (owned by %s)\n", file, local_pkg->name);
+			return RM_KEPT;
+		}
+	}
+
+	/* files the package did not own make the removal fail, which is cheaper
+	 * than looking for them first */
+	if(unlinkat(dirfd, cur->name, AT_REMOVEDIR)) {
+		if(errno == ENOTEMPTY || errno == EEXIST) {
 			_alpm_log(handle, ALPM_LOG_DEBUG,
-					"keeping directory %s (in new package)\n", file);
-		} else {
-			/* one last check- does any other package own this file? */
-			alpm_list_t *local, *local_pkgs;
-			int found = 0;
-			local_pkgs = _alpm_db_get_pkgcache(handle->db_local);
-			for(local = local_pkgs; local && !found; local = local->next) {
-				alpm_pkg_t *local_pkg = local->data;
-				alpm_filelist_t *filelist;
-
-				/* we duplicated the package when we put it in the removal list, so we
-				 * so we can't use direct pointer comparison here. */
-				if(oldpkg->name_hash == local_pkg->name_hash
-						&& strcmp(oldpkg->name, local_pkg->name) == 0) {
-					continue;
-				}
-				filelist = alpm_pkg_get_files(local_pkg);
-				if(alpm_filelist_contains(filelist, fileobj->name)) {
-					_alpm_log(handle, ALPM_LOG_DEBUG,
-							"keeping directory %s (owned by %s)\n", file, local_pkg->name);
-					found = 1;
-				}
-			}
-			if(!found) {
-				if(rmdir(file)) {
-					_alpm_log(handle, ALPM_LOG_DEBUG,
-							"directory removal of %s failed: %s\n", file, strerror(errno));
-					return -1;
-				} else {
-					_alpm_log(handle, ALPM_LOG_DEBUG,
-							"removed directory %s (no remaining owners)\n", file);
-				}
-			}
+					"keeping directory %s (contains files)\n", file);
+			return RM_KEPT;
 		}
-	} else {
-		/* if the file needs backup and has been modified, back it up to .pacsave */
-		alpm_backup_t *backup = _alpm_needbackup(fileobj->name, oldpkg);
-		if(backup) {
-			if(nosave) {
-				_alpm_log(handle, ALPM_LOG_DEBUG, "transaction is set to NOSAVE, not backing up '%s'\n", file);
-			} else {
-				char *filehash = alpm_compute_md5sum(file);
-				int cmp = filehash ? strcmp(filehash, backup->hash) : 0;
-				FREE(filehash);
-				if(cmp != 0) {
-					char *newpath;
-					size_t len = strlen(file) + 8 + 1;
-					MALLOC(newpath, len, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
-					snprintf(newpath, len, "%s.pacsave", file);
-					if(rename(file, newpath)) {
-						_alpm_log(handle, ALPM_LOG_ERROR, _("could not rename %s to %s (%s)\n"),
-								file, newpath, strerror(errno));
-						alpm_logaction(handle, "error: could not rename %s to %s (%s)\n",
-								file, newpath, strerror(errno));
-						free(newpath);
-						return -1;
-					}
-					_alpm_log(handle, ALPM_LOG_WARNING, _("%s saved as %s\n"), file, newpath);
-					alpm_logaction(handle, "warning: %s saved as %s\n", file, newpath);
-					free(newpath);
-					return 0;
-				}
-			}
+		_alpm_log(handle, ALPM_LOG_DEBUG,
+				"directory removal of %s failed: %s\n", file, strerror(errno));
+		return RM_FAILED;
+	}
+	_alpm_log(handle, ALPM_LOG_DEBUG,
+			"removed directory %s (no remaining owners)\n", file);
+	return RM_DONE;
+}
+
+/** Take chunks until there are none left, updating the progress bar if
+ * asked to. */
+static void remove_chunks(struct remove_state *state, struct rm_cursor *cur,
+		int progress)
+{
+	alpm_filelist_t *filelist = state->filelist;
+
+	while(1) {
+		size_t idx, done, i;
+		pthread_mutex_lock(&state->lock);
+		idx = state->next++;
+		pthread_mutex_unlock(&state->lock);
+		if(idx >= state->nchunks) {
+			break;
+		}
+		for(i = state->bounds[idx + 1]; i > state->bounds[idx]; i--) {
+			state->status[i - 1] = remove_file(state, cur, filelist->files + i - 1);
+		}
+		pthread_mutex_lock(&state->lock);
+		done = state->done += state->bounds[idx + 1] - state->bounds[idx];
+		pthread_mutex_unlock(&state->lock);
+
+		if(progress) {
+			/* update progress bar after each chunk */
+			int percent = (done * 100) / filelist->count;
+			PROGRESS(state->handle, ALPM_PROGRESS_REMOVE_START, state->oldpkg->name,
+					percent, state->pkg_count, state->targ_count);
 		}
+	}
+}
 
-		_alpm_log(handle, ALPM_LOG_DEBUG, "unlinking %s\n", file);
+static void *remove_worker(void *arg)
+{
+	struct remove_state *state = arg;
+	struct rm_cursor *cur;
+
+	CALLOC(cur, 1, sizeof(struct rm_cursor), return NULL);
+	remove_chunks(state, cur, 0);
+	cursor_close(cur);
+	free(cur);
+	return NULL;
+}
 
-		if(unlink(file) == -1) {
-			_alpm_log(handle, ALPM_LOG_ERROR, _("cannot remove %s (%s)\n"),
-					file, strerror(errno));
-			alpm_logaction(handle, "error: cannot remove %s (%s)\n",
-					file, strerror(errno));
-			return -1;
+/** Split the file list into chunks that end at a change of directory, so
+ * files of one directory go to the same worker.
+ * @return 0 on success, -1 on allocation failure
+ */
+static int split_chunks(struct remove_state *state)
+{
+	alpm_filelist_t *filelist = state->filelist;
+	size_t i, start = 0, prevlen = 0;
+
+	MALLOC(state->bounds, (filelist->count / RM_CHUNK + 2) * sizeof(size_t),
+			return -1);
+	state->bounds[0] = 0;
+	state->nchunks = 0;
+	for(i = 0; i < filelist->count; i++) {
+		const char *name = filelist->files[i].name;
+		size_t plen = parent_len(name, strlen(name));
+		if(i - start >= RM_CHUNK && (plen != prevlen
+					|| strncmp(name, filelist->files[i - 1].name, plen) != 0)) {
+			state->bounds[++state->nchunks] = start = i;
 		}
+		prevlen = plen;
+	}
+	if(filelist->count > start) {
+		state->bounds[++state->nchunks] = filelist->count;
 	}
 	return 0;
 }
 
+/** Remove the files of a package that are not directories, with one worker
+ * per CPU when there is enough to share. The calling thread takes part and
+ * updates the progress bar. Chunks nobody got to, for lack of memory, are
+ * left to remove_directories().
+ */
+static void run_remove_workers(struct remove_state *state)
+{
+	struct rm_cursor *cur;
+	pthread_t *threads = NULL;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads, i, started = 0;
+
+	nthreads = ncpu > 1 ? (size_t)ncpu : 1;
+	if(nthreads > state->nchunks) {
+		nthreads = state->nchunks;
+	}
+	if(nthreads > 1) {
+		CALLOC(threads, nthreads, sizeof(pthread_t), nthreads = 1);
+	}
+	for(i = 1; i < nthreads; i++) {
+		if(pthread_create(&threads[started], NULL, remove_worker, state) != 0) {
+			break;
+		}
+		started++;
+	}
+
+	CALLOC(cur, 1, sizeof(struct rm_cursor), cur = NULL);
+	if(cur) {
+		remove_chunks(state, cur, state->newpkg == NULL);
+		cursor_close(cur);
+		free(cur);
+	}
+
+	for(i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+/** Remove the directories left by run_remove_workers(), deepest first.
+ * Whatever is kept marks its directory as not empty.
+ * @return the number of entries that could not be removed
+ */
+static int remove_directories(struct remove_state *state)
+{
+	alpm_filelist_t *filelist = state->filelist;
+	struct rm_cursor *cur;
+	char parent[PATH_MAX];
+	size_t i;
+	int err = 0;
+
+	CALLOC(cur, 1, sizeof(struct rm_cursor), RET_ERR(state->handle, ALPM_ERR_MEMORY, -1));
+	for(i = filelist->count; i > 0; i--) {
+		const char *name = filelist->files[i - 1].name;
+		int status = state->status[i - 1] & ~RM_NONEMPTY;
+		size_t plen;
+
+		if(status == RM_PENDING) {
+			status = remove_directory(state, cur, filelist->files + i - 1,
+					state->status[i - 1] & RM_NONEMPTY);
+		}
+		if(status == RM_FAILED) {
+			err++;
+		}
+		if(status == RM_DONE) {
+			continue;
+		}
+
+		plen = parent_len(name, strlen(name));
+		if(plen > 0 && plen < PATH_MAX) {
+			alpm_file_t *dir;
+			memcpy(parent, name, plen);
+			parent[plen] = '\0';
+			dir = alpm_filelist_contains(filelist, parent);
+			if(dir) {
+				state->status[dir - filelist->files] |= RM_NONEMPTY;
+			}
+		}
+	}
+	cursor_close(cur);
+	free(cur);
+	return err;
+}
+
 /**
  * @brief Remove a package's files, optionally skipping its replacement's
  * files.
@@ -421,19 +805,20 @@ static int remove_package_files(alpm_handle_t *handle,
 		alpm_pkg_t *oldpkg, alpm_pkg_t *newpkg,
 		size_t targ_count, size_t pkg_count)
 {
-	alpm_list_t *skip_remove;
+	struct remove_state state;
+	alpm_globset_t *newbackup = NULL;
 	alpm_filelist_t *filelist;
 	size_t i;
-	int err = 0;
-	int nosave = handle->trans->flags & ALPM_TRANS_FLAG_NOSAVE;
+	int err = -1;
 
 	if(newpkg) {
 		alpm_filelist_t *newfiles;
 		alpm_list_t *b;
-		skip_remove = alpm_list_join(
-				alpm_list_strdup(handle->trans->skip_remove),
-				alpm_list_strdup(handle->noupgrade));
-		/* Add files in the NEW backup array to the skip_remove array
+		newbackup = _alpm_globset_new();
+		if(newbackup == NULL) {
+			RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+		}
+		/* Files in the NEW backup array are skipped
 		 * so this removal operation doesn't kill them */
 		/* old package backup list */
 		newfiles = alpm_pkg_get_files(newpkg);
@@ -443,56 +828,79 @@ static int remove_package_files(alpm_handle_t *handle,
 			if(!alpm_filelist_contains(newfiles, backup->name)) {
 				continue;
 			}
-			_alpm_log(handle, ALPM_LOG_DEBUG, "adding %s to the skip_remove array\n",
+			_alpm_log(handle, ALPM_LOG_DEBUG, "keeping %s, it is in the new backup array\n",
 					backup->name);
-			skip_remove = alpm_list_add(skip_remove, strdup(backup->name));
+			if(_alpm_globset_add(newbackup, backup->name) != 0) {
+				_alpm_globset_free(newbackup);
+				RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+			}
 		}
-	} else {
-		skip_remove = alpm_list_strdup(handle->trans->skip_remove);
 	}
 
 	filelist = alpm_pkg_get_files(oldpkg);
 	for(i = 0; i < filelist->count; i++) {
 		alpm_file_t *file = filelist->files + i;
-		if(!can_remove_file(handle, file, skip_remove)) {
+		if(!can_remove_file(handle, newpkg, file, newbackup)) {
 			_alpm_log(handle, ALPM_LOG_DEBUG,
 					"not removing package '%s', can't remove all files\n",
 					oldpkg->name);
-			FREELIST(skip_remove);
+			_alpm_globset_free(newbackup);
 			RET_ERR(handle, ALPM_ERR_PKG_CANT_REMOVE, -1);
 		}
 	}
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "removing %zd files\n", filelist->count);
 
+	memset(&state, 0, sizeof(state));
+	state.handle = handle;
+	state.oldpkg = oldpkg;
+	state.newpkg = newpkg;
+	state.filelist = filelist;
+	state.newbackup = newbackup;
+	state.nosave = handle->trans->flags & ALPM_TRANS_FLAG_NOSAVE;
+	state.targ_count = targ_count;
+	state.pkg_count = pkg_count;
+	/* load the backup list before the workers look at it */
+	alpm_pkg_get_backup(oldpkg);
+
+	state.rootfd = open(handle->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(state.rootfd < 0) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not open file %s: %s\n"),
+				handle->root, strerror(errno));
+		goto cleanup;
+	}
+	CALLOC(state.status, filelist->count + 1, sizeof(unsigned char), goto oom);
+	if(split_chunks(&state) != 0) {
+		goto oom;
+	}
+	pthread_mutex_init(&state.lock, NULL);
+
 	if(!newpkg) {
 		/* init progress bar, but only on true remove transactions */
 		PROGRESS(handle, ALPM_PROGRESS_REMOVE_START, oldpkg->name, 0,
 				pkg_count, targ_count);
 	}
 
-	/* iterate through the list backwards, unlinking files */
-	for(i = filelist->count; i > 0; i--) {
-		alpm_file_t *file = filelist->files + i - 1;
-		if(unlink_file(handle, oldpkg, newpkg, file, skip_remove, nosave) < 0) {
-			err++;
-		}
-
-		if(!newpkg) {
-			/* update progress bar after each file */
-			int percent = ((filelist->count - i) * 100) / filelist->count;
-			PROGRESS(handle, ALPM_PROGRESS_REMOVE_START, oldpkg->name,
-					percent, pkg_count, targ_count);
-		}
-	}
-	FREELIST(skip_remove);
+	run_remove_workers(&state);
+	err = remove_directories(&state);
+	pthread_mutex_destroy(&state.lock);
 
 	if(!newpkg) {
 		/* set progress to 100% after we finish unlinking files */
 		PROGRESS(handle, ALPM_PROGRESS_REMOVE_START, oldpkg->name, 100,
 				pkg_count, targ_count);
 	}
-
+	goto cleanup;
+
+oom:
+	handle->pm_errno = ALPM_ERR_MEMORY;
+cleanup:
+	free(state.bounds);
+	free(state.status);
+	if(state.rootfd >= 0) {
+		close(state.rootfd);
+	}
+	_alpm_globset_free(newbackup);
 	return err;
 }
 
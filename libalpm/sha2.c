@@ -72,7 +72,7 @@
 /*
  * SHA-256 context setup
  */
-static void sha2_starts( sha2_context *ctx, int is224 )
+void sha2_starts( sha2_context *ctx, int is224 )
 {
     ctx->total[0] = 0;
     ctx->total[1] = 0;
@@ -239,7 +239,7 @@ static void sha2_process( sha2_context *ctx, const unsigned char data[64] )
 /*
  * SHA-256 process buffer
  */
-static void sha2_update( sha2_context *ctx, const unsigned char *input, size_t ilen )
+void sha2_update( sha2_context *ctx, const unsigned char *input, size_t ilen )
 {
     size_t fill;
     uint32_t left;
@@ -291,7 +291,7 @@ static const unsigned char sha2_padding[64] =
 /*
  * SHA-256 final digest
  */
-static void sha2_finish( sha2_context *ctx, unsigned char output[32] )
+void sha2_finish( sha2_context *ctx, unsigned char output[32] )
 {
     uint32_t last, padn;
     uint32_t high, low;
@@ -20,6 +20,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h> /* intmax_t */
+#include <limits.h> /* PATH_MAX */
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #if HAVE_LIBGPGME
 #include <locale.h> /* setlocale() */
@@ -116,7 +122,8 @@ static alpm_list_t *list_sigsum(gpgme_sigsum_t sigsum)
 
 /**
  * Initialize the GPGME library.
- * This can be safely called multiple times; however it is not thread-safe.
+ * This can be safely called multiple times; however it is not thread-safe,
+ * callers should go through #ctx_acquire which serializes it.
  * @param handle the context handle
  * @return 0 on success, -1 on error
  */
@@ -179,6 +186,73 @@ error:
 	RET_ERR(handle, ALPM_ERR_GPGME, -1);
 }
 
+/**
+ * Take a gpgme context from the handle's pool, creating one if the pool is
+ * empty. Contexts are expensive to set up, so they are kept around for the
+ * lifetime of the handle and handed back with #ctx_release. This is safe to
+ * call from several threads at once.
+ * @param handle the context handle
+ * @param ctx storage for the context
+ * @return a gpgme error code
+ */
+static gpgme_error_t ctx_acquire(alpm_handle_t *handle, gpgme_ctx_t *ctx)
+{
+	alpm_list_t *idle;
+	int ret;
+
+	*ctx = NULL;
+	pthread_mutex_lock(&handle->gpgme_lock);
+	ret = init_gpgme(handle);
+	idle = handle->gpgme_ctxs;
+	if(!ret && idle) {
+		handle->gpgme_ctxs = alpm_list_remove_item(handle->gpgme_ctxs, idle);
+		*ctx = idle->data;
+		free(idle);
+	}
+	pthread_mutex_unlock(&handle->gpgme_lock);
+
+	if(ret) {
+		return gpg_error(GPG_ERR_GENERAL);
+	}
+	if(*ctx) {
+		return GPG_ERR_NO_ERROR;
+	}
+	_alpm_log(handle, ALPM_LOG_DEBUG, "creating new gpgme context\n");
+	return gpgme_new(ctx);
+}
+
+/**
+ * Return a context obtained from #ctx_acquire to the pool. Callers must put
+ * back any settings they changed (e.g. the keylist mode) beforehand.
+ * @param handle the context handle
+ * @param ctx the context, may be NULL
+ */
+static void ctx_release(alpm_handle_t *handle, gpgme_ctx_t ctx)
+{
+	if(!ctx) {
+		return;
+	}
+	pthread_mutex_lock(&handle->gpgme_lock);
+	handle->gpgme_ctxs = alpm_list_add(handle->gpgme_ctxs, ctx);
+	pthread_mutex_unlock(&handle->gpgme_lock);
+}
+
+/**
+ * Release all pooled gpgme contexts owned by a handle.
+ * @param handle the context handle
+ */
+void _alpm_gpgme_cleanup(alpm_handle_t *handle)
+{
+	alpm_list_t *i;
+
+	for(i = handle->gpgme_ctxs; i; i = i->next) {
+		gpgme_release(i->data);
+	}
+	alpm_list_free(handle->gpgme_ctxs);
+	handle->gpgme_ctxs = NULL;
+	pthread_mutex_destroy(&handle->gpgme_lock);
+}
+
 /**
  * Determine if we have a key is known in our local keyring.
  * @param handle the context handle
@@ -188,12 +262,11 @@ error:
 static int key_in_keychain(alpm_handle_t *handle, const char *fpr)
 {
 	gpgme_error_t err;
-	gpgme_ctx_t ctx;
+	gpgme_ctx_t ctx = NULL;
 	gpgme_key_t key;
 	int ret = -1;
 
-	memset(&ctx, 0, sizeof(ctx));
-	err = gpgme_new(&ctx);
+	err = ctx_acquire(handle, &ctx);
 	CHECK_ERR();
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "looking up key %s locally\n", fpr);
@@ -211,7 +284,7 @@ static int key_in_keychain(alpm_handle_t *handle, const char *fpr)
 	gpgme_key_unref(key);
 
 error:
-	gpgme_release(ctx);
+	ctx_release(handle, ctx);
 	return ret;
 }
 
@@ -228,8 +301,8 @@ static int key_search(alpm_handle_t *handle, const char *fpr,
 		alpm_pgpkey_t *pgpkey)
 {
 	gpgme_error_t err;
-	gpgme_ctx_t ctx;
-	gpgme_keylist_mode_t mode;
+	gpgme_ctx_t ctx = NULL;
+	gpgme_keylist_mode_t mode, oldmode = 0;
 	gpgme_key_t key;
 	int ret = -1;
 	size_t fpr_len;
@@ -241,11 +314,10 @@ static int key_search(alpm_handle_t *handle, const char *fpr,
 	MALLOC(full_fpr, fpr_len + 3, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
 	sprintf(full_fpr, "0x%s", fpr);
 
-	memset(&ctx, 0, sizeof(ctx));
-	err = gpgme_new(&ctx);
+	err = ctx_acquire(handle, &ctx);
 	CHECK_ERR();
 
-	mode = gpgme_get_keylist_mode(ctx);
+	mode = oldmode = gpgme_get_keylist_mode(ctx);
 	/* using LOCAL and EXTERN together doesn't work for GPG 1.X. Ugh. */
 	mode &= ~GPGME_KEYLIST_MODE_LOCAL;
 	mode |= GPGME_KEYLIST_MODE_EXTERN;
@@ -319,7 +391,11 @@ error:
 		_alpm_log(handle, ALPM_LOG_DEBUG, "gpg error: %s\n", gpgme_strerror(err));
 	}
 	free(full_fpr);
-	gpgme_release(ctx);
+	if(ctx) {
+		/* pooled contexts must go back in their default mode */
+		gpgme_set_keylist_mode(ctx, oldmode);
+		ctx_release(handle, ctx);
+	}
 	return ret;
 }
 
@@ -332,7 +408,7 @@ error:
 static int key_import(alpm_handle_t *handle, alpm_pgpkey_t *key)
 {
 	gpgme_error_t err;
-	gpgme_ctx_t ctx;
+	gpgme_ctx_t ctx = NULL;
 	gpgme_key_t keys[2];
 	gpgme_import_result_t result;
 	int ret = -1;
@@ -343,8 +419,7 @@ static int key_import(alpm_handle_t *handle, alpm_pgpkey_t *key)
 		return -1;
 	}
 
-	memset(&ctx, 0, sizeof(ctx));
-	err = gpgme_new(&ctx);
+	err = ctx_acquire(handle, &ctx);
 	CHECK_ERR();
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "importing key\n");
@@ -367,7 +442,7 @@ static int key_import(alpm_handle_t *handle, alpm_pgpkey_t *key)
 	}
 
 error:
-	gpgme_release(ctx);
+	ctx_release(handle, ctx);
 	return ret;
 }
 
@@ -420,7 +495,7 @@ int _alpm_gpgme_checksig(alpm_handle_t *handle, const char *path,
 {
 	int ret = -1, sigcount;
 	gpgme_error_t err = 0;
-	gpgme_ctx_t ctx;
+	gpgme_ctx_t ctx = NULL;
 	gpgme_data_t filedata, sigdata;
 	gpgme_verify_result_t verify_result;
 	gpgme_signature_t gpgsig;
@@ -455,19 +530,18 @@ int _alpm_gpgme_checksig(alpm_handle_t *handle, const char *path,
 		goto error;
 	}
 
-	if(init_gpgme(handle)) {
-		/* pm_errno was set in gpgme_init() */
-		goto error;
-	}
-
 	_alpm_log(handle, ALPM_LOG_DEBUG, "checking signature for %s\n", path);
 
-	memset(&ctx, 0, sizeof(ctx));
 	memset(&sigdata, 0, sizeof(sigdata));
 	memset(&filedata, 0, sizeof(filedata));
 
-	err = gpgme_new(&ctx);
-	CHECK_ERR();
+	if(ctx_acquire(handle, &ctx) != GPG_ERR_NO_ERROR) {
+		/* pm_errno was set in init_gpgme() or by the failed gpgme_new() */
+		if(!handle->pm_errno) {
+			handle->pm_errno = ALPM_ERR_GPGME;
+		}
+		goto error;
+	}
 
 	/* create our necessary data objects to verify the signature */
 	err = gpgme_data_new_from_stream(&filedata, file);
@@ -607,7 +681,7 @@ int _alpm_gpgme_checksig(alpm_handle_t *handle, const char *path,
 gpg_error:
 	gpgme_data_release(sigdata);
 	gpgme_data_release(filedata);
-	gpgme_release(ctx);
+	ctx_release(handle, ctx);
 
 error:
 	if(sigfile) {
@@ -635,6 +709,9 @@ int _alpm_gpgme_checksig(alpm_handle_t UNUSED *handle, const char UNUSED *path,
 {
 	return -1;
 }
+void _alpm_gpgme_cleanup(alpm_handle_t UNUSED *handle)
+{
+}
 #endif /* HAVE_LIBGPGME */
 
 /**
@@ -658,6 +735,454 @@ char *_alpm_sigpath(alpm_handle_t *handle, const char *path)
 	return sigpath;
 }
 
+/* Successful signature verifications are remembered in a small cache file in
+ * the gpgdir. Each line holds one good verification: a key made of the
+ * identity of the signed file (device, inode, size and times), the sha256
+ * of the signature data and the trust levels the caller was willing to
+ * accept; then the sha256 of the file, and the time the entry expires. The
+ * key is cheap to compute, so a check that is not cached costs no more than
+ * before; the file is only hashed to confirm a hit, and to add an entry. The
+ * first line holds a stamp describing the keyring; any change to the keyring
+ * (imports, trust changes, refreshes) invalidates every entry. Entries
+ * expire with the signing key, and after SIGCACHE_MAX_AGE in any case, as
+ * validity that depends on time alone does not show in the stamp. Entries
+ * are kept in memory sorted by key and written out once, by
+ * _alpm_sigcache_save(). All of it is under handle->sigcache_lock, as
+ * packages may be verified by several threads. */
+#define SIGCACHE_FILE "sigcache"
+#define SIGCACHE_VERSION "2"
+#define SIGCACHE_MAX_ENTRIES 4096
+#define SIGCACHE_MAX_AGE (7 * 24 * 60 * 60)
+
+struct _alpm_sigentry_t {
+	char *key;
+	char *filesum;
+	time_t expires;
+};
+
+static void sigcache_clear(alpm_handle_t *handle)
+{
+	size_t i;
+
+	for(i = 0; i < handle->sigcache_count; i++) {
+		free(handle->sigcache[i].key);
+		free(handle->sigcache[i].filesum);
+	}
+	FREE(handle->sigcache);
+	handle->sigcache_count = 0;
+}
+
+/**
+ * Describe the current state of the keyring.
+ * @param handle the context handle
+ * @return a newly allocated stamp string, NULL if the keyring is unusable
+ */
+static char *sigcache_stamp(alpm_handle_t *handle)
+{
+	/* GnuPG 2.1 keeps the public keys in pubring.kbx, older versions in
+	 * pubring.gpg; a keyring may have either or both */
+	const char *files[] = { "pubring.kbx", "pubring.gpg", "trustdb.gpg", NULL };
+	char stamp[256], path[PATH_MAX];
+	size_t i, len;
+	int keyring = 0;
+
+	/* a cache file of another layout is as good as stale */
+	len = snprintf(stamp, sizeof(stamp), "v%s", SIGCACHE_VERSION);
+	for(i = 0; files[i]; i++) {
+		struct stat st;
+		snprintf(path, PATH_MAX, "%s%s", handle->gpgdir, files[i]);
+		if(stat(path, &st) != 0) {
+			if(errno != ENOENT) {
+				return NULL;
+			}
+			len += snprintf(stamp + len, sizeof(stamp) - len, " -");
+			continue;
+		}
+		if(i < 2) {
+			keyring = 1;
+		}
+		len += snprintf(stamp + len, sizeof(stamp) - len, " %ju.%ju.%jd",
+				(uintmax_t)st.st_ino, (uintmax_t)st.st_mtime, (intmax_t)st.st_size);
+	}
+
+	return keyring ? strdup(stamp) : NULL;
+}
+
+static int sigentry_cmp(const void *p1, const void *p2)
+{
+	const struct _alpm_sigentry_t *e1 = p1;
+	const struct _alpm_sigentry_t *e2 = p2;
+	return strcmp(e1->key, e2->key);
+}
+
+/* parse "<key> <filesum> <expires>" into an entry, 0 on success */
+static int sigentry_parse(char *line, struct _alpm_sigentry_t *entry)
+{
+	char *expires, *filesum;
+
+	if((expires = strrchr(line, ' ')) == NULL) {
+		return -1;
+	}
+	*expires++ = '\0';
+	if((filesum = strrchr(line, ' ')) == NULL) {
+		return -1;
+	}
+	*filesum++ = '\0';
+	entry->expires = (time_t)strtoll(expires, NULL, 10);
+	entry->key = strdup(line);
+	entry->filesum = strdup(filesum);
+	if(!entry->key || !entry->filesum) {
+		free(entry->key);
+		free(entry->filesum);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Make sure the in-memory cache matches the keyring, loading or dropping
+ * entries as necessary. Called with handle->sigcache_lock held.
+ * @param handle the context handle
+ * @return 0 if the cache can be used, -1 otherwise
+ */
+static int sigcache_sync(alpm_handle_t *handle)
+{
+	char *stamp;
+	char line[PATH_MAX], path[PATH_MAX];
+	size_t size = 0;
+	FILE *fp;
+
+	if(!handle->gpgdir || (stamp = sigcache_stamp(handle)) == NULL) {
+		return -1;
+	}
+
+	if(handle->sigcache_stamp && strcmp(stamp, handle->sigcache_stamp) == 0) {
+		free(stamp);
+		return 0;
+	}
+
+	/* keyring changed under us or this is the first lookup */
+	sigcache_clear(handle);
+	free(handle->sigcache_stamp);
+	handle->sigcache_stamp = stamp;
+	handle->sigcache_dirty = 0;
+
+	snprintf(path, PATH_MAX, "%s%s", handle->gpgdir, SIGCACHE_FILE);
+	if((fp = fopen(path, "r")) == NULL) {
+		return 0;
+	}
+	if(fgets(line, sizeof(line), fp) == NULL) {
+		fclose(fp);
+		return 0;
+	}
+	_alpm_strip_newline(line, 0);
+	if(strcmp(line, stamp) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "signature cache is stale, ignoring\n");
+		fclose(fp);
+		return 0;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL
+			&& handle->sigcache_count < SIGCACHE_MAX_ENTRIES) {
+		if(_alpm_strip_newline(line, 0) == 0) {
+			continue;
+		}
+		if(handle->sigcache_count == size) {
+			size_t newsize = size ? size * 2 : 64;
+			struct _alpm_sigentry_t *grown = realloc(handle->sigcache,
+					newsize * sizeof(struct _alpm_sigentry_t));
+			if(grown == NULL) {
+				break;
+			}
+			handle->sigcache = grown;
+			size = newsize;
+		}
+		if(sigentry_parse(line, handle->sigcache + handle->sigcache_count) == 0) {
+			handle->sigcache_count++;
+		}
+	}
+	fclose(fp);
+	/* written in order, but nothing stops anyone from editing the file */
+	qsort(handle->sigcache, handle->sigcache_count,
+			sizeof(struct _alpm_sigentry_t), sigentry_cmp);
+	_alpm_log(handle, ALPM_LOG_DEBUG, "loaded %zd signature cache entries\n",
+			handle->sigcache_count);
+	return 0;
+}
+
+/* describe a file by where it lives and when it last changed */
+static int sigcache_identity(const char *path, char *buf, size_t len)
+{
+	struct stat st;
+
+	if(stat(path, &st) != 0) {
+		return -1;
+	}
+	snprintf(buf, len, "%ju.%ju.%jd.%jd.%ld.%jd.%ld",
+			(uintmax_t)st.st_dev, (uintmax_t)st.st_ino, (intmax_t)st.st_size,
+			(intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+			(intmax_t)st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+	return 0;
+}
+
+/**
+ * Compute the cache key for a signature check. The signed file is only
+ * looked at, not read.
+ * @param handle the context handle
+ * @param path the full path to a file
+ * @param base64_sig optional PGP signature data in base64 encoding
+ * @param marginal whether signatures with marginal trust are acceptable
+ * @param unknown whether signatures with unknown trust are acceptable
+ * @return a newly allocated key, NULL if the check can not be cached
+ */
+static char *sigcache_key(alpm_handle_t *handle, const char *path,
+		const char *base64_sig, int marginal, int unknown)
+{
+	char *sigsum = NULL, *key = NULL;
+	char identity[128];
+	size_t len;
+
+	if(sigcache_identity(path, identity, sizeof(identity)) != 0) {
+		return NULL;
+	}
+	if(base64_sig) {
+		sigsum = _alpm_compute_sha256sum_buffer(base64_sig, strlen(base64_sig));
+	} else {
+		char *sigpath = _alpm_sigpath(handle, path);
+		if(sigpath && access(sigpath, R_OK) == 0) {
+			sigsum = alpm_compute_sha256sum(sigpath);
+		}
+		free(sigpath);
+	}
+	if(!sigsum) {
+		return NULL;
+	}
+
+	len = strlen(identity) + strlen(sigsum) + 5;
+	MALLOC(key, len, free(sigsum); return NULL);
+	snprintf(key, len, "%s %s %d%d", identity, sigsum, !!marginal, !!unknown);
+	free(sigsum);
+	return key;
+}
+
+/**
+ * Look up a check in the cache. Called with handle->sigcache_lock held.
+ * @param handle the context handle
+ * @param key the key returned by #sigcache_key
+ * @return the entry if it exists and has not expired, NULL otherwise
+ */
+static struct _alpm_sigentry_t *sigcache_find(alpm_handle_t *handle,
+		const char *key)
+{
+	struct _alpm_sigentry_t needle, *entry;
+
+	if(handle->sigcache_count == 0) {
+		return NULL;
+	}
+	needle.key = (char *)key;
+	entry = bsearch(&needle, handle->sigcache, handle->sigcache_count,
+			sizeof(struct _alpm_sigentry_t), sigentry_cmp);
+	if(entry && entry->expires > time(NULL)) {
+		return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Record a successful verification, to be written out with the cache file.
+ * Called with handle->sigcache_lock held.
+ * @param handle the context handle
+ * @param key the key returned by #sigcache_key
+ * @param filesum the sha256 of the verified file
+ * @param expires the time after which the check has to be done again
+ */
+static void sigcache_add(alpm_handle_t *handle, const char *key,
+		const char *filesum, time_t expires)
+{
+	struct _alpm_sigentry_t entry;
+	size_t lo = 0, hi = handle->sigcache_count, i;
+
+	/* find where it goes, replacing an expired entry for the same check */
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(handle->sigcache[mid].key, key);
+		if(cmp == 0) {
+			char *sum;
+			STRDUP(sum, filesum, return);
+			free(handle->sigcache[mid].filesum);
+			handle->sigcache[mid].filesum = sum;
+			handle->sigcache[mid].expires = expires;
+			handle->sigcache_dirty = 1;
+			return;
+		} else if(cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if(handle->sigcache_count == SIGCACHE_MAX_ENTRIES) {
+		/* make room by dropping the entry that runs out first */
+		size_t victim = 0;
+		for(i = 1; i < handle->sigcache_count; i++) {
+			if(handle->sigcache[i].expires < handle->sigcache[victim].expires) {
+				victim = i;
+			}
+		}
+		free(handle->sigcache[victim].key);
+		free(handle->sigcache[victim].filesum);
+		memmove(handle->sigcache + victim, handle->sigcache + victim + 1,
+				(handle->sigcache_count - victim - 1) * sizeof(struct _alpm_sigentry_t));
+		handle->sigcache_count--;
+		if(victim < lo) {
+			lo--;
+		}
+	} else {
+		struct _alpm_sigentry_t *grown = realloc(handle->sigcache,
+				(handle->sigcache_count + 1) * sizeof(struct _alpm_sigentry_t));
+		if(grown == NULL) {
+			return;
+		}
+		handle->sigcache = grown;
+	}
+
+	STRDUP(entry.key, key, return);
+	STRDUP(entry.filesum, filesum, free(entry.key); return);
+	entry.expires = expires;
+	memmove(handle->sigcache + lo + 1, handle->sigcache + lo,
+			(handle->sigcache_count - lo) * sizeof(struct _alpm_sigentry_t));
+	handle->sigcache[lo] = entry;
+	handle->sigcache_count++;
+	handle->sigcache_dirty = 1;
+}
+
+/**
+ * Write out the signature cache if verifications were added to it, by
+ * replacing the cache file so an interrupted write leaves the old one.
+ * Failing to write the cache (e.g. running unprivileged) is not an error.
+ * @param handle the context handle
+ */
+void _alpm_sigcache_save(alpm_handle_t *handle)
+{
+	char path[PATH_MAX], tmppath[PATH_MAX];
+	time_t now = time(NULL);
+	size_t i;
+	FILE *fp;
+	int fd;
+
+	pthread_mutex_lock(&handle->sigcache_lock);
+	if(!handle->sigcache_dirty || !handle->gpgdir || !handle->sigcache_stamp) {
+		goto cleanup;
+	}
+	handle->sigcache_dirty = 0;
+
+	snprintf(path, PATH_MAX, "%s%s", handle->gpgdir, SIGCACHE_FILE);
+	snprintf(tmppath, PATH_MAX, "%s.XXXXXX", path);
+	if((fd = mkstemp(tmppath)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not write signature cache %s: %s\n",
+				path, strerror(errno));
+		if(fd >= 0) {
+			close(fd);
+			unlink(tmppath);
+		}
+		goto cleanup;
+	}
+	fchmod(fd, 0644);
+	fprintf(fp, "%s\n", handle->sigcache_stamp);
+	for(i = 0; i < handle->sigcache_count; i++) {
+		struct _alpm_sigentry_t *entry = handle->sigcache + i;
+		/* expired entries are not worth keeping */
+		if(entry->expires > now) {
+			fprintf(fp, "%s %s %jd\n", entry->key, entry->filesum,
+					(intmax_t)entry->expires);
+		}
+	}
+	if(fflush(fp) != 0 || fsync(fd) != 0 || fclose(fp) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not write signature cache %s: %s\n",
+				path, strerror(errno));
+		unlink(tmppath);
+		goto cleanup;
+	}
+	if(rename(tmppath, path) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not write signature cache %s: %s\n",
+				path, strerror(errno));
+		unlink(tmppath);
+	}
+
+cleanup:
+	pthread_mutex_unlock(&handle->sigcache_lock);
+}
+
+/**
+ * Release the in-memory signature cache.
+ * @param handle the context handle
+ */
+void _alpm_sigcache_free(alpm_handle_t *handle)
+{
+	sigcache_clear(handle);
+	FREE(handle->sigcache_stamp);
+	pthread_mutex_destroy(&handle->sigcache_lock);
+}
+
+/**
+ * Tell whether a check passed before and the file is still the one that
+ * was verified then.
+ * @param handle the context handle
+ * @param path the full path to a file
+ * @param key the key returned by #sigcache_key
+ * @return 1 if the check can be skipped, 0 otherwise
+ */
+static int sigcache_hit(alpm_handle_t *handle, const char *path,
+		const char *key)
+{
+	struct _alpm_sigentry_t *entry;
+	char *filesum = NULL, *cached = NULL;
+	int hit;
+
+	pthread_mutex_lock(&handle->sigcache_lock);
+	if(sigcache_sync(handle) == 0 && (entry = sigcache_find(handle, key))) {
+		cached = strdup(entry->filesum);
+	}
+	pthread_mutex_unlock(&handle->sigcache_lock);
+	if(cached == NULL) {
+		return 0;
+	}
+
+	/* the same inode and times can still hold other contents, e.g. on a
+	 * file system that was restored from a backup */
+	filesum = alpm_compute_sha256sum(path);
+	hit = filesum && strcmp(filesum, cached) == 0;
+	free(filesum);
+	free(cached);
+	return hit;
+}
+
+/**
+ * Remember a check that passed.
+ * @param handle the context handle
+ * @param path the full path to the verified file
+ * @param key the key returned by #sigcache_key before verifying it
+ * @param expires the time after which the check has to be done again
+ */
+static void sigcache_remember(alpm_handle_t *handle, const char *path,
+		const char *key, time_t expires)
+{
+	char *filesum = alpm_compute_sha256sum(path);
+	char identity[128];
+	size_t len;
+
+	/* the file must not have changed while it was verified and hashed */
+	if(filesum && sigcache_identity(path, identity, sizeof(identity)) == 0
+			&& strncmp(key, identity, len = strlen(identity)) == 0
+			&& key[len] == ' ') {
+		pthread_mutex_lock(&handle->sigcache_lock);
+		if(sigcache_sync(handle) == 0) {
+			sigcache_add(handle, key, filesum, expires);
+		}
+		pthread_mutex_unlock(&handle->sigcache_lock);
+	}
+	free(filesum);
+}
+
 /**
  * Helper for checking the PGP signature for the given file path.
  * This wraps #_alpm_gpgme_checksig in a slightly friendlier manner to simplify
@@ -677,11 +1202,20 @@ int _alpm_check_pgp_helper(alpm_handle_t *handle, const char *path,
 		alpm_siglist_t **sigdata)
 {
 	alpm_siglist_t *siglist;
+	char *cachekey = NULL;
 	int ret;
 
 	CALLOC(siglist, 1, sizeof(alpm_siglist_t),
 			RET_ERR(handle, ALPM_ERR_MEMORY, -1));
 
+	cachekey = sigcache_key(handle, path, base64_sig, marginal, unknown);
+	if(cachekey && sigcache_hit(handle, path, cachekey)) {
+		/* nothing changed since this exact check last passed */
+		_alpm_log(handle, ALPM_LOG_DEBUG, "signature for %s found in cache\n", path);
+		ret = 0;
+		goto done;
+	}
+
 	ret = _alpm_gpgme_checksig(handle, path, base64_sig, siglist);
 	if(ret && handle->pm_errno == ALPM_ERR_SIG_MISSING) {
 		if(optional) {
@@ -733,8 +1267,22 @@ int _alpm_check_pgp_helper(alpm_handle_t *handle, const char *path,
 					break;
 			}
 		}
+		if(!ret && siglist->count && cachekey) {
+			time_t now = time(NULL), expires = now + SIGCACHE_MAX_AGE;
+			for(num = 0; num < siglist->count; num++) {
+				alpm_time_t keyexpires = siglist->results[num].key.expires;
+				if(keyexpires && keyexpires < expires) {
+					expires = (time_t)keyexpires;
+				}
+			}
+			if(expires > now) {
+				sigcache_remember(handle, path, cachekey, expires);
+			}
+		}
 	}
 
+done:
+	free(cachekey);
 	if(sigdata) {
 		*sigdata = siglist;
 	} else {
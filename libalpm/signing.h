@@ -30,6 +30,9 @@ int _alpm_check_pgp_helper(alpm_handle_t *handle, const char *path,
 		alpm_siglist_t **sigdata);
 int _alpm_process_siglist(alpm_handle_t *handle, const char *identifier,
 		alpm_siglist_t *siglist, int optional, int marginal, int unknown);
+void _alpm_gpgme_cleanup(alpm_handle_t *handle);
+void _alpm_sigcache_save(alpm_handle_t *handle);
+void _alpm_sigcache_free(alpm_handle_t *handle);
 
 #endif /* _ALPM_SIGNING_H */
 
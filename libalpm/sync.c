@@ -28,6 +28,10 @@
 #include <stdint.h> /* intmax_t */
 #include <unistd.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 /* libalpm */
 #include "sync.h"
@@ -47,6 +51,7 @@
 #include "remove.h"
 #include "diskspace.h"
 #include "signing.h"
+#include "vcdiff.h"
 
 /** Check for new version of pkg in sync repos
  * (only the first occurrence is considered in sync)
@@ -123,69 +128,60 @@ static alpm_list_t *check_replacers(alpm_handle_t *handle, alpm_pkg_t *lpkg,
 {
 	/* 2. search for replacers in sdb */
 	alpm_list_t *replacers = NULL;
-	alpm_list_t *k;
+	alpm_list_t *candidates, *k;
 	_alpm_log(handle, ALPM_LOG_DEBUG,
 			"searching for replacements for %s in %s\n",
 			lpkg->name, sdb->treename);
-	for(k = _alpm_db_get_pkgcache(sdb); k; k = k->next) {
-		int found = 0;
+	/* we only want to consider literal matches at this point. */
+	candidates = _alpm_db_find_replacers(sdb, lpkg);
+	for(k = candidates; k; k = k->next) {
 		alpm_pkg_t *spkg = k->data;
-		alpm_list_t *l;
-		for(l = alpm_pkg_get_replaces(spkg); l; l = l->next) {
-			alpm_depend_t *replace = l->data;
-			/* we only want to consider literal matches at this point. */
-			if(_alpm_depcmp_literal(lpkg, replace)) {
-				found = 1;
-				break;
-			}
+		int doreplace = 0;
+		alpm_pkg_t *tpkg;
+		/* check IgnorePkg/IgnoreGroup */
+		if(_alpm_pkg_should_ignore(handle, spkg)
+				|| _alpm_pkg_should_ignore(handle, lpkg)) {
+			_alpm_log(handle, ALPM_LOG_WARNING,
+					_("ignoring package replacement (%s-%s => %s-%s)\n"),
+					lpkg->name, lpkg->version, spkg->name, spkg->version);
+			continue;
+		}
+
+		QUESTION(handle, ALPM_QUESTION_REPLACE_PKG, lpkg, spkg,
+				sdb->treename, &doreplace);
+		if(!doreplace) {
+			continue;
 		}
-		if(found) {
-			int doreplace = 0;
-			alpm_pkg_t *tpkg;
-			/* check IgnorePkg/IgnoreGroup */
-			if(_alpm_pkg_should_ignore(handle, spkg)
-					|| _alpm_pkg_should_ignore(handle, lpkg)) {
-				_alpm_log(handle, ALPM_LOG_WARNING,
-						_("ignoring package replacement (%s-%s => %s-%s)\n"),
-						lpkg->name, lpkg->version, spkg->name, spkg->version);
-				continue;
-			}
 
-			QUESTION(handle, ALPM_QUESTION_REPLACE_PKG, lpkg, spkg,
-					sdb->treename, &doreplace);
-			if(!doreplace) {
+		/* If spkg is already in the target list, we append lpkg to spkg's
+		 * removes list */
+		tpkg = _alpm_pkg_find(handle->trans->add, spkg->name);
+		if(tpkg) {
+			/* sanity check, multiple repos can contain spkg->name */
+			if(tpkg->origin_data.db != sdb) {
+				_alpm_log(handle, ALPM_LOG_WARNING, _("cannot replace %s by %s\n"),
+						lpkg->name, spkg->name);
 				continue;
 			}
-
-			/* If spkg is already in the target list, we append lpkg to spkg's
-			 * removes list */
-			tpkg = _alpm_pkg_find(handle->trans->add, spkg->name);
-			if(tpkg) {
-				/* sanity check, multiple repos can contain spkg->name */
-				if(tpkg->origin_data.db != sdb) {
-					_alpm_log(handle, ALPM_LOG_WARNING, _("cannot replace %s by %s\n"),
-							lpkg->name, spkg->name);
-					continue;
-				}
-				_alpm_log(handle, ALPM_LOG_DEBUG, "appending %s to the removes list of %s\n",
-						lpkg->name, tpkg->name);
-				tpkg->removes = alpm_list_add(tpkg->removes, lpkg);
-				/* check the to-be-replaced package's reason field */
-				if(alpm_pkg_get_reason(lpkg) == ALPM_PKG_REASON_EXPLICIT) {
-					tpkg->reason = ALPM_PKG_REASON_EXPLICIT;
-				}
-			} else {
-				/* add spkg to the target list */
-				/* copy over reason */
-				spkg->reason = alpm_pkg_get_reason(lpkg);
-				spkg->removes = alpm_list_add(NULL, lpkg);
-				_alpm_log(handle, ALPM_LOG_DEBUG,
-						"adding package %s-%s to the transaction targets\n",
-						spkg->name, spkg->version);
-				replacers = alpm_list_add(replacers, spkg);
+			_alpm_log(handle, ALPM_LOG_DEBUG, "appending %s to the removes list of %s\n",
+					lpkg->name, tpkg->name);
+			tpkg->removes = alpm_list_add(tpkg->removes, lpkg);
+			/* check the to-be-replaced package's reason field */
+			if(alpm_pkg_get_reason(lpkg) == ALPM_PKG_REASON_EXPLICIT) {
+				tpkg->reason = ALPM_PKG_REASON_EXPLICIT;
 			}
+		} else {
+			/* add spkg to the target list */
+			/* copy over reason */
+			spkg->reason = alpm_pkg_get_reason(lpkg);
+			spkg->removes = alpm_list_add(NULL, lpkg);
+			_alpm_log(handle, ALPM_LOG_DEBUG,
+					"adding package %s-%s to the transaction targets\n",
+					spkg->name, spkg->version);
+			replacers = alpm_list_add(replacers, spkg);
 		}
 	}
+	alpm_list_free(candidates);
 	return replacers;
 }
 
@@ -289,6 +285,10 @@ static int compute_download_size(alpm_pkg_t *newpkg)
 	alpm_handle_t *handle = newpkg->handle;
 	int ret = 0;
 
+	/* a delta path from an earlier computation may no longer apply */
+	alpm_list_free(newpkg->delta_path);
+	newpkg->delta_path = NULL;
+
 	if(newpkg->origin != ALPM_PKG_FROM_SYNCDB) {
 		newpkg->infolevel |= INFRQ_DSIZE;
 		newpkg->download_size = 0;
@@ -305,6 +305,12 @@ static int compute_download_size(alpm_pkg_t *newpkg)
 		goto finish;
 	}
 
+	/* nor if another root already has it, it gets linked in from there */
+	if((fpath = _alpm_sharedcache_find(handle, newpkg))) {
+		size = 0;
+		goto finish;
+	}
+
 	CALLOC(fnamepart, strlen(fname) + 6, sizeof(char), return -1);
 	sprintf(fnamepart, "%s.part", fname);
 	fpath = _alpm_filecache_find(handle, fnamepart);
@@ -618,8 +624,12 @@ int _alpm_sync_prepare(alpm_handle_t *handle, alpm_list_t **data)
 		}
 	}
 	for(i = trans->add; i; i = i->next) {
-		/* update download size field */
+		/* update download size field, unless a front end already asked for it
+		 * in this transaction; alpm_trans_init() forgets older values */
 		alpm_pkg_t *spkg = i->data;
+		if(spkg->infolevel & INFRQ_DSIZE) {
+			continue;
+		}
 		if(compute_download_size(spkg) < 0) {
 			ret = -1;
 			goto cleanup;
@@ -630,6 +640,32 @@ cleanup:
 	return ret;
 }
 
+/** Forget the download sizes and delta paths computed so far.
+ * The package cache may have changed since an earlier transaction, so each
+ * transaction starts over; packages of an unloaded cache have nothing set.
+ * @param handle the context handle
+ */
+void _alpm_sync_forget_dsize(alpm_handle_t *handle)
+{
+	alpm_list_t *i, *j;
+
+	for(i = handle->dbs_sync; i; i = i->next) {
+		alpm_db_t *db = i->data;
+		if(!(db->status & DB_STATUS_PKGCACHE) || db->pkgcache == NULL) {
+			continue;
+		}
+		for(j = db->pkgcache->list; j; j = j->next) {
+			alpm_pkg_t *pkg = j->data;
+			if(pkg->infolevel & INFRQ_DSIZE) {
+				pkg->infolevel &= ~INFRQ_DSIZE;
+				pkg->download_size = 0;
+				alpm_list_free(pkg->delta_path);
+				pkg->delta_path = NULL;
+			}
+		}
+	}
+}
+
 /** Returns the size of the files that will be downloaded to install a
  * package.
  * @param newpkg the new package to upgrade to
@@ -649,10 +685,393 @@ static int endswith(const char *filename, const char *extension)
 	return strcmp(s, extension) == 0;
 }
 
+/** Applies the deltas of a package one by one with the xdelta3 binary.
+ * @param handle the context handle
+ * @param spkg the package to patch together
+ * @param cachedir the cache directory to write to
+ * @param reported number of steps already announced by the in-process
+ * attempt; the last of them still waits for its outcome
+ * @return 0 if all delta files were able to be applied, 1 otherwise.
+ */
+static int apply_delta_path_external(alpm_handle_t *handle, alpm_pkg_t *spkg,
+		const char *cachedir, size_t reported)
+{
+	alpm_list_t *delta_path = spkg->delta_path;
+	alpm_list_t *dlts;
+	size_t n;
+
+	for(dlts = delta_path, n = 0; dlts; dlts = dlts->next, n++) {
+		alpm_delta_t *d = dlts->data;
+		char *delta, *from, *to;
+		char command[PATH_MAX];
+		size_t len = 0;
+
+		delta = _alpm_filecache_find(handle, d->delta);
+		/* the initial package might be in a different cachedir */
+		if(dlts == delta_path) {
+			from = _alpm_filecache_find(handle, d->from);
+		} else {
+			/* len = cachedir len + from len + '/' + null */
+			len = strlen(cachedir) + strlen(d->from) + 2;
+			MALLOC(from, len, RET_ERR(handle, ALPM_ERR_MEMORY, 1));
+			snprintf(from, len, "%s/%s", cachedir, d->from);
+		}
+		len = strlen(cachedir) + strlen(d->to) + 2;
+		MALLOC(to, len, RET_ERR(handle, ALPM_ERR_MEMORY, 1));
+		snprintf(to, len, "%s/%s", cachedir, d->to);
+
+		/* build the patch command */
+		if(endswith(to, ".gz")) {
+			/* special handling for gzip : we disable timestamp with -n option */
+			snprintf(command, PATH_MAX, "xdelta3 -d -q -R -c -s %s %s | gzip -n > %s", from, delta, to);
+		} else {
+			snprintf(command, PATH_MAX, "xdelta3 -d -q -s %s %s %s", from, delta, to);
+		}
+
+		_alpm_log(handle, ALPM_LOG_DEBUG, "command: %s\n", command);
+
+		if(n >= reported) {
+			EVENT(handle, ALPM_EVENT_DELTA_PATCH_START, d->to, d->delta);
+		}
+
+		int retval = system(command);
+		if(retval == 0) {
+			if(n + 1 >= reported) {
+				EVENT(handle, ALPM_EVENT_DELTA_PATCH_DONE, NULL, NULL);
+			}
+
+			/* delete the delta file */
+			unlink(delta);
+
+			/* Delete the 'from' package but only if it is an intermediate
+			 * package. The starting 'from' package should be kept, just
+			 * as if deltas were not used. */
+			if(dlts != delta_path) {
+				unlink(from);
+			}
+		}
+		FREE(from);
+		FREE(to);
+		FREE(delta);
+
+		if(retval != 0) {
+			/* one delta failed for this package, cancel the remaining ones; this
+			 * also ends the step still open, should an earlier one have failed */
+			EVENT(handle, ALPM_EVENT_DELTA_PATCH_FAILED, NULL, NULL);
+			handle->pm_errno = ALPM_ERR_DLT_PATCHFAILED;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* A package's delta path, applied in process by #apply_delta_chain. Each
+ * chain only touches its own files, so chains run on worker threads; events
+ * and logging are left to the main thread. */
+struct delta_workers;
+
+struct delta_chain {
+	alpm_pkg_t *spkg;
+	const char *cachedir;
+	char *from;         /* the starting package */
+	char *to;           /* the package to create */
+	char **deltas;      /* delta file of each step */
+	size_t count;
+	struct delta_workers *workers;
+	/* progress, under workers->lock */
+	size_t started;     /* steps begun */
+	size_t done;        /* steps decoded */
+	int finished;
+	int ret;            /* 0, -1 or VCDIFF_UNSUPPORTED */
+	int external;       /* result of the xdelta3 fallback, if ret != 0 */
+};
+
+struct delta_workers {
+	struct delta_chain *chains;
+	size_t count;
+	size_t next;
+	pthread_mutex_t lock;
+	pthread_cond_t progress;
+};
+
+/* record the progress of a chain and wake up the reporting thread */
+static void chain_progress(struct delta_chain *chain, size_t *steps, size_t value)
+{
+	struct delta_workers *workers = chain->workers;
+
+	pthread_mutex_lock(&workers->lock);
+	*steps = value;
+	pthread_cond_broadcast(&workers->progress);
+	pthread_mutex_unlock(&workers->lock);
+}
+
+static int open_delta_tmpfile(const char *cachedir, char **path)
+{
+	size_t len = strlen(cachedir) + 20;
+	int fd;
+
+	MALLOC(*path, len, return -1);
+	snprintf(*path, len, "%s/.alpm_delta_XXXXXX", cachedir);
+	fd = mkostemp(*path, O_CLOEXEC);
+	if(fd < 0) {
+		FREE(*path);
+	}
+	return fd;
+}
+
+/** Patch a package together from its delta path without leaving the
+ * process. Intermediate packages are kept decompressed in temporary files
+ * and only the final package is written to the cache.
+ * @param chain the chain to apply
+ * @return 0 on success, -1 on error, VCDIFF_UNSUPPORTED if the xdelta3
+ * binary has to be used instead
+ */
+static int apply_delta_chain(struct delta_chain *chain)
+{
+	char *prev = NULL, *cur = NULL;
+	char prev_comp = VCDIFF_COMP_NONE;
+	size_t k;
+	int ret = -1;
+
+	if(!chain->from) {
+		return -1;
+	}
+
+	for(k = 0; k < chain->count; k++) {
+		alpm_vcdiff_t *vcd;
+		unsigned char *src;
+		size_t srclen;
+		int fd;
+
+		if(!chain->deltas[k]) {
+			goto cleanup;
+		}
+		chain_progress(chain, &chain->started, k + 1);
+		if((ret = _alpm_vcdiff_open(chain->deltas[k], &vcd)) != 0) {
+			goto cleanup;
+		}
+		ret = -1;
+
+		if(k == 0) {
+			/* the delta was made against the decompressed package if xdelta3
+			 * recorded a compressor for the source */
+			if(_alpm_vcdiff_map_source(chain->from, vcd->source_comp != VCDIFF_COMP_NONE,
+						chain->cachedir, &src, &srclen) != 0) {
+				_alpm_vcdiff_close(vcd);
+				goto cleanup;
+			}
+		} else {
+			if(vcd->source_comp == VCDIFF_COMP_NONE && prev_comp != VCDIFF_COMP_NONE) {
+				/* would need the recompressed intermediate package */
+				_alpm_vcdiff_close(vcd);
+				ret = VCDIFF_UNSUPPORTED;
+				goto cleanup;
+			}
+			if(_alpm_vcdiff_map_source(prev, 0, chain->cachedir, &src, &srclen) != 0) {
+				_alpm_vcdiff_close(vcd);
+				goto cleanup;
+			}
+		}
+
+		fd = open_delta_tmpfile(chain->cachedir, &cur);
+		if(fd >= 0) {
+			ret = _alpm_vcdiff_decode(vcd, src, srclen, fd);
+			if(fchmod(fd, 0644) != 0) {
+				ret = -1;
+			}
+			CLOSE(fd);
+		}
+		prev_comp = vcd->target_comp;
+		_alpm_vcdiff_unmap_source(src, srclen);
+		_alpm_vcdiff_close(vcd);
+		if(fd < 0 || ret != 0) {
+			goto cleanup;
+		}
+
+		if(prev) {
+			unlink(prev);
+			free(prev);
+		}
+		prev = cur;
+		cur = NULL;
+		chain_progress(chain, &chain->done, k + 1);
+	}
+
+	/* prev now holds the decompressed final package */
+	if(prev_comp == VCDIFF_COMP_GZIP) {
+		ret = _alpm_gzip_file(prev, chain->to);
+	} else if(prev_comp == VCDIFF_COMP_NONE) {
+		ret = rename(prev, chain->to);
+	} else {
+		ret = VCDIFF_UNSUPPORTED;
+	}
+
+	/* our gzip output has to match the one the repository published, otherwise
+	 * leave it to the real tools */
+	if(ret == 0 && chain->spkg->sha256sum) {
+		ret = _alpm_test_checksum(chain->to, chain->spkg->sha256sum,
+				ALPM_PKG_VALIDATION_SHA256SUM) ? VCDIFF_UNSUPPORTED : 0;
+	} else if(ret == 0 && chain->spkg->md5sum) {
+		ret = _alpm_test_checksum(chain->to, chain->spkg->md5sum,
+				ALPM_PKG_VALIDATION_MD5SUM) ? VCDIFF_UNSUPPORTED : 0;
+	}
+	if(ret != 0) {
+		unlink(chain->to);
+	}
+
+cleanup:
+	if(cur) {
+		unlink(cur);
+		free(cur);
+	}
+	if(prev) {
+		unlink(prev);
+		free(prev);
+	}
+	return ret;
+}
+
+static void *delta_worker(void *arg)
+{
+	struct delta_workers *workers = arg;
+
+	while(1) {
+		size_t idx;
+		int ret;
+		pthread_mutex_lock(&workers->lock);
+		idx = workers->next++;
+		pthread_mutex_unlock(&workers->lock);
+		if(idx >= workers->count) {
+			break;
+		}
+		ret = apply_delta_chain(workers->chains + idx);
+		pthread_mutex_lock(&workers->lock);
+		workers->chains[idx].ret = ret;
+		workers->chains[idx].finished = 1;
+		pthread_cond_broadcast(&workers->progress);
+		pthread_mutex_unlock(&workers->lock);
+	}
+	return NULL;
+}
+
+/* Report the steps of the chains, in order, as the workers get through
+ * them. Events are only sent from the calling thread. A chain that fails
+ * in process is handed to xdelta3 right here, so a step is only reported
+ * as failed once both have given up on it. */
+static void report_delta_chains(alpm_handle_t *handle,
+		struct delta_workers *workers)
+{
+	size_t idx, k;
+
+	for(idx = 0; idx < workers->count; idx++) {
+		struct delta_chain *chain = workers->chains + idx;
+		alpm_list_t *dlts = chain->spkg->delta_path;
+		size_t reported = 0;
+		int ret;
+
+		for(k = 0; k < chain->count; k++, dlts = dlts->next) {
+			alpm_delta_t *d = dlts->data;
+			int ok;
+
+			pthread_mutex_lock(&workers->lock);
+			while(!chain->finished && chain->started <= k) {
+				pthread_cond_wait(&workers->progress, &workers->lock);
+			}
+			ok = chain->started > k;
+			pthread_mutex_unlock(&workers->lock);
+			if(!ok) {
+				/* the chain failed before this step */
+				break;
+			}
+
+			EVENT(handle, ALPM_EVENT_DELTA_PATCH_START, d->to, d->delta);
+			reported++;
+
+			/* the last step includes recompressing and checking the package */
+			pthread_mutex_lock(&workers->lock);
+			while(!chain->finished && (k + 1 == chain->count || chain->done <= k)) {
+				pthread_cond_wait(&workers->progress, &workers->lock);
+			}
+			ok = chain->done > k && (k + 1 < chain->count || chain->ret == 0);
+			pthread_mutex_unlock(&workers->lock);
+
+			if(!ok) {
+				break;
+			}
+			EVENT(handle, ALPM_EVENT_DELTA_PATCH_DONE, NULL, NULL);
+		}
+
+		pthread_mutex_lock(&workers->lock);
+		while(!chain->finished) {
+			pthread_cond_wait(&workers->progress, &workers->lock);
+		}
+		ret = chain->ret;
+		pthread_mutex_unlock(&workers->lock);
+
+		if(ret != 0) {
+			_alpm_log(handle, ALPM_LOG_DEBUG,
+					"could not apply deltas for %s internally (%s), using xdelta3\n",
+					chain->spkg->name, ret == VCDIFF_UNSUPPORTED ? "unsupported" : "error");
+			chain->external = apply_delta_path_external(handle, chain->spkg,
+					chain->cachedir, reported);
+		}
+	}
+}
+
+/** Apply independent delta chains concurrently, one worker per CPU, while
+ * the calling thread reports their progress.
+ * @param handle the context handle
+ * @param chains the chains to apply
+ * @param count number of chains
+ */
+static void run_delta_chains(alpm_handle_t *handle, struct delta_chain *chains,
+		size_t count)
+{
+	struct delta_workers workers;
+	pthread_t *threads;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads, i, started = 0;
+
+	workers.chains = chains;
+	workers.count = count;
+	workers.next = 0;
+	pthread_mutex_init(&workers.lock, NULL);
+	pthread_cond_init(&workers.progress, NULL);
+	for(i = 0; i < count; i++) {
+		chains[i].workers = &workers;
+	}
+
+	nthreads = ncpu > 1 ? (size_t)ncpu : 1;
+	if(nthreads > count) {
+		nthreads = count;
+	}
+	CALLOC(threads, nthreads, sizeof(pthread_t), nthreads = 0);
+	for(i = 0; i < nthreads; i++) {
+		if(pthread_create(&threads[started], NULL, delta_worker, &workers) != 0) {
+			break;
+		}
+		started++;
+	}
+	if(started == 0) {
+		/* no threads to be had, do the work here and report afterwards */
+		delta_worker(&workers);
+	}
+	report_delta_chains(handle, &workers);
+	for(i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	pthread_cond_destroy(&workers.progress);
+	pthread_mutex_destroy(&workers.lock);
+}
+
 /** Applies delta files to create an upgraded package file.
  *
  * All intermediate files are deleted, leaving only the starting and
- * ending package files.
+ * ending package files. Deltas are decoded in process, several packages
+ * at a time; anything the built-in decoder can not handle is passed on to
+ * the xdelta3 binary.
  *
  * @param handle the context handle
  *
@@ -661,88 +1080,90 @@ static int endswith(const char *filename, const char *extension)
 static int apply_deltas(alpm_handle_t *handle)
 {
 	alpm_list_t *i;
-	int deltas_found = 0, ret = 0;
+	struct delta_chain *chains;
+	size_t count = 0, idx;
+	int ret = 0;
 	const char *cachedir = _alpm_filecache_setup(handle);
 	alpm_trans_t *trans = handle->trans;
 
 	for(i = trans->add; i; i = i->next) {
 		alpm_pkg_t *spkg = i->data;
-		alpm_list_t *delta_path = spkg->delta_path;
-		alpm_list_t *dlts = NULL;
+		if(spkg->delta_path) {
+			count++;
+		}
+	}
+	if(count == 0) {
+		return 0;
+	}
+
+	CALLOC(chains, count, sizeof(struct delta_chain),
+			RET_ERR(handle, ALPM_ERR_MEMORY, 1));
+	for(i = trans->add, idx = 0; i; i = i->next) {
+		alpm_pkg_t *spkg = i->data;
+		struct delta_chain *chain = chains + idx;
+		alpm_delta_t *first, *last;
+		alpm_list_t *dlts;
+		size_t k, len;
 
-		if(!delta_path) {
+		if(!spkg->delta_path) {
 			continue;
 		}
-
-		if(!deltas_found) {
-			/* only show this if we actually have deltas to apply, and it is before
-			 * the very first one */
-			EVENT(handle, ALPM_EVENT_DELTA_PATCHES_START, NULL, NULL);
-			deltas_found = 1;
+		idx++;
+		chain->spkg = spkg;
+		chain->cachedir = cachedir;
+		chain->count = alpm_list_count(spkg->delta_path);
+		first = spkg->delta_path->data;
+		last = alpm_list_last(spkg->delta_path)->data;
+
+		/* the initial package might be in a different cachedir */
+		chain->from = _alpm_filecache_find(handle, first->from);
+		len = strlen(cachedir) + strlen(last->to) + 2;
+		MALLOC(chain->to, len, handle->pm_errno = ALPM_ERR_MEMORY; ret = 1; goto cleanup);
+		snprintf(chain->to, len, "%s/%s", cachedir, last->to);
+		CALLOC(chain->deltas, chain->count, sizeof(char *),
+				handle->pm_errno = ALPM_ERR_MEMORY; ret = 1; goto cleanup);
+		for(dlts = spkg->delta_path, k = 0; dlts; dlts = dlts->next, k++) {
+			alpm_delta_t *d = dlts->data;
+			chain->deltas[k] = _alpm_filecache_find(handle, d->delta);
 		}
+	}
 
-		for(dlts = delta_path; dlts; dlts = dlts->next) {
-			alpm_delta_t *d = dlts->data;
-			char *delta, *from, *to;
-			char command[PATH_MAX];
-			size_t len = 0;
-
-			delta = _alpm_filecache_find(handle, d->delta);
-			/* the initial package might be in a different cachedir */
-			if(dlts == delta_path) {
-				from = _alpm_filecache_find(handle, d->from);
-			} else {
-				/* len = cachedir len + from len + '/' + null */
-				len = strlen(cachedir) + strlen(d->from) + 2;
-				MALLOC(from, len, RET_ERR(handle, ALPM_ERR_MEMORY, 1));
-				snprintf(from, len, "%s/%s", cachedir, d->from);
-			}
-			len = strlen(cachedir) + strlen(d->to) + 2;
-			MALLOC(to, len, RET_ERR(handle, ALPM_ERR_MEMORY, 1));
-			snprintf(to, len, "%s/%s", cachedir, d->to);
-
-			/* build the patch command */
-			if(endswith(to, ".gz")) {
-				/* special handling for gzip : we disable timestamp with -n option */
-				snprintf(command, PATH_MAX, "xdelta3 -d -q -R -c -s %s %s | gzip -n > %s", from, delta, to);
-			} else {
-				snprintf(command, PATH_MAX, "xdelta3 -d -q -s %s %s %s", from, delta, to);
-			}
+	/* only show this if we actually have deltas to apply */
+	EVENT(handle, ALPM_EVENT_DELTA_PATCHES_START, NULL, NULL);
 
-			_alpm_log(handle, ALPM_LOG_DEBUG, "command: %s\n", command);
+	run_delta_chains(handle, chains, count);
 
-			EVENT(handle, ALPM_EVENT_DELTA_PATCH_START, d->to, d->delta);
-
-			int retval = system(command);
-			if(retval == 0) {
-				EVENT(handle, ALPM_EVENT_DELTA_PATCH_DONE, NULL, NULL);
+	for(idx = 0; idx < count; idx++) {
+		struct delta_chain *chain = chains + idx;
+		size_t k;
 
+		if(chain->ret == 0) {
+			for(k = 0; k < chain->count; k++) {
 				/* delete the delta file */
-				unlink(delta);
-
-				/* Delete the 'from' package but only if it is an intermediate
-				 * package. The starting 'from' package should be kept, just
-				 * as if deltas were not used. */
-				if(dlts != delta_path) {
-					unlink(from);
-				}
-			}
-			FREE(from);
-			FREE(to);
-			FREE(delta);
-
-			if(retval != 0) {
-				/* one delta failed for this package, cancel the remaining ones */
-				EVENT(handle, ALPM_EVENT_DELTA_PATCH_FAILED, NULL, NULL);
-				handle->pm_errno = ALPM_ERR_DLT_PATCHFAILED;
-				ret = 1;
-				break;
+				unlink(chain->deltas[k]);
 			}
+		} else if(chain->external != 0) {
+			ret = 1;
 		}
 	}
-	if(deltas_found) {
-		EVENT(handle, ALPM_EVENT_DELTA_PATCHES_DONE, NULL, NULL);
+
+	EVENT(handle, ALPM_EVENT_DELTA_PATCHES_DONE, NULL, NULL);
+
+cleanup:
+	for(idx = 0; idx < count; idx++) {
+		struct delta_chain *chain = chains + idx;
+		size_t k;
+
+		if(chain->deltas) {
+			for(k = 0; k < chain->count; k++) {
+				free(chain->deltas[k]);
+			}
+		}
+		free(chain->deltas);
+		free(chain->from);
+		free(chain->to);
 	}
+	free(chains);
 
 	return ret;
 }
@@ -814,6 +1235,19 @@ static struct dload_payload *build_payload(alpm_handle_t *handle,
 		return payload;
 }
 
+/* put a package that compute_download_size() found in the shared cache
+ * into the cache, 0 if it is there now */
+static int fetch_shared(alpm_handle_t *handle, alpm_pkg_t *spkg)
+{
+	char *fpath = _alpm_filecache_find(handle, spkg->filename);
+
+	if(fpath) {
+		free(fpath);
+		return 0;
+	}
+	return _alpm_sharedcache_fetch(handle, spkg);
+}
+
 static int find_dl_candidates(alpm_db_t *repo, alpm_list_t **files, alpm_list_t **deltas)
 {
 	alpm_list_t *i;
@@ -841,17 +1275,20 @@ static int find_dl_candidates(alpm_db_t *repo, alpm_list_t **files, alpm_list_t
 						struct dload_payload *payload = build_payload(
 								handle, delta->delta, delta->delta_size, repo->servers);
 						ASSERT(payload, return -1);
+						payload->md5sum = delta->delta_md5;
 						*files = alpm_list_add(*files, payload);
 					}
 					/* keep a list of all the delta files for md5sums */
 					*deltas = alpm_list_add(*deltas, delta);
 				}
 
-			} else if(spkg->download_size != 0) {
+			} else if(spkg->download_size != 0 || fetch_shared(handle, spkg) != 0) {
 				struct dload_payload *payload;
 				ASSERT(spkg->filename != NULL, RET_ERR(handle, ALPM_ERR_PKG_INVALID_NAME, -1));
 				payload = build_payload(handle, spkg->filename, spkg->size, repo->servers);
 				ASSERT(payload, return -1);
+				payload->md5sum = spkg->md5sum;
+				payload->sha256sum = spkg->sha256sum;
 				*files = alpm_list_add(*files, payload);
 			}
 		}
@@ -863,29 +1300,40 @@ static int find_dl_candidates(alpm_db_t *repo, alpm_list_t **files, alpm_list_t
 static int download_single_file(alpm_handle_t *handle, struct dload_payload *payload,
 		const char *cachedir)
 {
-	const alpm_list_t *server;
+	alpm_list_t *servers, *server;
+	int ret = -1;
 
 	payload->handle = handle;
 	payload->allow_resume = 1;
 
-	for(server = payload->servers; server; server = server->next) {
+	/* fastest mirror first; ranking again for every file lets a mirror that
+	 * just stalled drop behind the others */
+	servers = _alpm_dload_rank_servers(handle, payload->servers, payload->max_size);
+	if(_alpm_download_segmented(payload, servers, cachedir) == 0) {
+		alpm_list_free(servers);
+		return 0;
+	}
+	for(server = servers; server; server = server->next) {
 		const char *server_url = server->data;
 		size_t len;
 
 		/* print server + filename into a buffer */
 		len = strlen(server_url) + strlen(payload->remote_name) + 2;
-		MALLOC(payload->fileurl, len, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+		MALLOC(payload->fileurl, len, alpm_list_free(servers);
+				RET_ERR(handle, ALPM_ERR_MEMORY, -1));
 		snprintf(payload->fileurl, len, "%s/%s", server_url, payload->remote_name);
 
 		if(_alpm_download(payload, cachedir, NULL) != -1) {
-			return 0;
+			ret = 0;
+			break;
 		}
 
 		FREE(payload->fileurl);
 		payload->unlink_on_fail = 0;
 	}
 
-	return -1;
+	alpm_list_free(servers);
+	return ret;
 }
 
 static int download_files(alpm_handle_t *handle, alpm_list_t **deltas)
@@ -950,6 +1398,8 @@ static int download_files(alpm_handle_t *handle, alpm_list_t **deltas)
 	}
 
 finish:
+	_alpm_dload_save_mirrorstats(handle);
+
 	if(files) {
 		alpm_list_free_inner(files, (alpm_list_fn_free)_alpm_dload_payload_reset);
 		FREELIST(files);
@@ -1003,10 +1453,18 @@ static int check_validity(alpm_handle_t *handle,
 		if(_alpm_pkg_validate_internal(handle, v.path, v.pkg,
 					v.level, &v.siglist, &v.validation) == -1) {
 			v.error = handle->pm_errno;
+			if(v.error == ALPM_ERR_PKG_INVALID_CHECKSUM) {
+				/* a bad shared copy would come back on every retry */
+				_alpm_sharedcache_discard(handle, v.pkg);
+			}
 			struct validity *invalid = malloc(sizeof(struct validity));
 			memcpy(invalid, &v, sizeof(struct validity));
 			errors = alpm_list_add(errors, invalid);
 		} else {
+			if(v.validation & ALPM_PKG_VALIDATION_SHA256SUM) {
+				/* only verified contents may be shared */
+				_alpm_sharedcache_store(handle, v.pkg, v.path);
+			}
 			alpm_siglist_cleanup(v.siglist);
 			free(v.siglist);
 			free(v.path);
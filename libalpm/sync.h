@@ -26,6 +26,7 @@
 
 int _alpm_sync_prepare(alpm_handle_t *handle, alpm_list_t **data);
 int _alpm_sync_commit(alpm_handle_t *handle, alpm_list_t **data);
+void _alpm_sync_forget_dsize(alpm_handle_t *handle);
 
 #endif /* _ALPM_SYNC_H */
 
@@ -38,6 +38,7 @@
 #include "handle.h"
 #include "remove.h"
 #include "sync.h"
+#include "signing.h"
 #include "alpm.h"
 
 /** \addtogroup alpm_trans Transaction Functions
@@ -62,11 +63,19 @@ int SYMEXPORT alpm_trans_init(alpm_handle_t *handle, alpm_transflag_t flags)
 	}
 
 	CALLOC(trans, 1, sizeof(alpm_trans_t), RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	trans->skip_remove = _alpm_globset_new();
+	if(trans->skip_remove == NULL) {
+		free(trans);
+		RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+	}
 	trans->flags = flags;
 	trans->state = STATE_INITIALIZED;
 
 	handle->trans = trans;
 
+	/* download sizes from an earlier transaction may be out of date */
+	_alpm_sync_forget_dsize(handle);
+
 	return 0;
 }
 
@@ -139,10 +148,22 @@ int SYMEXPORT alpm_trans_prepare(alpm_handle_t *handle, alpm_list_t **data)
 	return 0;
 }
 
+static alpm_globset_t *compile_patterns(alpm_list_t *patterns)
+{
+	alpm_globset_t *set = _alpm_globset_new();
+
+	if(set && _alpm_globset_add_list(set, patterns) != 0) {
+		_alpm_globset_free(set);
+		return NULL;
+	}
+	return set;
+}
+
 /** Commit a transaction. */
 int SYMEXPORT alpm_trans_commit(alpm_handle_t *handle, alpm_list_t **data)
 {
 	alpm_trans_t *trans;
+	int ret;
 
 	/* Sanity checks */
 	CHECK_HANDLE(handle, return -1);
@@ -159,18 +180,33 @@ int SYMEXPORT alpm_trans_commit(alpm_handle_t *handle, alpm_list_t **data)
 		return 0;
 	}
 
+	/* these are matched against every file from now on */
+	_alpm_globset_free(trans->noextract);
+	_alpm_globset_free(trans->noupgrade);
+	trans->noextract = compile_patterns(handle->noextract);
+	trans->noupgrade = compile_patterns(handle->noupgrade);
+	if(trans->noextract == NULL || trans->noupgrade == NULL) {
+		RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+	}
+
 	trans->state = STATE_COMMITING;
 
 	if(trans->add == NULL) {
-		if(_alpm_remove_packages(handle, 1) == -1) {
-			/* pm_errno is set by _alpm_remove_commit() */
-			return -1;
-		}
+		ret = _alpm_remove_packages(handle, 1);
+		/* pm_errno is set by _alpm_remove_commit() */
 	} else {
-		if(_alpm_sync_commit(handle, data) == -1) {
-			/* pm_errno is set by _alpm_sync_commit() */
-			return -1;
-		}
+		ret = _alpm_sync_commit(handle, data);
+		/* pm_errno is set by _alpm_sync_commit() */
+	}
+
+	/* whatever made it to disk, even if the commit failed halfway */
+	_alpm_trans_rename_held(handle);
+	if(handle->syncpolicy != ALPM_SYNCPOLICY_NONE
+			&& !(trans->flags & ALPM_TRANS_FLAG_DOWNLOADONLY)) {
+		_alpm_syncfs(handle);
+	}
+	if(ret == -1) {
+		return -1;
 	}
 
 	trans->state = STATE_COMMITED;
@@ -213,6 +249,9 @@ int SYMEXPORT alpm_trans_release(alpm_handle_t *handle)
 	_alpm_trans_free(trans);
 	handle->trans = NULL;
 
+	/* verifications done during the transaction, written while still locked */
+	_alpm_sigcache_save(handle);
+
 	/* unlock db */
 	if(!nolock_flag) {
 		if(_alpm_handle_unlock(handle)) {
@@ -230,6 +269,8 @@ int SYMEXPORT alpm_trans_release(alpm_handle_t *handle)
 
 void _alpm_trans_free(alpm_trans_t *trans)
 {
+	alpm_list_t *i;
+
 	if(trans == NULL) {
 		return;
 	}
@@ -242,11 +283,81 @@ void _alpm_trans_free(alpm_trans_t *trans)
 	alpm_list_free_inner(trans->remove, (alpm_list_fn_free)_alpm_pkg_free);
 	alpm_list_free(trans->remove);
 
-	FREELIST(trans->skip_remove);
+	_alpm_globset_free(trans->skip_remove);
+	_alpm_globset_free(trans->noextract);
+	_alpm_globset_free(trans->noupgrade);
+
+	/* never renamed, the old files stay */
+	for(i = trans->renames; i; i = i->next) {
+		alpm_heldrename_t *held = i->data;
+		unlink(held->tmppath);
+		_alpm_heldrename_free(held);
+	}
+	alpm_list_free(trans->renames);
 
 	FREE(trans);
 }
 
+/** Whether files replaced during the commit are renamed into place by
+ * _alpm_trans_rename_held() instead of right away, which is what
+ * ALPM_SYNCPOLICY_TRANSACTION does.
+ */
+int _alpm_trans_holds_renames(alpm_handle_t *handle)
+{
+	return handle->syncpolicy == ALPM_SYNCPOLICY_TRANSACTION && handle->trans
+		&& (handle->trans->state == STATE_COMMITING
+				|| handle->trans->state == STATE_INTERRUPTED);
+}
+
+/** Rename tmppath over path with the other files held back.
+ * @return 0 if the rename is held and the strings belong to the transaction,
+ * -1 on error
+ */
+int _alpm_trans_hold_rename(alpm_handle_t *handle, char *tmppath, char *path)
+{
+	alpm_heldrename_t *held;
+
+	CALLOC(held, 1, sizeof(alpm_heldrename_t), RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	held->tmppath = tmppath;
+	held->path = path;
+	handle->trans->renames = alpm_list_add(handle->trans->renames, held);
+	return 0;
+}
+
+/** Rename the files held back so far into place, after a single syncfs()
+ * which puts their contents on disk. This runs before anything that may
+ * look at the files, scriptlets and ldconfig, and at the end of the commit.
+ * @param handle the context handle
+ * @return 0 on success, -1 if some file could not be renamed
+ */
+int _alpm_trans_rename_held(alpm_handle_t *handle)
+{
+	alpm_trans_t *trans = handle->trans;
+	alpm_list_t *i;
+	int ret = 0;
+
+	if(trans == NULL || trans->renames == NULL) {
+		return 0;
+	}
+
+	_alpm_log(handle, ALPM_LOG_DEBUG, "renaming %zd held files into place\n",
+			alpm_list_count(trans->renames));
+	_alpm_syncfs(handle);
+	for(i = trans->renames; i; i = i->next) {
+		alpm_heldrename_t *held = i->data;
+		if(rename(held->tmppath, held->path) != 0) {
+			_alpm_log(handle, ALPM_LOG_ERROR, _("could not rename %s to %s (%s)\n"),
+					held->tmppath, held->path, strerror(errno));
+			unlink(held->tmppath);
+			ret = -1;
+		}
+		_alpm_heldrename_free(held);
+	}
+	alpm_list_free(trans->renames);
+	trans->renames = NULL;
+	return ret;
+}
+
 /* A cheap grep for text files, returns 1 if a substring
  * was found in the text file fn, 0 if it wasn't
  */
@@ -282,6 +393,9 @@ int _alpm_runscriptlet(alpm_handle_t *handle, const char *filepath,
 	int retval = 0;
 	size_t len;
 
+	/* the scriptlet, and whatever it runs, sees the files written so far */
+	_alpm_trans_rename_held(handle);
+
 	if(_alpm_access(handle, NULL, filepath, R_OK) != 0) {
 		_alpm_log(handle, ALPM_LOG_DEBUG, "scriptlet '%s' not found\n", filepath);
 		return 0;
@@ -24,6 +24,7 @@
 #define _ALPM_TRANS_H
 
 #include "alpm.h"
+#include "globset.h"
 
 typedef enum _alpm_transstate_t {
 	STATE_IDLE = 0,
@@ -42,11 +43,20 @@ struct __alpm_trans_t {
 	alpm_list_t *unresolvable;  /* list of (alpm_pkg_t *) */
 	alpm_list_t *add;           /* list of (alpm_pkg_t *) */
 	alpm_list_t *remove;        /* list of (alpm_pkg_t *) */
-	alpm_list_t *skip_remove;   /* list of (char *) */
+	alpm_globset_t *skip_remove; /* files that changed owner */
+	/* handle->noextract and handle->noupgrade, compiled for the commit */
+	alpm_globset_t *noextract;
+	alpm_globset_t *noupgrade;
+	/* files written by the commit that replace others, renamed all at once
+	 * after a syncfs(), see _alpm_trans_rename_held() */
+	alpm_list_t *renames;       /* list of (alpm_heldrename_t *) */
 };
 
 void _alpm_trans_free(alpm_trans_t *trans);
 int _alpm_trans_init(alpm_trans_t *trans, alpm_transflag_t flags);
+int _alpm_trans_holds_renames(alpm_handle_t *handle);
+int _alpm_trans_hold_rename(alpm_handle_t *handle, char *tmppath, char *path);
+int _alpm_trans_rename_held(alpm_handle_t *handle);
 int _alpm_runscriptlet(alpm_handle_t *handle, const char *filepath,
 		const char *script, const char *ver, const char *oldver, int is_archive);
 
@@ -25,15 +25,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
-#include <dirent.h>
 #include <time.h>
 #include <syslog.h>
 #include <errno.h>
 #include <limits.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
 #include <locale.h> /* setlocale */
 #include <fnmatch.h>
 
+#ifdef __linux__
+#include <linux/fs.h> /* FICLONE */
+#endif
+
 /* libarchive */
 #include <archive.h>
 #include <archive_entry.h>
@@ -48,6 +52,8 @@
 
 /* libalpm */
 #include "util.h"
+#include "diskwriter.h"
+#include "mtdecode.h"
 #include "log.h"
 #include "alpm.h"
 #include "alpm_list.h"
@@ -193,6 +199,117 @@ cleanup:
 	return ret;
 }
 
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while(len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/** Copies the contents of a file between descriptors. The destination
+ * shares the blocks of the source if the filesystem can reflink them
+ * (FICLONE), otherwise copy_file_range() copies them in the kernel, and
+ * only if neither works are they read and written here.
+ * @param srcfd descriptor to copy from, at offset 0
+ * @param destfd empty descriptor to copy to
+ * @param size number of bytes to copy
+ * @return 0 on success, -1 on error (with errno set)
+ */
+int _alpm_copyfd(int srcfd, int destfd, off_t size)
+{
+	char buf[64 * 1024];
+	off_t left = size;
+
+#ifdef FICLONE
+	if(ioctl(destfd, FICLONE, srcfd) == 0) {
+		return 0;
+	}
+#endif
+
+	while(left > 0) {
+		ssize_t n = copy_file_range(srcfd, NULL, destfd, NULL, (size_t)left, 0);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			if(n < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+					errno != EOPNOTSUPP) {
+				return -1;
+			}
+			break;
+		}
+		left -= n;
+	}
+
+	/* no kernel support, copy the rest by hand */
+	while(left > 0) {
+		ssize_t nread = read(srcfd, buf, sizeof(buf));
+		if(nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if(nread <= 0) {
+			return -1;
+		}
+		if(write_all(destfd, buf, (size_t)nread) != 0) {
+			return -1;
+		}
+		left -= nread;
+	}
+	return 0;
+}
+
+/** Write the gzip compressed contents of src to dest with 'gzip -n'.
+ * zlib does not produce the same bytes as gzip and the result has to match
+ * the checksum published by the repository, so the real tool is used for
+ * this last step; it is spawned directly rather than through a shell. As
+ * this runs on delta worker threads, everything they open is close-on-exec
+ * so that gzip does not inherit it. */
+int _alpm_gzip_file(const char *src, const char *dest)
+{
+	int in, out, status;
+	pid_t pid;
+
+	OPEN(in, src, O_RDONLY | O_CLOEXEC);
+	if(in < 0) {
+		return -1;
+	}
+	out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC, 0644);
+	if(out < 0) {
+		CLOSE(in);
+		return -1;
+	}
+
+	pid = fork();
+	if(pid == 0) {
+		if(dup2(in, 0) == -1 || dup2(out, 1) == -1) {
+			_exit(1);
+		}
+		execlp("gzip", "gzip", "-n", "-c", (char *)NULL);
+		_exit(127);
+	}
+	CLOSE(in);
+	CLOSE(out);
+	if(pid == -1) {
+		return -1;
+	}
+
+	while(waitpid(pid, &status, 0) == -1) {
+		if(errno != EINTR) {
+			return -1;
+		}
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
 /** Trim trailing newlines from a string (if any exist).
  * @param str a single line of text
  * @param len size of str, if known, else 0
@@ -216,6 +333,22 @@ size_t _alpm_strip_newline(char *str, size_t len)
 
 /* Compression functions */
 
+/** Enable all the decompression filters for an archive being read.
+ * libarchive releases without zstd support hand it to the external program.
+ * @param archive the archive to set up
+ */
+void _alpm_archive_support_filters(struct archive *archive)
+{
+	archive_read_support_compression_all(archive);
+#ifndef ARCHIVE_FILTER_ZSTD
+	{
+		static const char zstd_magic[] = { '\x28', '\xb5', '\x2f', '\xfd' };
+		archive_read_support_compression_program_signature(archive, "zstd -dcq",
+				zstd_magic, sizeof(zstd_magic));
+	}
+#endif
+}
+
 /** Open an archive for reading and perform the necessary boilerplate.
  * This takes care of creating the libarchive 'archive' struct, setting up
  * compression and format options, opening a file descriptor, setting up the
@@ -227,20 +360,42 @@ size_t _alpm_strip_newline(char *str, size_t len)
  * @param buf space for a stat buffer for the given path
  * @param archive pointer to place the created archive object
  * @param error error code to set on failure to open archive
+ * @param readall whether all of the archive is going to be read, which
+ * allows decoding it with several threads
  * @return -1 on failure, >=0 file descriptor on success
  */
 int _alpm_open_archive(alpm_handle_t *handle, const char *path,
-		struct stat *buf, struct archive **archive, alpm_errno_t error)
+		struct stat *buf, struct archive **archive, alpm_errno_t error,
+		int readall)
 {
-	int fd;
+	alpm_errno_t err;
+	int fd = _alpm_open_archive_r(handle, path, buf, archive, error, readall, &err);
+
+	if(fd < 0) {
+		RET_ERR(handle, err, -1);
+	}
+	return fd;
+}
+
+/** Open an archive like _alpm_open_archive(), but leave handle->pm_errno
+ * alone so that worker threads can use it.
+ * @param err where to store the error code on failure
+ * @return -1 on failure, >=0 file descriptor on success
+ */
+int _alpm_open_archive_r(alpm_handle_t *handle, const char *path,
+		struct stat *buf, struct archive **archive, alpm_errno_t error,
+		int readall, alpm_errno_t *err)
+{
+	int fd, ret;
 	size_t bufsize = ALPM_BUFFER_SIZE;
 	errno = 0;
 
 	if((*archive = archive_read_new()) == NULL) {
-		RET_ERR(handle, ALPM_ERR_LIBARCHIVE, -1);
+		*err = ALPM_ERR_LIBARCHIVE;
+		return -1;
 	}
 
-	archive_read_support_compression_all(*archive);
+	_alpm_archive_support_filters(*archive);
 	archive_read_support_format_all(*archive);
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "opening archive %s\n", path);
@@ -262,6 +417,18 @@ int _alpm_open_archive(alpm_handle_t *handle, const char *path,
 	}
 #endif
 
+	if(readall) {
+		ret = _alpm_mtdecode_open(*archive, fd, buf->st_size);
+		if(ret == 0) {
+			_alpm_log(handle, ALPM_LOG_DEBUG, "decoding %s with several threads\n", path);
+			return fd;
+		} else if(ret < 0) {
+			_alpm_log(handle, ALPM_LOG_ERROR, _("could not open file %s: %s\n"),
+					path, archive_error_string(*archive));
+			goto error;
+		}
+	}
+
 	if(archive_read_open_fd(*archive, fd, bufsize) != ARCHIVE_OK) {
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not open file %s: %s\n"),
 				path, archive_error_string(*archive));
@@ -276,7 +443,8 @@ error:
 	if(fd >= 0) {
 		CLOSE(fd);
 	}
-	RET_ERR(handle, error, -1);
+	*err = error;
+	return -1;
 }
 
 /** Unpack a specific file in an archive.
@@ -316,24 +484,20 @@ int _alpm_unpack(alpm_handle_t *handle, const char *path, const char *prefix,
 	struct archive *archive;
 	struct archive_entry *entry;
 	struct stat buf;
-	int fd, cwdfd;
+	alpm_diskwriter_t *disk;
+	int fd;
 
-	fd = _alpm_open_archive(handle, path, &buf, &archive, ALPM_ERR_PKG_OPEN);
+	fd = _alpm_open_archive(handle, path, &buf, &archive, ALPM_ERR_PKG_OPEN,
+			list == NULL);
 	if(fd < 0) {
 		return 1;
 	}
 
 	oldmask = umask(0022);
 
-	/* save the cwd so we can restore it later */
-	OPEN(cwdfd, ".", O_RDONLY);
-	if(cwdfd < 0) {
-		_alpm_log(handle, ALPM_LOG_ERROR, _("could not get current working directory\n"));
-	}
-
-	/* just in case our cwd was removed in the upgrade operation */
-	if(chdir(prefix) != 0) {
-		_alpm_log(handle, ALPM_LOG_ERROR, _("could not change directory to %s (%s)\n"),
+	disk = _alpm_diskwriter_new(prefix, 0);
+	if(disk == NULL) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not open directory %s: %s\n"),
 				prefix, strerror(errno));
 		ret = 1;
 		goto cleanup;
@@ -373,14 +537,14 @@ int _alpm_unpack(alpm_handle_t *handle, const char *path, const char *prefix,
 		}
 
 		/* Extract the archive entry. */
-		int readret = archive_read_extract(archive, entry, 0);
+		int readret = _alpm_diskwriter_extract(disk, archive, entry);
 		if(readret == ARCHIVE_WARN) {
 			/* operation succeeded but a non-critical error was encountered */
 			_alpm_log(handle, ALPM_LOG_WARNING, _("warning given when extracting %s (%s)\n"),
-					entryname, archive_error_string(archive));
+					entryname, _alpm_diskwriter_error_string(disk));
 		} else if(readret != ARCHIVE_OK) {
 			_alpm_log(handle, ALPM_LOG_ERROR, _("could not extract %s (%s)\n"),
-					entryname, archive_error_string(archive));
+					entryname, _alpm_diskwriter_error_string(disk));
 			ret = 1;
 			goto cleanup;
 		}
@@ -391,61 +555,17 @@ int _alpm_unpack(alpm_handle_t *handle, const char *path, const char *prefix,
 	}
 
 cleanup:
+	if(disk) {
+		_alpm_diskwriter_close(disk);
+		_alpm_diskwriter_free(disk);
+	}
 	umask(oldmask);
 	archive_read_finish(archive);
 	CLOSE(fd);
-	if(cwdfd >= 0) {
-		if(fchdir(cwdfd) != 0) {
-			_alpm_log(handle, ALPM_LOG_ERROR,
-					_("could not restore working directory (%s)\n"), strerror(errno));
-		}
-		CLOSE(cwdfd);
-	}
 
 	return ret;
 }
 
-/** Determine if there are files in a directory.
- * @param handle the context handle
- * @param path the full absolute directory path
- * @param full_count whether to return an exact count of files
- * @return a file count if full_count is != 0, else >0 if directory has
- * contents, 0 if no contents, and -1 on error
- */
-ssize_t _alpm_files_in_directory(alpm_handle_t *handle, const char *path,
-		int full_count)
-{
-	ssize_t files = 0;
-	struct dirent *ent;
-	DIR *dir = opendir(path);
-
-	if(!dir) {
-		if(errno == ENOTDIR) {
-			_alpm_log(handle, ALPM_LOG_DEBUG, "%s was not a directory\n", path);
-		} else {
-			_alpm_log(handle, ALPM_LOG_DEBUG, "could not read directory %s\n",
-					path);
-		}
-		return -1;
-	}
-	while((ent = readdir(dir)) != NULL) {
-		const char *name = ent->d_name;
-
-		if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-			continue;
-		}
-
-		files++;
-
-		if(!full_count) {
-			break;
-		}
-	}
-
-	closedir(dir);
-	return files;
-}
-
 /** Write formatted message to log.
  * @param handle the context handle
  * @param format formatted string to write out
@@ -609,6 +729,54 @@ cleanup:
 	return retval;
 }
 
+/** Flush everything written below the root and to the local database to
+ * disk, with one syncfs() for each filesystem involved.
+ * @param handle the context handle
+ * @return 0 on success, -1 on error
+ */
+int _alpm_syncfs(alpm_handle_t *handle)
+{
+	const char *paths[2];
+	dev_t synced = 0;
+	int i, ret = 0;
+
+	paths[0] = handle->root;
+	paths[1] = handle->dbpath;
+	for(i = 0; i < 2; i++) {
+		struct stat st;
+		int fd;
+
+		OPEN(fd, paths[i], O_RDONLY | O_DIRECTORY);
+		if(fd < 0 || fstat(fd, &st) != 0) {
+			_alpm_log(handle, ALPM_LOG_WARNING, _("could not sync %s to disk (%s)\n"),
+					paths[i], strerror(errno));
+			ret = -1;
+		} else if(i == 0 || st.st_dev != synced) {
+			_alpm_log(handle, ALPM_LOG_DEBUG, "syncing filesystem of %s\n", paths[i]);
+			if(syncfs(fd) != 0) {
+				_alpm_log(handle, ALPM_LOG_WARNING, _("could not sync %s to disk (%s)\n"),
+						paths[i], strerror(errno));
+				ret = -1;
+			}
+			synced = st.st_dev;
+		}
+		if(fd >= 0) {
+			CLOSE(fd);
+		}
+	}
+
+	return ret;
+}
+
+void _alpm_heldrename_free(alpm_heldrename_t *held)
+{
+	if(held) {
+		free(held->tmppath);
+		free(held->path);
+		free(held);
+	}
+}
+
 /** Run ldconfig in a chroot.
  * @param handle the context handle
  * @return 0 on success, 1 on error
@@ -619,6 +787,9 @@ int _alpm_ldconfig(alpm_handle_t *handle)
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "running ldconfig\n");
 
+	/* it has to see the libraries written so far */
+	_alpm_trans_rename_held(handle);
+
 	snprintf(line, PATH_MAX, "%setc/ld.so.conf", handle->root);
 	if(access(line, F_OK) == 0) {
 		snprintf(line, PATH_MAX, "%ssbin/ldconfig", handle->root);
@@ -723,6 +894,256 @@ const char *_alpm_filecache_setup(alpm_handle_t *handle)
 	return cachedir;
 }
 
+/* The shared cache keeps packages by content, as
+ * <sharedcachedir>/<first two digits>/<sha256sum>, so that several roots,
+ * or several handles on one host, link their cache entries to a single
+ * copy: a package is downloaded and stored only once. Only package files
+ * whose sha256sum has been verified are added to it. */
+
+/* the path of the shared copy of a package, NULL if it cannot have one */
+static char *sharedcache_path(alpm_handle_t *handle, alpm_pkg_t *pkg)
+{
+	const char *sum = pkg->sha256sum;
+	char *path;
+	size_t len;
+
+	/* the sum becomes a path, so it has to be exactly that */
+	if(!handle->sharedcachedir || !sum || strlen(sum) != 64 ||
+			strspn(sum, "0123456789abcdef") != 64) {
+		return NULL;
+	}
+
+	len = strlen(handle->sharedcachedir) + 68;
+	MALLOC(path, len, RET_ERR(handle, ALPM_ERR_MEMORY, NULL));
+	snprintf(path, len, "%s%.2s/%s", handle->sharedcachedir, sum, sum);
+	return path;
+}
+
+/** Whether a file can only be modified by root. A package that was
+ * verified may only share its inode with such a file.
+ * @param st the status of the file
+ * @return 1 if only root can write it, 0 otherwise
+ */
+int _alpm_root_only_writable(const struct stat *st)
+{
+	return st->st_uid == 0 && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/** Hard link src to dest if src can only be modified by root. The new link
+ * is checked in case src was replaced in between.
+ * @param src the file to link to
+ * @param dest the new link, which must not exist
+ * @param st the status of src
+ * @return 0 if linked, -1 otherwise
+ */
+int _alpm_link_trusted(const char *src, const char *dest, const struct stat *st)
+{
+	struct stat linkst;
+
+	if(!_alpm_root_only_writable(st) || link(src, dest) != 0) {
+		return -1;
+	}
+	if(lstat(dest, &linkst) != 0 || linkst.st_ino != st->st_ino
+			|| linkst.st_dev != st->st_dev || !_alpm_root_only_writable(&linkst)) {
+		unlink(dest);
+		return -1;
+	}
+	return 0;
+}
+
+/* make dest a hard link to src if that is safe, or else a copy sharing its
+ * blocks where the filesystem allows it */
+static int link_or_copy(const char *src, const char *dest)
+{
+	struct stat st;
+	int srcfd, destfd, ret = -1;
+
+	unlink(dest);
+	if(stat(src, &st) == 0 && _alpm_link_trusted(src, dest, &st) == 0) {
+		return 0;
+	}
+
+	OPEN(srcfd, src, O_RDONLY | O_CLOEXEC);
+	if(srcfd < 0) {
+		return -1;
+	}
+	if(fstat(srcfd, &st) != 0 ||
+			(destfd = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) < 0) {
+		CLOSE(srcfd);
+		return -1;
+	}
+	if(_alpm_copyfd(srcfd, destfd, st.st_size) == 0) {
+		struct timespec times[2];
+		times[0] = st.st_atim;
+		times[1] = st.st_mtim;
+		futimens(destfd, times);
+		ret = 0;
+	}
+	if(close(destfd) != 0) {
+		ret = -1;
+	}
+	CLOSE(srcfd);
+	if(ret != 0) {
+		unlink(dest);
+	}
+	return ret;
+}
+
+/** Find a package in the shared cache.
+ * @param handle the context handle
+ * @param pkg the sync package to find
+ * @return malloced path of the shared copy, NULL if there is none
+ */
+char *_alpm_sharedcache_find(alpm_handle_t *handle, alpm_pkg_t *pkg)
+{
+	char *path = sharedcache_path(handle, pkg);
+	struct stat buf;
+
+	if(path == NULL) {
+		return NULL;
+	}
+	if(stat(path, &buf) != 0 || !S_ISREG(buf.st_mode)) {
+		free(path);
+		return NULL;
+	}
+	_alpm_log(handle, ALPM_LOG_DEBUG, "found shared pkg: %s\n", path);
+	return path;
+}
+
+/** Put the shared copy of a package into the writable cachedir, under the
+ * package filename. It is checked like a downloaded file afterwards.
+ * @param handle the context handle
+ * @param pkg the sync package to fetch
+ * @return 0 on success, -1 if there is no shared copy or it could not be
+ * linked or copied
+ */
+int _alpm_sharedcache_fetch(alpm_handle_t *handle, alpm_pkg_t *pkg)
+{
+	const char *cachedir;
+	char *src, *dest = NULL, *part = NULL;
+	size_t len;
+	int ret = -1;
+
+	if((src = _alpm_sharedcache_find(handle, pkg)) == NULL) {
+		return -1;
+	}
+
+	cachedir = _alpm_filecache_setup(handle);
+	len = strlen(cachedir) + strlen(pkg->filename) + 6;
+	MALLOC(dest, len, handle->pm_errno = ALPM_ERR_MEMORY; goto cleanup);
+	MALLOC(part, len, handle->pm_errno = ALPM_ERR_MEMORY; goto cleanup);
+	snprintf(dest, len, "%s%s", cachedir, pkg->filename);
+	snprintf(part, len, "%s%s.part", cachedir, pkg->filename);
+
+	if(link_or_copy(src, part) == 0 && rename(part, dest) == 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "using shared copy of %s\n", pkg->filename);
+		ret = 0;
+	} else {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not use shared copy %s (%s)\n",
+				src, strerror(errno));
+		unlink(part);
+	}
+
+cleanup:
+	free(src);
+	free(dest);
+	free(part);
+	return ret;
+}
+
+/** Remove the shared copy of a package if it does not match its checksum.
+ * A package that failed validation may have come from there, and would be
+ * taken from there again on the next attempt instead of being downloaded.
+ * @param handle the context handle
+ * @param pkg the sync package
+ */
+void _alpm_sharedcache_discard(alpm_handle_t *handle, alpm_pkg_t *pkg)
+{
+	char *obj, *objsum;
+
+	if((obj = _alpm_sharedcache_find(handle, pkg)) == NULL) {
+		return;
+	}
+	objsum = alpm_compute_sha256sum(obj);
+	if(objsum == NULL || strcmp(objsum, pkg->sha256sum) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "removing corrupted shared copy %s\n", obj);
+		unlink(obj);
+	}
+	free(objsum);
+	free(obj);
+}
+
+/** Share a verified package file through the shared cache. If the shared
+ * cache has no good copy yet, the file is added to it. The file itself is
+ * never replaced, it is what was verified; roots share a copy by fetching
+ * it from the shared cache before validation instead.
+ * @param handle the context handle
+ * @param pkg the sync package
+ * @param path the package file, its sha256sum already verified
+ * @return 0 on success, -1 on error
+ */
+int _alpm_sharedcache_store(alpm_handle_t *handle, alpm_pkg_t *pkg,
+		const char *path)
+{
+	char *obj, *tmp = NULL, *dir, *objsum;
+	struct stat st, objst;
+	size_t len;
+	int ret = -1;
+
+	if((obj = sharedcache_path(handle, pkg)) == NULL) {
+		return -1;
+	}
+	if(stat(path, &st) != 0) {
+		goto cleanup;
+	}
+
+	if(stat(obj, &objst) == 0) {
+		if(objst.st_dev == st.st_dev && objst.st_ino == st.st_ino) {
+			/* fetched from the shared cache */
+			ret = 0;
+			goto cleanup;
+		}
+		/* only the contents tell whether an existing copy is good */
+		if(objst.st_size == st.st_size && (objsum = alpm_compute_sha256sum(obj))) {
+			int match = strcmp(objsum, pkg->sha256sum) == 0;
+			free(objsum);
+			if(match) {
+				ret = 0;
+				goto cleanup;
+			}
+		}
+	}
+
+	/* add it, replacing a shared copy that turned out not to match */
+	dir = strrchr(obj, '/');
+	*dir = '\0';
+	if(_alpm_makepath(obj) != 0) {
+		*dir = '/';
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not create shared cache directory for %s\n",
+				obj);
+		goto cleanup;
+	}
+	*dir = '/';
+
+	/* other handles may be adding it at the same time */
+	len = strlen(obj) + 24;
+	MALLOC(tmp, len, handle->pm_errno = ALPM_ERR_MEMORY; goto cleanup);
+	snprintf(tmp, len, "%s.%ld", obj, (long)getpid());
+	if(link_or_copy(path, tmp) == 0 && rename(tmp, obj) == 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "added %s to shared cache\n", pkg->filename);
+		ret = 0;
+	} else {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not add %s to shared cache (%s)\n",
+				pkg->filename, strerror(errno));
+		unlink(tmp);
+	}
+
+cleanup:
+	free(obj);
+	free(tmp);
+	return ret;
+}
+
 /** lstat wrapper that treats /path/dirsymlink/ the same as /path/dirsymlink.
  * Linux lstat follows POSIX semantics and still performs a dereference on
  * the first, and for uses of lstat in libalpm this is not what we want.
@@ -763,7 +1184,7 @@ static int md5_file(const char *path, unsigned char output[16])
 
 	MALLOC(buf, (size_t)ALPM_BUFFER_SIZE, return 1);
 
-	OPEN(fd, path, O_RDONLY);
+	OPEN(fd, path, O_RDONLY | O_CLOEXEC);
 	if(fd < 0) {
 		free(buf);
 		return 1;
@@ -805,7 +1226,7 @@ static int sha2_file(const char *path, unsigned char output[32], int is224)
 
 	MALLOC(buf, (size_t)ALPM_BUFFER_SIZE, return 1);
 
-	OPEN(fd, path, O_RDONLY);
+	OPEN(fd, path, O_RDONLY | O_CLOEXEC);
 	if(fd < 0) {
 		free(buf);
 		return 1;
@@ -906,6 +1327,127 @@ char SYMEXPORT *alpm_compute_sha256sum(const char *filename)
 	return hex_representation(output, 32);
 }
 
+/** Get the sha256 sum of a memory buffer.
+ * @param data the buffer to digest
+ * @param len length of the buffer in bytes
+ * @return the checksum on success, NULL on error
+ */
+char *_alpm_compute_sha256sum_buffer(const void *data, size_t len)
+{
+	unsigned char output[32];
+
+	ASSERT(data != NULL, return NULL);
+
+#ifdef HAVE_LIBSSL
+	SHA256(data, len, output);
+#else
+	sha2(data, len, output, 0);
+#endif
+
+	return hex_representation(output, 32);
+}
+
+struct __alpm_digest_t {
+	alpm_pkgvalidation_t type;
+	union {
+#ifdef HAVE_LIBSSL
+		MD5_CTX md5;
+		SHA256_CTX sha256;
+#else
+		md5_context md5;
+		sha2_context sha256;
+#endif
+	} ctx;
+};
+
+/** Start computing a digest of data which arrives piecewise.
+ * @param type ALPM_PKG_VALIDATION_MD5SUM or ALPM_PKG_VALIDATION_SHA256SUM
+ * @return the digest context, NULL on error
+ */
+alpm_digest_t *_alpm_digest_new(alpm_pkgvalidation_t type)
+{
+	alpm_digest_t *digest;
+
+	ASSERT(type == ALPM_PKG_VALIDATION_MD5SUM
+			|| type == ALPM_PKG_VALIDATION_SHA256SUM, return NULL);
+
+	MALLOC(digest, sizeof(alpm_digest_t), return NULL);
+	digest->type = type;
+	_alpm_digest_reset(digest);
+	return digest;
+}
+
+/** Discard all data digested so far. */
+void _alpm_digest_reset(alpm_digest_t *digest)
+{
+#ifdef HAVE_LIBSSL
+	if(digest->type == ALPM_PKG_VALIDATION_MD5SUM) {
+		MD5_Init(&digest->ctx.md5);
+	} else {
+		SHA256_Init(&digest->ctx.sha256);
+	}
+#else
+	if(digest->type == ALPM_PKG_VALIDATION_MD5SUM) {
+		md5_starts(&digest->ctx.md5);
+	} else {
+		sha2_starts(&digest->ctx.sha256, 0);
+	}
+#endif
+}
+
+void _alpm_digest_update(alpm_digest_t *digest, const void *data, size_t len)
+{
+#ifdef HAVE_LIBSSL
+	if(digest->type == ALPM_PKG_VALIDATION_MD5SUM) {
+		MD5_Update(&digest->ctx.md5, data, len);
+	} else {
+		SHA256_Update(&digest->ctx.sha256, data, len);
+	}
+#else
+	if(digest->type == ALPM_PKG_VALIDATION_MD5SUM) {
+		md5_update(&digest->ctx.md5, data, len);
+	} else {
+		sha2_update(&digest->ctx.sha256, data, len);
+	}
+#endif
+}
+
+/** Finish a digest. The context starts over afterwards.
+ * @param digest the digest context
+ * @return the checksum on success, NULL on error. This string must be freed.
+ */
+char *_alpm_digest_finish(alpm_digest_t *digest)
+{
+	unsigned char output[32];
+	size_t size;
+
+#ifdef HAVE_LIBSSL
+	if(digest->type == ALPM_PKG_VALIDATION_MD5SUM) {
+		MD5_Final(output, &digest->ctx.md5);
+		size = 16;
+	} else {
+		SHA256_Final(output, &digest->ctx.sha256);
+		size = 32;
+	}
+#else
+	if(digest->type == ALPM_PKG_VALIDATION_MD5SUM) {
+		md5_finish(&digest->ctx.md5, output);
+		size = 16;
+	} else {
+		sha2_finish(&digest->ctx.sha256, output);
+		size = 32;
+	}
+#endif
+	_alpm_digest_reset(digest);
+
+	return hex_representation(output, size);
+}
+
+void _alpm_digest_free(alpm_digest_t *digest)
+{
+	free(digest);
+}
+
 /** Calculates a file's MD5 or SHA2 digest  and compares it to an expected value. 
  * @param filepath path of the file to check
  * @param expected hash value to compare against
@@ -109,23 +109,50 @@ struct archive_read_buffer {
 int _alpm_makepath(const char *path);
 int _alpm_makepath_mode(const char *path, mode_t mode);
 int _alpm_copyfile(const char *src, const char *dest);
+int _alpm_copyfd(int srcfd, int destfd, off_t size);
+int _alpm_root_only_writable(const struct stat *st);
+int _alpm_link_trusted(const char *src, const char *dest, const struct stat *st);
+int _alpm_gzip_file(const char *src, const char *dest);
 size_t _alpm_strip_newline(char *str, size_t len);
 
+void _alpm_archive_support_filters(struct archive *archive);
 int _alpm_open_archive(alpm_handle_t *handle, const char *path,
-		struct stat *buf, struct archive **archive, alpm_errno_t error);
+		struct stat *buf, struct archive **archive, alpm_errno_t error,
+		int readall);
+int _alpm_open_archive_r(alpm_handle_t *handle, const char *path,
+		struct stat *buf, struct archive **archive, alpm_errno_t error,
+		int readall, alpm_errno_t *err);
 int _alpm_unpack_single(alpm_handle_t *handle, const char *archive,
 		const char *prefix, const char *filename);
 int _alpm_unpack(alpm_handle_t *handle, const char *archive, const char *prefix,
 		alpm_list_t *list, int breakfirst);
 
-ssize_t _alpm_files_in_directory(alpm_handle_t *handle, const char *path, int full_count);
 int _alpm_logaction(alpm_handle_t *handle, const char *fmt, va_list args);
 int _alpm_run_chroot(alpm_handle_t *handle, const char *cmd, char *const argv[]);
 int _alpm_ldconfig(alpm_handle_t *handle);
+int _alpm_syncfs(alpm_handle_t *handle);
+/* a file written under a temporary name, waiting to be renamed over path */
+typedef struct _alpm_heldrename_t {
+	char *tmppath;
+	char *path;
+} alpm_heldrename_t;
+void _alpm_heldrename_free(alpm_heldrename_t *held);
 int _alpm_str_cmp(const void *s1, const void *s2);
 char *_alpm_filecache_find(alpm_handle_t *handle, const char *filename);
 const char *_alpm_filecache_setup(alpm_handle_t *handle);
+char *_alpm_sharedcache_find(alpm_handle_t *handle, alpm_pkg_t *pkg);
+int _alpm_sharedcache_fetch(alpm_handle_t *handle, alpm_pkg_t *pkg);
+void _alpm_sharedcache_discard(alpm_handle_t *handle, alpm_pkg_t *pkg);
+int _alpm_sharedcache_store(alpm_handle_t *handle, alpm_pkg_t *pkg,
+		const char *path);
 int _alpm_lstat(const char *path, struct stat *buf);
+char *_alpm_compute_sha256sum_buffer(const void *data, size_t len);
+typedef struct __alpm_digest_t alpm_digest_t;
+alpm_digest_t *_alpm_digest_new(alpm_pkgvalidation_t type);
+void _alpm_digest_reset(alpm_digest_t *digest);
+void _alpm_digest_update(alpm_digest_t *digest, const void *data, size_t len);
+char *_alpm_digest_finish(alpm_digest_t *digest);
+void _alpm_digest_free(alpm_digest_t *digest);
 int _alpm_test_checksum(const char *filepath, const char *expected, alpm_pkgvalidation_t type);
 int _alpm_archive_fgets(struct archive *a, struct archive_read_buffer *b);
 int _alpm_splitname(const char *target, char **name, char **version,
@@ -0,0 +1,645 @@
+/*
+ *  vcdiff.c
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A decoder for the VCDIFF delta format (RFC 3284) as produced by xdelta3.
+ * Only the default code table is supported and windows must not use
+ * secondary compression; callers fall back to the xdelta3 binary when
+ * VCDIFF_UNSUPPORTED is returned. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <zlib.h> /* adler32 */
+
+/* libarchive */
+#include <archive.h>
+#include <archive_entry.h>
+
+/* libalpm */
+#include "vcdiff.h"
+#include "util.h"
+
+/* file header indicator bits */
+#define VCD_DECOMPRESS 0x01
+#define VCD_CODETABLE  0x02
+#define VCD_APPHEADER  0x04 /* xdelta3 extension */
+
+/* window indicator bits */
+#define VCD_SOURCE     0x01
+#define VCD_TARGET     0x02
+#define VCD_ADLER32    0x04 /* xdelta3 extension */
+
+/* instruction types */
+#define VCD_NOOP       0
+#define VCD_ADD        1
+#define VCD_RUN        2
+#define VCD_COPY       3
+
+/* address cache sizes of the default code table */
+#define VCD_NEAR       4
+#define VCD_SAME       3
+
+/* refuse windows larger than this; xdelta3 never exceeds 16MiB */
+#define VCD_MAX_WINDOW (1 << 28)
+
+struct vcd_code {
+	unsigned char type1, size1, mode1;
+	unsigned char type2, size2, mode2;
+};
+
+struct vcd_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+};
+
+struct vcd_cache {
+	uint64_t near[VCD_NEAR];
+	unsigned int next;
+	uint64_t same[VCD_SAME * 256];
+};
+
+/** Build the default instruction code table of RFC 3284 section 5.6. */
+static void build_code_table(struct vcd_code table[256])
+{
+	unsigned int i = 0, mode, size, add;
+
+	memset(table, 0, 256 * sizeof(struct vcd_code));
+
+	table[i].type1 = VCD_RUN;
+	i++;
+	for(size = 0; size <= 17; size++, i++) {
+		table[i].type1 = VCD_ADD;
+		table[i].size1 = size;
+	}
+	for(mode = 0; mode < 9; mode++) {
+		table[i].type1 = VCD_COPY;
+		table[i].mode1 = mode;
+		i++;
+		for(size = 4; size <= 18; size++, i++) {
+			table[i].type1 = VCD_COPY;
+			table[i].size1 = size;
+			table[i].mode1 = mode;
+		}
+	}
+	for(mode = 0; mode < 9; mode++) {
+		unsigned int maxcopy = mode < 6 ? 6 : 4;
+		for(add = 1; add <= 4; add++) {
+			for(size = 4; size <= maxcopy; size++, i++) {
+				table[i].type1 = VCD_ADD;
+				table[i].size1 = add;
+				table[i].type2 = VCD_COPY;
+				table[i].size2 = size;
+				table[i].mode2 = mode;
+			}
+		}
+	}
+	for(mode = 0; mode < 9; mode++, i++) {
+		table[i].type1 = VCD_COPY;
+		table[i].size1 = 4;
+		table[i].mode1 = mode;
+		table[i].type2 = VCD_ADD;
+		table[i].size2 = 1;
+	}
+}
+
+static int read_byte(struct vcd_reader *r, unsigned char *out)
+{
+	if(r->p >= r->end) {
+		return -1;
+	}
+	*out = *r->p++;
+	return 0;
+}
+
+/** Read a variable length integer: base 128, most significant digit first,
+ * with the high bit set on every byte but the last. */
+static int read_int(struct vcd_reader *r, uint64_t *out)
+{
+	uint64_t val = 0;
+	int i;
+
+	for(i = 0; i < 10; i++) {
+		unsigned char c;
+		if(read_byte(r, &c) != 0 || val > (UINT64_MAX >> 7)) {
+			return -1;
+		}
+		val = (val << 7) | (c & 0x7f);
+		if(!(c & 0x80)) {
+			*out = val;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int read_size(struct vcd_reader *r, size_t *out)
+{
+	uint64_t val;
+	if(read_int(r, &val) != 0 || val > SIZE_MAX) {
+		return -1;
+	}
+	*out = (size_t)val;
+	return 0;
+}
+
+static int decode_address(struct vcd_cache *cache, struct vcd_reader *addrs,
+		uint64_t here, unsigned char mode, uint64_t *addr)
+{
+	uint64_t val;
+
+	if(mode >= 2 + VCD_NEAR) {
+		unsigned char c;
+		if(read_byte(addrs, &c) != 0) {
+			return -1;
+		}
+		val = cache->same[(mode - 2 - VCD_NEAR) * 256 + c];
+	} else {
+		if(read_int(addrs, &val) != 0) {
+			return -1;
+		}
+		if(mode == 1) {
+			/* VCD_HERE */
+			if(val > here) {
+				return -1;
+			}
+			val = here - val;
+		} else if(mode >= 2) {
+			val += cache->near[mode - 2];
+		}
+	}
+
+	cache->near[cache->next] = val;
+	cache->next = (cache->next + 1) % VCD_NEAR;
+	cache->same[val % (VCD_SAME * 256)] = val;
+
+	*addr = val;
+	return 0;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+	while(len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+	while(len > 0) {
+		ssize_t n = pread(fd, buf, len, offset);
+		if(n <= 0) {
+			if(n < 0 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/** Split the xdelta3 application header "tgt/tcomp/src/scomp" (or
+ * "tgt/tcomp" without a source) into the compression identifiers. */
+static int parse_appheader(alpm_vcdiff_t *vcd, const char *hdr, size_t len)
+{
+	const char *fields[4];
+	size_t flen[4];
+	size_t i, start = 0, count = 0;
+
+	for(i = 0; i <= len && count < 4; i++) {
+		if(i == len || hdr[i] == '/') {
+			fields[count] = hdr + start;
+			flen[count] = i - start;
+			count++;
+			start = i + 1;
+		}
+	}
+	if(count != 2 && count != 4) {
+		/* not something xdelta3 wrote; assume no external compression */
+		return 0;
+	}
+	if(flen[1] > 1 || (count == 4 && flen[3] > 1)) {
+		return VCDIFF_UNSUPPORTED;
+	}
+	vcd->target_comp = flen[1] ? fields[1][0] : VCDIFF_COMP_NONE;
+	if(count == 4) {
+		vcd->source_comp = flen[3] ? fields[3][0] : VCDIFF_COMP_NONE;
+	}
+	return 0;
+}
+
+/** Open a delta file and parse its header.
+ * @param path the delta file
+ * @param vcd storage for the decoder state
+ * @return 0 on success, -1 on error, VCDIFF_UNSUPPORTED if the delta uses
+ * features this decoder does not implement
+ */
+int _alpm_vcdiff_open(const char *path, alpm_vcdiff_t **vcd)
+{
+	alpm_vcdiff_t *v;
+	struct vcd_reader r;
+	struct stat st;
+	unsigned char hdr_ind;
+	int fd, ret = -1;
+
+	CALLOC(v, 1, sizeof(alpm_vcdiff_t), return -1);
+
+	OPEN(fd, path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		free(v);
+		return -1;
+	}
+	if(fstat(fd, &st) != 0 || st.st_size < 5) {
+		CLOSE(fd);
+		free(v);
+		return -1;
+	}
+	v->len = st.st_size;
+	v->data = mmap(NULL, v->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	CLOSE(fd);
+	if(v->data == MAP_FAILED) {
+		free(v);
+		return -1;
+	}
+
+	if(v->data[0] != 0xd6 || v->data[1] != 0xc3 || v->data[2] != 0xc4
+			|| v->data[3] != 0x00) {
+		goto error;
+	}
+	r.p = v->data + 4;
+	r.end = v->data + v->len;
+
+	if(read_byte(&r, &hdr_ind) != 0) {
+		goto error;
+	}
+	if(hdr_ind & VCD_DECOMPRESS) {
+		if(read_byte(&r, &v->secondary) != 0) {
+			goto error;
+		}
+	}
+	if(hdr_ind & VCD_CODETABLE) {
+		ret = VCDIFF_UNSUPPORTED;
+		goto error;
+	}
+	if(hdr_ind & VCD_APPHEADER) {
+		size_t len;
+		if(read_size(&r, &len) != 0 || len > (size_t)(r.end - r.p)) {
+			goto error;
+		}
+		if((ret = parse_appheader(v, (const char *)r.p, len)) != 0) {
+			goto error;
+		}
+		ret = -1;
+		r.p += len;
+	}
+
+	v->windows = r.p - v->data;
+	*vcd = v;
+	return 0;
+
+error:
+	_alpm_vcdiff_close(v);
+	return ret;
+}
+
+void _alpm_vcdiff_close(alpm_vcdiff_t *vcd)
+{
+	if(vcd == NULL) {
+		return;
+	}
+	munmap(vcd->data, vcd->len);
+	free(vcd);
+}
+
+/** Decode a single window into the target buffer. */
+static int decode_window(const struct vcd_code table[256],
+		struct vcd_reader *r, const unsigned char *source, size_t source_len,
+		int outfd, off_t written, unsigned char **target, size_t *target_len)
+{
+	unsigned char win_ind, delta_ind;
+	const unsigned char *segment = NULL;
+	unsigned char *segbuf = NULL, *out = NULL;
+	size_t seg_len = 0, seg_pos = 0, delta_len, len, tpos = 0;
+	size_t data_len, inst_len, addr_len;
+	uint32_t checksum = 0;
+	struct vcd_reader data, inst, addrs, delta;
+	struct vcd_cache cache;
+	int ret = -1;
+
+	if(read_byte(r, &win_ind) != 0) {
+		return -1;
+	}
+	if((win_ind & VCD_SOURCE) && (win_ind & VCD_TARGET)) {
+		return -1;
+	}
+	if(win_ind & (VCD_SOURCE | VCD_TARGET)) {
+		if(read_size(r, &seg_len) != 0 || read_size(r, &seg_pos) != 0) {
+			return -1;
+		}
+		if(win_ind & VCD_SOURCE) {
+			if(seg_pos > source_len || seg_len > source_len - seg_pos) {
+				return -1;
+			}
+			segment = source + seg_pos;
+		} else {
+			/* copy from already decoded target data */
+			if(seg_len > VCD_MAX_WINDOW || (off_t)(seg_pos + seg_len) > written) {
+				return -1;
+			}
+			MALLOC(segbuf, seg_len ? seg_len : 1, return -1);
+			if(read_all(outfd, segbuf, seg_len, seg_pos) != 0) {
+				goto cleanup;
+			}
+			segment = segbuf;
+		}
+	}
+
+	if(read_size(r, &delta_len) != 0 || delta_len > (size_t)(r->end - r->p)) {
+		goto cleanup;
+	}
+	delta.p = r->p;
+	delta.end = r->p + delta_len;
+	r->p += delta_len;
+
+	if(read_size(&delta, &len) != 0 || len > VCD_MAX_WINDOW
+			|| read_byte(&delta, &delta_ind) != 0) {
+		goto cleanup;
+	}
+	if(delta_ind != 0) {
+		/* secondary compression of the sections */
+		ret = VCDIFF_UNSUPPORTED;
+		goto cleanup;
+	}
+	if(read_size(&delta, &data_len) != 0 || read_size(&delta, &inst_len) != 0
+			|| read_size(&delta, &addr_len) != 0) {
+		goto cleanup;
+	}
+	if(win_ind & VCD_ADLER32) {
+		int i;
+		for(i = 0; i < 4; i++) {
+			unsigned char c;
+			if(read_byte(&delta, &c) != 0) {
+				goto cleanup;
+			}
+			checksum = (checksum << 8) | c;
+		}
+	}
+	if((size_t)(delta.end - delta.p) != data_len + inst_len + addr_len) {
+		goto cleanup;
+	}
+	data.p = delta.p;
+	data.end = inst.p = data.p + data_len;
+	inst.end = addrs.p = inst.p + inst_len;
+	addrs.end = addrs.p + addr_len;
+
+	MALLOC(out, len ? len : 1, goto cleanup);
+	memset(&cache, 0, sizeof(cache));
+
+	while(inst.p < inst.end) {
+		const struct vcd_code *code = &table[*inst.p++];
+		int half;
+
+		for(half = 0; half < 2; half++) {
+			unsigned char type = half ? code->type2 : code->type1;
+			unsigned char mode = half ? code->mode2 : code->mode1;
+			size_t size = half ? code->size2 : code->size1;
+			uint64_t addr;
+
+			if(type == VCD_NOOP) {
+				continue;
+			}
+			if(size == 0 && read_size(&inst, &size) != 0) {
+				goto cleanup;
+			}
+			if(size > len - tpos) {
+				goto cleanup;
+			}
+
+			switch(type) {
+				case VCD_ADD:
+					if(size > (size_t)(data.end - data.p)) {
+						goto cleanup;
+					}
+					memcpy(out + tpos, data.p, size);
+					data.p += size;
+					break;
+				case VCD_RUN:
+					if(data.p >= data.end) {
+						goto cleanup;
+					}
+					memset(out + tpos, *data.p++, size);
+					break;
+				case VCD_COPY:
+					if(decode_address(&cache, &addrs, seg_len + tpos, mode, &addr) != 0
+							|| addr >= seg_len + tpos) {
+						goto cleanup;
+					}
+					if(addr + size <= seg_len) {
+						memcpy(out + tpos, segment + addr, size);
+					} else {
+						/* may overlap the bytes being produced, so go byte by byte */
+						size_t i;
+						for(i = 0; i < size; i++) {
+							uint64_t a = addr + i;
+							out[tpos + i] = a < seg_len ? segment[a] : out[a - seg_len];
+						}
+					}
+					break;
+				default:
+					goto cleanup;
+			}
+			tpos += size;
+		}
+	}
+
+	if(tpos != len) {
+		goto cleanup;
+	}
+	if((win_ind & VCD_ADLER32) && adler32(1L, out, len) != checksum) {
+		goto cleanup;
+	}
+
+	*target = out;
+	*target_len = len;
+	out = NULL;
+	ret = 0;
+
+cleanup:
+	free(out);
+	free(segbuf);
+	return ret;
+}
+
+/** Apply an opened delta to a source, writing the target to a file.
+ * @param vcd the delta from #_alpm_vcdiff_open
+ * @param source the (decompressed) source file contents
+ * @param source_len length of the source
+ * @param outfd a readable and writable file descriptor for the target
+ * @return 0 on success, -1 on error, VCDIFF_UNSUPPORTED if the delta uses
+ * features this decoder does not implement
+ */
+int _alpm_vcdiff_decode(alpm_vcdiff_t *vcd, const unsigned char *source,
+		size_t source_len, int outfd)
+{
+	struct vcd_code table[256];
+	struct vcd_reader r;
+	off_t written = 0;
+
+	build_code_table(table);
+	r.p = vcd->data + vcd->windows;
+	r.end = vcd->data + vcd->len;
+
+	while(r.p < r.end) {
+		unsigned char *target;
+		size_t target_len;
+		int ret = decode_window(table, &r, source, source_len, outfd, written,
+				&target, &target_len);
+		if(ret != 0) {
+			return ret;
+		}
+		ret = write_all(outfd, target, target_len);
+		free(target);
+		if(ret != 0) {
+			return -1;
+		}
+		written += target_len;
+	}
+
+	return 0;
+}
+
+/** Decompress a file through libarchive's raw format into an open fd. */
+static int decompress_to_fd(const char *path, int outfd)
+{
+	struct archive *archive;
+	struct archive_entry *entry;
+	const void *buf;
+	size_t size;
+	int64_t offset;
+	int ret = -1, r;
+
+	if((archive = archive_read_new()) == NULL) {
+		return -1;
+	}
+	_alpm_archive_support_filters(archive);
+	archive_read_support_format_raw(archive);
+
+	if(archive_read_open_filename(archive, path, ALPM_BUFFER_SIZE) != ARCHIVE_OK
+			|| archive_read_next_header(archive, &entry) != ARCHIVE_OK) {
+		goto cleanup;
+	}
+	while((r = archive_read_data_block(archive, &buf, &size, &offset)) == ARCHIVE_OK) {
+		if(write_all(outfd, buf, size) != 0) {
+			goto cleanup;
+		}
+	}
+	if(r == ARCHIVE_EOF) {
+		ret = 0;
+	}
+
+cleanup:
+	archive_read_finish(archive);
+	return ret;
+}
+
+/** Map the contents of a delta source into memory.
+ * @param path the source file
+ * @param decompress whether the delta was made against the decompressed
+ * contents of the file
+ * @param tmpdir a directory with room for the decompressed data
+ * @param data storage for the mapping, NULL for empty sources
+ * @param len storage for the mapping length
+ * @return 0 on success, -1 on error
+ */
+int _alpm_vcdiff_map_source(const char *path, int decompress,
+		const char *tmpdir, unsigned char **data, size_t *len)
+{
+	struct stat st;
+	int fd;
+
+	*data = NULL;
+	*len = 0;
+
+	if(decompress) {
+		char *tmpfile;
+		size_t tlen = strlen(tmpdir) + 22;
+		MALLOC(tmpfile, tlen, return -1);
+		snprintf(tmpfile, tlen, "%s/.alpm_source_XXXXXX", tmpdir);
+		fd = mkostemp(tmpfile, O_CLOEXEC);
+		if(fd >= 0) {
+			/* nobody else needs to see it */
+			unlink(tmpfile);
+		}
+		free(tmpfile);
+		if(fd < 0) {
+			return -1;
+		}
+		if(decompress_to_fd(path, fd) != 0) {
+			CLOSE(fd);
+			return -1;
+		}
+	} else {
+		OPEN(fd, path, O_RDONLY | O_CLOEXEC);
+		if(fd < 0) {
+			return -1;
+		}
+	}
+
+	if(fstat(fd, &st) != 0) {
+		CLOSE(fd);
+		return -1;
+	}
+	if(st.st_size > 0) {
+		*data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(*data == MAP_FAILED) {
+			*data = NULL;
+			CLOSE(fd);
+			return -1;
+		}
+		*len = st.st_size;
+	}
+	CLOSE(fd);
+	return 0;
+}
+
+void _alpm_vcdiff_unmap_source(unsigned char *data, size_t len)
+{
+	if(data) {
+		munmap(data, len);
+	}
+}
+
+/* vim: set ts=2 sw=2 noet: */
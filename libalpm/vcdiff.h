@@ -0,0 +1,55 @@
+/*
+ *  vcdiff.h
+ *
+ *  Copyright (c) 2012 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALPM_VCDIFF_H
+#define _ALPM_VCDIFF_H
+
+#include <sys/types.h> /* size_t */
+
+/* xdelta3 identifiers of the external compressors it may have applied */
+#define VCDIFF_COMP_NONE  '\0'
+#define VCDIFF_COMP_GZIP  'G'
+
+typedef struct __alpm_vcdiff_t {
+	/* the whole delta file, mapped read-only */
+	unsigned char *data;
+	size_t len;
+	/* start of the first window */
+	size_t windows;
+	/* secondary compressor id from the file header, 0 if none */
+	unsigned char secondary;
+	/* external compression xdelta3 removed from source and target */
+	char source_comp;
+	char target_comp;
+} alpm_vcdiff_t;
+
+/* return values of the functions below besides 0 (success) and -1 (error) */
+#define VCDIFF_UNSUPPORTED 1
+
+int _alpm_vcdiff_open(const char *path, alpm_vcdiff_t **vcd);
+int _alpm_vcdiff_decode(alpm_vcdiff_t *vcd, const unsigned char *source,
+		size_t source_len, int outfd);
+void _alpm_vcdiff_close(alpm_vcdiff_t *vcd);
+
+int _alpm_vcdiff_map_source(const char *path, int decompress,
+		const char *tmpdir, unsigned char **data, size_t *len);
+void _alpm_vcdiff_unmap_source(unsigned char *data, size_t len);
+
+#endif /* _ALPM_VCDIFF_H */
+
+/* vim: set ts=2 sw=2 noet: */
@@ -81,6 +81,7 @@ int config_free(config_t *oldconfig)
 	free(oldconfig->logfile);
 	free(oldconfig->gpgdir);
 	FREELIST(oldconfig->cachedirs);
+	free(oldconfig->sharedcachedir);
 	free(oldconfig->xfercommand);
 	free(oldconfig->print_format);
 	free(oldconfig->arch);
@@ -404,6 +405,9 @@ static int _parse_options(const char *key, char *value,
 			pm_printf(ALPM_LOG_DEBUG, "config: totaldownload\n");
 		} else if(strcmp(key, "CheckSpace") == 0) {
 			config->checkspace = 1;
+		} else if(strcmp(key, "ParallelExtract") == 0) {
+			config->parallelextract = 1;
+			pm_printf(ALPM_LOG_DEBUG, "config: parallelextract\n");
 		} else {
 			pm_printf(ALPM_LOG_WARNING,
 					_("config file %s, line %d: directive '%s' in section '%s' not recognized.\n"),
@@ -423,6 +427,11 @@ static int _parse_options(const char *key, char *value,
 			setrepeatingoption(value, "HoldPkg", &(config->holdpkg));
 		} else if(strcmp(key, "CacheDir") == 0) {
 			setrepeatingoption(value, "CacheDir", &(config->cachedirs));
+		} else if(strcmp(key, "SharedCacheDir") == 0) {
+			if(!config->sharedcachedir) {
+				config->sharedcachedir = strdup(value);
+				pm_printf(ALPM_LOG_DEBUG, "config: sharedcachedir: %s\n", value);
+			}
 		} else if(strcmp(key, "Architecture") == 0) {
 			if(!config->arch) {
 				config_set_arch(value);
@@ -464,6 +473,20 @@ static int _parse_options(const char *key, char *value,
 		} else if(strcmp(key, "XferCommand") == 0) {
 			config->xfercommand = strdup(value);
 			pm_printf(ALPM_LOG_DEBUG, "config: xfercommand: %s\n", value);
+		} else if(strcmp(key, "SyncPolicy") == 0) {
+			if(strcmp(value, "None") == 0) {
+				config->syncpolicy = ALPM_SYNCPOLICY_NONE;
+			} else if(strcmp(value, "Package") == 0) {
+				config->syncpolicy = ALPM_SYNCPOLICY_PACKAGE;
+			} else if(strcmp(value, "Transaction") == 0) {
+				config->syncpolicy = ALPM_SYNCPOLICY_TRANSACTION;
+			} else {
+				pm_printf(ALPM_LOG_ERROR,
+						_("config file %s, line %d: invalid value for '%s' : '%s'\n"),
+						file, linenum, "SyncPolicy", value);
+				return 1;
+			}
+			pm_printf(ALPM_LOG_DEBUG, "config: syncpolicy: %s\n", value);
 		} else if(strcmp(key, "CleanMethod") == 0) {
 			alpm_list_t *methods = NULL;
 			setrepeatingoption(value, "CleanMethod", &methods);
@@ -600,6 +623,10 @@ static int setup_libalpm(void)
 		alpm_option_set_cachedirs(handle, config->cachedirs);
 	}
 
+	if(config->sharedcachedir) {
+		alpm_option_set_sharedcachedir(handle, config->sharedcachedir);
+	}
+
 	alpm_option_set_default_siglevel(handle, config->siglevel);
 
 	if(config->xfercommand) {
@@ -614,6 +641,8 @@ static int setup_libalpm(void)
 
 	alpm_option_set_arch(handle, config->arch);
 	alpm_option_set_checkspace(handle, config->checkspace);
+	alpm_option_set_parallelextract(handle, config->parallelextract);
+	alpm_option_set_syncpolicy(handle, config->syncpolicy);
 	alpm_option_set_usesyslog(handle, config->usesyslog);
 	alpm_option_set_deltaratio(handle, config->deltaratio);
 
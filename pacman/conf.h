@@ -33,6 +33,8 @@ typedef struct __config_t {
 	unsigned short logmask;
 	unsigned short print;
 	unsigned short checkspace;
+	unsigned short parallelextract;
+	alpm_syncpolicy_t syncpolicy;
 	unsigned short usesyslog;
 	double deltaratio;
 	char *arch;
@@ -46,6 +48,7 @@ typedef struct __config_t {
 	char *logfile;
 	char *gpgdir;
 	alpm_list_t *cachedirs;
+	char *sharedcachedir;
 
 	unsigned short op_q_isfile;
 	unsigned short op_q_info;
@@ -108,6 +108,9 @@ static int sync_cleandb(const char *dbpath, int keep_used)
 			dbname = strndup(dname, len - 3);
 		} else if(len > 7 && strcmp(dname + len - 7, ".db.sig") == 0) {
 			dbname = strndup(dname, len - 7);
+		} else if(len > 9 && strcmp(dname + len - 9, ".db.delta") == 0) {
+			/* the delta index kept for the next refresh */
+			dbname = strndup(dname, len - 9);
 		} else {
 			ret += unlink_verbose(path, 0);
 			continue;
@@ -130,6 +133,8 @@ static int sync_cleandb(const char *dbpath, int keep_used)
 			/* unlink a signature file if present too */
 			snprintf(path, PATH_MAX, "%s%s.db.sig", dbpath, dbname);
 			ret += unlink_verbose(path, 1);
+			snprintf(path, PATH_MAX, "%s%s.db.delta", dbpath, dbname);
+			ret += unlink_verbose(path, 1);
 		}
 		free(dbname);
 	}
@@ -53,8 +53,9 @@ function unpksrc1 {
 		(*.gz)	gzip  -df "$y" || failed=yes;|
 		(*.bz2)	bzip2 -df "$y" || failed=yes;|
 		(*.xz)	xz    -df "$y" || failed=yes;|
+		(*.zst)	zstd  -dfq --rm "$y" || failed=yes;|
 		(*.lzo)	lzop  -df "$y" || failed=yes;|
-		(*.@(gz|bz2|xz|lzo))
+		(*.@(gz|bz2|xz|zst|lzo))
 			unpksrc1 "$(sed -E 's/\.[^.]+$//' <<<"$y")";;
 		(*.tar)
 			tar -xC src <"$y" || failed=yes;;
@@ -91,6 +92,27 @@ function writePkginfo {
 	for x in "${provides[@]}";   do echo "provides = $x"; done
 	for x in "${depends[@]}";    do echo "depend = $x"; done
 	for x in "${optdepends[@]}"; do echo "optdepend = $x"; done
+	writeDirsizes
+}
+
+# disk usage by directory, two levels deep, each file rounded up to 4 KiB
+function writeDirsizes {
+	find . \! -type d \! -type l -printf '%s\t%P\n' | awk -F '\t' '
+		$2 !~ /^\./ {
+			n = split($2, c, "/")
+			k = n > 2 ? c[1] "/" c[2] "/" : (n == 2 ? c[1] "/" : "")
+			u[k] += int(($1 + 4095) / 4096) * 4096
+		}
+		END { for(k in u) printf "dirsize = %s\t%.0f\n", k, u[k] }' | sort
+}
+
+# digests of the packaged files, pacman skips rewriting unchanged ones
+function writeMtree {
+	echo '#mtree'
+	find * -type f | sort | while IFS= read -r x; do
+		y="$(sed 's/\\/\\134/g; s/ /\\040/g' <<<"$x")"
+		echo "./$y type=file sha256digest=$(sha256sum <"$x" | cut -d ' ' -f 1)"
+	done
 }
 
 function createPackage {
@@ -109,6 +131,9 @@ function createPackage {
 	comp_files=('.PKGINFO')
 	
 	test -f .INSTALL && comp_files+=('.INSTALL')
+
+	writeMtree >.MTREE
+	comp_files+=('.MTREE')
 	
 	test -z "$PKGDEST" && PKGDEST="$startdir"
 	pkg_file="$PKGDEST/${pkgname}-${pkgver}-${pkgrel}-${pkgarch}$PKGEXT"
@@ -119,7 +144,8 @@ function createPackage {
 	case "$PKGEXT" {
 		(*.gz)		gzip -n;;
 		(*.bz2)		bzip2;;
-		(*.xz)		xz;;
+		(*.xz)		xz -T0;;
+		(*.zst)		split -b 32M --filter="${COMPRESSZST[*]}";;
 	} >"$pkg_file" || {
 		msg "Failed to create package file"
 		exit 1